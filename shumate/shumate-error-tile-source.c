@@ -26,7 +26,7 @@
 
 #include "shumate-debug.h"
 #include "shumate-enum-types.h"
-#include "shumate-tile.h"
+#include "shumate-tile-private.h"
 
 static GdkTexture *
 texture_new_for_surface (cairo_surface_t *surface)
@@ -109,6 +109,7 @@ fill_tile (ShumateMapSource *map_source,
 
       shumate_tile_set_texture (tile, texture);
       shumate_tile_set_fade_in (tile, TRUE);
+      shumate_tile_set_failed (tile, TRUE);
       shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
     }
   else if (SHUMATE_IS_MAP_SOURCE (next_source))
@@ -25,12 +25,31 @@
  * #ShumateFileCache is a cache that stores and retrieves tiles from the
  * file system. Tiles most frequently loaded gain in "popularity". This popularity
  * is taken into account when purging the cache.
+ *
+ * By default every tile is stored in its own file next to the cache database.
+ * With %SHUMATE_FILE_CACHE_STORAGE_DATABASE as #ShumateFileCache:storage the
+ * tiles are kept inside the database instead, which is much cheaper for
+ * caches holding many small tiles.
+ *
+ * Tiles stay fresh for as long as the server allowed in its Cache-Control or
+ * Expires headers. Stale tiles are still displayed while they are revalidated
+ * with the server.
+ *
+ * Tiles are written by a separate thread, which groups the writes into
+ * transactions, so that storing tiles never blocks the user interface.
+ *
+ * Identical tiles, such as the many ocean or empty overlay tiles of a map,
+ * are only stored once: the tile data is stored by the hash of its content
+ * and shared by all the tiles having it.
  */
 
 #define DEBUG_FLAG SHUMATE_DEBUG_CACHE
 #include "shumate-debug.h"
 
 #include "shumate-file-cache.h"
+#include "shumate-enum-types.h"
+#include "shumate-tile-decoder-private.h"
+#include "shumate-tile-private.h"
 
 #include <sqlite3.h>
 #include <errno.h>
@@ -43,17 +62,80 @@ enum
 {
   PROP_0,
   PROP_SIZE_LIMIT,
-  PROP_CACHE_DIR
+  PROP_CACHE_DIR,
+  PROP_STORAGE
 };
 
+/* Writes are grouped in a transaction committed after this delay */
+#define COMMIT_INTERVAL_MS 500
+
+/* How long a connection waits for the other one to release the database */
+#define BUSY_TIMEOUT_MS 5000
+
+/* Purging deletes at most this many tiles per transaction */
+#define PURGE_CHUNK_SIZE 256
+
+typedef enum
+{
+  WRITE_STORE,
+  WRITE_REFRESH,
+  WRITE_POPULARITY,
+  WRITE_PURGE,
+  WRITE_VACUUM,
+  WRITE_QUIT,
+} WriteKind;
+
+/* A change queued for the writer thread */
+typedef struct
+{
+  WriteKind kind;
+  char *filename; /* The tile's key in the database */
+  char *etag;
+  gint64 modified; /* Unix time the change was queued at */
+  gint64 expiry_time;
+  GBytes *bytes;
+  guint64 size_limit; /* WRITE_PURGE only */
+  GTask *task; /* WRITE_PURGE only, returned once the purge is done */
+} WriteOp;
+
+/*
+ * The writer thread owns its own connection to the database, so the main
+ * thread can keep reading while it writes. It only touches this struct.
+ */
+typedef struct
+{
+  ShumateFileCacheStorage storage;
+  char *cache_dir;
+  sqlite3 *db;
+  sqlite3_stmt *stmt_store;
+  sqlite3_stmt *stmt_legacy_select;
+  sqlite3_stmt *stmt_blob_insert;
+  sqlite3_stmt *stmt_blob_fill;
+  sqlite3_stmt *stmt_unused_blobs;
+  sqlite3_stmt *stmt_blob_delete;
+  sqlite3_stmt *stmt_refresh;
+  sqlite3_stmt *stmt_popularity;
+  sqlite3_stmt *stmt_total_size;
+  sqlite3_stmt *stmt_purge_select;
+  sqlite3_stmt *stmt_delete;
+  sqlite3_stmt *stmt_popularity_base;
+
+  GAsyncQueue *queue; /* WriteOp */
+  GThread *thread;
+  int quitting; /* Atomic, the purges and vacuums left are skipped once set */
+} CacheWriter;
+
 typedef struct
 {
-  guint size_limit;
+  guint64 size_limit;
   char *cache_dir;
+  ShumateFileCacheStorage storage;
 
   sqlite3 *db;
   sqlite3_stmt *stmt_select;
-  sqlite3_stmt *stmt_update;
+  sqlite3_stmt *stmt_select_data;
+
+  CacheWriter *writer;
 } ShumateFileCachePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShumateFileCache, shumate_file_cache, SHUMATE_TYPE_TILE_CACHE);
@@ -62,10 +144,6 @@ static void finalize_sql (ShumateFileCache *file_cache);
 static void init_cache (ShumateFileCache *file_cache);
 static char *get_filename (ShumateFileCache *file_cache,
     ShumateTile *tile);
-static gboolean tile_is_expired (ShumateFileCache *file_cache,
-    ShumateTile *tile);
-static void delete_tile (ShumateFileCache *file_cache,
-    const char *filename);
 static gboolean create_cache_dir (const char *dir_name);
 
 static void fill_tile (ShumateMapSource *map_source,
@@ -74,8 +152,7 @@ static void fill_tile (ShumateMapSource *map_source,
 
 static void store_tile (ShumateTileCache *tile_cache,
     ShumateTile *tile,
-    const char *contents,
-    gsize size);
+    GBytes *bytes);
 static void refresh_tile_time (ShumateTileCache *tile_cache,
     ShumateTile *tile);
 static void on_tile_filled (ShumateTileCache *tile_cache,
@@ -92,13 +169,17 @@ shumate_file_cache_get_property (GObject *object,
   switch (property_id)
     {
     case PROP_SIZE_LIMIT:
-      g_value_set_uint (value, shumate_file_cache_get_size_limit (file_cache));
+      g_value_set_uint64 (value, shumate_file_cache_get_size_limit (file_cache));
       break;
 
     case PROP_CACHE_DIR:
       g_value_set_string (value, shumate_file_cache_get_cache_dir (file_cache));
       break;
 
+    case PROP_STORAGE:
+      g_value_set_enum (value, shumate_file_cache_get_storage (file_cache));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -117,7 +198,7 @@ shumate_file_cache_set_property (GObject *object,
   switch (property_id)
     {
     case PROP_SIZE_LIMIT:
-      shumate_file_cache_set_size_limit (file_cache, g_value_get_uint (value));
+      shumate_file_cache_set_size_limit (file_cache, g_value_get_uint64 (value));
       break;
 
     case PROP_CACHE_DIR:
@@ -126,18 +207,624 @@ shumate_file_cache_set_property (GObject *object,
       priv->cache_dir = g_strdup (g_value_get_string (value));
       break;
 
+    case PROP_STORAGE:
+      priv->storage = g_value_get_enum (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
+static WriteOp *
+write_op_new (WriteKind  kind,
+              char      *filename)
+{
+  WriteOp *op = g_slice_new0 (WriteOp);
+
+  op->kind = kind;
+  op->filename = filename;
+  op->modified = g_get_real_time () / G_USEC_PER_SEC;
+
+  return op;
+}
+
+
+static void
+write_op_free (WriteOp *op)
+{
+  g_free (op->filename);
+  g_free (op->etag);
+  g_clear_pointer (&op->bytes, g_bytes_unref);
+  g_clear_object (&op->task);
+  g_slice_free (WriteOp, op);
+}
+
+
+static gboolean
+prepare_statement (sqlite3       *db,
+                   const char    *sql,
+                   sqlite3_stmt **stmt)
+{
+  if (sqlite3_prepare_v2 (db, sql, -1, stmt, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Failed to prepare '%s', error: %s", sql, sqlite3_errmsg (db));
+      *stmt = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * Blobs are shared by the tiles of every map source, they are spread in
+ * subdirectories named after the start of their hash.
+ */
+static char *
+get_blob_filename (const char *cache_dir,
+                   const char *hash)
+{
+  char prefix[3] = { hash[0], hash[1], '\0' };
+
+  return g_build_filename (cache_dir, "blobs", prefix, hash, NULL);
+}
+
+
+static gboolean
+cache_writer_store_file (const char *filename,
+                         GBytes     *bytes)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (filename);
+  g_autofree char *path = g_path_get_dirname (filename);
+  g_autoptr(GError) error = NULL;
+
+  /* If needed, create the cache's dirs */
+  if (g_mkdir_with_parents (path, 0700) == -1 && errno != EEXIST)
+    {
+      g_warning ("Unable to create the image cache path '%s': %s",
+          path, g_strerror (errno));
+      return FALSE;
+    }
+
+  /* The data goes to a temporary file first, so that the main thread never
+   * reads a tile that is half written */
+  if (!g_file_replace_contents (file,
+        g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+        NULL, FALSE,
+        G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+        NULL, NULL, &error))
+    {
+      DEBUG ("Writing file contents failed: %s", error->message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * Makes sure the blob @hash exists. Its reference count is raised by the
+ * triggers when a tile row points to it.
+ */
+static gboolean
+cache_writer_store_blob (CacheWriter *writer,
+                         const char  *hash,
+                         GBytes      *bytes)
+{
+  gboolean in_database = (writer->storage == SHUMATE_FILE_CACHE_STORAGE_DATABASE);
+  gconstpointer data = g_bytes_get_data (bytes, NULL);
+  gsize size = g_bytes_get_size (bytes);
+  gboolean stored;
+
+  sqlite3_reset (writer->stmt_blob_insert);
+  sqlite3_bind_text (writer->stmt_blob_insert, 1, hash, -1, SQLITE_STATIC);
+  sqlite3_bind_int64 (writer->stmt_blob_insert, 2, size);
+  if (in_database)
+    sqlite3_bind_blob64 (writer->stmt_blob_insert, 3, data, size, SQLITE_STATIC);
+  else
+    sqlite3_bind_null (writer->stmt_blob_insert, 3);
+
+  stored = (sqlite3_step (writer->stmt_blob_insert) == SQLITE_DONE);
+  if (!stored)
+    DEBUG ("Storing blob %s failed: %s", hash, sqlite3_errmsg (writer->db));
+  else if (in_database && sqlite3_changes (writer->db) == 0)
+    {
+      /* The blob exists, but the file storage may have added it without
+       * its data */
+      sqlite3_reset (writer->stmt_blob_fill);
+      sqlite3_bind_blob64 (writer->stmt_blob_fill, 1, data, size, SQLITE_STATIC);
+      sqlite3_bind_text (writer->stmt_blob_fill, 2, hash, -1, SQLITE_STATIC);
+      stored = (sqlite3_step (writer->stmt_blob_fill) == SQLITE_DONE);
+      if (!stored)
+        DEBUG ("Storing blob %s failed: %s", hash, sqlite3_errmsg (writer->db));
+      sqlite3_reset (writer->stmt_blob_fill);
+      sqlite3_clear_bindings (writer->stmt_blob_fill);
+    }
+
+  sqlite3_reset (writer->stmt_blob_insert);
+  sqlite3_clear_bindings (writer->stmt_blob_insert);
+
+  if (stored && !in_database)
+    {
+      g_autofree char *filename = get_blob_filename (writer->cache_dir, hash);
+
+      /* A blob left without file, for instance by the database storage,
+       * gets one. Blobs nothing refers to are cleaned up later. */
+      if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+        stored = cache_writer_store_file (filename, bytes);
+    }
+
+  return stored;
+}
+
+
+/*
+ * Deletes the blobs no tile refers to anymore. Their files are only added to
+ * @unused_files, to be deleted once the transaction is committed.
+ */
+static void
+cache_writer_collect_blobs (CacheWriter *writer,
+                            GPtrArray   *unused_files)
+{
+  g_autoptr(GPtrArray) hashes = g_ptr_array_new_with_free_func (g_free);
+
+  sqlite3_reset (writer->stmt_unused_blobs);
+  while (sqlite3_step (writer->stmt_unused_blobs) == SQLITE_ROW)
+    g_ptr_array_add (hashes, g_strdup ((const char *) sqlite3_column_text (writer->stmt_unused_blobs, 0)));
+  sqlite3_reset (writer->stmt_unused_blobs);
+
+  for (guint i = 0; i < hashes->len; i++)
+    {
+      const char *hash = g_ptr_array_index (hashes, i);
+
+      sqlite3_bind_text (writer->stmt_blob_delete, 1, hash, -1, SQLITE_STATIC);
+      if (sqlite3_step (writer->stmt_blob_delete) != SQLITE_DONE)
+        DEBUG ("Deleting blob %s failed: %s", hash, sqlite3_errmsg (writer->db));
+      sqlite3_reset (writer->stmt_blob_delete);
+      sqlite3_clear_bindings (writer->stmt_blob_delete);
+
+      if (writer->storage == SHUMATE_FILE_CACHE_STORAGE_FILES)
+        g_ptr_array_add (unused_files, get_blob_filename (writer->cache_dir, hash));
+    }
+}
+
+
+static void
+delete_files (GPtrArray *filenames)
+{
+  for (guint i = 0; i < filenames->len; i++)
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (g_ptr_array_index (filenames, i));
+      g_autoptr(GError) error = NULL;
+
+      if (!g_file_delete (file, NULL, &error))
+        DEBUG ("Deleting tile from disk failed: %s", error->message);
+    }
+
+  g_ptr_array_set_size (filenames, 0);
+}
+
+
+/*
+ * Applies a change. Files it leaves unused are only added to @unused_files,
+ * to be deleted once the transaction is committed.
+ */
+static void
+cache_writer_apply (CacheWriter *writer,
+                    WriteOp     *op,
+                    GPtrArray   *unused_files)
+{
+  g_autofree char *hash = NULL;
+  sqlite3_stmt *stmt;
+
+  switch (op->kind)
+    {
+    case WRITE_STORE:
+      /* Hashing is done here rather than when the tile is stored, to keep
+       * it out of the main thread */
+      hash = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, op->bytes);
+      if (!cache_writer_store_blob (writer, hash, op->bytes))
+        return;
+
+      /* A tile stored before the blobs existed has a file of its own, which
+       * nothing refers to once the row is replaced */
+      sqlite3_reset (writer->stmt_legacy_select);
+      sqlite3_bind_text (writer->stmt_legacy_select, 1, op->filename, -1, SQLITE_STATIC);
+      if (sqlite3_step (writer->stmt_legacy_select) == SQLITE_ROW)
+        g_ptr_array_add (unused_files, g_strdup (op->filename));
+      sqlite3_reset (writer->stmt_legacy_select);
+      sqlite3_clear_bindings (writer->stmt_legacy_select);
+
+      stmt = writer->stmt_store;
+      sqlite3_reset (stmt);
+      sqlite3_bind_text (stmt, 1, op->filename, -1, SQLITE_STATIC);
+      sqlite3_bind_text (stmt, 2, hash, -1, SQLITE_STATIC);
+      sqlite3_bind_text (stmt, 3, op->etag, -1, SQLITE_STATIC);
+      sqlite3_bind_int64 (stmt, 4, g_bytes_get_size (op->bytes));
+      sqlite3_bind_int64 (stmt, 5, op->modified);
+      sqlite3_bind_int64 (stmt, 6, op->expiry_time);
+      break;
+
+    case WRITE_REFRESH:
+      stmt = writer->stmt_refresh;
+      sqlite3_reset (stmt);
+      sqlite3_bind_int64 (stmt, 1, op->modified);
+      sqlite3_bind_int64 (stmt, 2, op->expiry_time);
+      sqlite3_bind_text (stmt, 3, op->filename, -1, SQLITE_STATIC);
+      break;
+
+    case WRITE_POPULARITY:
+      stmt = writer->stmt_popularity;
+      sqlite3_reset (stmt);
+      sqlite3_bind_text (stmt, 1, op->filename, -1, SQLITE_STATIC);
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  if (sqlite3_step (stmt) != SQLITE_DONE)
+    DEBUG ("Writing '%s' to the cache failed: %s", op->filename, sqlite3_errmsg (writer->db));
+
+  /* Also releases the bound data */
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+}
+
+
+static void
+cache_writer_delete_tile (CacheWriter *writer,
+                          const char  *filename)
+{
+  sqlite3_reset (writer->stmt_delete);
+  sqlite3_bind_text (writer->stmt_delete, 1, filename, -1, SQLITE_STATIC);
+  if (sqlite3_step (writer->stmt_delete) != SQLITE_DONE)
+    DEBUG ("Deleting tile from db failed: %s", sqlite3_errmsg (writer->db));
+  sqlite3_reset (writer->stmt_delete);
+  sqlite3_clear_bindings (writer->stmt_delete);
+}
+
+
+/*
+ * Deletes the least popular tiles until the cache fits in @size_limit. The
+ * total size is kept up to date by triggers and the tiles are picked with
+ * the popularity index, so each chunk costs the same whatever the size of
+ * the cache. A blob still used by other tiles doesn't free anything, the
+ * total size is read again after each chunk.
+ */
+static void
+cache_writer_purge (CacheWriter *writer,
+                    guint64      size_limit)
+{
+  g_autoptr(GPtrArray) filenames = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) unused_files = g_ptr_array_new_with_free_func (g_free);
+
+  while (TRUE)
+    {
+      gint64 total_size;
+      gint64 highest_popularity = 0;
+      char *error_msg = NULL;
+
+      sqlite3_reset (writer->stmt_total_size);
+      if (sqlite3_step (writer->stmt_total_size) != SQLITE_ROW)
+        {
+          DEBUG ("Failed to read the cache size: %s", sqlite3_errmsg (writer->db));
+          sqlite3_reset (writer->stmt_total_size);
+          break;
+        }
+
+      total_size = sqlite3_column_int64 (writer->stmt_total_size, 0);
+      sqlite3_reset (writer->stmt_total_size);
+
+      if (total_size <= 0 || (guint64) total_size <= size_limit)
+        {
+          DEBUG ("Cache size is %" G_GINT64_FORMAT " bytes", total_size);
+          break;
+        }
+
+      /* The whole chunk is read before deleting anything */
+      g_ptr_array_set_size (filenames, 0);
+      sqlite3_bind_int (writer->stmt_purge_select, 1, PURGE_CHUNK_SIZE);
+      while ((guint64) MAX (total_size, 0) > size_limit &&
+             sqlite3_step (writer->stmt_purge_select) == SQLITE_ROW)
+        {
+          const char *filename = (const char *) sqlite3_column_text (writer->stmt_purge_select, 0);
+
+          g_ptr_array_add (filenames, g_strdup (filename));
+          total_size -= sqlite3_column_int64 (writer->stmt_purge_select, 1);
+          highest_popularity = sqlite3_column_int64 (writer->stmt_purge_select, 2);
+
+          /* Tiles stored before the blobs existed have a file of their own */
+          if (sqlite3_column_type (writer->stmt_purge_select, 3) == SQLITE_NULL)
+            g_ptr_array_add (unused_files, g_strdup (filename));
+        }
+      sqlite3_reset (writer->stmt_purge_select);
+
+      if (filenames->len == 0)
+        break;
+
+      /* The cache is going away, the next purge continues from there */
+      if (g_atomic_int_get (&writer->quitting))
+        return;
+
+      sqlite3_exec (writer->db, "BEGIN", NULL, NULL, NULL);
+
+      for (guint i = 0; i < filenames->len; i++)
+        {
+          DEBUG ("Deleting %s", (char *) g_ptr_array_index (filenames, i));
+          cache_writer_delete_tile (writer, g_ptr_array_index (filenames, i));
+        }
+
+      cache_writer_collect_blobs (writer, unused_files);
+
+      /* Rather than making every remaining tile less popular, which touches
+       * all the rows, tiles stored from now on start above the purged ones */
+      sqlite3_bind_int64 (writer->stmt_popularity_base, 1, highest_popularity);
+      if (sqlite3_step (writer->stmt_popularity_base) != SQLITE_DONE)
+        DEBUG ("Updating popularity failed: %s", sqlite3_errmsg (writer->db));
+      sqlite3_reset (writer->stmt_popularity_base);
+
+      sqlite3_exec (writer->db, "COMMIT", NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        {
+          DEBUG ("Committing the purge failed: %s", error_msg);
+          sqlite3_free (error_msg);
+          break;
+        }
+
+      delete_files (unused_files);
+    }
+
+  sqlite3_exec (writer->db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL);
+}
+
+
+static gboolean
+purge_task_return_cb (gpointer user_data)
+{
+  g_autoptr(GTask) task = user_data;
+
+  if (!g_task_return_error_if_cancelled (task))
+    g_task_return_boolean (task, TRUE);
+  return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * Waits for a change, then applies the ones that follow for up to
+ * COMMIT_INTERVAL_MS in the same transaction.
+ */
+static gpointer
+cache_writer_thread (gpointer data)
+{
+  CacheWriter *writer = data;
+  g_autoptr(GPtrArray) unused_files = g_ptr_array_new_with_free_func (g_free);
+  gboolean running = TRUE;
+
+  while (running)
+    {
+      WriteOp *op = g_async_queue_pop (writer->queue);
+      WriteOp *maintenance_op = NULL;
+      gboolean stored = FALSE;
+      gint64 deadline = g_get_monotonic_time () + COMMIT_INTERVAL_MS * 1000;
+      char *error_msg = NULL;
+
+      sqlite3_exec (writer->db, "BEGIN", NULL, NULL, NULL);
+
+      while (op != NULL)
+        {
+          gint64 remaining;
+
+          if (op->kind == WRITE_QUIT)
+            {
+              write_op_free (op);
+              running = FALSE;
+              break;
+            }
+
+          /* Purging and vacuuming use transactions of their own */
+          if (op->kind == WRITE_PURGE || op->kind == WRITE_VACUUM)
+            {
+              maintenance_op = op;
+              break;
+            }
+
+          stored |= (op->kind == WRITE_STORE);
+          cache_writer_apply (writer, op, unused_files);
+          write_op_free (op);
+
+          remaining = deadline - g_get_monotonic_time ();
+          if (remaining <= 0)
+            break;
+
+          op = g_async_queue_timeout_pop (writer->queue, remaining);
+        }
+
+      /* Replaced tiles may have left blobs unused */
+      if (stored)
+        cache_writer_collect_blobs (writer, unused_files);
+
+      sqlite3_exec (writer->db, "COMMIT", NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        {
+          DEBUG ("Committing cache changes failed: %s", error_msg);
+          sqlite3_free (error_msg);
+          g_ptr_array_set_size (unused_files, 0);
+        }
+      else
+        delete_files (unused_files);
+
+      if (maintenance_op != NULL && g_atomic_int_get (&writer->quitting))
+        {
+          /* No purge task can be left once the cache is going away, and an
+           * unfinished vacuum is retried on the next start */
+          DEBUG ("Skipping the cache maintenance on quit");
+        }
+      else if (maintenance_op != NULL && maintenance_op->kind == WRITE_PURGE)
+        {
+          GCancellable *cancellable = maintenance_op->task ? g_task_get_cancellable (maintenance_op->task) : NULL;
+
+          if (g_cancellable_is_cancelled (cancellable))
+            DEBUG ("Skipping a cancelled purge");
+          else
+            cache_writer_purge (writer, maintenance_op->size_limit);
+
+          if (maintenance_op->task)
+            {
+              GTask *task = g_steal_pointer (&maintenance_op->task);
+
+              /* The task holds the cache alive, so it must also be released
+               * in the caller's context and never on this thread */
+              g_main_context_invoke_full (g_task_get_context (task),
+                                          G_PRIORITY_DEFAULT,
+                                          purge_task_return_cb,
+                                          task, NULL);
+            }
+        }
+      else if (maintenance_op != NULL && maintenance_op->kind == WRITE_VACUUM)
+        {
+          /* Switching an existing database to incremental vacuuming only
+           * takes effect once it is rebuilt. The mode is a setting of the
+           * connection until then, so it has to be set on this one. */
+          DEBUG ("Rebuilding the cache database");
+          sqlite3_exec (writer->db, "PRAGMA auto_vacuum=INCREMENTAL;", NULL, NULL, NULL);
+          if (sqlite3_exec (writer->db, "VACUUM;", NULL, NULL, NULL) != SQLITE_OK)
+            DEBUG ("Vacuuming the cache failed: %s", sqlite3_errmsg (writer->db));
+        }
+
+      g_clear_pointer (&maintenance_op, write_op_free);
+    }
+
+  return NULL;
+}
+
+
+static void
+cache_writer_free (CacheWriter *writer)
+{
+  if (writer->thread)
+    {
+      /* A long purge or vacuum doesn't hold up quitting: the ones still
+       * queued are skipped, and the statement running is interrupted. At
+       * worst the last changes are lost, which a cache can afford. */
+      g_atomic_int_set (&writer->quitting, TRUE);
+      g_async_queue_push (writer->queue, write_op_new (WRITE_QUIT, NULL));
+      sqlite3_interrupt (writer->db);
+      g_thread_join (writer->thread);
+    }
+
+  g_clear_pointer (&writer->queue, g_async_queue_unref);
+  g_clear_pointer (&writer->stmt_store, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_legacy_select, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_blob_insert, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_blob_fill, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_unused_blobs, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_blob_delete, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_refresh, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_popularity, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_total_size, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_purge_select, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_delete, sqlite3_finalize);
+  g_clear_pointer (&writer->stmt_popularity_base, sqlite3_finalize);
+  g_clear_pointer (&writer->db, sqlite3_close);
+  g_free (writer->cache_dir);
+  g_free (writer);
+}
+
+
+static CacheWriter *
+cache_writer_new (const char              *db_filename,
+                  const char              *cache_dir,
+                  ShumateFileCacheStorage  storage)
+{
+  CacheWriter *writer = g_new0 (CacheWriter, 1);
+
+  writer->storage = storage;
+  writer->cache_dir = g_strdup (cache_dir);
+
+  if (sqlite3_open_v2 (db_filename, &writer->db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Opening the cache database for writing failed: %s", sqlite3_errmsg (writer->db));
+      cache_writer_free (writer);
+      return NULL;
+    }
+
+  sqlite3_busy_timeout (writer->db, BUSY_TIMEOUT_MS);
+  /* The triggers keeping the total size and the blob reference counts must
+   * see the rows REPLACE deletes */
+  sqlite3_exec (writer->db,
+      "PRAGMA synchronous=OFF;"
+      "PRAGMA recursive_triggers=ON;",
+      NULL, NULL, NULL);
+
+  if (!prepare_statement (writer->db,
+        "REPLACE INTO tiles (filename, hash, etag, size, modified, expires, popularity) "
+        "VALUES (?, ?, ?, ?, ?, ?, (SELECT value FROM metadata WHERE key = 'popularity_base') + 1)",
+        &writer->stmt_store) ||
+      !prepare_statement (writer->db,
+        "SELECT 1 FROM tiles WHERE filename = ? AND hash IS NULL",
+        &writer->stmt_legacy_select) ||
+      !prepare_statement (writer->db,
+        "INSERT OR IGNORE INTO blobs (hash, refcount, size, data) VALUES (?, 0, ?, ?)",
+        &writer->stmt_blob_insert) ||
+      !prepare_statement (writer->db,
+        "UPDATE blobs SET data = ? WHERE hash = ? AND data IS NULL",
+        &writer->stmt_blob_fill) ||
+      !prepare_statement (writer->db,
+        "SELECT hash FROM blobs WHERE refcount <= 0",
+        &writer->stmt_unused_blobs) ||
+      !prepare_statement (writer->db,
+        "DELETE FROM blobs WHERE hash = ? AND refcount <= 0",
+        &writer->stmt_blob_delete) ||
+      !prepare_statement (writer->db,
+        "UPDATE tiles SET modified = ?, expires = ? WHERE filename = ?",
+        &writer->stmt_refresh) ||
+      !prepare_statement (writer->db,
+        "UPDATE tiles SET popularity = popularity + 1 WHERE filename = ?",
+        &writer->stmt_popularity) ||
+      !prepare_statement (writer->db,
+        "SELECT value FROM metadata WHERE key = 'total_size'",
+        &writer->stmt_total_size) ||
+      !prepare_statement (writer->db,
+        "SELECT filename, size, popularity, hash FROM tiles ORDER BY popularity LIMIT ?",
+        &writer->stmt_purge_select) ||
+      !prepare_statement (writer->db,
+        "DELETE FROM tiles WHERE filename = ?",
+        &writer->stmt_delete) ||
+      !prepare_statement (writer->db,
+        "UPDATE metadata SET value = MAX (value, ?) WHERE key = 'popularity_base'",
+        &writer->stmt_popularity_base))
+    {
+      cache_writer_free (writer);
+      return NULL;
+    }
+
+  writer->queue = g_async_queue_new ();
+  writer->thread = g_thread_new ("shumate-file-cache", cache_writer_thread, writer);
+
+  return writer;
+}
+
+
+static void
+cache_writer_push (CacheWriter *writer,
+                   WriteOp     *op)
+{
+  g_async_queue_push (writer->queue, op);
+}
+
+
 static void
 finalize_sql (ShumateFileCache *file_cache)
 {
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
 
+  /* Finishes the pending writes */
+  g_clear_pointer (&priv->writer, cache_writer_free);
+
   g_clear_pointer (&priv->stmt_select, sqlite3_finalize);
-  g_clear_pointer (&priv->stmt_update, sqlite3_finalize);
+  g_clear_pointer (&priv->stmt_select_data, sqlite3_finalize);
 
   if (priv->db)
     {
@@ -180,12 +867,100 @@ create_cache_dir (const char *dir_name)
 }
 
 
+/*
+ * Sets up the total size of the tiles, kept up to date by triggers, the
+ * reference counts of the blobs and the popularity index used when purging.
+ *
+ * The size of a blob counts once however many tiles share it. Tiles stored
+ * before the blobs existed have no hash and count on their own.
+ */
+static gboolean
+init_metadata (sqlite3 *db)
+{
+  sqlite3_stmt *stmt = NULL;
+  char *error_msg = NULL;
+  gboolean has_total;
+
+  sqlite3_exec (db,
+      "PRAGMA recursive_triggers=ON;"
+      "CREATE TABLE IF NOT EXISTS metadata (key TEXT PRIMARY KEY, value INT);"
+      "INSERT OR IGNORE INTO metadata VALUES ('popularity_base', 0);"
+      "CREATE INDEX IF NOT EXISTS tiles_popularity ON tiles (popularity);"
+      "CREATE INDEX IF NOT EXISTS blobs_refcount ON blobs (refcount);",
+      NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      DEBUG ("Creating table 'metadata' failed: %s", error_msg);
+      sqlite3_free (error_msg);
+      return FALSE;
+    }
+
+  if (!prepare_statement (db, "SELECT 1 FROM metadata WHERE key = 'total_size'", &stmt))
+    return FALSE;
+  has_total = (sqlite3_step (stmt) == SQLITE_ROW);
+  sqlite3_finalize (stmt);
+
+  /* Only databases created by older versions need a full scan, once */
+  if (!has_total)
+    sqlite3_exec (db,
+        "INSERT INTO metadata SELECT 'total_size', "
+        "  (SELECT IFNULL (SUM (size), 0) FROM tiles WHERE hash IS NULL) + "
+        "  (SELECT IFNULL (SUM (size), 0) FROM blobs)",
+        NULL, NULL, NULL);
+
+  sqlite3_exec (db,
+      "CREATE TRIGGER IF NOT EXISTS tiles_ref AFTER INSERT ON tiles BEGIN "
+      "  UPDATE blobs SET refcount = refcount + 1 WHERE hash = NEW.hash; "
+      "END;"
+      "CREATE TRIGGER IF NOT EXISTS tiles_unref AFTER DELETE ON tiles BEGIN "
+      "  UPDATE blobs SET refcount = refcount - 1 WHERE hash = OLD.hash; "
+      "  UPDATE metadata SET value = value - OLD.size WHERE key = 'total_size' AND OLD.hash IS NULL; "
+      "END;"
+      "CREATE TRIGGER IF NOT EXISTS blobs_insert AFTER INSERT ON blobs BEGIN "
+      "  UPDATE metadata SET value = value + NEW.size WHERE key = 'total_size'; "
+      "END;"
+      "CREATE TRIGGER IF NOT EXISTS blobs_delete AFTER DELETE ON blobs BEGIN "
+      "  UPDATE metadata SET value = value - OLD.size WHERE key = 'total_size'; "
+      "END;",
+      NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      DEBUG ("Creating the size triggers failed: %s", error_msg);
+      sqlite3_free (error_msg);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/* Runs a query returning a single integer */
+static gint64
+query_int (sqlite3    *db,
+           const char *sql)
+{
+  sqlite3_stmt *stmt = NULL;
+  gint64 value = 0;
+
+  if (!prepare_statement (db, sql, &stmt))
+    return 0;
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    value = sqlite3_column_int64 (stmt, 0);
+
+  sqlite3_finalize (stmt);
+
+  return value;
+}
+
+
 static void
 init_cache (ShumateFileCache *file_cache)
 {
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
-  char *filename = NULL;
+  g_autofree char *filename = NULL;
   char *error_msg = NULL;
+  gboolean needs_vacuum;
   gint error;
 
   g_return_if_fail (create_cache_dir (priv->cache_dir));
@@ -194,7 +969,6 @@ init_cache (ShumateFileCache *file_cache)
         "cache.db", NULL);
   error = sqlite3_open_v2 (filename, &priv->db,
         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-  g_free (filename);
 
   if (error == SQLITE_ERROR)
     {
@@ -202,6 +976,14 @@ init_cache (ShumateFileCache *file_cache)
       return;
     }
 
+  /* The writer thread may hold the database for a moment */
+  sqlite3_busy_timeout (priv->db, BUSY_TIMEOUT_MS);
+
+  /* The vacuum mode of a database that has tables already only changes
+   * when it is rebuilt, which the writer thread does once */
+  needs_vacuum = query_int (priv->db, "PRAGMA auto_vacuum;") != 2 &&
+                 query_int (priv->db, "SELECT COUNT(*) FROM sqlite_master;") > 0;
+
   sqlite3_exec (priv->db,
       "PRAGMA synchronous=OFF;"
       "PRAGMA auto_vacuum=INCREMENTAL;",
@@ -218,17 +1000,60 @@ init_cache (ShumateFileCache *file_cache)
       "filename TEXT PRIMARY KEY, "
       "etag TEXT, "
       "popularity INT DEFAULT 1, "
-      "size INT DEFAULT 0)",
+      "size INT DEFAULT 0, "
+      "modified INT, "
+      "expires INT, "
+      "hash TEXT);"
+      "CREATE TABLE IF NOT EXISTS blobs ("
+      "hash TEXT PRIMARY KEY, "
+      "refcount INT DEFAULT 0, "
+      "size INT DEFAULT 0, "
+      "data BLOB)",
       NULL, NULL, &error_msg);
   if (error_msg != NULL)
     {
-      DEBUG ("Creating table 'tiles' failed: %s", error_msg);
+      DEBUG ("Creating the tables failed: %s", error_msg);
       sqlite3_free (error_msg);
       return;
     }
 
+  /* Databases created by older versions only have the filename, etag,
+   * popularity and size columns, these fail harmlessly when they already
+   * exist. */
+  sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN modified INT", NULL, NULL, NULL);
+  sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN expires INT", NULL, NULL, NULL);
+  sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN hash TEXT", NULL, NULL, NULL);
+
+  if (!init_metadata (priv->db))
+    return;
+
+  /* Lets this connection read while the writer thread writes */
+  sqlite3_exec (priv->db, "PRAGMA journal_mode=WAL;", NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      DEBUG ("Enabling WAL failed: %s", error_msg);
+      sqlite3_free (error_msg);
+      error_msg = NULL;
+    }
+
+  if (priv->storage == SHUMATE_FILE_CACHE_STORAGE_DATABASE)
+    {
+      error = sqlite3_prepare_v2 (priv->db,
+            "SELECT blobs.data, tiles.modified, tiles.etag, tiles.expires "
+            "FROM tiles JOIN blobs ON blobs.hash = tiles.hash "
+            "WHERE tiles.filename = ? AND blobs.data IS NOT NULL", -1,
+            &priv->stmt_select_data, NULL);
+      if (error != SQLITE_OK)
+        {
+          priv->stmt_select_data = NULL;
+          DEBUG ("Failed to prepare the select data statement, error: %s",
+              sqlite3_errmsg (priv->db));
+          return;
+        }
+    }
+
   error = sqlite3_prepare_v2 (priv->db,
-        "SELECT etag FROM tiles WHERE filename = ?", -1,
+        "SELECT etag, expires, modified, hash FROM tiles WHERE filename = ?", -1,
         &priv->stmt_select, NULL);
   if (error != SQLITE_OK)
     {
@@ -238,16 +1063,9 @@ init_cache (ShumateFileCache *file_cache)
       return;
     }
 
-  error = sqlite3_prepare_v2 (priv->db,
-        "UPDATE tiles SET popularity = popularity + 1 WHERE filename = ?", -1,
-        &priv->stmt_update, NULL);
-  if (error != SQLITE_OK)
-    {
-      priv->stmt_update = NULL;
-      DEBUG ("Failed to prepare the update popularity statement, error: %s",
-          sqlite3_errmsg (priv->db));
-      return;
-    }
+  priv->writer = cache_writer_new (filename, priv->cache_dir, priv->storage);
+  if (priv->writer && needs_vacuum)
+    cache_writer_push (priv->writer, write_op_new (WRITE_VACUUM, NULL));
 
   g_object_notify (G_OBJECT (file_cache), "cache-dir");
 }
@@ -292,11 +1110,11 @@ shumate_file_cache_class_init (ShumateFileCacheClass *klass)
    *
    * Note: this new value will not be applied until you call shumate_file_cache_purge()
    */
-  pspec = g_param_spec_uint ("size-limit",
+  pspec = g_param_spec_uint64 ("size-limit",
         "Size Limit",
-        "The cache's size limit (Mb)",
+        "The cache's size limit in bytes",
         1,
-        G_MAXINT,
+        G_MAXUINT64,
         100000000,
         G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_SIZE_LIMIT, pspec);
@@ -313,6 +1131,20 @@ shumate_file_cache_class_init (ShumateFileCacheClass *klass)
         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_CACHE_DIR, pspec);
 
+  /**
+   * ShumateFileCache:storage:
+   *
+   * Where the tile data is stored: in one file per tile, or in the cache
+   * database along with the tile metadata.
+   */
+  pspec = g_param_spec_enum ("storage",
+        "Storage",
+        "Where the tile data is stored",
+        SHUMATE_TYPE_FILE_CACHE_STORAGE,
+        SHUMATE_FILE_CACHE_STORAGE_FILES,
+        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_STORAGE, pspec);
+
   tile_cache_class->store_tile = store_tile;
   tile_cache_class->refresh_tile_time = refresh_tile_time;
   tile_cache_class->on_tile_filled = on_tile_filled;
@@ -331,7 +1163,8 @@ shumate_file_cache_init (ShumateFileCache *file_cache)
   priv->cache_dir = NULL;
   priv->db = NULL;
   priv->stmt_select = NULL;
-  priv->stmt_update = NULL;
+  priv->writer = NULL;
+  priv->storage = SHUMATE_FILE_CACHE_STORAGE_FILES;
 }
 
 
@@ -346,7 +1179,7 @@ shumate_file_cache_init (ShumateFileCache *file_cache)
  * Returns: a constructed #ShumateFileCache
  */
 ShumateFileCache *
-shumate_file_cache_new_full (guint size_limit,
+shumate_file_cache_new_full (guint64 size_limit,
     const char *cache_dir)
 {
   ShumateFileCache *cache;
@@ -367,7 +1200,7 @@ shumate_file_cache_new_full (guint size_limit,
  *
  * Returns: size limit
  */
-guint
+guint64
 shumate_file_cache_get_size_limit (ShumateFileCache *file_cache)
 {
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
@@ -397,6 +1230,25 @@ shumate_file_cache_get_cache_dir (ShumateFileCache *file_cache)
 }
 
 
+/**
+ * shumate_file_cache_get_storage:
+ * @file_cache: a #ShumateFileCache
+ *
+ * Gets where the cache stores the tile data.
+ *
+ * Returns: the storage of the cache
+ */
+ShumateFileCacheStorage
+shumate_file_cache_get_storage (ShumateFileCache *file_cache)
+{
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_FILE_CACHE (file_cache), SHUMATE_FILE_CACHE_STORAGE_FILES);
+
+  return priv->storage;
+}
+
+
 /**
  * shumate_file_cache_set_size_limit:
  * @file_cache: a #ShumateFileCache
@@ -406,7 +1258,7 @@ shumate_file_cache_get_cache_dir (ShumateFileCache *file_cache)
  */
 void
 shumate_file_cache_set_size_limit (ShumateFileCache *file_cache,
-    guint size_limit)
+    guint64 size_limit)
 {
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
 
@@ -442,37 +1294,17 @@ get_filename (ShumateFileCache *file_cache,
 }
 
 
-static gboolean
-tile_is_expired (ShumateFileCache *file_cache,
-    ShumateTile *tile)
-{
-  GDateTime *modified_time;
-  gboolean validate_cache = TRUE;
-
-  g_return_val_if_fail (SHUMATE_FILE_CACHE (file_cache), FALSE);
-  g_return_val_if_fail (SHUMATE_TILE (tile), FALSE);
-
-  modified_time = shumate_tile_get_modified_time (tile);
-  if (modified_time)
-    {
-      GDateTime *now = g_date_time_new_now_utc ();
-      GTimeSpan diff = g_date_time_difference (now, modified_time);
-
-      validate_cache = (diff > 7 * G_TIME_SPAN_DAY); /* Cache expires in 7 days */
-      g_date_time_unref (now);
-    }
-
-  DEBUG ("%p is %s expired", tile, (validate_cache ? "" : "not"));
-
-  return validate_cache;
-}
-
-
 typedef struct
 {
   ShumateFileCache *self;
   ShumateTile *tile;
   GCancellable *cancellable;
+
+  /* Metadata of the files storage, set on the tile once it is loaded */
+  char *etag;
+  gint64 expiry_time;
+  gint64 modified;
+  gboolean legacy_file;
 } FileLoadedData;
 
 static void
@@ -481,107 +1313,128 @@ file_loaded_data_free (FileLoadedData *data)
   g_clear_object (&data->self);
   g_clear_object (&data->tile);
   g_clear_object (&data->cancellable);
+  g_free (data->etag);
   g_slice_free (FileLoadedData, data);
 }
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FileLoadedData, file_loaded_data_free)
 
-static void
-on_pixbuf_created (GObject *source_object,
-                   GAsyncResult *res,
-                   gpointer user_data)
+
+/*
+ * Reads the metadata of a tile stored as a file, and returns the file its
+ * data is in: its blob, or for tiles stored by older versions, a file of its
+ * own.
+ */
+static char *
+load_tile_metadata (ShumateFileCache *self,
+    const char *filename,
+    FileLoadedData *data)
 {
-  g_autoptr(FileLoadedData) loaded_data = user_data;
-  ShumateFileCache *self = loaded_data->self;
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
-  ShumateTile *tile = loaded_data->tile;
-  ShumateMapSource *next_source = shumate_map_source_get_next_source (SHUMATE_MAP_SOURCE (self));
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
-  g_autoptr(GdkTexture) texture = NULL;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GFile) file = NULL;
-  g_autofree char *filename = NULL;
-  g_autoptr(GFileInfo) info = NULL;
-
-  pixbuf = gdk_pixbuf_new_from_stream_finish (res, &error);
-  if (!pixbuf)
-    {
-      DEBUG ("Tile rendering failed");
-      goto load_next;
-    }
+  char *path = NULL;
+  int sql_rc;
 
-  texture = gdk_texture_new_for_pixbuf (pixbuf);
-  shumate_tile_set_texture (tile, texture);
-  shumate_tile_set_state (tile, SHUMATE_STATE_LOADED);
+  data->legacy_file = TRUE;
 
-  filename = get_filename (self, tile);
-  file = g_file_new_for_path (filename);
+  if (!priv->stmt_select)
+    return g_strdup (filename);
 
-  /* Retrieve modification time */
-  info = g_file_query_info (file,
-                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
-                            G_FILE_QUERY_INFO_NONE, loaded_data->cancellable, NULL);
-  if (info)
+  sqlite3_reset (priv->stmt_select);
+  sql_rc = sqlite3_bind_text (priv->stmt_select, 1, filename, -1, SQLITE_STATIC);
+  if (sql_rc != SQLITE_OK)
     {
-      g_autoptr(GDateTime) modified_time = g_file_info_get_modification_date_time (info);
-      shumate_tile_set_modified_time (tile, modified_time);
+      DEBUG ("Failed to prepare the SQL query for finding the Etag of '%s', error: %s",
+          filename, sqlite3_errmsg (priv->db));
+      return g_strdup (filename);
     }
 
-  /* Notify other caches that the tile has been filled */
-  if (SHUMATE_IS_TILE_CACHE (next_source))
-    shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
-
-  if (tile_is_expired (self, tile))
+  sql_rc = sqlite3_step (priv->stmt_select);
+  if (sql_rc == SQLITE_ROW)
     {
-      int sql_rc = SQLITE_OK;
+      const char *etag = (const char *) sqlite3_column_text (priv->stmt_select, 0);
+      const char *hash = (const char *) sqlite3_column_text (priv->stmt_select, 3);
 
-      /* Retrieve etag */
-      sqlite3_reset (priv->stmt_select);
-      sql_rc = sqlite3_bind_text (priv->stmt_select, 1, filename, -1, SQLITE_STATIC);
-      if (sql_rc == SQLITE_ERROR)
-        {
-          DEBUG ("Failed to prepare the SQL query for finding the Etag of '%s', error: %s",
-              filename, sqlite3_errmsg (priv->db));
-          goto load_next;
-        }
+      data->etag = g_strdup (etag);
+      data->expiry_time = sqlite3_column_int64 (priv->stmt_select, 1);
+      data->modified = sqlite3_column_int64 (priv->stmt_select, 2);
 
-      sql_rc = sqlite3_step (priv->stmt_select);
-      if (sql_rc == SQLITE_ROW)
+      if (hash)
         {
-          const char *etag = (const char *) sqlite3_column_text (priv->stmt_select, 0);
-          shumate_tile_set_etag (SHUMATE_TILE (tile), etag);
+          path = get_blob_filename (priv->cache_dir, hash);
+          data->legacy_file = FALSE;
         }
-      else if (sql_rc == SQLITE_DONE)
+    }
+  else if (sql_rc == SQLITE_DONE)
+    DEBUG ("'%s' doesn't have metadata", filename);
+  else
+    DEBUG ("Failed to find the Etag of '%s', %d error: %s",
+        filename, sql_rc, sqlite3_errmsg (priv->db));
+
+  sqlite3_reset (priv->stmt_select);
+
+  return path ? path : g_strdup (filename);
+}
+
+
+/* Finishes loading a tile whose data is in the cache, decoded or not */
+static void
+on_tile_loaded (FileLoadedData *loaded_data)
+{
+  ShumateFileCache *self = loaded_data->self;
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
+  ShumateTile *tile = loaded_data->tile;
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *filename = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+
+  shumate_tile_set_state (tile, SHUMATE_STATE_LOADED);
+
+  /* Set the metadata, the database storage has set it already */
+  if (priv->storage == SHUMATE_FILE_CACHE_STORAGE_FILES)
+    {
+      if (loaded_data->etag)
+        shumate_tile_set_etag (tile, loaded_data->etag);
+      shumate_tile_set_expiry_time (tile, loaded_data->expiry_time);
+
+      if (loaded_data->modified != 0)
         {
-          DEBUG ("'%s' does't have an etag",
-              filename);
-          goto load_next;
+          g_autoptr(GDateTime) modified_time = g_date_time_new_from_unix_utc (loaded_data->modified);
+          shumate_tile_set_modified_time (tile, modified_time);
         }
-      else if (sql_rc == SQLITE_ERROR)
+      else if (loaded_data->legacy_file)
         {
-          DEBUG ("Failed to finding the Etag of '%s', %d error: %s",
-              filename, sql_rc, sqlite3_errmsg (priv->db));
-          goto load_next;
+          /* Tiles stored by older versions only have the time of their file */
+          filename = get_filename (self, tile);
+          file = g_file_new_for_path (filename);
+          info = g_file_query_info (file,
+                                    G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                    G_FILE_QUERY_INFO_NONE, loaded_data->cancellable, NULL);
+          if (info)
+            {
+              g_autoptr(GDateTime) modified_time = g_file_info_get_modification_date_time (info);
+              shumate_tile_set_modified_time (tile, modified_time);
+            }
         }
-
-      /* Validate the tile */
-      /* goto load_next; */
-    }
-  else
-    {
-      /* Tile loaded and no validation needed - done */
-      shumate_tile_set_fade_in (tile, FALSE);
-      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
-      return;
     }
 
-load_next:
-  if (SHUMATE_IS_MAP_SOURCE (next_source))
-    shumate_map_source_fill_tile (next_source, tile, loaded_data->cancellable);
-  else if (shumate_tile_get_state (tile) == SHUMATE_STATE_LOADED)
-    {
-      /* if we have some content, use the tile even if it wasn't validated */
-      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
-    }
+  shumate_tile_finish_cached (SHUMATE_MAP_SOURCE (self),
+                              tile,
+                              shumate_tile_is_expired (tile),
+                              loaded_data->cancellable);
+}
+
+
+static void
+on_tile_decoded (GObject *source_object,
+                 GAsyncResult *res,
+                 gpointer user_data)
+{
+  g_autoptr(FileLoadedData) loaded_data = user_data;
+
+  if (!shumate_tile_decode_finish_for_source (res, SHUMATE_MAP_SOURCE (loaded_data->self),
+                                              loaded_data->tile, loaded_data->cancellable))
+    return;
+
+  on_tile_loaded (loaded_data);
 }
 
 
@@ -594,11 +1447,11 @@ on_file_loaded (GObject      *source_object,
   ShumateFileCache *self = loaded_data->self;
   ShumateTile *tile = loaded_data->tile;
   g_autoptr(GError) error = NULL;
-  g_autoptr(GInputStream) input_stream = NULL;
+  g_autoptr(GBytes) bytes = NULL;
   GCancellable *cancellable = loaded_data->cancellable;
 
-  input_stream = G_INPUT_STREAM (g_file_read_finish (G_FILE (source_object), res, &error));
-  if (!input_stream)
+  bytes = g_file_load_bytes_finish (G_FILE (source_object), res, NULL, &error);
+  if (!bytes)
     {
       g_autofree char *path = g_file_get_path (G_FILE (source_object));
       ShumateMapSource *next_source = shumate_map_source_get_next_source (SHUMATE_MAP_SOURCE (self));
@@ -611,7 +1464,64 @@ on_file_loaded (GObject      *source_object,
       return;
     }
 
-  gdk_pixbuf_new_from_stream_async (input_stream, cancellable, on_pixbuf_created, g_steal_pointer (&loaded_data));
+  /* The tile was checked when it was stored, it only needs to be there */
+  if (shumate_tile_get_store_only (tile))
+    {
+      on_tile_loaded (loaded_data);
+      return;
+    }
+
+  shumate_tile_decode_async (bytes,
+      tile,
+      cancellable,
+      on_tile_decoded,
+      g_steal_pointer (&loaded_data));
+}
+
+
+static GBytes *
+load_tile_data (ShumateFileCache *self,
+    ShumateTile *tile,
+    const char *filename)
+{
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
+  GBytes *bytes;
+  int sql_rc;
+
+  if (!priv->stmt_select_data)
+    return NULL;
+
+  sqlite3_reset (priv->stmt_select_data);
+  sql_rc = sqlite3_bind_text (priv->stmt_select_data, 1, filename, -1, SQLITE_STATIC);
+  if (sql_rc != SQLITE_OK)
+    {
+      DEBUG ("Failed to prepare the SQL query for loading '%s', error: %s",
+          filename, sqlite3_errmsg (priv->db));
+      return NULL;
+    }
+
+  sql_rc = sqlite3_step (priv->stmt_select_data);
+  if (sql_rc != SQLITE_ROW)
+    return NULL;
+
+  bytes = g_bytes_new (sqlite3_column_blob (priv->stmt_select_data, 0),
+        sqlite3_column_bytes (priv->stmt_select_data, 0));
+
+  if (sqlite3_column_type (priv->stmt_select_data, 2) != SQLITE_NULL)
+    shumate_tile_set_etag (tile, (const char *) sqlite3_column_text (priv->stmt_select_data, 2));
+  shumate_tile_set_expiry_time (tile, sqlite3_column_int64 (priv->stmt_select_data, 3));
+
+  if (sqlite3_column_type (priv->stmt_select_data, 1) != SQLITE_NULL)
+    {
+      g_autoptr(GDateTime) modified_time = NULL;
+
+      modified_time = g_date_time_new_from_unix_utc (sqlite3_column_int64 (priv->stmt_select_data, 1));
+      shumate_tile_set_modified_time (tile, modified_time);
+    }
+
+  sqlite3_reset (priv->stmt_select_data);
+
+  return bytes;
 }
 
 
@@ -621,7 +1531,8 @@ fill_tile (ShumateMapSource *map_source,
            GCancellable     *cancellable)
 {
   ShumateFileCache *self = (ShumateFileCache *)map_source;
-  
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (self);
+
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (self));
   g_return_if_fail (SHUMATE_IS_TILE (tile));
 
@@ -637,7 +1548,6 @@ fill_tile (ShumateMapSource *map_source,
       g_autofree char *filename = NULL;
 
       filename = get_filename (self, tile);
-      file = g_file_new_for_path (filename);
 
       user_data = g_slice_new0 (FileLoadedData);
       user_data->self = g_object_ref (self);
@@ -647,7 +1557,40 @@ fill_tile (ShumateMapSource *map_source,
 
       DEBUG ("fill of %s", filename);
 
-      g_file_read_async (file, G_PRIORITY_DEFAULT, cancellable, on_file_loaded, user_data);
+      if (priv->storage == SHUMATE_FILE_CACHE_STORAGE_DATABASE)
+        {
+          g_autoptr(GBytes) bytes = load_tile_data (self, tile, filename);
+
+          if (!bytes)
+            {
+              file_loaded_data_free (user_data);
+              if (SHUMATE_IS_MAP_SOURCE (next_source))
+                shumate_map_source_fill_tile (next_source, tile, cancellable);
+
+              return;
+            }
+
+          /* The tile was checked when it was stored, it only needs to be there */
+          if (shumate_tile_get_store_only (tile))
+            {
+              on_tile_loaded (user_data);
+              file_loaded_data_free (user_data);
+              return;
+            }
+
+          shumate_tile_decode_async (bytes,
+              tile,
+              cancellable,
+              on_tile_decoded,
+              user_data);
+        }
+      else
+        {
+          g_autofree char *path = load_tile_metadata (self, filename, user_data);
+
+          file = g_file_new_for_path (path);
+          g_file_load_bytes_async (file, cancellable, on_file_loaded, user_data);
+        }
     }
   else if (SHUMATE_IS_MAP_SOURCE (next_source))
     shumate_map_source_fill_tile (next_source, tile, cancellable);
@@ -668,30 +1611,16 @@ refresh_tile_time (ShumateTileCache *tile_cache,
   ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (tile_cache);
   ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
   ShumateFileCache *file_cache = SHUMATE_FILE_CACHE (tile_cache);
-  char *filename = NULL;
-  GFile *file;
-  GFileInfo *info;
-
-  filename = get_filename (file_cache, tile);
-  file = g_file_new_for_path (filename);
-  g_free (filename);
-
-  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
-        G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
 
-  if (info)
+  if (priv->writer)
     {
-      GDateTime *now = g_date_time_new_now_utc ();
-
-      g_file_info_set_modification_date_time (info, now);
-      g_file_set_attributes_from_info (file, info, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+      WriteOp *op = write_op_new (WRITE_REFRESH, get_filename (file_cache, tile));
 
-      g_date_time_unref (now);
-      g_object_unref (info);
+      op->expiry_time = shumate_tile_get_expiry_time (tile);
+      cache_writer_push (priv->writer, op);
     }
 
-  g_object_unref (file);
-
   if (SHUMATE_IS_TILE_CACHE (next_source))
     shumate_tile_cache_refresh_tile_time (SHUMATE_TILE_CACHE (next_source), tile);
 }
@@ -700,8 +1629,7 @@ refresh_tile_time (ShumateTileCache *tile_cache,
 static void
 store_tile (ShumateTileCache *tile_cache,
     ShumateTile *tile,
-    const char *contents,
-    gsize size)
+    GBytes *bytes)
 {
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (tile_cache));
 
@@ -709,73 +1637,21 @@ store_tile (ShumateTileCache *tile_cache,
   ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
   ShumateFileCache *file_cache = SHUMATE_FILE_CACHE (tile_cache);
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
-  char *query = NULL;
-  char *error = NULL;
-  char *path = NULL;
-  char *filename = NULL;
-  GError *gerror = NULL;
-  GFile *file;
-  GFileOutputStream *ostream;
-  gsize bytes_written;
 
   DEBUG ("Update of %p", tile);
 
-  filename = get_filename (file_cache, tile);
-  file = g_file_new_for_path (filename);
-
-  /* If the file exists, delete it */
-  g_file_delete (file, NULL, NULL);
-
-  /* If needed, create the cache's dirs */
-  path = g_path_get_dirname (filename);
-  if (g_mkdir_with_parents (path, 0700) == -1)
+  if (priv->writer)
     {
-      if (errno != EEXIST)
-        {
-          g_warning ("Unable to create the image cache path '%s': %s",
-              path, g_strerror (errno));
-          goto store_next;
-        }
-    }
-
-  ostream = g_file_create (file, G_FILE_CREATE_PRIVATE, NULL, &gerror);
-  if (!ostream)
-    {
-      DEBUG ("GFileOutputStream creation failed: %s", gerror->message);
-      g_error_free (gerror);
-      goto store_next;
-    }
+      WriteOp *op = write_op_new (WRITE_STORE, get_filename (file_cache, tile));
 
-  /* Write the cache */
-  if (!g_output_stream_write_all (G_OUTPUT_STREAM (ostream), contents, size, &bytes_written, NULL, &gerror))
-    {
-      DEBUG ("Writing file contents failed: %s", gerror->message);
-      g_error_free (gerror);
-      g_object_unref (ostream);
-      goto store_next;
+      op->etag = g_strdup (shumate_tile_get_etag (tile));
+      op->expiry_time = shumate_tile_get_expiry_time (tile);
+      op->bytes = g_bytes_ref (bytes);
+      cache_writer_push (priv->writer, op);
     }
 
-  g_object_unref (ostream);
-
-  query = sqlite3_mprintf ("REPLACE INTO tiles (filename, etag, size) VALUES (%Q, %Q, %d)",
-        filename,
-        shumate_tile_get_etag (tile),
-        size);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
-    {
-      DEBUG ("Saving Etag and size failed: %s", error);
-      sqlite3_free (error);
-    }
-  sqlite3_free (query);
-
-store_next:
   if (SHUMATE_IS_TILE_CACHE (next_source))
-    shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (next_source), tile, contents, size);
-
-  g_free (filename);
-  g_free (path);
-  g_object_unref (file);
+    shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (next_source), tile, bytes);
 }
 
 
@@ -790,175 +1666,116 @@ on_tile_filled (ShumateTileCache *tile_cache,
   ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
   ShumateFileCache *file_cache = SHUMATE_FILE_CACHE (tile_cache);
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
-  int sql_rc = SQLITE_OK;
-  char *filename = NULL;
-
-  filename = get_filename (file_cache, tile);
-
-  DEBUG ("popularity of %s", filename);
-
-  sqlite3_reset (priv->stmt_update);
-  sql_rc = sqlite3_bind_text (priv->stmt_update, 1, filename, -1, SQLITE_STATIC);
-  if (sql_rc != SQLITE_OK)
-    {
-      DEBUG ("Failed to set values to the popularity query of '%s', error: %s",
-          filename, sqlite3_errmsg (priv->db));
-      goto call_next;
-    }
 
-  sql_rc = sqlite3_step (priv->stmt_update);
-  if (sql_rc != SQLITE_DONE)
-    {
-      /* may not be present in this cache */
-      goto call_next;
-    }
+  /* The tile may not be present in this cache, the update does nothing then */
+  if (priv->writer)
+    cache_writer_push (priv->writer, write_op_new (WRITE_POPULARITY, get_filename (file_cache, tile)));
 
-call_next:
-  g_free (filename);
   if (SHUMATE_IS_TILE_CACHE (next_source))
     shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
 }
 
 
-static void
-delete_tile (ShumateFileCache *file_cache, const char *filename)
+/**
+ * shumate_file_cache_purge_on_idle:
+ * @file_cache: a #ShumateFileCache
+ *
+ * Purge the cache from the less popular tiles until cache's size limit is reached.
+ * This is a non blocking call as the purge happens in the background.
+ */
+void
+shumate_file_cache_purge_on_idle (ShumateFileCache *file_cache)
 {
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
+  WriteOp *op;
 
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (file_cache));
-  char *query, *error = NULL;
-  GError *gerror = NULL;
-  GFile *file;
 
-  query = sqlite3_mprintf ("DELETE FROM tiles WHERE filename = %Q", filename);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
-    {
-      DEBUG ("Deleting tile from db failed: %s", error);
-      sqlite3_free (error);
-    }
-  sqlite3_free (query);
+  if (!priv->writer)
+    return;
 
-  file = g_file_new_for_path (filename);
-  if (!g_file_delete (file, NULL, &gerror))
-    {
-      DEBUG ("Deleting tile from disk failed: %s", gerror->message);
-      g_error_free (gerror);
-    }
-  g_object_unref (file);
-}
-
-
-static gboolean
-purge_on_idle (gpointer data)
-{
-  shumate_file_cache_purge (SHUMATE_FILE_CACHE (data));
-  return FALSE;
+  op = write_op_new (WRITE_PURGE, NULL);
+  op->size_limit = priv->size_limit;
+  cache_writer_push (priv->writer, op);
 }
 
 
 /**
- * shumate_file_cache_purge_on_idle:
+ * shumate_file_cache_purge:
  * @file_cache: a #ShumateFileCache
  *
  * Purge the cache from the less popular tiles until cache's size limit is reached.
- * This is a non blocking call as the purge will happen when the application is idle
+ * The purge happens in the background after the changes queued so far, this
+ * call doesn't wait for it. Use shumate_file_cache_purge_async() to know when
+ * it is done.
  */
 void
-shumate_file_cache_purge_on_idle (ShumateFileCache *file_cache)
+shumate_file_cache_purge (ShumateFileCache *file_cache)
 {
-  g_return_if_fail (SHUMATE_IS_FILE_CACHE (file_cache));
-  g_idle_add_full (G_PRIORITY_HIGH + 50,
-      (GSourceFunc) purge_on_idle,
-      g_object_ref (file_cache),
-      (GDestroyNotify) g_object_unref);
+  shumate_file_cache_purge_on_idle (file_cache);
 }
 
 
 /**
- * shumate_file_cache_purge:
+ * shumate_file_cache_purge_async:
  * @file_cache: a #ShumateFileCache
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the purge is done
+ * @user_data: data to pass to @callback
  *
- * Purge the cache from the less popular tiles until cache's size limit is reached.
+ * Purge the cache from the less popular tiles until cache's size limit is
+ * reached, in the background after the changes queued so far. A purge
+ * cancelled before it starts is skipped. Once it has started it isn't
+ * interrupted, and cancelling @cancellable only makes it report
+ * %G_IO_ERROR_CANCELLED.
  */
 void
-shumate_file_cache_purge (ShumateFileCache *file_cache)
+shumate_file_cache_purge_async (ShumateFileCache    *file_cache,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
 {
   ShumateFileCachePrivate *priv = shumate_file_cache_get_instance_private (file_cache);
+  g_autoptr(GTask) task = NULL;
+  WriteOp *op;
 
   g_return_if_fail (SHUMATE_IS_FILE_CACHE (file_cache));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
 
-  char *query;
-  sqlite3_stmt *stmt;
-  int rc = 0;
-  guint current_size = 0;
-  guint highest_popularity = 0;
-  char *error;
-
-  query = "SELECT SUM (size) FROM tiles";
-  rc = sqlite3_prepare (priv->db, query, strlen (query), &stmt, NULL);
-  if (rc != SQLITE_OK)
-    {
-      DEBUG ("Can't compute cache size %s", sqlite3_errmsg (priv->db));
-    }
-
-  rc = sqlite3_step (stmt);
-  if (rc != SQLITE_ROW)
-    {
-      DEBUG ("Failed to count the total cache consumption %s",
-          sqlite3_errmsg (priv->db));
-      sqlite3_finalize (stmt);
-      return;
-    }
+  task = g_task_new (file_cache, cancellable, callback, user_data);
+  g_task_set_source_tag (task, shumate_file_cache_purge_async);
 
-  current_size = sqlite3_column_int (stmt, 0);
-  if (current_size < priv->size_limit)
+  if (!priv->writer)
     {
-      DEBUG ("Cache doesn't need to be purged at %d bytes", current_size);
-      sqlite3_finalize (stmt);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
+                               "The cache database couldn't be opened");
       return;
     }
 
-  sqlite3_finalize (stmt);
-
-  /* Ok, delete the less popular tiles until size_limit reached */
-  query = "SELECT filename, size, popularity FROM tiles ORDER BY popularity";
-  rc = sqlite3_prepare (priv->db, query, strlen (query), &stmt, NULL);
-  if (rc != SQLITE_OK)
-    {
-      DEBUG ("Can't fetch tiles to delete: %s", sqlite3_errmsg (priv->db));
-    }
-
-  rc = sqlite3_step (stmt);
-  while (rc == SQLITE_ROW && current_size > priv->size_limit)
-    {
-      const char *filename;
-      guint size;
-
-      filename = (const char *) sqlite3_column_text (stmt, 0);
-      size = sqlite3_column_int (stmt, 1);
-      highest_popularity = sqlite3_column_int (stmt, 2);
-      DEBUG ("Deleting %s of size %d", filename, size);
-
-      delete_tile (file_cache, filename);
-
-      current_size -= size;
-
-      rc = sqlite3_step (stmt);
-    }
-  DEBUG ("Cache size is now %d", current_size);
+  op = write_op_new (WRITE_PURGE, NULL);
+  op->size_limit = priv->size_limit;
+  op->task = g_steal_pointer (&task);
+  cache_writer_push (priv->writer, op);
+}
 
-  sqlite3_finalize (stmt);
 
-  query = sqlite3_mprintf ("UPDATE tiles SET popularity = popularity - %d",
-        highest_popularity);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
-    {
-      DEBUG ("Updating popularity failed: %s", error);
-      sqlite3_free (error);
-    }
-  sqlite3_free (query);
+/**
+ * shumate_file_cache_purge_finish:
+ * @file_cache: a #ShumateFileCache
+ * @result: a #GAsyncResult provided to callback
+ * @error: a location for a #GError, or %NULL
+ *
+ * Gets the result of a purge started with shumate_file_cache_purge_async().
+ *
+ * Returns: %TRUE if the cache was purged, %FALSE if an error occurred
+ */
+gboolean
+shumate_file_cache_purge_finish (ShumateFileCache  *file_cache,
+                                 GAsyncResult      *result,
+                                 GError           **error)
+{
+  g_return_val_if_fail (SHUMATE_IS_FILE_CACHE (file_cache), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, file_cache), FALSE);
 
-  sqlite3_exec (priv->db, "PRAGMA incremental_vacuum;", NULL, NULL, &error);
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
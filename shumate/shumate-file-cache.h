@@ -30,6 +30,19 @@
 
 G_BEGIN_DECLS
 
+/**
+ * ShumateFileCacheStorage:
+ * @SHUMATE_FILE_CACHE_STORAGE_FILES: every tile is stored in its own file
+ * @SHUMATE_FILE_CACHE_STORAGE_DATABASE: tiles are stored in the cache database
+ *
+ * Where a #ShumateFileCache keeps the tile data.
+ */
+typedef enum
+{
+  SHUMATE_FILE_CACHE_STORAGE_FILES,
+  SHUMATE_FILE_CACHE_STORAGE_DATABASE
+} ShumateFileCacheStorage;
+
 #define SHUMATE_TYPE_FILE_CACHE shumate_file_cache_get_type ()
 G_DECLARE_DERIVABLE_TYPE (ShumateFileCache, shumate_file_cache, SHUMATE, FILE_CACHE, ShumateTileCache)
 
@@ -45,17 +58,25 @@ struct _ShumateFileCacheClass
   ShumateTileCacheClass parent_class;
 };
 
-ShumateFileCache *shumate_file_cache_new_full (guint size_limit,
+ShumateFileCache *shumate_file_cache_new_full (guint64 size_limit,
     const char *cache_dir);
 
-guint shumate_file_cache_get_size_limit (ShumateFileCache *file_cache);
+guint64 shumate_file_cache_get_size_limit (ShumateFileCache *file_cache);
 void shumate_file_cache_set_size_limit (ShumateFileCache *file_cache,
-    guint size_limit);
+    guint64 size_limit);
 
 const char *shumate_file_cache_get_cache_dir (ShumateFileCache *file_cache);
+ShumateFileCacheStorage shumate_file_cache_get_storage (ShumateFileCache *file_cache);
 
 void shumate_file_cache_purge (ShumateFileCache *file_cache);
 void shumate_file_cache_purge_on_idle (ShumateFileCache *file_cache);
+void shumate_file_cache_purge_async (ShumateFileCache    *file_cache,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data);
+gboolean shumate_file_cache_purge_finish (ShumateFileCache  *file_cache,
+                                          GAsyncResult      *result,
+                                          GError           **error);
 
 G_END_DECLS
 
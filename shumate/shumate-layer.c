@@ -23,9 +23,16 @@
  *
  * Every layer (overlay that moves together with the map) has to inherit this
  * class and implement its virtual methods.
+ *
+ * Changes of the viewport are not handled one property notification at a
+ * time: they are accumulated and delivered once per frame through the
+ * #ShumateLayer::viewport-changed signal, so a layer does its layout work at
+ * most once per frame however many viewport setters were called.
  */
 
 #include "shumate-layer.h"
+#include "shumate-enum-types.h"
+#include "shumate-viewport-private.h"
 
 enum
 {
@@ -35,8 +42,17 @@ enum
 
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
 
+enum
+{
+  VIEWPORT_CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0, };
+
 typedef struct {
   ShumateViewport *viewport;
+  ShumateViewportWatch *viewport_watch;
 } ShumateLayerPrivate;
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE (ShumateLayer, shumate_layer, GTK_TYPE_WIDGET)
@@ -83,11 +99,19 @@ shumate_layer_get_property (GObject    *object,
     }
 }
 
+static void
+on_viewport_changed (GtkWidget             *widget,
+                     ShumateViewportChange  changes)
+{
+  g_signal_emit (widget, signals[VIEWPORT_CHANGED], 0, changes);
+}
+
 static void
 shumate_layer_dispose (GObject *object)
 {
   ShumateLayerPrivate *priv = shumate_layer_get_instance_private (SHUMATE_LAYER (object));
 
+  g_clear_pointer (&priv->viewport_watch, shumate_viewport_unwatch);
   g_clear_object (&priv->viewport);
 
   G_OBJECT_CLASS (shumate_layer_parent_class)->dispose (object);
@@ -101,6 +125,8 @@ shumate_layer_constructed (GObject *object)
   if (!priv->viewport)
     priv->viewport = shumate_viewport_new ();
 
+  priv->viewport_watch = shumate_viewport_watch (priv->viewport, GTK_WIDGET (object), on_viewport_changed);
+
   G_OBJECT_CLASS (shumate_layer_parent_class)->constructed (object);
 }
 
@@ -126,6 +152,25 @@ shumate_layer_class_init (ShumateLayerClass *klass)
                                      N_PROPERTIES,
                                      obj_properties);
 
+  /**
+   * ShumateLayer::viewport-changed:
+   * @self: the #ShumateLayer
+   * @changes: the #ShumateViewportChange flags of what changed
+   *
+   * Emitted during the update phase of the frame clock when the viewport
+   * changed since the previous frame. All the property changes made in
+   * between are merged into a single emission.
+   */
+  signals[VIEWPORT_CHANGED] =
+    g_signal_new ("viewport-changed",
+                  G_OBJECT_CLASS_TYPE (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (ShumateLayerClass, viewport_changed),
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__FLAGS,
+                  G_TYPE_NONE,
+                  1, SHUMATE_TYPE_VIEWPORT_CHANGE);
+
   gtk_widget_class_set_css_name (widget_class, g_intern_static_string ("map-layer"));
 }
 
@@ -39,9 +39,20 @@ G_DECLARE_DERIVABLE_TYPE (ShumateLayer, shumate_layer, SHUMATE, LAYER, GtkWidget
  * and should be accessed using the provided API
  */
 
+/**
+ * ShumateLayerClass:
+ * @viewport_changed: class handler of the #ShumateLayer::viewport-changed
+ *   signal, where the layer updates its contents for the new viewport
+ */
 struct _ShumateLayerClass
 {
   GtkWidgetClass parent_class;
+
+  void (*viewport_changed) (ShumateLayer          *self,
+                            ShumateViewportChange  changes);
+
+  /*< private >*/
+  gpointer padding[15];
 };
 
 ShumateViewport *shumate_layer_get_viewport (ShumateLayer *self);
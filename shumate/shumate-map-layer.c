@@ -18,197 +18,559 @@
  */
 
 #include "shumate-map-layer.h"
+#include "shumate-texture-cache.h"
+#include "shumate-tile-private.h"
 #include "shumate-view.h"
 
+#include <math.h>
+
+/* A cell of the tile grid. The tile is what the map source fills; it is
+ * never added as a child widget, the layer draws it itself. */
+typedef struct
+{
+  ShumateTile *tile;
+  GCancellable *cancellable; /* Set while the tile is being filled */
+} GridTile;
+
 struct _ShumateMapLayer
 {
   ShumateLayer parent_instance;
 
   ShumateMapSource *map_source;
 
-  GPtrArray *tiles_positions;
+  /* Dense grid of required_tiles_x × required_tiles_y tiles used as a 2D ring
+   * buffer: the tile shown in grid cell (x, y) lives at
+   * tiles[((origin_y + y) % required_tiles_y) * required_tiles_x + (origin_x + x) % required_tiles_x].
+   * Panning by whole tiles only moves the origin.
+   *
+   * The cells are plain records: the layer draws the whole grid in its own
+   * snapshot, and no tile goes through measure or allocation.
+   */
+  GridTile *tiles;
   guint required_tiles_x;
   guint required_tiles_y;
-  GHashTable *tile_fill;
+  guint origin_x;
+  guint origin_y;
+
+  /* Where the top left grid cell is drawn, and the scale of the grid */
+  double grid_offset_x;
+  double grid_offset_y;
+  double grid_scale;
+
+  /* Map coordinates of the top left grid cell at the last layout */
+  int tile_initial_x;
+  int tile_initial_y;
+  guint tile_initial_zoom_level;
+
+  /* Tiles loaded ahead of time around the grid and on the neighbouring zoom
+   * levels, keyed by their packed coordinates. They are not children of the
+   * layer; a grid cell that needs one of them takes its texture over. */
+  GHashTable *prefetched_tiles;
+  guint prefetch_generation;
+  gboolean prefetch_dirty;
+  guint prefetch_distance;
+  gboolean prefetch_zoom_levels;
+  guint64 prefetch_requests;
+  guint64 prefetch_hits;
+
+  GMemoryMonitor *memory_monitor;
 };
 
+typedef struct
+{
+  guint64 key;
+  guint generation;
+  ShumateTile *tile;
+  GCancellable *cancellable;
+} PrefetchedTile;
+
 G_DEFINE_TYPE (ShumateMapLayer, shumate_map_layer, SHUMATE_TYPE_LAYER)
 
 enum
 {
   PROP_MAP_SOURCE = 1,
+  PROP_PREFETCH_DISTANCE,
+  PROP_PREFETCH_ZOOM_LEVELS,
+  PROP_PREFETCH_REQUESTS,
+  PROP_PREFETCH_HITS,
   N_PROPERTIES
 };
 
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
 
-typedef struct
+/* How many zoom levels up an ancestor tile is looked for as placeholder */
+#define MAX_PLACEHOLDER_ZOOM_DELTA 3
+
+static inline guint
+positive_mod (int i,
+              int n)
+{
+  return (i % n + n) % n;
+}
+
+static inline GridTile *
+shumate_map_layer_get_grid_tile (ShumateMapLayer *self,
+                                 guint            left_attach,
+                                 guint            top_attach)
+{
+  guint column = (self->origin_x + left_attach) % self->required_tiles_x;
+  guint row = (self->origin_y + top_attach) % self->required_tiles_y;
+
+  return &self->tiles[row * self->required_tiles_x + column];
+}
+
+static inline guint64
+prefetch_key (guint zoom_level,
+              guint x,
+              guint y)
 {
+  return ((guint64) zoom_level << 58) | ((guint64) x << 29) | y;
+}
+
+static void
+prefetched_tile_free (PrefetchedTile *prefetched)
+{
+  if (shumate_tile_get_state (prefetched->tile) != SHUMATE_STATE_DONE)
+    g_cancellable_cancel (prefetched->cancellable);
+
+  g_clear_object (&prefetched->cancellable);
+  g_clear_object (&prefetched->tile);
+  g_slice_free (PrefetchedTile, prefetched);
+}
+
+static void shumate_map_layer_add_placeholders (ShumateMapLayer *self,
+                                                ShumateTile     *tile);
+static void shumate_map_layer_clear_grid_tile (ShumateMapLayer *self,
+                                               GridTile        *grid_tile);
+
+/*
+ * Puts the matching prefetched tile in a grid cell, in place of the tile
+ * that was there, whether it has been loaded already or is still loading.
+ * Returns whether the cell doesn't need to be filled.
+ */
+static gboolean
+shumate_map_layer_adopt_prefetched_tile (ShumateMapLayer *self,
+                                         guint            left_attach,
+                                         guint            top_attach)
+{
+  GridTile *grid_tile = shumate_map_layer_get_grid_tile (self, left_attach, top_attach);
+  ShumateTile *child = grid_tile->tile;
+  PrefetchedTile *prefetched;
   ShumateTile *tile;
-  guint left_attach;
-  guint top_attach;
-} TileGridPosition;
-
-static TileGridPosition *
-tile_grid_position_new (ShumateTile *tile,
-                        guint        left_attach,
-                        guint        top_attach)
-{
-  TileGridPosition *self = g_new0 (TileGridPosition, 1);
-  self->tile = g_object_ref (tile);
-  self->left_attach = left_attach;
-  self->top_attach = top_attach;
-  return self;
+  guint64 key;
+
+  key = prefetch_key (shumate_tile_get_zoom_level (child),
+                      shumate_tile_get_x (child),
+                      shumate_tile_get_y (child));
+  prefetched = g_hash_table_lookup (self->prefetched_tiles, &key);
+  if (!prefetched)
+    return FALSE;
+
+  /* A failed prefetch is retried by the grid */
+  if (shumate_tile_get_state (prefetched->tile) == SHUMATE_STATE_DONE &&
+      !shumate_tile_get_texture (prefetched->tile))
+    return FALSE;
+
+  g_hash_table_steal (self->prefetched_tiles, &key);
+
+  tile = g_steal_pointer (&prefetched->tile);
+  shumate_tile_set_priority (tile, shumate_tile_get_priority (child));
+  g_signal_connect_swapped (tile, "notify::texture", G_CALLBACK (gtk_widget_queue_draw), self);
+
+  shumate_map_layer_clear_grid_tile (self, grid_tile);
+  grid_tile->tile = tile;
+
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
+    {
+      shumate_tile_set_fade_in (tile, FALSE);
+      g_clear_object (&prefetched->cancellable);
+    }
+  else
+    {
+      /* Still loading: the grid keeps the fill going instead of starting
+       * another one */
+      shumate_map_layer_add_placeholders (self, tile);
+      grid_tile->cancellable = g_steal_pointer (&prefetched->cancellable);
+    }
+
+  g_slice_free (PrefetchedTile, prefetched);
+
+  self->prefetch_hits++;
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_PREFETCH_HITS]);
+
+  return TRUE;
+}
+
+static void
+shumate_map_layer_prefetch_tile (ShumateMapLayer *self,
+                                 guint            zoom_level,
+                                 int              x,
+                                 int              y)
+{
+  PrefetchedTile *prefetched;
+  guint source_rows, source_columns;
+  guint tile_size;
+  guint64 key;
+
+  source_rows = shumate_map_source_get_row_count (self->map_source, zoom_level);
+  source_columns = shumate_map_source_get_column_count (self->map_source, zoom_level);
+  if (y < 0 || y >= (int) source_rows)
+    return;
+
+  x = positive_mod (x, source_columns);
+  key = prefetch_key (zoom_level, x, y);
+
+  prefetched = g_hash_table_lookup (self->prefetched_tiles, &key);
+  if (prefetched)
+    {
+      prefetched->generation = self->prefetch_generation;
+      return;
+    }
+
+  tile_size = shumate_map_source_get_tile_size (self->map_source);
+
+  prefetched = g_slice_new0 (PrefetchedTile);
+  prefetched->key = key;
+  prefetched->generation = self->prefetch_generation;
+  prefetched->tile = g_object_ref_sink (shumate_tile_new_full (x, y, tile_size, zoom_level));
+  prefetched->cancellable = g_cancellable_new ();
+  shumate_tile_set_priority (prefetched->tile, SHUMATE_TILE_PRIORITY_PREFETCH);
+  shumate_tile_set_owner (prefetched->tile, shumate_layer_get_viewport (SHUMATE_LAYER (self)));
+  g_hash_table_insert (self->prefetched_tiles, &prefetched->key, prefetched);
+
+  self->prefetch_requests++;
+  shumate_map_source_fill_tile (self->map_source, prefetched->tile, prefetched->cancellable);
+}
+
+/* Prefetches the tiles a viewport centered on the given point would show */
+static void
+shumate_map_layer_prefetch_area (ShumateMapLayer *self,
+                                 guint            zoom_level,
+                                 double           center_x,
+                                 double           center_y)
+{
+  guint tile_size = shumate_map_source_get_tile_size (self->map_source);
+  int width = gtk_widget_get_width (GTK_WIDGET (self));
+  int height = gtk_widget_get_height (GTK_WIDGET (self));
+  int tile_initial_x, tile_initial_y;
+
+  tile_initial_x = (int) floor ((center_x - width/2) / tile_size);
+  tile_initial_y = (int) floor ((center_y - height/2) / tile_size);
+
+  for (int x = tile_initial_x; x < tile_initial_x + (int) self->required_tiles_x; x++)
+    for (int y = tile_initial_y; y < tile_initial_y + (int) self->required_tiles_y; y++)
+      shumate_map_layer_prefetch_tile (self, zoom_level, x, y);
+}
+
+/*
+ * Requests the ring of tiles around the grid and the tiles of the parent and
+ * child zoom levels at a low priority, and cancels the prefetches that are
+ * not around the viewport anymore.
+ */
+static void
+shumate_map_layer_update_prefetch (ShumateMapLayer *self,
+                                   guint            zoom_level,
+                                   double           center_x,
+                                   double           center_y)
+{
+  GHashTableIter iter;
+  PrefetchedTile *prefetched;
+  guint64 prefetch_requests = self->prefetch_requests;
+  int distance = self->prefetch_distance;
+
+  self->prefetch_dirty = FALSE;
+  self->prefetch_generation++;
+
+  for (int x = self->tile_initial_x - distance; x < self->tile_initial_x + (int) self->required_tiles_x + distance; x++)
+    {
+      for (int y = self->tile_initial_y - distance; y < self->tile_initial_y + (int) self->required_tiles_y + distance; y++)
+        {
+          /* Skip the grid itself */
+          if (x >= self->tile_initial_x && x < self->tile_initial_x + (int) self->required_tiles_x &&
+              y >= self->tile_initial_y && y < self->tile_initial_y + (int) self->required_tiles_y)
+            continue;
+
+          shumate_map_layer_prefetch_tile (self, zoom_level, x, y);
+        }
+    }
+
+  if (self->prefetch_zoom_levels)
+    {
+      if (zoom_level > shumate_map_source_get_min_zoom_level (self->map_source))
+        shumate_map_layer_prefetch_area (self, zoom_level - 1, center_x / 2, center_y / 2);
+      if (zoom_level < shumate_map_source_get_max_zoom_level (self->map_source))
+        shumate_map_layer_prefetch_area (self, zoom_level + 1, center_x * 2, center_y * 2);
+    }
+
+  g_hash_table_iter_init (&iter, self->prefetched_tiles);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &prefetched))
+    {
+      if (prefetched->generation != self->prefetch_generation)
+        g_hash_table_iter_remove (&iter);
+    }
+
+  if (prefetch_requests != self->prefetch_requests)
+    g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_PREFETCH_REQUESTS]);
 }
 
+/*
+ * Covers a tile being loaded with the textures of the same area at other
+ * zoom levels, if they are in the texture cache: its four children scaled
+ * down, drawn over the closest ancestor scaled up when some of them are
+ * missing. Nothing is decoded or requested for this.
+ */
 static void
-tile_grid_position_free (TileGridPosition *self)
+shumate_map_layer_add_placeholders (ShumateMapLayer *self,
+                                    ShumateTile     *tile)
 {
-  if (!self)
+  ShumateTextureCache *texture_cache = shumate_texture_cache_get_default ();
+  const char *source_id = shumate_map_source_get_id (self->map_source);
+  guint zoom_level = shumate_tile_get_zoom_level (tile);
+  guint x = shumate_tile_get_x (tile);
+  guint y = shumate_tile_get_y (tile);
+  double size = shumate_tile_get_size (tile);
+  GdkTexture *children[4] = { NULL, };
+  guint n_children = 0;
+
+  if (!source_id)
     return;
 
-  g_clear_object (&self->tile);
-  self->left_attach = 0;
-  self->top_attach = 0;
-  g_free (self);
+  if (zoom_level < shumate_map_source_get_max_zoom_level (self->map_source))
+    {
+      for (guint i = 0; i < 4; i++)
+        {
+          children[i] = shumate_texture_cache_lookup (texture_cache, source_id,
+                                                      x * 2 + i % 2,
+                                                      y * 2 + i / 2,
+                                                      zoom_level + 1);
+          if (children[i])
+            n_children++;
+        }
+    }
+
+  if (n_children < 4)
+    {
+      guint min_zoom_level = shumate_map_source_get_min_zoom_level (self->map_source);
+
+      for (guint delta = 1; delta <= MAX_PLACEHOLDER_ZOOM_DELTA && zoom_level >= min_zoom_level + delta; delta++)
+        {
+          guint scale = 1 << delta;
+          GdkTexture *ancestor;
+
+          ancestor = shumate_texture_cache_lookup (texture_cache, source_id,
+                                                   x >> delta,
+                                                   y >> delta,
+                                                   zoom_level - delta);
+          if (ancestor)
+            {
+              shumate_tile_add_placeholder (tile, ancestor,
+                                            &GRAPHENE_RECT_INIT (-(double) (x % scale) * size,
+                                                                 -(double) (y % scale) * size,
+                                                                 size * scale,
+                                                                 size * scale));
+              break;
+            }
+        }
+    }
+
+  for (guint i = 0; i < 4; i++)
+    {
+      if (children[i])
+        shumate_tile_add_placeholder (tile, children[i],
+                                      &GRAPHENE_RECT_INIT ((i % 2) * size / 2,
+                                                           (i / 2) * size / 2,
+                                                           size / 2,
+                                                           size / 2));
+    }
 }
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (TileGridPosition, tile_grid_position_free);
+/* Stops filling the tile of a grid cell and drops it */
+static void
+shumate_map_layer_clear_grid_tile (ShumateMapLayer *self,
+                                   GridTile        *grid_tile)
+{
+  if (grid_tile->cancellable)
+    {
+      g_cancellable_cancel (grid_tile->cancellable);
+      g_clear_object (&grid_tile->cancellable);
+    }
+
+  if (grid_tile->tile)
+    {
+      g_signal_handlers_disconnect_by_data (grid_tile->tile, self);
+      g_clear_object (&grid_tile->tile);
+    }
+}
 
-static TileGridPosition *
-shumate_map_layer_get_tile_child (ShumateMapLayer *self,
-                                  guint            left_attach,
-                                  guint            top_attach)
+/*
+ * Shifts the ring buffer origin so that the grid starts at the given map
+ * coordinates. Tiles that stay on screen keep their contents, the ones that
+ * wrapped around are refilled by shumate_map_layer_compute_grid().
+ */
+static void
+shumate_map_layer_shift_grid (ShumateMapLayer *self,
+                              int              tile_initial_x,
+                              int              tile_initial_y,
+                              guint            zoom_level)
 {
-  for (guint index = 0; index < self->tiles_positions->len; index++)
+  if (self->tile_initial_zoom_level == zoom_level)
     {
-      TileGridPosition *tile_child = g_ptr_array_index (self->tiles_positions, index);
-      if (tile_child->left_attach == left_attach && tile_child->top_attach == top_attach)
-        return tile_child;
+      int delta_x = tile_initial_x - self->tile_initial_x;
+      int delta_y = tile_initial_y - self->tile_initial_y;
+
+      if (delta_x != 0)
+        self->origin_x = positive_mod ((int) self->origin_x + delta_x % (int) self->required_tiles_x,
+                                       self->required_tiles_x);
+      if (delta_y != 0)
+        self->origin_y = positive_mod ((int) self->origin_y + delta_y % (int) self->required_tiles_y,
+                                       self->required_tiles_y);
     }
 
-  return NULL;
+  self->tile_initial_x = tile_initial_x;
+  self->tile_initial_y = tile_initial_y;
+  self->tile_initial_zoom_level = zoom_level;
 }
 
+static void shumate_map_layer_resize_grid (ShumateMapLayer *self,
+                                           guint            required_tiles_x,
+                                           guint            required_tiles_y);
+
+/*
+ * Lays out the grid for the current viewport. A fractional zoom level shows
+ * the tiles of the integer level below it, scaled up by a transform, so new
+ * tiles are only requested once the integer level changes.
+ */
 static void
 shumate_map_layer_compute_grid (ShumateMapLayer *self)
 {
   guint tile_size;
-  guint zoom_level;
+  double zoom_level;
+  guint tile_zoom_level;
+  double scale;
   double center_latitude, center_longitude;
-  guint center_x, center_y;
-  int x_offset, y_offset;
-  guint tile_x, tile_y;
-  guint tile_initial_x, tile_initial_y;
+  double center_x, center_y;
+  int tile_x, tile_y;
+  int tile_initial_x, tile_initial_y;
+  guint required_tiles_x, required_tiles_y;
   guint source_rows, source_columns;
   int width, height;
-  GtkAllocation child_allocation;
   ShumateViewport *viewport;
 
   g_assert (SHUMATE_IS_MAP_LAYER (self));
 
+  width = gtk_widget_get_width (GTK_WIDGET (self));
+  height = gtk_widget_get_height (GTK_WIDGET (self));
+  if (self->map_source == NULL || width <= 0 || height <= 0)
+    return;
+
   viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
   tile_size = shumate_map_source_get_tile_size (self->map_source);
   zoom_level = shumate_viewport_get_zoom_level (viewport);
+  tile_zoom_level = CLAMP ((guint) floor (zoom_level),
+                           shumate_map_source_get_min_zoom_level (self->map_source),
+                           shumate_map_source_get_max_zoom_level (self->map_source));
+  scale = pow (2.0, zoom_level - tile_zoom_level);
+
   center_latitude = shumate_location_get_latitude (SHUMATE_LOCATION (viewport));
   center_longitude = shumate_location_get_longitude (SHUMATE_LOCATION (viewport));
-  center_x = (guint) shumate_map_source_get_x (self->map_source, zoom_level, center_longitude);
-  center_y = (guint) shumate_map_source_get_y (self->map_source, zoom_level, center_latitude);
-  source_rows = shumate_map_source_get_row_count (self->map_source, zoom_level);
-  source_columns = shumate_map_source_get_column_count (self->map_source, zoom_level);
-  width = gtk_widget_get_width (GTK_WIDGET (self));
-  height = gtk_widget_get_height (GTK_WIDGET (self));
+  center_x = shumate_map_source_get_x (self->map_source, tile_zoom_level, center_longitude);
+  center_y = shumate_map_source_get_y (self->map_source, tile_zoom_level, center_latitude);
+  source_rows = shumate_map_source_get_row_count (self->map_source, tile_zoom_level);
+  source_columns = shumate_map_source_get_column_count (self->map_source, tile_zoom_level);
+
+  /* Only grow the grid when zoomed out past the tile level, so that zooming
+   * in between two integer levels keeps the same tiles. */
+  required_tiles_x = (guint) ceil (width / (tile_size * MIN (scale, 1.0))) + 1;
+  required_tiles_y = (guint) ceil (height / (tile_size * MIN (scale, 1.0))) + 1;
+  if (self->required_tiles_x != required_tiles_x ||
+      self->required_tiles_y != required_tiles_y)
+    {
+      shumate_map_layer_resize_grid (self, required_tiles_x, required_tiles_y);
+      self->prefetch_dirty = TRUE;
+    }
 
   // This is the (x,y) of the top left ShumateTile
-  tile_initial_x = (center_x - width/2)/tile_size;
-  tile_initial_y = (center_y - height/2)/tile_size;
-
-  x_offset = (center_x - tile_initial_x * tile_size) - width/2;
-  y_offset = (center_y - tile_initial_y * tile_size) - height/2;
-  child_allocation.x = -x_offset;
-  child_allocation.width = tile_size;
-  child_allocation.height = tile_size;
+  tile_initial_x = (int) floor ((center_x - width / (2 * scale)) / tile_size);
+  tile_initial_y = (int) floor ((center_y - height / (2 * scale)) / tile_size);
+  if (tile_initial_x != self->tile_initial_x ||
+      tile_initial_y != self->tile_initial_y ||
+      tile_zoom_level != self->tile_initial_zoom_level)
+    self->prefetch_dirty = TRUE;
+  shumate_map_layer_shift_grid (self, tile_initial_x, tile_initial_y, tile_zoom_level);
+
+  self->grid_offset_x = (tile_initial_x * (double) tile_size - center_x) * scale + width / 2.0;
+  self->grid_offset_y = (tile_initial_y * (double) tile_size - center_y) * scale + height / 2.0;
+  self->grid_scale = scale;
 
   tile_x = tile_initial_x;
-  for (int x = 0; x < self->required_tiles_x; x++)
+  for (guint x = 0; x < self->required_tiles_x; x++)
     {
-      child_allocation.y = -y_offset;
+      guint source_x = positive_mod (tile_x, source_columns);
+
       tile_y = tile_initial_y;
-      for (int y = 0; y < self->required_tiles_y; y++)
+      for (guint y = 0; y < self->required_tiles_y; y++)
         {
-          TileGridPosition *tile_child;
-          ShumateTile *child;
-
-          tile_child = shumate_map_layer_get_tile_child (self, x, y);
-          if (!tile_child)
+          GridTile *grid_tile = shumate_map_layer_get_grid_tile (self, x, y);
+          ShumateTile *child = grid_tile->tile;
+          guint source_y = positive_mod (tile_y, source_rows);
+          double distance_x = tile_x + 0.5 - center_x / tile_size;
+          double distance_y = tile_y + 0.5 - center_y / tile_size;
+
+          /* Load the tiles at the center of the view first. This is updated
+           * on every layout so pending downloads follow the view. */
+          shumate_tile_set_priority (child,
+                                     SHUMATE_TILE_PRIORITY_VISIBLE +
+                                     (int) MIN (distance_x * distance_x + distance_y * distance_y,
+                                                SHUMATE_TILE_PRIORITY_PREFETCH - 1));
+
+          if (shumate_tile_get_zoom_level (child) != tile_zoom_level ||
+              shumate_tile_get_x (child) != source_x ||
+              shumate_tile_get_y (child) != source_y ||
+              shumate_tile_get_state (child) == SHUMATE_STATE_NONE)
             {
-              g_critical ("Unable to find tile at (%u;%u)", x, y);
-            }
-          else
-            {
-              child = tile_child->tile;
-              gtk_widget_measure (GTK_WIDGET (child), GTK_ORIENTATION_HORIZONTAL, 0, NULL, NULL, NULL, NULL);
-              gtk_widget_size_allocate (GTK_WIDGET (child), &child_allocation, -1);
-              if (shumate_tile_get_zoom_level (child) != zoom_level ||
-                  shumate_tile_get_x (child) != x ||
-                  shumate_tile_get_y (child) != y ||
-                  shumate_tile_get_state (child) == SHUMATE_STATE_NONE)
+              if (grid_tile->cancellable)
+                {
+                  g_cancellable_cancel (grid_tile->cancellable);
+                  g_clear_object (&grid_tile->cancellable);
+                }
+
+              shumate_tile_set_zoom_level (child, tile_zoom_level);
+              shumate_tile_set_x (child, source_x);
+              shumate_tile_set_y (child, source_y);
+
+              shumate_tile_set_texture (child, NULL);
+              shumate_tile_clear_placeholders (child);
+              if (!shumate_map_layer_adopt_prefetched_tile (self, x, y))
                 {
-                  GCancellable *cancellable = g_hash_table_lookup (self->tile_fill, child);
-                  if (cancellable)
-                    g_cancellable_cancel (cancellable);
-
-                  shumate_tile_set_zoom_level (child, zoom_level);
-                  shumate_tile_set_x (child, tile_x % source_columns);
-                  shumate_tile_set_y (child, tile_y % source_rows);
-
-                  cancellable = g_cancellable_new ();
-                  shumate_tile_set_texture (child, NULL);
-                  shumate_map_source_fill_tile (self->map_source, child, cancellable);
-                  g_hash_table_insert (self->tile_fill, g_object_ref (child), cancellable);
+                  shumate_map_layer_add_placeholders (self, child);
+
+                  grid_tile->cancellable = g_cancellable_new ();
+                  shumate_map_source_fill_tile (self->map_source, child, grid_tile->cancellable);
                 }
             }
 
-          child_allocation.y += tile_size;
           tile_y++;
         }
 
-      child_allocation.x += tile_size;
       tile_x++;
     }
-}
 
-static void
-on_view_longitude_changed (ShumateMapLayer *self,
-                           GParamSpec      *pspec,
-                           ShumateViewport *view)
-{
-  g_assert (SHUMATE_IS_MAP_LAYER (self));
+  if (self->prefetch_dirty)
+    shumate_map_layer_update_prefetch (self, tile_zoom_level, center_x, center_y);
 
-  shumate_map_layer_compute_grid (self);
   gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
 static void
-on_view_latitude_changed (ShumateMapLayer *self,
-                          GParamSpec      *pspec,
-                          ShumateViewport *view)
+shumate_map_layer_viewport_changed (ShumateLayer          *layer,
+                                    ShumateViewportChange  changes)
 {
-  g_assert (SHUMATE_IS_MAP_LAYER (self));
+  ShumateMapLayer *self = SHUMATE_MAP_LAYER (layer);
 
-  shumate_map_layer_compute_grid (self);
-  gtk_widget_queue_draw (GTK_WIDGET (self));
-}
-
-static void
-on_view_zoom_level_changed (ShumateMapLayer *self,
-                            GParamSpec      *pspec,
-                            ShumateViewport *view)
-{
-  g_assert (SHUMATE_IS_MAP_LAYER (self));
+  if (!(changes & (SHUMATE_VIEWPORT_CHANGE_LOCATION | SHUMATE_VIEWPORT_CHANGE_ZOOM_LEVEL)))
+    return;
 
   shumate_map_layer_compute_grid (self);
-  gtk_widget_queue_draw (GTK_WIDGET (self));
 }
 
 static void
@@ -225,6 +587,14 @@ shumate_map_layer_set_property (GObject      *object,
       g_set_object (&self->map_source, g_value_get_object (value));
       break;
 
+    case PROP_PREFETCH_DISTANCE:
+      shumate_map_layer_set_prefetch_distance (self, g_value_get_uint (value));
+      break;
+
+    case PROP_PREFETCH_ZOOM_LEVELS:
+      shumate_map_layer_set_prefetch_zoom_levels (self, g_value_get_boolean (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -245,43 +615,137 @@ shumate_map_layer_get_property (GObject    *object,
       g_value_set_object (value, self->map_source);
       break;
 
+    case PROP_PREFETCH_DISTANCE:
+      g_value_set_uint (value, self->prefetch_distance);
+      break;
+
+    case PROP_PREFETCH_ZOOM_LEVELS:
+      g_value_set_boolean (value, self->prefetch_zoom_levels);
+      break;
+
+    case PROP_PREFETCH_REQUESTS:
+      g_value_set_uint64 (value, self->prefetch_requests);
+      break;
+
+    case PROP_PREFETCH_HITS:
+      g_value_set_uint64 (value, self->prefetch_hits);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
     }
 }
 
+/*
+ * Drops what the layer holds for tiles that aren't drawn, more of it as the
+ * warning gets more severe:
+ * - low: the textures of the prefetched tiles, which are off screen;
+ * - medium and critical: also the prefetches still loading, so that no more
+ *   tile data is downloaded, cached and decoded for them.
+ * The prefetches are requested again on the next pan. The tiles on screen
+ * keep their textures and placeholders: dropping them would blank the map
+ * where the user is looking, and the texture cache shares most of them
+ * anyway. The texture cache and the memory cache release what they hold
+ * themselves.
+ */
+static void
+on_low_memory_warning (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       ShumateMapLayer            *self)
+{
+  GHashTableIter iter;
+  PrefetchedTile *prefetched;
+
+  g_hash_table_iter_init (&iter, self->prefetched_tiles);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &prefetched))
+    {
+      if (shumate_tile_get_state (prefetched->tile) != SHUMATE_STATE_DONE &&
+          level < G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+        continue;
+
+      /* Whoever else still holds the tile doesn't keep its texture alive */
+      shumate_tile_release_texture (prefetched->tile);
+      g_hash_table_iter_remove (&iter);
+    }
+}
+
 static void
 shumate_map_layer_dispose (GObject *object)
 {
   ShumateMapLayer *self = SHUMATE_MAP_LAYER (object);
   ShumateViewport *viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
-  GtkWidget *child;
 
   g_signal_handlers_disconnect_by_data (viewport, self);
-  while ((child = gtk_widget_get_first_child (GTK_WIDGET (object))))
-    gtk_widget_unparent (child);
 
-  g_clear_pointer (&self->tile_fill, g_hash_table_unref);
-  g_clear_pointer (&self->tiles_positions, g_ptr_array_unref);
+  if (self->tiles)
+    {
+      for (guint i = 0; i < self->required_tiles_x * self->required_tiles_y; i++)
+        shumate_map_layer_clear_grid_tile (self, &self->tiles[i]);
+      g_clear_pointer (&self->tiles, g_free);
+      self->required_tiles_x = 0;
+      self->required_tiles_y = 0;
+    }
+
+  if (self->memory_monitor)
+    g_signal_handlers_disconnect_by_data (self->memory_monitor, self);
+
+  g_clear_pointer (&self->prefetched_tiles, g_hash_table_unref);
+  g_clear_object (&self->memory_monitor);
   g_clear_object (&self->map_source);
 
   G_OBJECT_CLASS (shumate_map_layer_parent_class)->dispose (object);
 }
 
+/*
+ * Rebuilds the ring buffer for a new grid size. Tiles are kept at the same
+ * grid cell so their contents survive the resize, extra ones are dropped
+ * and missing ones created.
+ */
 static void
-shumate_map_layer_constructed (GObject *object)
+shumate_map_layer_resize_grid (ShumateMapLayer *self,
+                               guint            required_tiles_x,
+                               guint            required_tiles_y)
 {
-  ShumateMapLayer *self = SHUMATE_MAP_LAYER (object);
-  ShumateViewport *viewport;
+  GridTile *tiles;
+  guint tile_size;
 
-  G_OBJECT_CLASS (shumate_map_layer_parent_class)->constructed (object);
+  tile_size = shumate_map_source_get_tile_size (self->map_source);
+  tiles = g_new0 (GridTile, required_tiles_x * required_tiles_y);
 
-  viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
-  g_signal_connect_swapped (viewport, "notify::longitude", G_CALLBACK (on_view_longitude_changed), self);
-  g_signal_connect_swapped (viewport, "notify::latitude", G_CALLBACK (on_view_latitude_changed), self);
-  g_signal_connect_swapped (viewport, "notify::zoom-level", G_CALLBACK (on_view_zoom_level_changed), self);
+  for (guint y = 0; y < MAX (required_tiles_y, self->required_tiles_y); y++)
+    {
+      for (guint x = 0; x < MAX (required_tiles_x, self->required_tiles_x); x++)
+        {
+          gboolean in_old = x < self->required_tiles_x && y < self->required_tiles_y;
+          gboolean in_new = x < required_tiles_x && y < required_tiles_y;
+
+          if (in_old && in_new)
+            {
+              tiles[y * required_tiles_x + x] = *shumate_map_layer_get_grid_tile (self, x, y);
+            }
+          else if (in_old)
+            {
+              shumate_map_layer_clear_grid_tile (self, shumate_map_layer_get_grid_tile (self, x, y));
+            }
+          else if (in_new)
+            {
+              ShumateTile *tile = g_object_ref_sink (shumate_tile_new ());
+
+              shumate_tile_set_size (tile, tile_size);
+              shumate_tile_set_owner (tile, shumate_layer_get_viewport (SHUMATE_LAYER (self)));
+              g_signal_connect_swapped (tile, "notify::texture", G_CALLBACK (gtk_widget_queue_draw), self);
+              tiles[y * required_tiles_x + x].tile = tile;
+            }
+        }
+    }
 
+  g_free (self->tiles);
+  self->tiles = tiles;
+  self->required_tiles_x = required_tiles_x;
+  self->required_tiles_y = required_tiles_y;
+  self->origin_x = 0;
+  self->origin_y = 0;
 }
 
 static void
@@ -291,95 +755,38 @@ shumate_map_layer_size_allocate (GtkWidget *widget,
                                  int        baseline)
 {
   ShumateMapLayer *self = SHUMATE_MAP_LAYER (widget);
+
+  shumate_map_layer_compute_grid (self);
+}
+
+/*
+ * Draws the whole grid under a single transform: panning only changes the
+ * offset, and no tile goes through measure or allocation.
+ */
+static void
+shumate_map_layer_snapshot (GtkWidget   *widget,
+                            GtkSnapshot *snapshot)
+{
+  ShumateMapLayer *self = SHUMATE_MAP_LAYER (widget);
   guint tile_size;
-  guint required_tiles_x, required_tiles_y;
 
-  tile_size = shumate_map_source_get_tile_size (self->map_source);
-  required_tiles_x = (width / tile_size) + 2;
-  required_tiles_y = (height / tile_size) + 2;
-  if (self->required_tiles_x != required_tiles_x)
-    {
-      if (required_tiles_x > self->required_tiles_x)
-        {
-          for (guint x = self->required_tiles_x; x < required_tiles_x; x++)
-            {
-              for (guint y = 0; y < self->required_tiles_y; y++)
-                {
-                  ShumateTile *tile;
-                  TileGridPosition *tile_child;
-
-                  tile = shumate_tile_new ();
-                  shumate_tile_set_size (tile, tile_size);
-                  gtk_widget_insert_before (GTK_WIDGET (tile), widget, NULL);
-                  tile_child = tile_grid_position_new (tile, x, y);
-                  g_ptr_array_add (self->tiles_positions, tile_child);
-                }
-            }
-        }
-      else
-        {
-          for (guint x = self->required_tiles_x - 1; x >= required_tiles_x; x--)
-            {
-              for (guint y = 0; y < self->required_tiles_y; y++)
-                {
-                  TileGridPosition *tile_child = shumate_map_layer_get_tile_child (self, x, y);
-                  if (!tile_child)
-                    {
-                      g_critical ("Unable to find tile to remove at (%u;%u)", x, y);
-                      continue;
-                    }
-
-                  gtk_widget_unparent (GTK_WIDGET (tile_child->tile));
-                  g_ptr_array_remove_fast (self->tiles_positions, tile_child);
-                }
-            }
-        }
+  if (self->tiles == NULL || self->map_source == NULL)
+    return;
 
-      self->required_tiles_x = required_tiles_x;
-    }
+  tile_size = shumate_map_source_get_tile_size (self->map_source);
 
-  if (self->required_tiles_y != required_tiles_y)
-    {
-      if (required_tiles_y > self->required_tiles_y)
-        {
-          for (guint x = 0; x < self->required_tiles_x; x++)
-            {
-              for (guint y = self->required_tiles_y; y < required_tiles_y; y++)
-                {
-                  ShumateTile *tile;
-                  TileGridPosition *tile_child;
-
-                  tile = shumate_tile_new ();
-                  shumate_tile_set_size (tile, tile_size);
-                  gtk_widget_insert_before (GTK_WIDGET (tile), widget, NULL);
-                  tile_child = tile_grid_position_new (tile, x, y);
-                  g_ptr_array_add (self->tiles_positions, tile_child);
-                }
-            }
-        }
-      else
-        {
-          for (guint x = 0; x < self->required_tiles_x; x++)
-            {
-              for (guint y = self->required_tiles_y - 1; y >= required_tiles_y; y--)
-                {
-                  TileGridPosition *tile_child = shumate_map_layer_get_tile_child (self, x, y);
-                  if (!tile_child)
-                    {
-                      g_critical ("Unable to find tile to remove at (%u;%u)", x, y);
-                      continue;
-                    }
-
-                  gtk_widget_unparent (GTK_WIDGET (tile_child->tile));
-                  g_ptr_array_remove_fast (self->tiles_positions, tile_child);
-                }
-            }
-        }
+  gtk_snapshot_save (snapshot);
+  gtk_snapshot_translate (snapshot, &GRAPHENE_POINT_INIT (self->grid_offset_x, self->grid_offset_y));
+  gtk_snapshot_scale (snapshot, self->grid_scale, self->grid_scale);
 
-      self->required_tiles_y = required_tiles_y;
-    }
+  for (guint y = 0; y < self->required_tiles_y; y++)
+    for (guint x = 0; x < self->required_tiles_x; x++)
+      shumate_tile_snapshot_at (shumate_map_layer_get_grid_tile (self, x, y)->tile,
+                                snapshot,
+                                x * tile_size,
+                                y * tile_size);
 
-  shumate_map_layer_compute_grid (self);
+  gtk_snapshot_restore (snapshot);
 }
 
 static void
@@ -405,7 +812,7 @@ shumate_map_layer_measure (GtkWidget      *widget,
 
       viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
       tile_size = shumate_map_source_get_tile_size (self->map_source);
-      zoom_level = shumate_viewport_get_zoom_level (viewport);
+      zoom_level = (guint) floor (shumate_viewport_get_zoom_level (viewport));
       if (orientation == GTK_ORIENTATION_HORIZONTAL)
         count = shumate_map_source_get_column_count (self->map_source, zoom_level);
       else
@@ -420,14 +827,17 @@ shumate_map_layer_class_init (ShumateMapLayerClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
+  ShumateLayerClass *layer_class = SHUMATE_LAYER_CLASS (klass);
 
   object_class->set_property = shumate_map_layer_set_property;
   object_class->get_property = shumate_map_layer_get_property;
   object_class->dispose = shumate_map_layer_dispose;
-  object_class->constructed = shumate_map_layer_constructed;
 
   widget_class->size_allocate = shumate_map_layer_size_allocate;
   widget_class->measure = shumate_map_layer_measure;
+  widget_class->snapshot = shumate_map_layer_snapshot;
+
+  layer_class->viewport_changed = shumate_map_layer_viewport_changed;
 
   obj_properties[PROP_MAP_SOURCE] =
     g_param_spec_object ("map-source",
@@ -436,6 +846,65 @@ shumate_map_layer_class_init (ShumateMapLayerClass *klass)
                          SHUMATE_TYPE_MAP_SOURCE,
                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+  /**
+   * ShumateMapLayer:prefetch-distance:
+   *
+   * The number of tiles loaded ahead of time on each side of the visible
+   * ones, so that they are ready when the map is panned. 0, the default,
+   * disables the prefetching around the viewport.
+   *
+   * Prefetching multiplies the number of tiles requested from the tile
+   * server. Check the usage policy of the server before enabling it: some
+   * public servers, like the OpenStreetMap ones, don't allow it.
+   */
+  obj_properties[PROP_PREFETCH_DISTANCE] =
+    g_param_spec_uint ("prefetch-distance",
+                       "Prefetch distance",
+                       "The number of tiles prefetched around the viewport",
+                       0, 8, 0,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+
+  /**
+   * ShumateMapLayer:prefetch-zoom-levels:
+   *
+   * Whether the tiles the viewport would show one zoom level above and
+   * below the current one are loaded ahead of time. Disabled by default,
+   * see #ShumateMapLayer:prefetch-distance.
+   */
+  obj_properties[PROP_PREFETCH_ZOOM_LEVELS] =
+    g_param_spec_boolean ("prefetch-zoom-levels",
+                          "Prefetch zoom levels",
+                          "Whether the neighbouring zoom levels are prefetched",
+                          FALSE,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+
+  /**
+   * ShumateMapLayer:prefetch-requests:
+   *
+   * The number of tiles requested ahead of time so far.
+   */
+  obj_properties[PROP_PREFETCH_REQUESTS] =
+    g_param_spec_uint64 ("prefetch-requests",
+                         "Prefetch requests",
+                         "The number of prefetched tiles requested",
+                         0, G_MAXUINT64, 0,
+                         G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ShumateMapLayer:prefetch-hits:
+   *
+   * The number of prefetched tiles that were shown before being dropped,
+   * including the ones the grid took over while they were still loading.
+   * Compared with #ShumateMapLayer:prefetch-requests, it tells how much of
+   * the prefetching is useful.
+   */
+  obj_properties[PROP_PREFETCH_HITS] =
+    g_param_spec_uint64 ("prefetch-hits",
+                         "Prefetch hits",
+                         "The number of prefetched tiles that were used",
+                         0, G_MAXUINT64, 0,
+                         G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class,
                                      N_PROPERTIES,
                                      obj_properties);
@@ -447,8 +916,15 @@ shumate_map_layer_init (ShumateMapLayer *self)
   g_object_set (G_OBJECT (self),
                 "overflow", GTK_OVERFLOW_HIDDEN,
                 NULL);
-  self->tiles_positions = g_ptr_array_new_with_free_func ((GDestroyNotify) tile_grid_position_free);
-  self->tile_fill = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, g_object_unref);
+  self->prefetched_tiles = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                                  NULL, (GDestroyNotify) prefetched_tile_free);
+  self->prefetch_distance = 0;
+  self->prefetch_zoom_levels = FALSE;
+  self->grid_scale = 1.0;
+
+  self->memory_monitor = g_memory_monitor_dup_default ();
+  g_signal_connect_object (self->memory_monitor, "low-memory-warning",
+                           G_CALLBACK (on_low_memory_warning), self, 0);
 }
 
 ShumateMapLayer *
@@ -460,3 +936,114 @@ shumate_map_layer_new (ShumateMapSource *map_source,
                        "viewport", viewport,
                        NULL);
 }
+
+/**
+ * shumate_map_layer_get_prefetch_distance:
+ * @self: a #ShumateMapLayer
+ *
+ * Gets the number of tiles prefetched on each side of the viewport.
+ *
+ * Returns: the prefetch distance, in tiles
+ */
+guint
+shumate_map_layer_get_prefetch_distance (ShumateMapLayer *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_LAYER (self), 0);
+
+  return self->prefetch_distance;
+}
+
+/**
+ * shumate_map_layer_set_prefetch_distance:
+ * @self: a #ShumateMapLayer
+ * @distance: the number of tiles to prefetch on each side of the viewport
+ *
+ * Sets the number of tiles loaded ahead of time on each side of the
+ * viewport. 0 disables the prefetching around the viewport.
+ */
+void
+shumate_map_layer_set_prefetch_distance (ShumateMapLayer *self,
+                                         guint            distance)
+{
+  g_return_if_fail (SHUMATE_IS_MAP_LAYER (self));
+
+  if (self->prefetch_distance == distance)
+    return;
+
+  self->prefetch_distance = distance;
+  self->prefetch_dirty = TRUE;
+  gtk_widget_queue_allocate (GTK_WIDGET (self));
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_PREFETCH_DISTANCE]);
+}
+
+/**
+ * shumate_map_layer_get_prefetch_zoom_levels:
+ * @self: a #ShumateMapLayer
+ *
+ * Gets whether the neighbouring zoom levels are prefetched.
+ *
+ * Returns: %TRUE if the tiles of the neighbouring zoom levels are prefetched
+ */
+gboolean
+shumate_map_layer_get_prefetch_zoom_levels (ShumateMapLayer *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_LAYER (self), FALSE);
+
+  return self->prefetch_zoom_levels;
+}
+
+/**
+ * shumate_map_layer_set_prefetch_zoom_levels:
+ * @self: a #ShumateMapLayer
+ * @prefetch_zoom_levels: whether to prefetch the neighbouring zoom levels
+ *
+ * Sets whether the tiles the viewport would show one zoom level above and
+ * below the current one are loaded ahead of time.
+ */
+void
+shumate_map_layer_set_prefetch_zoom_levels (ShumateMapLayer *self,
+                                            gboolean         prefetch_zoom_levels)
+{
+  g_return_if_fail (SHUMATE_IS_MAP_LAYER (self));
+
+  prefetch_zoom_levels = !!prefetch_zoom_levels;
+  if (self->prefetch_zoom_levels == prefetch_zoom_levels)
+    return;
+
+  self->prefetch_zoom_levels = prefetch_zoom_levels;
+  self->prefetch_dirty = TRUE;
+  gtk_widget_queue_allocate (GTK_WIDGET (self));
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_PREFETCH_ZOOM_LEVELS]);
+}
+
+/**
+ * shumate_map_layer_get_prefetch_requests:
+ * @self: a #ShumateMapLayer
+ *
+ * Gets the number of tiles requested ahead of time so far.
+ *
+ * Returns: the number of prefetch requests
+ */
+guint64
+shumate_map_layer_get_prefetch_requests (ShumateMapLayer *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_LAYER (self), 0);
+
+  return self->prefetch_requests;
+}
+
+/**
+ * shumate_map_layer_get_prefetch_hits:
+ * @self: a #ShumateMapLayer
+ *
+ * Gets the number of prefetched tiles that ended up being shown.
+ *
+ * Returns: the number of prefetch hits
+ */
+guint64
+shumate_map_layer_get_prefetch_hits (ShumateMapLayer *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_LAYER (self), 0);
+
+  return self->prefetch_hits;
+}
@@ -42,6 +42,16 @@ G_DECLARE_FINAL_TYPE (ShumateMapLayer, shumate_map_layer, SHUMATE, MAP_LAYER, Sh
 ShumateMapLayer *shumate_map_layer_new (ShumateMapSource *map_source,
                                         ShumateViewport  *viewport);
 
+guint shumate_map_layer_get_prefetch_distance (ShumateMapLayer *self);
+void shumate_map_layer_set_prefetch_distance (ShumateMapLayer *self,
+                                              guint            distance);
+gboolean shumate_map_layer_get_prefetch_zoom_levels (ShumateMapLayer *self);
+void shumate_map_layer_set_prefetch_zoom_levels (ShumateMapLayer *self,
+                                                 gboolean         prefetch_zoom_levels);
+
+guint64 shumate_map_layer_get_prefetch_requests (ShumateMapLayer *self);
+guint64 shumate_map_layer_get_prefetch_hits (ShumateMapLayer *self);
+
 G_END_DECLS
 
 #endif /* __SHUMATE_MAP_LAYER_H__ */
@@ -407,8 +407,10 @@ shumate_map_source_desc_init (ShumateMapSourceDesc *desc)
  * @max_zoom: the map source's maximum zoom level
  * @tile_size: the map source's tile size (in pixels)
  * @projection: the map source's projection
- * @uri_format: the URI to fetch the tiles from, see #shumate_network_tile_source_set_uri_format
- * @constructor: the map source's constructor
+ * @uri_format: the URI to fetch the tiles from, see #shumate_network_tile_source_set_uri_format,
+ * or `mbtiles://` or `pmtiles://` followed by the path of an archive
+ * @constructor: (nullable): the map source's constructor, or %NULL to use the
+ * one picked by the uri-format
  * @data: user data passed to the constructor
  *
  * Constructor of #ShumateMapSourceDesc which describes a #ShumateMapSource.
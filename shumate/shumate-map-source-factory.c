@@ -45,12 +45,18 @@
 #include "shumate-enum-types.h"
 #include "shumate-map-source.h"
 #include "shumate-marshal.h"
+#include "shumate-mbtiles-source.h"
 #include "shumate-network-tile-source.h"
+#include "shumate-pmtiles-source.h"
 #include "shumate-map-source-chain.h"
 
 #include <glib.h>
 #include <string.h>
 
+/* uri-format of descriptions served from a local archive */
+#define MBTILES_URI_PREFIX "mbtiles://"
+#define PMTILES_URI_PREFIX "pmtiles://"
+
 static ShumateMapSourceFactory *instance = NULL;
 
 struct _ShumateMapSourceFactory
@@ -308,6 +314,9 @@ shumate_map_source_factory_create (ShumateMapSourceFactory *factory,
           ShumateMapSourceConstructor constructor;
 
           constructor = shumate_map_source_desc_get_constructor (desc);
+          if (!constructor)
+            constructor = shumate_map_source_new_generic;
+
           return constructor (desc);
         }
       item = g_slist_next (item);
@@ -349,14 +358,19 @@ shumate_map_source_factory_create_cached_source (ShumateMapSourceFactory *factor
   tile_size = shumate_map_source_get_tile_size (tile_source);
   error_source = shumate_map_source_factory_create_error_source (factory, tile_size);
 
-  file_cache = SHUMATE_MAP_SOURCE (shumate_file_cache_new_full (100000000, NULL));
-
   memory_cache = SHUMATE_MAP_SOURCE (shumate_memory_cache_new_full (100));
 
   source_chain = shumate_map_source_chain_new ();
   shumate_map_source_chain_push (source_chain, error_source);
   shumate_map_source_chain_push (source_chain, tile_source);
-  shumate_map_source_chain_push (source_chain, file_cache);
+
+  /* Tiles of a local archive are already on disk */
+  if (!SHUMATE_IS_MBTILES_SOURCE (tile_source) && !SHUMATE_IS_PMTILES_SOURCE (tile_source))
+    {
+      file_cache = SHUMATE_MAP_SOURCE (shumate_file_cache_new_full (100000000, NULL));
+      shumate_map_source_chain_push (source_chain, file_cache);
+    }
+
   shumate_map_source_chain_push (source_chain, memory_cache);
 
   return SHUMATE_MAP_SOURCE (source_chain);
@@ -443,6 +457,11 @@ compare_id (ShumateMapSourceDesc *a, ShumateMapSourceDesc *b)
  * map source.  #ShumateMapSourceFactory will take ownership of the passed
  * #ShumateMapSourceDesc, so don't free it.
  *
+ * When the description has no constructor, a #ShumateNetworkTileSource is
+ * built from its #ShumateMapSourceDesc:uri-format, or a #ShumateMbtilesSource
+ * or #ShumatePmtilesSource if the uri-format is of the form
+ * `mbtiles:///path/to/file.mbtiles` or `pmtiles:///path/to/file.pmtiles`.
+ *
  * Returns: TRUE if the registration suceeded.
  */
 gboolean
@@ -478,6 +497,36 @@ shumate_map_source_new_generic (ShumateMapSourceDesc *desc)
   projection = shumate_map_source_desc_get_projection (desc);
   uri_format = shumate_map_source_desc_get_uri_format (desc);
 
+  if (uri_format && g_str_has_prefix (uri_format, MBTILES_URI_PREFIX))
+    {
+      return g_object_new (SHUMATE_TYPE_MBTILES_SOURCE,
+            "id", id,
+            "name", name,
+            "license", license,
+            "license-uri", license_uri,
+            "min-zoom-level", min_zoom,
+            "max-zoom-level", max_zoom,
+            "tile-size", tile_size,
+            "projection", projection,
+            "path", uri_format + strlen (MBTILES_URI_PREFIX),
+            NULL);
+    }
+
+  if (uri_format && g_str_has_prefix (uri_format, PMTILES_URI_PREFIX))
+    {
+      return g_object_new (SHUMATE_TYPE_PMTILES_SOURCE,
+            "id", id,
+            "name", name,
+            "license", license,
+            "license-uri", license_uri,
+            "min-zoom-level", min_zoom,
+            "max-zoom-level", max_zoom,
+            "tile-size", tile_size,
+            "projection", projection,
+            "path", uri_format + strlen (PMTILES_URI_PREFIX),
+            NULL);
+    }
+
   map_source = SHUMATE_MAP_SOURCE (shumate_network_tile_source_new_full (
             id,
             name,
@@ -50,10 +50,18 @@
  * the tile from the next source in the chain (error tile source).
  * The error tile source always generates an error tile, no matter what
  * its next source is.
+ *
+ * Whole regions can be downloaded ahead of time, for instance to use them
+ * offline, with shumate_map_source_download_region_async(). The tiles go
+ * through the same chain, so they end up in its caches.
  */
 
+#define DEBUG_FLAG SHUMATE_DEBUG_LOADING
+#include "shumate-debug.h"
+
 #include "shumate-map-source.h"
 #include "shumate-location.h"
+#include "shumate-tile-private.h"
 
 #include <math.h>
 
@@ -355,7 +363,7 @@ shumate_map_source_get_projection (ShumateMapSource *map_source)
 /**
  * shumate_map_source_get_x:
  * @map_source: a #ShumateMapSource
- * @zoom_level: the zoom level
+ * @zoom_level: the zoom level, which may be fractional
  * @longitude: a longitude
  *
  * Gets the x position on the map using this map source's projection.
@@ -365,7 +373,7 @@ shumate_map_source_get_projection (ShumateMapSource *map_source)
  */
 double
 shumate_map_source_get_x (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double longitude)
 {
   g_return_val_if_fail (SHUMATE_IS_MAP_SOURCE (map_source), 0.0);
@@ -380,7 +388,7 @@ shumate_map_source_get_x (ShumateMapSource *map_source,
 /**
  * shumate_map_source_get_y:
  * @map_source: a #ShumateMapSource
- * @zoom_level: the zoom level
+ * @zoom_level: the zoom level, which may be fractional
  * @latitude: a latitude
  *
  * Gets the y position on the map using this map source's projection.
@@ -390,7 +398,7 @@ shumate_map_source_get_x (ShumateMapSource *map_source,
  */
 double
 shumate_map_source_get_y (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double latitude)
 {
   double sin_latitude;
@@ -407,7 +415,7 @@ shumate_map_source_get_y (ShumateMapSource *map_source,
 /**
  * shumate_map_source_get_longitude:
  * @map_source: a #ShumateMapSource
- * @zoom_level: the zoom level
+ * @zoom_level: the zoom level, which may be fractional
  * @x: a x position
  *
  * Gets the longitude corresponding to this x position in the map source's
@@ -417,7 +425,7 @@ shumate_map_source_get_y (ShumateMapSource *map_source,
  */
 double
 shumate_map_source_get_longitude (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double x)
 {
   double longitude;
@@ -434,7 +442,7 @@ shumate_map_source_get_longitude (ShumateMapSource *map_source,
 /**
  * shumate_map_source_get_latitude:
  * @map_source: a #ShumateMapSource
- * @zoom_level: the zoom level
+ * @zoom_level: the zoom level, which may be fractional
  * @y: a y position
  *
  * Gets the latitude corresponding to this y position in the map source's
@@ -444,14 +452,14 @@ shumate_map_source_get_longitude (ShumateMapSource *map_source,
  */
 double
 shumate_map_source_get_latitude (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double y)
 {
   double latitude, map_size, dy;
 
   g_return_val_if_fail (SHUMATE_IS_MAP_SOURCE (map_source), 0.0);
   /* FIXME: support other projections */
-  map_size = shumate_map_source_get_tile_size (map_source) * shumate_map_source_get_row_count (map_source, zoom_level);
+  map_size = shumate_map_source_get_tile_size (map_source) * pow (2.0, zoom_level);
   dy = 0.5 - y / map_size;
   latitude = 90.0 - 360.0 / G_PI * atan (exp (-dy * 2.0 * G_PI));
   
@@ -503,7 +511,7 @@ shumate_map_source_get_column_count (ShumateMapSource *map_source,
 /**
  * shumate_map_source_get_meters_per_pixel:
  * @map_source: a #ShumateMapSource
- * @zoom_level: the zoom level
+ * @zoom_level: the zoom level, which may be fractional
  * @latitude: a latitude
  * @longitude: a longitude
  *
@@ -513,7 +521,7 @@ shumate_map_source_get_column_count (ShumateMapSource *map_source,
  */
 double
 shumate_map_source_get_meters_per_pixel (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double latitude,
     G_GNUC_UNUSED double longitude)
 {
@@ -526,7 +534,7 @@ shumate_map_source_get_meters_per_pixel (ShumateMapSource *map_source,
    * radius_at_latitude = 2pi * k * sin (pi/2-theta)
    */
 
-  double map_size = shumate_map_source_get_tile_size (map_source) * shumate_map_source_get_row_count (map_source, zoom_level);
+  double map_size = shumate_map_source_get_tile_size (map_source) * pow (2.0, zoom_level);
   /* FIXME: support other projections */
   return 2.0 * G_PI * EARTH_RADIUS * sin (G_PI / 2.0 - G_PI / 180.0 * latitude) / map_size;
 }
@@ -551,3 +559,582 @@ shumate_map_source_fill_tile (ShumateMapSource *map_source,
   shumate_tile_set_state (tile, SHUMATE_STATE_LOADING);
   SHUMATE_MAP_SOURCE_GET_CLASS (map_source)->fill_tile (map_source, tile, cancellable);
 }
+
+
+/* Region downloads run this many tiles at once, and download at most
+ * REGION_TILES_PER_SECOND of them per second, to be gentle with servers.
+ * Tiles the caches of the chain answer don't count. */
+#define REGION_PARALLEL_TILES 4
+#define REGION_TILES_PER_SECOND 10
+
+/* A tile that isn't done after this long is given up on, and counts as
+ * failed */
+#define REGION_TILE_TIMEOUT_S 60
+
+/* Rough size of a 256 pixel raster tile, used for estimates */
+#define REGION_BYTES_PER_TILE 15000
+
+typedef struct
+{
+  double min_latitude;
+  double min_longitude;
+  double max_latitude;
+  double max_longitude;
+  guint max_zoom;
+
+  /* The next tile to download, and the tile range of its zoom level */
+  guint zoom;
+  int column;
+  int row;
+  int x_start;
+  int n_columns;
+  int y_start;
+  int n_rows;
+  gboolean enumerated;
+
+  guint64 n_tiles;
+  guint64 n_done;
+  guint64 n_failed;
+  GPtrArray *running; /* RegionTile */
+  gint64 next_start_time;
+  GSource *source;
+  gulong cancelled_id;
+  gboolean finished;
+  GTask *task; /* Owned until the download returns, the rest borrows it */
+
+  ShumateRegionProgressFunc progress;
+  gpointer progress_data;
+  GDestroyNotify progress_destroy;
+} RegionDownload;
+
+typedef struct
+{
+  GTask *task;
+  ShumateTile *tile;
+  GCancellable *cancellable;
+  gulong state_id;
+  GSource *timeout;
+  gint64 start_time;
+} RegionTile;
+
+static void region_download_run (GTask *task);
+
+
+static void
+region_tile_free (RegionTile *region_tile)
+{
+  g_clear_signal_handler (&region_tile->state_id, region_tile->tile);
+
+  if (region_tile->timeout)
+    {
+      g_source_destroy (region_tile->timeout);
+      g_source_unref (region_tile->timeout);
+    }
+
+  /* Stops the sources still working on the tile */
+  g_cancellable_cancel (region_tile->cancellable);
+
+  g_object_unref (region_tile->cancellable);
+  g_object_unref (region_tile->tile);
+  g_slice_free (RegionTile, region_tile);
+}
+
+
+static void
+region_download_free (RegionDownload *download)
+{
+  g_assert (download->source == NULL);
+
+  g_ptr_array_unref (download->running);
+
+  if (download->progress_destroy)
+    download->progress_destroy (download->progress_data);
+
+  g_slice_free (RegionDownload, download);
+}
+
+
+/*
+ * Computes the tiles of @zoom covering the region. A region whose western
+ * edge is east of its eastern edge crosses the antimeridian: its columns
+ * wrap around from the last one to the first one.
+ */
+static void
+get_region_range (ShumateMapSource *map_source,
+                  guint             zoom,
+                  double            min_latitude,
+                  double            min_longitude,
+                  double            max_latitude,
+                  double            max_longitude,
+                  int              *x_start,
+                  int              *n_columns,
+                  int              *y_start,
+                  int              *n_rows)
+{
+  guint tile_size = shumate_map_source_get_tile_size (map_source);
+  int column_count = shumate_map_source_get_column_count (map_source, zoom);
+  int last_row = shumate_map_source_get_row_count (map_source, zoom) - 1;
+  int x_end, y_end;
+
+  *x_start = CLAMP (floor (shumate_map_source_get_x (map_source, zoom, min_longitude) / tile_size), 0, column_count - 1);
+  x_end = CLAMP (floor (shumate_map_source_get_x (map_source, zoom, max_longitude) / tile_size), 0, column_count - 1);
+
+  if (min_longitude <= max_longitude)
+    *n_columns = x_end - *x_start + 1;
+  else
+    *n_columns = MIN (column_count - *x_start + x_end + 1, column_count);
+
+  /* Rows go from north to south */
+  *y_start = CLAMP (floor (shumate_map_source_get_y (map_source, zoom, max_latitude) / tile_size), 0, last_row);
+  y_end = CLAMP (floor (shumate_map_source_get_y (map_source, zoom, min_latitude) / tile_size), 0, last_row);
+  *n_rows = y_end - *y_start + 1;
+}
+
+
+static void
+region_download_set_zoom (RegionDownload   *download,
+                          ShumateMapSource *map_source,
+                          guint             zoom)
+{
+  download->zoom = zoom;
+  get_region_range (map_source, zoom,
+                    download->min_latitude, download->min_longitude,
+                    download->max_latitude, download->max_longitude,
+                    &download->x_start, &download->n_columns,
+                    &download->y_start, &download->n_rows);
+  download->column = 0;
+  download->row = 0;
+}
+
+
+/* Returns the next tile of the pyramid, zoom level after zoom level */
+static gboolean
+region_download_next_tile (RegionDownload   *download,
+                           ShumateMapSource *map_source,
+                           int              *x,
+                           int              *y,
+                           guint            *zoom)
+{
+  if (download->enumerated)
+    return FALSE;
+
+  *x = (download->x_start + download->column) % shumate_map_source_get_column_count (map_source, download->zoom);
+  *y = download->y_start + download->row;
+  *zoom = download->zoom;
+
+  if (++download->column >= download->n_columns)
+    {
+      download->column = 0;
+
+      if (++download->row >= download->n_rows)
+        {
+          if (download->zoom >= download->max_zoom)
+            download->enumerated = TRUE;
+          else
+            region_download_set_zoom (download, map_source, download->zoom + 1);
+        }
+    }
+
+  return TRUE;
+}
+
+
+static gboolean
+region_download_continue_cb (gpointer user_data)
+{
+  GTask *task = user_data;
+  RegionDownload *download = g_task_get_task_data (task);
+
+  g_clear_pointer (&download->source, g_source_unref);
+  region_download_run (task);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+/* Continues the download from the main context of the task */
+static void
+region_download_schedule (GTask *task,
+                          guint  delay_ms)
+{
+  RegionDownload *download = g_task_get_task_data (task);
+
+  if (download->source != NULL || download->finished)
+    return;
+
+  download->source = delay_ms > 0 ? g_timeout_source_new (delay_ms) : g_idle_source_new ();
+  g_source_set_callback (download->source, region_download_continue_cb, g_object_ref (task), g_object_unref);
+  g_source_attach (download->source, g_task_get_context (task));
+}
+
+
+static void
+region_tile_finish (RegionTile *region_tile,
+                    gboolean    failed)
+{
+  GTask *task = region_tile->task;
+  RegionDownload *download = g_task_get_task_data (task);
+
+  download->n_done++;
+  if (failed)
+    download->n_failed++;
+
+  /* Only tiles that went to the network count against the rate, so seeding
+   * a region the caches already hold goes as fast as they answer */
+  if (shumate_tile_get_downloaded (region_tile->tile))
+    download->next_start_time = MAX (download->next_start_time, region_tile->start_time) +
+                                G_USEC_PER_SEC / REGION_TILES_PER_SECOND;
+
+  /* Frees region_tile */
+  g_ptr_array_remove_fast (download->running, region_tile);
+
+  if (download->progress)
+    download->progress (g_task_get_source_object (task),
+                        download->n_done,
+                        download->n_failed,
+                        download->n_tiles,
+                        download->progress_data);
+
+  region_download_schedule (task, 0);
+}
+
+
+static void
+on_region_tile_state (ShumateTile *tile,
+                      GParamSpec  *pspec,
+                      RegionTile  *region_tile)
+{
+  /* The error source of the chain is done with the tiles nothing loaded */
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
+    region_tile_finish (region_tile, shumate_tile_get_failed (tile));
+}
+
+
+static gboolean
+on_region_tile_timeout (gpointer user_data)
+{
+  RegionTile *region_tile = user_data;
+
+  DEBUG ("Giving up on tile %u, %u at zoom level %u",
+         shumate_tile_get_x (region_tile->tile),
+         shumate_tile_get_y (region_tile->tile),
+         shumate_tile_get_zoom_level (region_tile->tile));
+
+  g_clear_pointer (&region_tile->timeout, g_source_unref);
+  region_tile_finish (region_tile, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+region_download_start_tile (GTask *task,
+                            int    x,
+                            int    y,
+                            guint  zoom)
+{
+  RegionDownload *download = g_task_get_task_data (task);
+  ShumateMapSource *map_source = g_task_get_source_object (task);
+  RegionTile *region_tile = g_slice_new0 (RegionTile);
+  g_autoptr(ShumateTile) tile = NULL;
+
+  tile = g_object_ref_sink (shumate_tile_new_full (x, y, shumate_map_source_get_tile_size (map_source), zoom));
+
+  /* Tiles the user is looking at come first, and keep their place in the
+   * memory and texture caches */
+  shumate_tile_set_priority (tile, SHUMATE_TILE_PRIORITY_PREFETCH);
+  shumate_tile_set_store_only (tile, TRUE);
+
+  region_tile->task = task;
+  region_tile->tile = g_object_ref (tile);
+  region_tile->cancellable = g_cancellable_new ();
+  region_tile->start_time = g_get_monotonic_time ();
+  region_tile->state_id = g_signal_connect (tile, "notify::state", G_CALLBACK (on_region_tile_state), region_tile);
+
+  region_tile->timeout = g_timeout_source_new_seconds (REGION_TILE_TIMEOUT_S);
+  g_source_set_callback (region_tile->timeout, on_region_tile_timeout, region_tile, NULL);
+  g_source_attach (region_tile->timeout, g_task_get_context (task));
+
+  g_ptr_array_add (download->running, region_tile);
+
+  /* Fresh tiles in the caches of the chain are done without downloading
+   * anything. The tile may be done, and region_tile freed, on return. */
+  shumate_map_source_fill_tile (map_source, tile, region_tile->cancellable);
+}
+
+
+/* Stops everything the download runs, and returns it */
+static void
+region_download_finish (GTask *task)
+{
+  RegionDownload *download = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  g_autoptr(GTask) task_ref = g_steal_pointer (&download->task);
+
+  download->finished = TRUE;
+
+  if (download->source)
+    {
+      g_source_destroy (download->source);
+      g_clear_pointer (&download->source, g_source_unref);
+    }
+
+  if (cancellable)
+    g_cancellable_disconnect (cancellable, download->cancelled_id);
+  download->cancelled_id = 0;
+
+  g_ptr_array_set_size (download->running, 0);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  if (download->n_failed > 0)
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "%" G_GUINT64_FORMAT " of the %" G_GUINT64_FORMAT " tiles of the region couldn't be loaded",
+                             download->n_failed, download->n_done);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+
+static void
+region_download_run (GTask *task)
+{
+  RegionDownload *download = g_task_get_task_data (task);
+  ShumateMapSource *map_source = g_task_get_source_object (task);
+
+  if (download->finished)
+    return;
+
+  if (g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    {
+      region_download_finish (task);
+      return;
+    }
+
+  while (download->running->len < REGION_PARALLEL_TILES && !download->enumerated)
+    {
+      gint64 now = g_get_monotonic_time ();
+      int x, y;
+      guint zoom;
+
+      if (now < download->next_start_time)
+        {
+          region_download_schedule (task, (download->next_start_time - now) / 1000 + 1);
+          return;
+        }
+
+      if (region_download_next_tile (download, map_source, &x, &y, &zoom))
+        region_download_start_tile (task, x, y, zoom);
+    }
+
+  if (download->enumerated && download->running->len == 0)
+    region_download_finish (task);
+}
+
+
+static gboolean
+region_download_cancelled_cb (gpointer user_data)
+{
+  region_download_run (G_TASK (user_data));
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+on_region_download_cancelled (GCancellable *cancellable,
+                              GTask        *task)
+{
+  GSource *source = g_idle_source_new ();
+
+  /* This may run in any thread, the download stops from its own context */
+  g_source_set_callback (source, region_download_cancelled_cb, g_object_ref (task), g_object_unref);
+  g_source_attach (source, g_task_get_context (task));
+  g_source_unref (source);
+}
+
+
+/**
+ * shumate_map_source_estimate_region:
+ * @map_source: a #ShumateMapSource
+ * @min_latitude: the southern edge of the region
+ * @min_longitude: the western edge of the region
+ * @max_latitude: the northern edge of the region
+ * @max_longitude: the eastern edge of the region
+ * @min_zoom: the lowest zoom level to download
+ * @max_zoom: the highest zoom level to download
+ * @n_bytes: (out) (optional): return location for a rough estimate of the
+ *   size of the tiles in bytes
+ *
+ * Counts the tiles shumate_map_source_download_region_async() goes through
+ * for the same region. The zoom levels are clamped to the ones of
+ * @map_source. If @min_longitude is greater than @max_longitude, the region
+ * crosses the antimeridian.
+ *
+ * The size estimate assumes an average raster tile, the actual size depends
+ * a lot on the map style and on the region.
+ *
+ * Returns: the number of tiles covering the region
+ */
+guint64
+shumate_map_source_estimate_region (ShumateMapSource *map_source,
+    double min_latitude,
+    double min_longitude,
+    double max_latitude,
+    double max_longitude,
+    guint min_zoom,
+    guint max_zoom,
+    guint64 *n_bytes)
+{
+  guint64 n_tiles = 0;
+  guint tile_size;
+
+  g_return_val_if_fail (SHUMATE_IS_MAP_SOURCE (map_source), 0);
+  g_return_val_if_fail (min_latitude <= max_latitude, 0);
+
+  min_zoom = MAX (min_zoom, shumate_map_source_get_min_zoom_level (map_source));
+  max_zoom = MIN (max_zoom, shumate_map_source_get_max_zoom_level (map_source));
+
+  for (guint zoom = min_zoom; zoom <= max_zoom; zoom++)
+    {
+      int x_start, n_columns, y_start, n_rows;
+
+      get_region_range (map_source, zoom,
+                        min_latitude, min_longitude, max_latitude, max_longitude,
+                        &x_start, &n_columns, &y_start, &n_rows);
+
+      n_tiles += (guint64) n_columns * n_rows;
+    }
+
+  tile_size = shumate_map_source_get_tile_size (map_source);
+  if (n_bytes)
+    *n_bytes = n_tiles * REGION_BYTES_PER_TILE * tile_size * tile_size / (256 * 256);
+
+  return n_tiles;
+}
+
+
+/**
+ * shumate_map_source_download_region_async:
+ * @map_source: a #ShumateMapSource
+ * @min_latitude: the southern edge of the region
+ * @min_longitude: the western edge of the region
+ * @max_latitude: the northern edge of the region
+ * @max_longitude: the eastern edge of the region
+ * @min_zoom: the lowest zoom level to download
+ * @max_zoom: the highest zoom level to download
+ * @cancellable: (nullable): a #GCancellable
+ * @progress: (nullable) (scope notified): called after each tile
+ * @progress_data: (closure progress): data for @progress
+ * @progress_destroy: (destroy progress_data): frees @progress_data
+ * @callback: called when the download is over
+ * @user_data: data for @callback
+ *
+ * Loads every tile of the region, from @min_zoom to @max_zoom, through
+ * @map_source so that the persistent caches of the chain, such as
+ * #ShumateFileCache, hold them, typically to use the region offline later.
+ * Tiles that these caches have and which are still fresh aren't downloaded
+ * again. The tiles don't go through #ShumateMemoryCache nor the decoded
+ * textures kept for the views, so a download doesn't slow down the maps
+ * being displayed.
+ *
+ * If @min_longitude is greater than @max_longitude, the region crosses the
+ * antimeridian.
+ *
+ * A few tiles are loaded at a time, and only a few are downloaded each
+ * second, so that tile servers aren't overwhelmed. Tiles the caches answer
+ * don't count against that rate. Check the usage policy of the
+ * server before downloading large regions. Use
+ * shumate_map_source_estimate_region() to know how large a region is
+ * beforehand.
+ *
+ * Tiles that can't be loaded still count as done for @progress, which also
+ * tells how many of them failed. A tile fails when the chain has nothing
+ * for it, that is when it ends up drawn by a #ShumateErrorTileSource, or
+ * when it isn't loaded after a minute.
+ */
+void
+shumate_map_source_download_region_async (ShumateMapSource *map_source,
+    double min_latitude,
+    double min_longitude,
+    double max_latitude,
+    double max_longitude,
+    guint min_zoom,
+    guint max_zoom,
+    GCancellable *cancellable,
+    ShumateRegionProgressFunc progress,
+    gpointer progress_data,
+    GDestroyNotify progress_destroy,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  RegionDownload *download;
+
+  g_return_if_fail (SHUMATE_IS_MAP_SOURCE (map_source));
+  g_return_if_fail (min_latitude <= max_latitude);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (map_source, cancellable, callback, user_data);
+  g_task_set_source_tag (task, shumate_map_source_download_region_async);
+
+  min_zoom = MAX (min_zoom, shumate_map_source_get_min_zoom_level (map_source));
+  max_zoom = MIN (max_zoom, shumate_map_source_get_max_zoom_level (map_source));
+
+  download = g_slice_new0 (RegionDownload);
+  download->min_latitude = min_latitude;
+  download->min_longitude = min_longitude;
+  download->max_latitude = max_latitude;
+  download->max_longitude = max_longitude;
+  download->max_zoom = max_zoom;
+  download->running = g_ptr_array_new_with_free_func ((GDestroyNotify) region_tile_free);
+  download->progress = progress;
+  download->progress_data = progress_data;
+  download->progress_destroy = progress_destroy;
+  download->n_tiles = shumate_map_source_estimate_region (map_source,
+                                                          min_latitude, min_longitude,
+                                                          max_latitude, max_longitude,
+                                                          min_zoom, max_zoom, NULL);
+  download->enumerated = (download->n_tiles == 0);
+  if (!download->enumerated)
+    region_download_set_zoom (download, map_source, min_zoom);
+
+  g_task_set_task_data (task, download, (GDestroyNotify) region_download_free);
+
+  /* The scheduled sources only keep the task alive between two steps, and
+   * nothing is scheduled while the tiles load */
+  download->task = g_object_ref (task);
+
+  if (cancellable)
+    download->cancelled_id = g_cancellable_connect (cancellable,
+                                                    G_CALLBACK (on_region_download_cancelled),
+                                                    task, NULL);
+
+  region_download_schedule (task, 0);
+}
+
+
+/**
+ * shumate_map_source_download_region_finish:
+ * @map_source: a #ShumateMapSource
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes a download started with
+ * shumate_map_source_download_region_async().
+ *
+ * Returns: %TRUE if every tile of the region was loaded, %FALSE if the
+ *   download was cancelled, with %G_IO_ERROR_CANCELLED, or if some tiles
+ *   couldn't be loaded, with %G_IO_ERROR_FAILED. The download still went
+ *   through the whole region in the latter case.
+ */
+gboolean
+shumate_map_source_download_region_finish (ShumateMapSource *map_source,
+    GAsyncResult *result,
+    GError **error)
+{
+  g_return_val_if_fail (SHUMATE_IS_MAP_SOURCE (map_source), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, map_source), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
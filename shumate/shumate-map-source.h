@@ -81,23 +81,23 @@ guint shumate_map_source_get_tile_size (ShumateMapSource *map_source);
 ShumateMapProjection shumate_map_source_get_projection (ShumateMapSource *map_source);
 
 double shumate_map_source_get_x (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double longitude);
 double shumate_map_source_get_y (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double latitude);
 double shumate_map_source_get_longitude (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double x);
 double shumate_map_source_get_latitude (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double y);
 guint shumate_map_source_get_row_count (ShumateMapSource *map_source,
     guint zoom_level);
 guint shumate_map_source_get_column_count (ShumateMapSource *map_source,
     guint zoom_level);
 double shumate_map_source_get_meters_per_pixel (ShumateMapSource *map_source,
-    guint zoom_level,
+    double zoom_level,
     double latitude,
     double longitude);
 
@@ -105,6 +105,48 @@ void shumate_map_source_fill_tile (ShumateMapSource *map_source,
                                    ShumateTile      *tile,
                                    GCancellable     *cancellable);
 
+/**
+ * ShumateRegionProgressFunc:
+ * @map_source: the #ShumateMapSource downloading the region
+ * @n_done: the number of tiles done so far
+ * @n_failed: the number of tiles, among the done ones, which couldn't be
+ *   loaded
+ * @n_tiles: the number of tiles in the region
+ * @user_data: the data passed to shumate_map_source_download_region_async()
+ *
+ * Reports the progress of a region download.
+ */
+typedef void (*ShumateRegionProgressFunc) (ShumateMapSource *map_source,
+                                           guint64           n_done,
+                                           guint64           n_failed,
+                                           guint64           n_tiles,
+                                           gpointer          user_data);
+
+guint64 shumate_map_source_estimate_region (ShumateMapSource *map_source,
+    double min_latitude,
+    double min_longitude,
+    double max_latitude,
+    double max_longitude,
+    guint min_zoom,
+    guint max_zoom,
+    guint64 *n_bytes);
+void shumate_map_source_download_region_async (ShumateMapSource *map_source,
+    double min_latitude,
+    double min_longitude,
+    double max_latitude,
+    double max_longitude,
+    guint min_zoom,
+    guint max_zoom,
+    GCancellable *cancellable,
+    ShumateRegionProgressFunc progress,
+    gpointer progress_data,
+    GDestroyNotify progress_destroy,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+gboolean shumate_map_source_download_region_finish (ShumateMapSource *map_source,
+    GAsyncResult *result,
+    GError **error);
+
 G_END_DECLS
 
 #endif /* _SHUMATE_MAP_SOURCE_H_ */
@@ -185,31 +185,13 @@ shumate_marker_layer_reposition_markers (ShumateMarkerLayer *self)
 }
 
 static void
-on_view_longitude_changed (ShumateMarkerLayer *self,
-                           GParamSpec      *pspec,
-                           ShumateViewport *view)
+shumate_marker_layer_viewport_changed (ShumateLayer          *layer,
+                                       ShumateViewportChange  changes)
 {
-  g_assert (SHUMATE_IS_MARKER_LAYER (self));
+  ShumateMarkerLayer *self = SHUMATE_MARKER_LAYER (layer);
 
-  shumate_marker_layer_reposition_markers (self);
-}
-
-static void
-on_view_latitude_changed (ShumateMarkerLayer *self,
-                          GParamSpec      *pspec,
-                          ShumateViewport *view)
-{
-  g_assert (SHUMATE_IS_MARKER_LAYER (self));
-
-  shumate_marker_layer_reposition_markers (self);
-}
-
-static void
-on_view_zoom_level_changed (ShumateMarkerLayer *self,
-                            GParamSpec      *pspec,
-                            ShumateViewport *view)
-{
-  g_assert (SHUMATE_IS_MARKER_LAYER (self));
+  if (!(changes & (SHUMATE_VIEWPORT_CHANGE_LOCATION | SHUMATE_VIEWPORT_CHANGE_ZOOM_LEVEL)))
+    return;
 
   shumate_marker_layer_reposition_markers (self);
 }
@@ -277,34 +259,21 @@ shumate_marker_layer_dispose (GObject *object)
   G_OBJECT_CLASS (shumate_marker_layer_parent_class)->dispose (object);
 }
 
-static void
-shumate_marker_layer_constructed (GObject *object)
-{
-  ShumateMarkerLayer *self = SHUMATE_MARKER_LAYER (object);
-  ShumateViewport *viewport;
-
-  G_OBJECT_CLASS (shumate_marker_layer_parent_class)->constructed (object);
-
-  viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
-  g_signal_connect_swapped (viewport, "notify::longitude", G_CALLBACK (on_view_longitude_changed), self);
-  g_signal_connect_swapped (viewport, "notify::latitude", G_CALLBACK (on_view_latitude_changed), self);
-  g_signal_connect_swapped (viewport, "notify::zoom-level", G_CALLBACK (on_view_zoom_level_changed), self);
-
-}
-
 static void
 shumate_marker_layer_class_init (ShumateMarkerLayerClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
+  ShumateLayerClass *layer_class = SHUMATE_LAYER_CLASS (klass);
 
   object_class->dispose = shumate_marker_layer_dispose;
   object_class->get_property = shumate_marker_layer_get_property;
   object_class->set_property = shumate_marker_layer_set_property;
-  object_class->constructed = shumate_marker_layer_constructed;
 
   widget_class->size_allocate = shumate_marker_layer_size_allocate;
 
+  layer_class->viewport_changed = shumate_marker_layer_viewport_changed;
+
   /**
    * ShumateMarkerLayer:selection-mode:
    *
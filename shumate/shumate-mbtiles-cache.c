@@ -0,0 +1,481 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * SECTION:shumate-mbtiles-cache
+ * @short_description: Stores and loads cached tiles in an MBTiles file
+ *
+ * #ShumateMbtilesCache is a cache that keeps the tiles in an
+ * [MBTiles](https://github.com/mapbox/mbtiles-spec) archive. Tiles stored
+ * while browsing a network source end up in a file that can be shipped and
+ * opened later with #ShumateMbtilesSource, for example to prepare maps for
+ * offline use.
+ *
+ * An archive holds the tiles of a single tileset, so a cache should only be
+ * used in front of one tile source. The archive is created if it doesn't
+ * exist yet; its metadata is filled in from the tile source when the first
+ * tile is stored. Tiles in the archive are not purged, but they are
+ * revalidated against the next source once they are stale, like the tiles
+ * of #ShumateFileCache: the archive records their HTTP validators and when
+ * they were stored in an extra table. Tiles the archive has no such record
+ * for, for example in an archive made by another tool, are always
+ * revalidated. They are still shown while the next source is asked, and
+ * kept as they are when it can't be reached.
+ */
+
+#define DEBUG_FLAG SHUMATE_DEBUG_CACHE
+#include "shumate-debug.h"
+
+#include "shumate-mbtiles-cache.h"
+#include "shumate-mbtiles-private.h"
+#include "shumate-tile-decoder-private.h"
+#include "shumate-tile-private.h"
+
+#include <string.h>
+
+enum
+{
+  PROP_0,
+  PROP_PATH
+};
+
+typedef struct
+{
+  char *path;
+  ShumateMbtiles *mbtiles;
+  gboolean metadata_written;
+} ShumateMbtilesCachePrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (ShumateMbtilesCache, shumate_mbtiles_cache, SHUMATE_TYPE_TILE_CACHE);
+
+static void fill_tile (ShumateMapSource *map_source,
+    ShumateTile *tile,
+    GCancellable *cancellable);
+static void store_tile (ShumateTileCache *tile_cache,
+    ShumateTile *tile,
+    GBytes *bytes);
+static void refresh_tile_time (ShumateTileCache *tile_cache,
+    ShumateTile *tile);
+static void on_tile_filled (ShumateTileCache *tile_cache,
+    ShumateTile *tile);
+
+
+static void
+shumate_mbtiles_cache_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ShumateMbtilesCache *mbtiles_cache = SHUMATE_MBTILES_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, shumate_mbtiles_cache_get_path (mbtiles_cache));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+shumate_mbtiles_cache_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ShumateMbtilesCache *mbtiles_cache = SHUMATE_MBTILES_CACHE (object);
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_free (priv->path);
+      priv->path = g_value_dup_string (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+shumate_mbtiles_cache_finalize (GObject *object)
+{
+  ShumateMbtilesCache *mbtiles_cache = SHUMATE_MBTILES_CACHE (object);
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+
+  g_clear_pointer (&priv->mbtiles, shumate_mbtiles_free);
+  g_clear_pointer (&priv->path, g_free);
+
+  G_OBJECT_CLASS (shumate_mbtiles_cache_parent_class)->finalize (object);
+}
+
+
+static void
+shumate_mbtiles_cache_constructed (GObject *object)
+{
+  ShumateMbtilesCache *mbtiles_cache = SHUMATE_MBTILES_CACHE (object);
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+  g_autoptr(GError) error = NULL;
+
+  G_OBJECT_CLASS (shumate_mbtiles_cache_parent_class)->constructed (object);
+
+  if (!priv->path)
+    {
+      g_warning ("ShumateMbtilesCache created without a path");
+      return;
+    }
+
+  priv->mbtiles = shumate_mbtiles_open (priv->path, TRUE, &error);
+  if (!priv->mbtiles)
+    g_warning ("%s", error->message);
+}
+
+
+static void
+shumate_mbtiles_cache_class_init (ShumateMbtilesCacheClass *klass)
+{
+  ShumateMapSourceClass *map_source_class = SHUMATE_MAP_SOURCE_CLASS (klass);
+  ShumateTileCacheClass *tile_cache_class = SHUMATE_TILE_CACHE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *pspec;
+
+  object_class->finalize = shumate_mbtiles_cache_finalize;
+  object_class->get_property = shumate_mbtiles_cache_get_property;
+  object_class->set_property = shumate_mbtiles_cache_set_property;
+  object_class->constructed = shumate_mbtiles_cache_constructed;
+
+  /**
+   * ShumateMbtilesCache:path:
+   *
+   * The path of the MBTiles file the tiles are stored in.
+   */
+  pspec = g_param_spec_string ("path",
+        "Path",
+        "The path of the MBTiles file",
+        NULL,
+        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_PATH, pspec);
+
+  tile_cache_class->store_tile = store_tile;
+  tile_cache_class->refresh_tile_time = refresh_tile_time;
+  tile_cache_class->on_tile_filled = on_tile_filled;
+
+  map_source_class->fill_tile = fill_tile;
+}
+
+
+static void
+shumate_mbtiles_cache_init (ShumateMbtilesCache *mbtiles_cache)
+{
+}
+
+
+/**
+ * shumate_mbtiles_cache_new_full:
+ * @path: the path of the MBTiles file, created if it doesn't exist
+ *
+ * Constructor of #ShumateMbtilesCache.
+ *
+ * Returns: a constructed #ShumateMbtilesCache
+ */
+ShumateMbtilesCache *
+shumate_mbtiles_cache_new_full (const char *path)
+{
+  return g_object_new (SHUMATE_TYPE_MBTILES_CACHE,
+        "path", path,
+        NULL);
+}
+
+
+/**
+ * shumate_mbtiles_cache_get_path:
+ * @mbtiles_cache: a #ShumateMbtilesCache
+ *
+ * Gets the path of the MBTiles file the tiles are stored in.
+ *
+ * Returns: the path of the file
+ */
+const char *
+shumate_mbtiles_cache_get_path (ShumateMbtilesCache *mbtiles_cache)
+{
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MBTILES_CACHE (mbtiles_cache), NULL);
+
+  return priv->path;
+}
+
+
+typedef struct
+{
+  ShumateMbtilesCache *self;
+  ShumateTile *tile;
+  GCancellable *cancellable;
+  gboolean has_info;
+  char *etag;
+  gint64 modified;
+  gint64 expiry_time;
+} TileDecodedData;
+
+static void
+tile_decoded_data_free (TileDecodedData *data)
+{
+  g_clear_object (&data->self);
+  g_clear_object (&data->tile);
+  g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->etag, g_free);
+  g_slice_free (TileDecodedData, data);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (TileDecodedData, tile_decoded_data_free)
+
+
+/* Finishes loading a tile whose data is in the file, decoded or not */
+static void
+on_tile_loaded (TileDecodedData *data)
+{
+  ShumateTile *tile = data->tile;
+
+  shumate_tile_set_state (tile, SHUMATE_STATE_LOADED);
+
+  if (data->has_info)
+    {
+      g_autoptr(GDateTime) modified_time = g_date_time_new_from_unix_utc (data->modified);
+
+      if (data->etag)
+        shumate_tile_set_etag (tile, data->etag);
+      shumate_tile_set_modified_time (tile, modified_time);
+      shumate_tile_set_expiry_time (tile, data->expiry_time);
+    }
+
+  /* Tiles the archive has no record for are always revalidated */
+  shumate_tile_finish_cached (SHUMATE_MAP_SOURCE (data->self),
+                              tile,
+                              !data->has_info || shumate_tile_is_expired (tile),
+                              data->cancellable);
+}
+
+
+static void
+on_tile_decoded (GObject *source_object,
+                 GAsyncResult *res,
+                 gpointer user_data)
+{
+  g_autoptr(TileDecodedData) data = user_data;
+
+  if (!shumate_tile_decode_finish_for_source (res, SHUMATE_MAP_SOURCE (data->self),
+                                              data->tile, data->cancellable))
+    return;
+
+  on_tile_loaded (data);
+}
+
+
+static void
+fill_tile (ShumateMapSource *map_source,
+           ShumateTile      *tile,
+           GCancellable     *cancellable)
+{
+  ShumateMbtilesCache *self = (ShumateMbtilesCache *)map_source;
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (self);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+
+  g_return_if_fail (SHUMATE_IS_MBTILES_CACHE (self));
+  g_return_if_fail (SHUMATE_IS_TILE (tile));
+
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
+    return;
+
+  if (shumate_tile_get_state (tile) != SHUMATE_STATE_LOADED && priv->mbtiles)
+    {
+      g_autoptr(GBytes) bytes = NULL;
+      TileDecodedData *data;
+
+      bytes = shumate_mbtiles_read_tile (priv->mbtiles,
+          shumate_tile_get_x (tile),
+          shumate_tile_get_y (tile),
+          shumate_tile_get_zoom_level (tile));
+
+      if (bytes)
+        {
+          data = g_slice_new0 (TileDecodedData);
+          data->self = g_object_ref (self);
+          data->tile = g_object_ref (tile);
+          if (cancellable)
+            data->cancellable = g_object_ref (cancellable);
+          data->has_info = shumate_mbtiles_read_tile_info (priv->mbtiles,
+              shumate_tile_get_x (tile),
+              shumate_tile_get_y (tile),
+              shumate_tile_get_zoom_level (tile),
+              &data->etag,
+              &data->modified,
+              &data->expiry_time);
+
+          /* The tile was checked when it was stored, it only needs to be there */
+          if (shumate_tile_get_store_only (tile))
+            {
+              on_tile_loaded (data);
+              tile_decoded_data_free (data);
+              return;
+            }
+
+          shumate_tile_decode_async (bytes,
+              tile,
+              cancellable,
+              on_tile_decoded,
+              data);
+          return;
+        }
+    }
+
+  if (SHUMATE_IS_MAP_SOURCE (next_source))
+    shumate_map_source_fill_tile (next_source, tile, cancellable);
+  else
+    {
+      /* Last source of the chain: the tile is used as it is, even if it
+       * wasn't validated or has nothing to show */
+      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+    }
+}
+
+
+static const char *
+guess_format (GBytes *bytes)
+{
+  gsize size;
+  const guint8 *data = g_bytes_get_data (bytes, &size);
+
+  if (size >= 8 && memcmp (data, "\x89PNG\r\n\x1a\n", 8) == 0)
+    return "png";
+  if (size >= 3 && memcmp (data, "\xff\xd8\xff", 3) == 0)
+    return "jpg";
+  if (size >= 12 && memcmp (data, "RIFF", 4) == 0 && memcmp (data + 8, "WEBP", 4) == 0)
+    return "webp";
+
+  return NULL;
+}
+
+
+/* Describes the tileset in the archive, as required by the specification */
+static void
+write_metadata (ShumateMbtilesCache *mbtiles_cache,
+    GBytes *bytes)
+{
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+  ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (mbtiles_cache);
+  g_autofree char *min_zoom = NULL;
+  g_autofree char *max_zoom = NULL;
+  const char *format;
+
+  if (priv->metadata_written)
+    return;
+
+  priv->metadata_written = TRUE;
+
+  min_zoom = g_strdup_printf ("%u", shumate_map_source_get_min_zoom_level (map_source));
+  max_zoom = g_strdup_printf ("%u", shumate_map_source_get_max_zoom_level (map_source));
+
+  shumate_mbtiles_set_metadata (priv->mbtiles, "name", shumate_map_source_get_name (map_source));
+  shumate_mbtiles_set_metadata (priv->mbtiles, "attribution", shumate_map_source_get_license (map_source));
+  shumate_mbtiles_set_metadata (priv->mbtiles, "minzoom", min_zoom);
+  shumate_mbtiles_set_metadata (priv->mbtiles, "maxzoom", max_zoom);
+
+  format = guess_format (bytes);
+  if (format)
+    shumate_mbtiles_set_metadata (priv->mbtiles, "format", format);
+}
+
+
+static void
+store_tile (ShumateTileCache *tile_cache,
+    ShumateTile *tile,
+    GBytes *bytes)
+{
+  g_return_if_fail (SHUMATE_IS_MBTILES_CACHE (tile_cache));
+
+  ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (tile_cache);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+  ShumateMbtilesCache *mbtiles_cache = SHUMATE_MBTILES_CACHE (tile_cache);
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+
+  DEBUG ("Update of %p", tile);
+
+  if (priv->mbtiles)
+    {
+      write_metadata (mbtiles_cache, bytes);
+      if (shumate_mbtiles_write_tile (priv->mbtiles,
+              shumate_tile_get_x (tile),
+              shumate_tile_get_y (tile),
+              shumate_tile_get_zoom_level (tile),
+              bytes))
+        shumate_mbtiles_write_tile_info (priv->mbtiles,
+            shumate_tile_get_x (tile),
+            shumate_tile_get_y (tile),
+            shumate_tile_get_zoom_level (tile),
+            shumate_tile_get_etag (tile),
+            g_get_real_time () / G_USEC_PER_SEC,
+            shumate_tile_get_expiry_time (tile));
+    }
+
+  if (SHUMATE_IS_TILE_CACHE (next_source))
+    shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (next_source), tile, bytes);
+}
+
+
+static void
+refresh_tile_time (ShumateTileCache *tile_cache,
+    ShumateTile *tile)
+{
+  g_return_if_fail (SHUMATE_IS_MBTILES_CACHE (tile_cache));
+
+  ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (tile_cache);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+  ShumateMbtilesCache *mbtiles_cache = SHUMATE_MBTILES_CACHE (tile_cache);
+  ShumateMbtilesCachePrivate *priv = shumate_mbtiles_cache_get_instance_private (mbtiles_cache);
+
+  /* The server confirmed the tile didn't change, it is fresh again */
+  if (priv->mbtiles)
+    shumate_mbtiles_write_tile_info (priv->mbtiles,
+        shumate_tile_get_x (tile),
+        shumate_tile_get_y (tile),
+        shumate_tile_get_zoom_level (tile),
+        shumate_tile_get_etag (tile),
+        g_get_real_time () / G_USEC_PER_SEC,
+        shumate_tile_get_expiry_time (tile));
+
+  if (SHUMATE_IS_TILE_CACHE (next_source))
+    shumate_tile_cache_refresh_tile_time (SHUMATE_TILE_CACHE (next_source), tile);
+}
+
+
+static void
+on_tile_filled (ShumateTileCache *tile_cache,
+    ShumateTile *tile)
+{
+  g_return_if_fail (SHUMATE_IS_MBTILES_CACHE (tile_cache));
+
+  ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (tile_cache);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+
+  if (SHUMATE_IS_TILE_CACHE (next_source))
+    shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#if !defined (__SHUMATE_SHUMATE_H_INSIDE__) && !defined (SHUMATE_COMPILATION)
+#error "Only <shumate/shumate.h> can be included directly."
+#endif
+
+#ifndef __SHUMATE_MBTILES_CACHE_H__
+#define __SHUMATE_MBTILES_CACHE_H__
+
+#include <glib-object.h>
+#include <shumate/shumate-tile-cache.h>
+
+G_BEGIN_DECLS
+
+#define SHUMATE_TYPE_MBTILES_CACHE shumate_mbtiles_cache_get_type ()
+G_DECLARE_DERIVABLE_TYPE (ShumateMbtilesCache, shumate_mbtiles_cache, SHUMATE, MBTILES_CACHE, ShumateTileCache)
+
+/**
+ * ShumateMbtilesCache:
+ *
+ * The #ShumateMbtilesCache structure contains only private data
+ * and should be accessed using the provided API
+ */
+struct _ShumateMbtilesCacheClass
+{
+  ShumateTileCacheClass parent_class;
+};
+
+ShumateMbtilesCache *shumate_mbtiles_cache_new_full (const char *path);
+
+const char *shumate_mbtiles_cache_get_path (ShumateMbtilesCache *mbtiles_cache);
+
+G_END_DECLS
+
+#endif /* __SHUMATE_MBTILES_CACHE_H__ */
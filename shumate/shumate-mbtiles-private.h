@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHUMATE_MBTILES_PRIVATE_H__
+#define __SHUMATE_MBTILES_PRIVATE_H__
+
+#include <gio/gio.h>
+
+/*
+ * Access to an MBTiles archive, shared by #ShumateMbtilesSource and
+ * #ShumateMbtilesCache. See https://github.com/mapbox/mbtiles-spec
+ */
+typedef struct _ShumateMbtiles ShumateMbtiles;
+
+ShumateMbtiles *shumate_mbtiles_open (const char  *path,
+                                      gboolean     writable,
+                                      GError     **error);
+void shumate_mbtiles_free (ShumateMbtiles *mbtiles);
+
+char *shumate_mbtiles_get_metadata (ShumateMbtiles *mbtiles,
+                                    const char     *name);
+void shumate_mbtiles_set_metadata (ShumateMbtiles *mbtiles,
+                                   const char     *name,
+                                   const char     *value);
+
+GBytes *shumate_mbtiles_read_tile (ShumateMbtiles *mbtiles,
+                                   guint           x,
+                                   guint           y,
+                                   guint           zoom_level);
+gboolean shumate_mbtiles_write_tile (ShumateMbtiles *mbtiles,
+                                     guint           x,
+                                     guint           y,
+                                     guint           zoom_level,
+                                     GBytes         *bytes);
+gboolean shumate_mbtiles_read_tile_info (ShumateMbtiles  *mbtiles,
+                                         guint            x,
+                                         guint            y,
+                                         guint            zoom_level,
+                                         char           **etag,
+                                         gint64          *modified,
+                                         gint64          *expiry_time);
+void shumate_mbtiles_write_tile_info (ShumateMbtiles *mbtiles,
+                                      guint           x,
+                                      guint           y,
+                                      guint           zoom_level,
+                                      const char     *etag,
+                                      gint64          modified,
+                                      gint64          expiry_time);
+void shumate_mbtiles_commit (ShumateMbtiles *mbtiles);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ShumateMbtiles, shumate_mbtiles_free)
+
+#endif /* __SHUMATE_MBTILES_PRIVATE_H__ */
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * SECTION:shumate-mbtiles-source
+ * @short_description: A tile source serving tiles from an MBTiles file
+ *
+ * #ShumateMbtilesSource loads tiles from an
+ * [MBTiles](https://github.com/mapbox/mbtiles-spec) archive, an SQLite
+ * database of prerendered raster tiles, so maps can be shown without any
+ * network access. Tiles missing from the archive are requested from the next
+ * source of the chain.
+ *
+ * When no #ShumateMapSource:id is given at construction, the source takes its
+ * name, license and zoom levels from the metadata table of the archive. Its
+ * id is derived from the location of the file, so that two archives with
+ * the same name don't share cached tiles.
+ *
+ * Use #ShumateMbtilesCache to populate an archive from another source.
+ */
+
+#define DEBUG_FLAG SHUMATE_DEBUG_LOADING
+#include "shumate-debug.h"
+
+#include "shumate-mbtiles-source.h"
+#include "shumate-mbtiles-private.h"
+#include "shumate-tile-decoder-private.h"
+#include "shumate-tile-private.h"
+
+#include <stdlib.h>
+
+enum
+{
+  PROP_0,
+  PROP_PATH
+};
+
+typedef struct
+{
+  char *path;
+  ShumateMbtiles *mbtiles;
+} ShumateMbtilesSourcePrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (ShumateMbtilesSource, shumate_mbtiles_source, SHUMATE_TYPE_TILE_SOURCE);
+
+static void fill_tile (ShumateMapSource *map_source,
+    ShumateTile *tile,
+    GCancellable *cancellable);
+
+
+static void
+shumate_mbtiles_source_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ShumateMbtilesSource *mbtiles_source = SHUMATE_MBTILES_SOURCE (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, shumate_mbtiles_source_get_path (mbtiles_source));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+shumate_mbtiles_source_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ShumateMbtilesSource *mbtiles_source = SHUMATE_MBTILES_SOURCE (object);
+  ShumateMbtilesSourcePrivate *priv = shumate_mbtiles_source_get_instance_private (mbtiles_source);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_free (priv->path);
+      priv->path = g_value_dup_string (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+shumate_mbtiles_source_finalize (GObject *object)
+{
+  ShumateMbtilesSource *mbtiles_source = SHUMATE_MBTILES_SOURCE (object);
+  ShumateMbtilesSourcePrivate *priv = shumate_mbtiles_source_get_instance_private (mbtiles_source);
+
+  g_clear_pointer (&priv->mbtiles, shumate_mbtiles_free);
+  g_clear_pointer (&priv->path, g_free);
+
+  G_OBJECT_CLASS (shumate_mbtiles_source_parent_class)->finalize (object);
+}
+
+
+/*
+ * The id keys the texture cache, shared by the whole process, and names a
+ * directory of #ShumateFileCache: it is made from the canonical path of the
+ * file rather than from its free-text name.
+ */
+static char *
+get_source_id (const char *path)
+{
+  g_autofree char *canonical_path = g_canonicalize_filename (path, NULL);
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, canonical_path, -1);
+
+  return g_strconcat ("mbtiles-", checksum, NULL);
+}
+
+
+/* Describes the source from the metadata table of the archive */
+static void
+load_metadata (ShumateMbtilesSource *mbtiles_source)
+{
+  ShumateMbtilesSourcePrivate *priv = shumate_mbtiles_source_get_instance_private (mbtiles_source);
+  ShumateTileSource *tile_source = SHUMATE_TILE_SOURCE (mbtiles_source);
+  g_autofree char *id = NULL;
+  g_autofree char *name = NULL;
+  g_autofree char *attribution = NULL;
+  g_autofree char *min_zoom = NULL;
+  g_autofree char *max_zoom = NULL;
+
+  name = shumate_mbtiles_get_metadata (priv->mbtiles, "name");
+  if (!name)
+    name = g_path_get_basename (priv->path);
+
+  id = get_source_id (priv->path);
+  shumate_tile_source_set_id (tile_source, id);
+  shumate_tile_source_set_name (tile_source, name);
+
+  attribution = shumate_mbtiles_get_metadata (priv->mbtiles, "attribution");
+  if (attribution)
+    shumate_tile_source_set_license (tile_source, attribution);
+
+  min_zoom = shumate_mbtiles_get_metadata (priv->mbtiles, "minzoom");
+  if (min_zoom)
+    shumate_tile_source_set_min_zoom_level (tile_source, CLAMP (atoi (min_zoom), 0, 30));
+
+  max_zoom = shumate_mbtiles_get_metadata (priv->mbtiles, "maxzoom");
+  if (max_zoom)
+    shumate_tile_source_set_max_zoom_level (tile_source, CLAMP (atoi (max_zoom), 0, 30));
+}
+
+
+static void
+shumate_mbtiles_source_constructed (GObject *object)
+{
+  ShumateMbtilesSource *mbtiles_source = SHUMATE_MBTILES_SOURCE (object);
+  ShumateMbtilesSourcePrivate *priv = shumate_mbtiles_source_get_instance_private (mbtiles_source);
+  g_autoptr(GError) error = NULL;
+
+  G_OBJECT_CLASS (shumate_mbtiles_source_parent_class)->constructed (object);
+
+  if (!priv->path)
+    {
+      g_warning ("ShumateMbtilesSource created without a path");
+      return;
+    }
+
+  priv->mbtiles = shumate_mbtiles_open (priv->path, FALSE, &error);
+  if (!priv->mbtiles)
+    {
+      g_warning ("%s", error->message);
+      return;
+    }
+
+  if (!shumate_map_source_get_id (SHUMATE_MAP_SOURCE (mbtiles_source)))
+    load_metadata (mbtiles_source);
+}
+
+
+static void
+shumate_mbtiles_source_class_init (ShumateMbtilesSourceClass *klass)
+{
+  ShumateMapSourceClass *map_source_class = SHUMATE_MAP_SOURCE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *pspec;
+
+  object_class->finalize = shumate_mbtiles_source_finalize;
+  object_class->get_property = shumate_mbtiles_source_get_property;
+  object_class->set_property = shumate_mbtiles_source_set_property;
+  object_class->constructed = shumate_mbtiles_source_constructed;
+
+  map_source_class->fill_tile = fill_tile;
+
+  /**
+   * ShumateMbtilesSource:path:
+   *
+   * The path of the MBTiles file the tiles are read from.
+   */
+  pspec = g_param_spec_string ("path",
+        "Path",
+        "The path of the MBTiles file",
+        NULL,
+        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_PATH, pspec);
+}
+
+
+static void
+shumate_mbtiles_source_init (ShumateMbtilesSource *mbtiles_source)
+{
+}
+
+
+/**
+ * shumate_mbtiles_source_new_full:
+ * @path: the path of an MBTiles file
+ *
+ * Constructor of #ShumateMbtilesSource. The source is described by the
+ * metadata stored in the file.
+ *
+ * Returns: a constructed #ShumateMbtilesSource
+ */
+ShumateMbtilesSource *
+shumate_mbtiles_source_new_full (const char *path)
+{
+  return g_object_new (SHUMATE_TYPE_MBTILES_SOURCE,
+        "path", path,
+        NULL);
+}
+
+
+/**
+ * shumate_mbtiles_source_get_path:
+ * @mbtiles_source: a #ShumateMbtilesSource
+ *
+ * Gets the path of the MBTiles file the tiles are read from.
+ *
+ * Returns: the path of the file
+ */
+const char *
+shumate_mbtiles_source_get_path (ShumateMbtilesSource *mbtiles_source)
+{
+  ShumateMbtilesSourcePrivate *priv = shumate_mbtiles_source_get_instance_private (mbtiles_source);
+
+  g_return_val_if_fail (SHUMATE_IS_MBTILES_SOURCE (mbtiles_source), NULL);
+
+  return priv->path;
+}
+
+
+static void
+fill_tile (ShumateMapSource *map_source,
+           ShumateTile      *tile,
+           GCancellable     *cancellable)
+{
+  ShumateMbtilesSource *self = (ShumateMbtilesSource *)map_source;
+  ShumateMbtilesSourcePrivate *priv = shumate_mbtiles_source_get_instance_private (self);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+
+  g_return_if_fail (SHUMATE_IS_MBTILES_SOURCE (self));
+  g_return_if_fail (SHUMATE_IS_TILE (tile));
+
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
+    return;
+
+  if (shumate_tile_get_state (tile) != SHUMATE_STATE_LOADED && priv->mbtiles)
+    {
+      g_autoptr(GBytes) bytes = NULL;
+
+      bytes = shumate_mbtiles_read_tile (priv->mbtiles,
+          shumate_tile_get_x (tile),
+          shumate_tile_get_y (tile),
+          shumate_tile_get_zoom_level (tile));
+
+      if (bytes)
+        {
+          shumate_tile_decode_for_source (bytes, map_source, tile, cancellable);
+          return;
+        }
+    }
+
+  if (SHUMATE_IS_MAP_SOURCE (next_source))
+    shumate_map_source_fill_tile (next_source, tile, cancellable);
+  else
+    {
+      /* Last source of the chain: the tile is used as it is, even if it
+       * wasn't validated or has nothing to show */
+      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+    }
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Reads and writes tiles of an MBTiles archive: an SQLite database with a
+ * `tiles` table keyed by zoom_level, tile_column and tile_row, and a
+ * `metadata` table of name/value pairs describing the tileset.
+ *
+ * MBTiles uses the TMS tiling scheme, whose rows are counted from the
+ * bottom of the map, so the y coordinate is flipped on the way in and out.
+ *
+ * Writes are grouped in a transaction which is committed shortly after the
+ * first write, or when shumate_mbtiles_commit() is called. A commit that
+ * finds the database busy is retried a few times before the writes are
+ * rolled back, so that a failure never leaves a transaction open.
+ *
+ * Writable archives also get a `shumate_tile_info` table, which is not part
+ * of the specification and is ignored by other readers. It records the
+ * HTTP validators of each tile and when it was stored, so that a cache can
+ * tell when its tiles need to be revalidated.
+ */
+
+#define DEBUG_FLAG SHUMATE_DEBUG_CACHE
+#include "shumate-debug.h"
+
+#include "shumate-mbtiles-private.h"
+
+#include <sqlite3.h>
+
+/* Writes are grouped in a transaction committed after this delay */
+#define COMMIT_INTERVAL_MS 500
+/* Commits retried this many times while the database is busy */
+#define MAX_COMMIT_RETRIES 10
+
+struct _ShumateMbtiles
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmt_select_tile;
+  sqlite3_stmt *stmt_store_tile;
+  sqlite3_stmt *stmt_select_metadata;
+  sqlite3_stmt *stmt_store_metadata;
+  sqlite3_stmt *stmt_select_info;
+  sqlite3_stmt *stmt_store_info;
+
+  guint commit_source_id;
+  guint commit_retries;
+};
+
+
+static inline guint
+flip_y (guint y,
+        guint zoom_level)
+{
+  return (1u << zoom_level) - 1 - y;
+}
+
+
+static sqlite3_stmt *
+prepare (ShumateMbtiles *self,
+         const char     *query)
+{
+  sqlite3_stmt *stmt = NULL;
+
+  if (sqlite3_prepare_v2 (self->db, query, -1, &stmt, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Failed to prepare '%s': %s", query, sqlite3_errmsg (self->db));
+      return NULL;
+    }
+
+  return stmt;
+}
+
+
+ShumateMbtiles *
+shumate_mbtiles_open (const char  *path,
+                      gboolean     writable,
+                      GError     **error)
+{
+  g_autoptr(ShumateMbtiles) self = NULL;
+  int flags;
+  int sql_rc;
+
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  self = g_slice_new0 (ShumateMbtiles);
+
+  if (writable)
+    flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  else
+    flags = SQLITE_OPEN_READONLY;
+
+  sql_rc = sqlite3_open_v2 (path, &self->db, flags | SQLITE_OPEN_NOMUTEX, NULL);
+  if (sql_rc != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to open '%s': %s", path, sqlite3_errmsg (self->db));
+      return NULL;
+    }
+
+  if (writable)
+    {
+      char *error_msg = NULL;
+
+      sqlite3_exec (self->db,
+                    "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+                    "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name);"
+                    "CREATE TABLE IF NOT EXISTS tiles ("
+                    "  zoom_level INTEGER,"
+                    "  tile_column INTEGER,"
+                    "  tile_row INTEGER,"
+                    "  tile_data BLOB);"
+                    "CREATE UNIQUE INDEX IF NOT EXISTS tile_index"
+                    "  ON tiles (zoom_level, tile_column, tile_row);"
+                    "CREATE TABLE IF NOT EXISTS shumate_tile_info ("
+                    "  zoom_level INTEGER,"
+                    "  tile_column INTEGER,"
+                    "  tile_row INTEGER,"
+                    "  etag TEXT,"
+                    "  modified INTEGER,"
+                    "  expiry_time INTEGER);"
+                    "CREATE UNIQUE INDEX IF NOT EXISTS shumate_tile_info_index"
+                    "  ON shumate_tile_info (zoom_level, tile_column, tile_row);",
+                    NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Failed to set up '%s': %s", path, error_msg);
+          sqlite3_free (error_msg);
+          return NULL;
+        }
+
+      self->stmt_store_tile = prepare (self, "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)");
+      self->stmt_store_metadata = prepare (self, "REPLACE INTO metadata (name, value) VALUES (?, ?)");
+      self->stmt_store_info = prepare (self, "REPLACE INTO shumate_tile_info (zoom_level, tile_column, tile_row, etag, modified, expiry_time) VALUES (?, ?, ?, ?, ?, ?)");
+      self->stmt_select_info = prepare (self, "SELECT etag, modified, expiry_time FROM shumate_tile_info WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?");
+    }
+
+  self->stmt_select_tile = prepare (self, "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?");
+  self->stmt_select_metadata = prepare (self, "SELECT value FROM metadata WHERE name = ?");
+
+  if (!self->stmt_select_tile)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "'%s' is not an MBTiles file", path);
+      return NULL;
+    }
+
+  return g_steal_pointer (&self);
+}
+
+
+void
+shumate_mbtiles_free (ShumateMbtiles *self)
+{
+  if (self == NULL)
+    return;
+
+  shumate_mbtiles_commit (self);
+
+  g_clear_pointer (&self->stmt_select_tile, sqlite3_finalize);
+  g_clear_pointer (&self->stmt_store_tile, sqlite3_finalize);
+  g_clear_pointer (&self->stmt_select_metadata, sqlite3_finalize);
+  g_clear_pointer (&self->stmt_store_metadata, sqlite3_finalize);
+  g_clear_pointer (&self->stmt_select_info, sqlite3_finalize);
+  g_clear_pointer (&self->stmt_store_info, sqlite3_finalize);
+  g_clear_pointer (&self->db, sqlite3_close);
+
+  g_slice_free (ShumateMbtiles, self);
+}
+
+
+char *
+shumate_mbtiles_get_metadata (ShumateMbtiles *self,
+                              const char     *name)
+{
+  char *value = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (name != NULL, NULL);
+
+  if (!self->stmt_select_metadata)
+    return NULL;
+
+  sqlite3_reset (self->stmt_select_metadata);
+  sqlite3_bind_text (self->stmt_select_metadata, 1, name, -1, SQLITE_STATIC);
+
+  if (sqlite3_step (self->stmt_select_metadata) == SQLITE_ROW)
+    value = g_strdup ((const char *) sqlite3_column_text (self->stmt_select_metadata, 0));
+
+  sqlite3_reset (self->stmt_select_metadata);
+
+  return value;
+}
+
+
+/*
+ * Commits the open transaction. Returns %FALSE if the database was busy and
+ * the commit should be tried again later, otherwise the transaction is over:
+ * committed, or rolled back if the commit failed.
+ */
+static gboolean
+end_transaction (ShumateMbtiles *self,
+                 gboolean        can_retry)
+{
+  int sql_rc;
+
+  sql_rc = sqlite3_exec (self->db, "COMMIT", NULL, NULL, NULL);
+  if (sql_rc == SQLITE_OK)
+    {
+      self->commit_retries = 0;
+      return TRUE;
+    }
+
+  if (sql_rc == SQLITE_BUSY && can_retry && self->commit_retries < MAX_COMMIT_RETRIES)
+    {
+      self->commit_retries++;
+      DEBUG ("MBTiles file is busy, committing again later");
+      return FALSE;
+    }
+
+  DEBUG ("Committing MBTiles changes failed: %s", sqlite3_errmsg (self->db));
+
+  /* Some errors roll the transaction back already */
+  if (!sqlite3_get_autocommit (self->db))
+    sqlite3_exec (self->db, "ROLLBACK", NULL, NULL, NULL);
+
+  self->commit_retries = 0;
+  return TRUE;
+}
+
+
+static gboolean
+commit_cb (gpointer user_data)
+{
+  ShumateMbtiles *self = user_data;
+
+  if (!end_transaction (self, TRUE))
+    return G_SOURCE_CONTINUE;
+
+  /* The source is about to be destroyed, don't remove it again */
+  self->commit_source_id = 0;
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+begin_transaction (ShumateMbtiles *self)
+{
+  char *error_msg = NULL;
+
+  if (self->commit_source_id != 0)
+    return;
+
+  sqlite3_exec (self->db, "BEGIN", NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      DEBUG ("Starting a transaction failed: %s", error_msg);
+      sqlite3_free (error_msg);
+      return;
+    }
+
+  self->commit_source_id = g_timeout_add (COMMIT_INTERVAL_MS, commit_cb, self);
+}
+
+
+void
+shumate_mbtiles_commit (ShumateMbtiles *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (self->commit_source_id == 0)
+    return;
+
+  g_clear_handle_id (&self->commit_source_id, g_source_remove);
+  end_transaction (self, FALSE);
+}
+
+
+void
+shumate_mbtiles_set_metadata (ShumateMbtiles *self,
+                              const char     *name,
+                              const char     *value)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (name != NULL);
+
+  if (!self->stmt_store_metadata)
+    return;
+
+  begin_transaction (self);
+
+  sqlite3_reset (self->stmt_store_metadata);
+  sqlite3_bind_text (self->stmt_store_metadata, 1, name, -1, SQLITE_STATIC);
+  sqlite3_bind_text (self->stmt_store_metadata, 2, value, -1, SQLITE_STATIC);
+  if (sqlite3_step (self->stmt_store_metadata) != SQLITE_DONE)
+    DEBUG ("Storing metadata '%s' failed: %s", name, sqlite3_errmsg (self->db));
+  sqlite3_reset (self->stmt_store_metadata);
+}
+
+
+GBytes *
+shumate_mbtiles_read_tile (ShumateMbtiles *self,
+                           guint           x,
+                           guint           y,
+                           guint           zoom_level)
+{
+  GBytes *bytes = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  if (zoom_level > 30 || y >= (1u << zoom_level))
+    return NULL;
+
+  sqlite3_reset (self->stmt_select_tile);
+  sqlite3_bind_int (self->stmt_select_tile, 1, zoom_level);
+  sqlite3_bind_int (self->stmt_select_tile, 2, x);
+  sqlite3_bind_int (self->stmt_select_tile, 3, flip_y (y, zoom_level));
+
+  if (sqlite3_step (self->stmt_select_tile) == SQLITE_ROW)
+    bytes = g_bytes_new (sqlite3_column_blob (self->stmt_select_tile, 0),
+                         sqlite3_column_bytes (self->stmt_select_tile, 0));
+
+  sqlite3_reset (self->stmt_select_tile);
+
+  return bytes;
+}
+
+
+gboolean
+shumate_mbtiles_write_tile (ShumateMbtiles *self,
+                            guint           x,
+                            guint           y,
+                            guint           zoom_level,
+                            GBytes         *bytes)
+{
+  gsize size;
+  gconstpointer data;
+  gboolean ok;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (bytes != NULL, FALSE);
+
+  if (!self->stmt_store_tile || zoom_level > 30 || y >= (1u << zoom_level))
+    return FALSE;
+
+  begin_transaction (self);
+
+  data = g_bytes_get_data (bytes, &size);
+
+  sqlite3_reset (self->stmt_store_tile);
+  sqlite3_bind_int (self->stmt_store_tile, 1, zoom_level);
+  sqlite3_bind_int (self->stmt_store_tile, 2, x);
+  sqlite3_bind_int (self->stmt_store_tile, 3, flip_y (y, zoom_level));
+  sqlite3_bind_blob (self->stmt_store_tile, 4, data, size, SQLITE_STATIC);
+
+  ok = sqlite3_step (self->stmt_store_tile) == SQLITE_DONE;
+  if (!ok)
+    DEBUG ("Storing tile %u/%u/%u failed: %s", zoom_level, x, y, sqlite3_errmsg (self->db));
+
+  sqlite3_reset (self->stmt_store_tile);
+
+  return ok;
+}
+
+
+gboolean
+shumate_mbtiles_read_tile_info (ShumateMbtiles  *self,
+                                guint            x,
+                                guint            y,
+                                guint            zoom_level,
+                                char           **etag,
+                                gint64          *modified,
+                                gint64          *expiry_time)
+{
+  gboolean found = FALSE;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  if (!self->stmt_select_info || zoom_level > 30 || y >= (1u << zoom_level))
+    return FALSE;
+
+  sqlite3_reset (self->stmt_select_info);
+  sqlite3_bind_int (self->stmt_select_info, 1, zoom_level);
+  sqlite3_bind_int (self->stmt_select_info, 2, x);
+  sqlite3_bind_int (self->stmt_select_info, 3, flip_y (y, zoom_level));
+
+  if (sqlite3_step (self->stmt_select_info) == SQLITE_ROW)
+    {
+      found = TRUE;
+      if (etag)
+        *etag = g_strdup ((const char *) sqlite3_column_text (self->stmt_select_info, 0));
+      if (modified)
+        *modified = sqlite3_column_int64 (self->stmt_select_info, 1);
+      if (expiry_time)
+        *expiry_time = sqlite3_column_int64 (self->stmt_select_info, 2);
+    }
+
+  sqlite3_reset (self->stmt_select_info);
+
+  return found;
+}
+
+
+void
+shumate_mbtiles_write_tile_info (ShumateMbtiles *self,
+                                 guint           x,
+                                 guint           y,
+                                 guint           zoom_level,
+                                 const char     *etag,
+                                 gint64          modified,
+                                 gint64          expiry_time)
+{
+  g_return_if_fail (self != NULL);
+
+  if (!self->stmt_store_info || zoom_level > 30 || y >= (1u << zoom_level))
+    return;
+
+  begin_transaction (self);
+
+  sqlite3_reset (self->stmt_store_info);
+  sqlite3_bind_int (self->stmt_store_info, 1, zoom_level);
+  sqlite3_bind_int (self->stmt_store_info, 2, x);
+  sqlite3_bind_int (self->stmt_store_info, 3, flip_y (y, zoom_level));
+  sqlite3_bind_text (self->stmt_store_info, 4, etag, -1, SQLITE_STATIC);
+  sqlite3_bind_int64 (self->stmt_store_info, 5, modified);
+  sqlite3_bind_int64 (self->stmt_store_info, 6, expiry_time);
+
+  if (sqlite3_step (self->stmt_store_info) != SQLITE_DONE)
+    DEBUG ("Storing the info of tile %u/%u/%u failed: %s", zoom_level, x, y, sqlite3_errmsg (self->db));
+
+  sqlite3_reset (self->stmt_store_info);
+}
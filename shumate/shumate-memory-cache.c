@@ -25,12 +25,40 @@
  * memory. The cache contents is not preserved between application restarts
  * so this cache serves mostly as a quick access temporary cache to the
  * most recently used tiles.
+ *
+ * Tiles whose decoded texture is still kept by the default
+ * #ShumateTextureCache are filled with it directly, without decoding the
+ * stored tile data again.
+ *
+ * The cache can be bounded by the number of tiles, with
+ * #ShumateMemoryCache:size-limit, and by the size of their data, with
+ * #ShumateMemoryCache:byte-limit. The tile data is shared with the other
+ * sources of the chain rather than copied.
+ *
+ * By default the least recently used tiles are dropped first. Jumping far
+ * away or downloading a region brings many tiles that are only seen once,
+ * which push the tiles around the usual places out of such a cache. The
+ * %SHUMATE_MEMORY_CACHE_POLICY_TWO_Q #ShumateMemoryCache:policy only keeps
+ * tiles for long once they have been seen twice.
+ *
+ * When the system runs low on memory, as reported by #GMemoryMonitor, the
+ * cache drops half of its tiles on a medium warning and all of them on a
+ * critical one. Decoded textures, kept by the #ShumateTextureCache, go
+ * first.
+ *
+ * Looking a tile up doesn't allocate memory: tiles are identified by the
+ * interned map source id and their packed coordinates, and are kept in a
+ * pool of nodes indexed by an open addressing hash table.
  */
 
 #define DEBUG_FLAG SHUMATE_DEBUG_CACHE
 #include "shumate-debug.h"
 
 #include "shumate-memory-cache.h"
+#include "shumate-enum-types.h"
+#include "shumate-texture-cache.h"
+#include "shumate-tile-decoder-private.h"
+#include "shumate-tile-private.h"
 
 #include <glib.h>
 #include <string.h>
@@ -38,24 +66,80 @@
 enum
 {
   PROP_0,
-  PROP_SIZE_LIMIT
+  PROP_SIZE_LIMIT,
+  PROP_BYTE_LIMIT,
+  PROP_FOOTPRINT,
+  PROP_POLICY,
+  PROP_RECLAIMED,
+  N_PROPERTIES
 };
 
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
+
+/* Marks the end of the queues and of the free list */
+#define NO_NODE G_MAXUINT
+
+/* Nodes are kept in one of these queues. With the LRU policy, all of them
+ * are in QUEUE_MAIN. With 2Q, tiles seen once wait in QUEUE_IN, and tiles
+ * seen again while their key is still remembered in QUEUE_GHOSTS go to
+ * QUEUE_MAIN. */
+typedef enum
+{
+  QUEUE_MAIN,
+  QUEUE_IN,
+  QUEUE_GHOSTS, /* keys of tiles dropped from QUEUE_IN, without data */
+  N_QUEUES
+} Queue;
+
 typedef struct
 {
-  guint size_limit;
-  GQueue *queue;
-  GHashTable *hash_table;
-} ShumateMemoryCachePrivate;
+  const char *source_id; /* interned */
+  guint64 tile; /* zoom level, x and y packed together */
+} TileKey;
 
-G_DEFINE_TYPE_WITH_PRIVATE (ShumateMemoryCache, shumate_memory_cache, SHUMATE_TYPE_TILE_CACHE);
+typedef struct
+{
+  TileKey key;
+  GBytes *data;
+  guint prev; /* towards the head of the queue */
+  guint next; /* towards the tail of the queue, or the next free node */
+  Queue queue;
+} TileNode;
 
 typedef struct
 {
-  char *key;
-  char *data;
-  guint size;
-} QueueMember;
+  guint size_limit;
+  guint64 byte_limit;
+  guint64 data_size;
+  guint64 reclaimed;
+  ShumateMemoryCachePolicy policy;
+  GMemoryMonitor *memory_monitor;
+
+  /* Nodes are referred to by their index, the pool is reallocated when it
+   * grows. It holds at most size_limit tiles and the ghosts of 2Q. */
+  TileNode *nodes;
+  guint n_nodes;
+  guint n_used; /* nodes of the pool used at least once */
+  guint free_list;
+  guint count; /* nodes with data, in QUEUE_MAIN and QUEUE_IN */
+
+  /* Most recently added or used first */
+  guint head[N_QUEUES];
+  guint tail[N_QUEUES];
+  guint length[N_QUEUES];
+
+  /* Node index + 1, 0 for empty slots. n_slots is a power of two and the
+   * table is kept at most half full. */
+  guint *slots;
+  guint n_slots;
+
+  /* The id of the next source, which the keys use, is interned once when it
+   * changes. id_source is the next source it was taken from. */
+  const char *source_id;
+  ShumateMapSource *id_source;
+} ShumateMemoryCachePrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (ShumateMemoryCache, shumate_memory_cache, SHUMATE_TYPE_TILE_CACHE);
 
 
 static void fill_tile (ShumateMapSource *map_source,
@@ -64,12 +148,22 @@ static void fill_tile (ShumateMapSource *map_source,
 
 static void store_tile (ShumateTileCache *tile_cache,
     ShumateTile *tile,
-    const char *contents,
-    gsize size);
+    GBytes *bytes);
 static void refresh_tile_time (ShumateTileCache *tile_cache,
     ShumateTile *tile);
 static void on_tile_filled (ShumateTileCache *tile_cache,
     ShumateTile *tile);
+static void clear_nodes (ShumateMemoryCachePrivate *priv);
+static void on_low_memory_warning (GMemoryMonitor *monitor,
+    GMemoryMonitorWarningLevel level,
+    ShumateMemoryCache *memory_cache);
+static void evict (ShumateMemoryCachePrivate *priv);
+static void update_source_id (ShumateMemoryCache *memory_cache);
+static void queue_unlink (ShumateMemoryCachePrivate *priv,
+    guint index);
+static void queue_push_tail (ShumateMemoryCachePrivate *priv,
+    guint index,
+    Queue queue);
 
 
 static void
@@ -86,6 +180,22 @@ shumate_memory_cache_get_property (GObject *object,
       g_value_set_uint (value, shumate_memory_cache_get_size_limit (memory_cache));
       break;
 
+    case PROP_BYTE_LIMIT:
+      g_value_set_uint64 (value, shumate_memory_cache_get_byte_limit (memory_cache));
+      break;
+
+    case PROP_FOOTPRINT:
+      g_value_set_uint64 (value, shumate_memory_cache_get_footprint (memory_cache));
+      break;
+
+    case PROP_POLICY:
+      g_value_set_enum (value, shumate_memory_cache_get_policy (memory_cache));
+      break;
+
+    case PROP_RECLAIMED:
+      g_value_set_uint64 (value, shumate_memory_cache_get_reclaimed (memory_cache));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -106,20 +216,43 @@ shumate_memory_cache_set_property (GObject *object,
       shumate_memory_cache_set_size_limit (memory_cache, g_value_get_uint (value));
       break;
 
+    case PROP_BYTE_LIMIT:
+      shumate_memory_cache_set_byte_limit (memory_cache, g_value_get_uint64 (value));
+      break;
+
+    case PROP_POLICY:
+      shumate_memory_cache_set_policy (memory_cache, g_value_get_enum (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
+static void
+shumate_memory_cache_dispose (GObject *object)
+{
+  ShumateMemoryCache *memory_cache = SHUMATE_MEMORY_CACHE (object);
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  if (priv->id_source)
+    g_signal_handlers_disconnect_by_func (priv->id_source, update_source_id, memory_cache);
+  g_clear_object (&priv->id_source);
+  priv->source_id = NULL;
+
+  G_OBJECT_CLASS (shumate_memory_cache_parent_class)->dispose (object);
+}
+
 static void
 shumate_memory_cache_finalize (GObject *object)
 {
   ShumateMemoryCache *memory_cache = SHUMATE_MEMORY_CACHE (object);
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
 
-  shumate_memory_cache_clean (memory_cache);
-  g_clear_pointer (&priv->queue, g_queue_free);
-  g_clear_pointer (&priv->hash_table, g_hash_table_unref);
+  clear_nodes (priv);
+  g_clear_pointer (&priv->nodes, g_free);
+  g_clear_pointer (&priv->slots, g_free);
+  g_clear_object (&priv->memory_monitor);
 
   G_OBJECT_CLASS (shumate_memory_cache_parent_class)->finalize (object);
 }
@@ -131,8 +264,8 @@ shumate_memory_cache_class_init (ShumateMemoryCacheClass *klass)
   ShumateMapSourceClass *map_source_class = SHUMATE_MAP_SOURCE_CLASS (klass);
   ShumateTileCacheClass *tile_cache_class = SHUMATE_TILE_CACHE_CLASS (klass);
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
-  GParamSpec *pspec;
 
+  object_class->dispose = shumate_memory_cache_dispose;
   object_class->finalize = shumate_memory_cache_finalize;
   object_class->get_property = shumate_memory_cache_get_property;
   object_class->set_property = shumate_memory_cache_set_property;
@@ -142,14 +275,77 @@ shumate_memory_cache_class_init (ShumateMemoryCacheClass *klass)
    *
    * The maximum number of tiles that are stored in the cache.
    */
-  pspec = g_param_spec_uint ("size-limit",
+  obj_properties[PROP_SIZE_LIMIT] =
+    g_param_spec_uint ("size-limit",
         "Size Limit",
         "Maximal number of stored tiles",
         1,
         G_MAXINT,
         100,
         G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
-  g_object_class_install_property (object_class, PROP_SIZE_LIMIT, pspec);
+
+  /**
+   * ShumateMemoryCache:byte-limit:
+   *
+   * The maximum size, in bytes, of the tile data stored in the cache, or 0
+   * to only limit the number of tiles.
+   */
+  obj_properties[PROP_BYTE_LIMIT] =
+    g_param_spec_uint64 ("byte-limit",
+        "Byte Limit",
+        "Maximal size of the stored tile data in bytes",
+        0,
+        G_MAXUINT64,
+        0,
+        G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ShumateMemoryCache:footprint:
+   *
+   * The memory currently used by the cache in bytes: the size of the stored
+   * tile data, which may be shared with other caches, and of the cache's own
+   * bookkeeping.
+   */
+  obj_properties[PROP_FOOTPRINT] =
+    g_param_spec_uint64 ("footprint",
+        "Footprint",
+        "Memory used by the cache in bytes",
+        0,
+        G_MAXUINT64,
+        0,
+        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ShumateMemoryCache:policy:
+   *
+   * Which tiles the cache drops first when it is full.
+   */
+  obj_properties[PROP_POLICY] =
+    g_param_spec_enum ("policy",
+        "Policy",
+        "How tiles are evicted",
+        SHUMATE_TYPE_MEMORY_CACHE_POLICY,
+        SHUMATE_MEMORY_CACHE_POLICY_LRU,
+        G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ShumateMemoryCache:reclaimed:
+   *
+   * The size, in bytes, of the tile data dropped so far because the system
+   * was low on memory.
+   */
+  obj_properties[PROP_RECLAIMED] =
+    g_param_spec_uint64 ("reclaimed",
+        "Reclaimed",
+        "Size of the tile data dropped on low memory in bytes",
+        0,
+        G_MAXUINT64,
+        0,
+        G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     N_PROPERTIES,
+                                     obj_properties);
 
   tile_cache_class->store_tile = store_tile;
   tile_cache_class->refresh_tile_time = refresh_tile_time;
@@ -185,8 +381,19 @@ shumate_memory_cache_init (ShumateMemoryCache *memory_cache)
 {
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
 
-  priv->queue = g_queue_new ();
-  priv->hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->free_list = NO_NODE;
+  for (guint queue = 0; queue < N_QUEUES; queue++)
+    {
+      priv->head[queue] = NO_NODE;
+      priv->tail[queue] = NO_NODE;
+    }
+
+  priv->memory_monitor = g_memory_monitor_dup_default ();
+  g_signal_connect_object (priv->memory_monitor, "low-memory-warning",
+                           G_CALLBACK (on_low_memory_warning), memory_cache, 0);
+
+  g_signal_connect (memory_cache, "notify::next-source",
+                    G_CALLBACK (update_source_id), NULL);
 }
 
 
@@ -225,46 +432,593 @@ shumate_memory_cache_set_size_limit (ShumateMemoryCache *memory_cache,
   g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache));
 
   priv->size_limit = size_limit;
-  g_object_notify (G_OBJECT (memory_cache), "size-limit");
+  evict (priv);
+
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_SIZE_LIMIT]);
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_FOOTPRINT]);
 }
 
 
-static char *
-generate_queue_key (ShumateMemoryCache *memory_cache,
-    ShumateTile *tile)
+/**
+ * shumate_memory_cache_get_byte_limit:
+ * @memory_cache: a #ShumateMemoryCache
+ *
+ * Gets the maximum size of the tile data stored in the cache.
+ *
+ * Returns: the limit in bytes, or 0 if only the number of tiles is limited
+ */
+guint64
+shumate_memory_cache_get_byte_limit (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), 0);
+
+  return priv->byte_limit;
+}
+
+
+/**
+ * shumate_memory_cache_set_byte_limit:
+ * @memory_cache: a #ShumateMemoryCache
+ * @byte_limit: maximum size of the stored tile data in bytes, or 0
+ *
+ * Sets the maximum size of the tile data stored in the cache. The least
+ * recently used tiles are dropped right away if the cache is over the new
+ * limit. Both this limit and #ShumateMemoryCache:size-limit apply.
+ */
+void
+shumate_memory_cache_set_byte_limit (ShumateMemoryCache *memory_cache,
+    guint64 byte_limit)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache));
+
+  if (priv->byte_limit == byte_limit)
+    return;
+
+  priv->byte_limit = byte_limit;
+  evict (priv);
+
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_BYTE_LIMIT]);
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_FOOTPRINT]);
+}
+
+
+/**
+ * shumate_memory_cache_get_footprint:
+ * @memory_cache: a #ShumateMemoryCache
+ *
+ * Gets the memory currently used by the cache: the size of the stored tile
+ * data and of the structures indexing it. The tile data is shared with the
+ * other caches of the chain, so it may be counted by them too.
+ *
+ * Returns: the memory used by the cache in bytes
+ */
+guint64
+shumate_memory_cache_get_footprint (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), 0);
+
+  return priv->data_size +
+         (guint64) priv->n_nodes * sizeof (TileNode) +
+         (guint64) priv->n_slots * sizeof (guint);
+}
+
+
+/**
+ * shumate_memory_cache_get_reclaimed:
+ * @memory_cache: a #ShumateMemoryCache
+ *
+ * Gets the size of the tile data dropped so far because the system was low
+ * on memory.
+ *
+ * Returns: the size of the dropped tile data in bytes
+ */
+guint64
+shumate_memory_cache_get_reclaimed (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), 0);
+
+  return priv->reclaimed;
+}
+
+
+/**
+ * shumate_memory_cache_get_policy:
+ * @memory_cache: a #ShumateMemoryCache
+ *
+ * Gets how the cache picks the tiles it drops when it is full.
+ *
+ * Returns: the eviction policy of the cache
+ */
+ShumateMemoryCachePolicy
+shumate_memory_cache_get_policy (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), SHUMATE_MEMORY_CACHE_POLICY_LRU);
+
+  return priv->policy;
+}
+
+
+/**
+ * shumate_memory_cache_set_policy:
+ * @memory_cache: a #ShumateMemoryCache
+ * @policy: a #ShumateMemoryCachePolicy
+ *
+ * Sets how the cache picks the tiles it drops when it is full. The tiles
+ * stored so far are kept.
+ */
+void
+shumate_memory_cache_set_policy (ShumateMemoryCache *memory_cache,
+    ShumateMemoryCachePolicy policy)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache));
+
+  if (priv->policy == policy)
+    return;
+
+  priv->policy = policy;
+
+  /* Tiles seen once become the least recently used ones, and the ghosts
+   * are forgotten by evict () */
+  while (priv->head[QUEUE_IN] != NO_NODE)
+    {
+      guint index = priv->head[QUEUE_IN];
+
+      queue_unlink (priv, index);
+      queue_push_tail (priv, index, QUEUE_MAIN);
+    }
+
+  evict (priv);
+
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_POLICY]);
+}
+
+
+/*
+ * Interns the id of the next source. The id of a tile source can change, and
+ * so can the one of a cache, with its own next source: any property of the
+ * next source is watched.
+ */
+static void
+update_source_id (ShumateMemoryCache *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (SHUMATE_MAP_SOURCE (memory_cache));
+
+  if (priv->id_source != next_source)
+    {
+      if (priv->id_source)
+        g_signal_handlers_disconnect_by_func (priv->id_source, update_source_id, memory_cache);
+      g_set_object (&priv->id_source, next_source);
+      if (next_source)
+        g_signal_connect_swapped (next_source, "notify",
+                                  G_CALLBACK (update_source_id), memory_cache);
+    }
+
+  if (next_source)
+    priv->source_id = g_intern_string (shumate_map_source_get_id (next_source));
+  else
+    priv->source_id = NULL;
+}
+
+static void
+tile_key_init (TileKey            *key,
+               ShumateMemoryCache *memory_cache,
+               ShumateTile        *tile)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+
+  key->source_id = priv->source_id;
+  key->tile = ((guint64) shumate_tile_get_zoom_level (tile) << 58) |
+              ((guint64) shumate_tile_get_x (tile) << 29) |
+              (guint64) shumate_tile_get_y (tile);
+}
+
+
+static inline guint
+tile_key_hash (const TileKey *key)
+{
+  guint64 hash = (key->tile ^ GPOINTER_TO_SIZE (key->source_id)) * G_GUINT64_CONSTANT (0x9e3779b97f4a7c15);
+
+  /* The high bits are the best mixed */
+  return (guint) (hash >> 32);
+}
+
+
+static inline gboolean
+tile_key_equal (const TileKey *a,
+                const TileKey *b)
+{
+  return a->tile == b->tile && a->source_id == b->source_id;
+}
+
+
+/* Returns the slot of @key, or the empty slot where it would go */
+static guint
+find_slot (ShumateMemoryCachePrivate *priv,
+           const TileKey             *key,
+           gboolean                  *found)
+{
+  guint mask = priv->n_slots - 1;
+  guint slot;
+
+  *found = FALSE;
+
+  if (priv->n_slots == 0)
+    return 0;
+
+  for (slot = tile_key_hash (key) & mask; priv->slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+      if (tile_key_equal (&priv->nodes[priv->slots[slot] - 1].key, key))
+        {
+          *found = TRUE;
+          break;
+        }
+    }
+
+  return slot;
+}
+
+
+/* Empties @slot, moving back the nodes which collided with it so that no
+ * tombstone is needed */
+static void
+remove_slot (ShumateMemoryCachePrivate *priv,
+             guint                      slot)
+{
+  guint mask = priv->n_slots - 1;
+  guint hole = slot;
+
+  for (guint i = (slot + 1) & mask; priv->slots[i] != 0; i = (i + 1) & mask)
+    {
+      guint home = tile_key_hash (&priv->nodes[priv->slots[i] - 1].key) & mask;
+
+      /* Nodes whose home is cyclically in (hole, i] stay where they are */
+      if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+        continue;
+
+      priv->slots[hole] = priv->slots[i];
+      hole = i;
+    }
+
+  priv->slots[hole] = 0;
+}
+
+
+static void
+grow_slots (ShumateMemoryCachePrivate *priv)
+{
+  guint n_slots = MAX (16, priv->n_slots * 2);
+  guint mask = n_slots - 1;
+
+  g_free (priv->slots);
+  priv->slots = g_new0 (guint, n_slots);
+  priv->n_slots = n_slots;
+
+  for (guint queue = 0; queue < N_QUEUES; queue++)
+    for (guint i = priv->head[queue]; i != NO_NODE; i = priv->nodes[i].next)
+      {
+        guint slot = tile_key_hash (&priv->nodes[i].key) & mask;
+
+        while (priv->slots[slot] != 0)
+          slot = (slot + 1) & mask;
+
+        priv->slots[slot] = i + 1;
+      }
+}
+
+
+static void
+queue_unlink (ShumateMemoryCachePrivate *priv,
+              guint                      index)
 {
-  g_return_val_if_fail (SHUMATE_IS_MEMORY_CACHE (memory_cache), NULL);
-  g_return_val_if_fail (SHUMATE_IS_TILE (tile), NULL);
+  TileNode *node = &priv->nodes[index];
 
-  ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (memory_cache);
-  char *key;
+  if (node->prev != NO_NODE)
+    priv->nodes[node->prev].next = node->next;
+  else
+    priv->head[node->queue] = node->next;
+
+  if (node->next != NO_NODE)
+    priv->nodes[node->next].prev = node->prev;
+  else
+    priv->tail[node->queue] = node->prev;
 
-  key = g_strdup_printf ("%d/%d/%d/%s",
-        shumate_tile_get_zoom_level (tile),
-        shumate_tile_get_x (tile),
-        shumate_tile_get_y (tile),
-        shumate_map_source_get_id (map_source));
-  return key;
+  priv->length[node->queue]--;
 }
 
 
 static void
-move_queue_member_to_head (GQueue *queue, GList *link)
+queue_push_head (ShumateMemoryCachePrivate *priv,
+                 guint                      index,
+                 Queue                      queue)
 {
-  g_queue_unlink (queue, link);
-  g_queue_push_head_link (queue, link);
+  TileNode *node = &priv->nodes[index];
+
+  node->queue = queue;
+  node->prev = NO_NODE;
+  node->next = priv->head[queue];
+
+  if (priv->head[queue] != NO_NODE)
+    priv->nodes[priv->head[queue]].prev = index;
+  else
+    priv->tail[queue] = index;
+
+  priv->head[queue] = index;
+  priv->length[queue]++;
 }
 
 
 static void
-delete_queue_member (QueueMember *member, gpointer user_data)
+queue_push_tail (ShumateMemoryCachePrivate *priv,
+                 guint                      index,
+                 Queue                      queue)
 {
-  if (member)
+  TileNode *node = &priv->nodes[index];
+
+  node->queue = queue;
+  node->prev = priv->tail[queue];
+  node->next = NO_NODE;
+
+  if (priv->tail[queue] != NO_NODE)
+    priv->nodes[priv->tail[queue]].next = index;
+  else
+    priv->head[queue] = index;
+
+  priv->tail[queue] = index;
+  priv->length[queue]++;
+}
+
+
+/* Marks a stored tile as used */
+static void
+touch_node (ShumateMemoryCachePrivate *priv,
+            guint                      index)
+{
+  /* 2Q leaves tiles seen once in the order they came: tiles of a single
+   * pan are often requested a few times in a row, that doesn't make them
+   * worth keeping. */
+  if (priv->nodes[index].queue != QUEUE_MAIN || priv->head[QUEUE_MAIN] == index)
+    return;
+
+  queue_unlink (priv, index);
+  queue_push_head (priv, index, QUEUE_MAIN);
+}
+
+
+/* The 2Q queues get a quarter of the cache for tiles seen once, and
+ * remember the keys of half as many tiles as the cache holds */
+static guint
+get_in_limit (ShumateMemoryCachePrivate *priv)
+{
+  return MAX (1, priv->size_limit / 4);
+}
+
+
+static guint
+get_ghost_limit (ShumateMemoryCachePrivate *priv)
+{
+  return priv->policy == SHUMATE_MEMORY_CACHE_POLICY_TWO_Q ? priv->size_limit / 2 : 0;
+}
+
+
+static guint
+alloc_node (ShumateMemoryCachePrivate *priv)
+{
+  guint index;
+
+  if (priv->free_list != NO_NODE)
+    {
+      index = priv->free_list;
+      priv->free_list = priv->nodes[index].next;
+      return index;
+    }
+
+  if (priv->n_used == priv->n_nodes)
     {
-      g_free (member->key);
-      g_free (member->data);
-      g_slice_free (QueueMember, member);
+      guint max_nodes = priv->size_limit + get_ghost_limit (priv);
+
+      priv->n_nodes = MAX (priv->n_nodes + 1, MIN (MAX (16, priv->n_nodes * 2), max_nodes));
+      priv->nodes = g_renew (TileNode, priv->nodes, priv->n_nodes);
     }
+
+  return priv->n_used++;
+}
+
+
+static void
+free_node (ShumateMemoryCachePrivate *priv,
+           guint                      index)
+{
+  TileNode *node = &priv->nodes[index];
+  gboolean found;
+  guint slot;
+
+  slot = find_slot (priv, &node->key, &found);
+  g_assert (found);
+  remove_slot (priv, slot);
+
+  queue_unlink (priv, index);
+  node->next = priv->free_list;
+  priv->free_list = index;
+}
+
+
+/* Drops the data of a stored tile, and with 2Q remembers its key for a
+ * while if it was only seen once */
+static void
+evict_node (ShumateMemoryCachePrivate *priv,
+            guint                      index)
+{
+  TileNode *node = &priv->nodes[index];
+
+  priv->data_size -= g_bytes_get_size (node->data);
+  g_clear_pointer (&node->data, g_bytes_unref);
+  priv->count--;
+
+  if (node->queue == QUEUE_IN)
+    {
+      queue_unlink (priv, index);
+      queue_push_head (priv, index, QUEUE_GHOSTS);
+    }
+  else
+    free_node (priv, index);
+}
+
+
+static void
+evict_one (ShumateMemoryCachePrivate *priv)
+{
+  if (priv->length[QUEUE_IN] > 0 &&
+      (priv->length[QUEUE_IN] > get_in_limit (priv) || priv->length[QUEUE_MAIN] == 0))
+    evict_node (priv, priv->tail[QUEUE_IN]);
+  else
+    evict_node (priv, priv->tail[QUEUE_MAIN]);
+}
+
+
+static gboolean
+is_over_limits (ShumateMemoryCachePrivate *priv)
+{
+  return priv->count > priv->size_limit ||
+         (priv->byte_limit != 0 && priv->data_size > priv->byte_limit);
+}
+
+
+static void
+evict (ShumateMemoryCachePrivate *priv)
+{
+  while (priv->count > 0 && is_over_limits (priv))
+    evict_one (priv);
+
+  while (priv->length[QUEUE_GHOSTS] > get_ghost_limit (priv))
+    free_node (priv, priv->tail[QUEUE_GHOSTS]);
+}
+
+
+static void
+on_low_memory_warning (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       ShumateMemoryCache         *memory_cache)
+{
+  ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
+  guint64 old_size = priv->data_size;
+  guint64 target_size;
+
+  /* The texture cache sheds its decoded textures on low warnings already,
+   * the encoded tiles are only dropped when that wasn't enough */
+  if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+    target_size = 0;
+  else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+    target_size = priv->data_size / 2;
+  else
+    return;
+
+  while (priv->count > 0 && priv->data_size > target_size)
+    evict_one (priv);
+
+  while (priv->length[QUEUE_GHOSTS] > get_ghost_limit (priv))
+    free_node (priv, priv->tail[QUEUE_GHOSTS]);
+
+  if (old_size == priv->data_size)
+    return;
+
+  priv->reclaimed += old_size - priv->data_size;
+  DEBUG ("Low memory warning %d, dropped %" G_GUINT64_FORMAT " bytes of tiles",
+      level, old_size - priv->data_size);
+
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_FOOTPRINT]);
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_RECLAIMED]);
+}
+
+
+static void
+clear_nodes (ShumateMemoryCachePrivate *priv)
+{
+  for (guint queue = 0; queue < N_QUEUES; queue++)
+    {
+      for (guint i = priv->head[queue]; i != NO_NODE; i = priv->nodes[i].next)
+        g_clear_pointer (&priv->nodes[i].data, g_bytes_unref);
+
+      priv->head[queue] = NO_NODE;
+      priv->tail[queue] = NO_NODE;
+      priv->length[queue] = 0;
+    }
+
+  /* Keeps the allocations, the cache usually fills up again */
+  if (priv->slots)
+    memset (priv->slots, 0, priv->n_slots * sizeof (guint));
+
+  priv->n_used = 0;
+  priv->free_list = NO_NODE;
+  priv->count = 0;
+  priv->data_size = 0;
+}
+
+
+/* Returns the node of a stored tile, ghosts aside */
+static guint
+lookup_node (ShumateMemoryCachePrivate *priv,
+             const TileKey             *key)
+{
+  gboolean found;
+  guint slot = find_slot (priv, key, &found);
+  guint index;
+
+  if (!found)
+    return NO_NODE;
+
+  index = priv->slots[slot] - 1;
+  return priv->nodes[index].queue == QUEUE_GHOSTS ? NO_NODE : index;
+}
+
+
+typedef struct
+{
+  ShumateMemoryCache *self;
+  ShumateTile *tile;
+  GCancellable *cancellable;
+} TileDecodedData;
+
+static void
+tile_decoded_data_free (TileDecodedData *data)
+{
+  g_clear_object (&data->self);
+  g_clear_object (&data->tile);
+  g_clear_object (&data->cancellable);
+  g_slice_free (TileDecodedData, data);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (TileDecodedData, tile_decoded_data_free)
+
+static void
+on_tile_decoded (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  g_autoptr(TileDecodedData) data = user_data;
+  ShumateMapSource *map_source = SHUMATE_MAP_SOURCE (data->self);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+  ShumateTile *tile = data->tile;
+
+  if (!shumate_tile_decode_finish_for_source (res, map_source, tile, data->cancellable))
+    return;
+
+  if (SHUMATE_IS_TILE_CACHE (next_source))
+    shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
+
+  shumate_tile_set_fade_in (tile, FALSE);
+  shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
 }
 
 static void
@@ -280,43 +1034,56 @@ fill_tile (ShumateMapSource *map_source,
   if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
     return;
 
-  if (shumate_tile_get_state (tile) != SHUMATE_STATE_LOADED)
+  /* Only the persistent caches are filled for such tiles */
+  if (shumate_tile_get_state (tile) != SHUMATE_STATE_LOADED &&
+      !shumate_tile_get_store_only (tile))
     {
       ShumateMemoryCache *memory_cache = SHUMATE_MEMORY_CACHE (map_source);
       ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
-      GList *link;
-      g_autofree char *key = generate_queue_key (memory_cache, tile);
-
-      link = g_hash_table_lookup (priv->hash_table, key);
-      if (link)
+      ShumateTextureCache *texture_cache = shumate_texture_cache_get_default ();
+      GdkTexture *cached_texture;
+      TileKey key;
+      guint index;
+
+      tile_key_init (&key, memory_cache, tile);
+      index = lookup_node (priv, &key);
+      if (index != NO_NODE)
+        touch_node (priv, index);
+
+      /* The decoded texture is still around, no need to decode it again */
+      cached_texture = shumate_texture_cache_lookup (texture_cache,
+            shumate_map_source_get_id (map_source),
+            shumate_tile_get_x (tile),
+            shumate_tile_get_y (tile),
+            shumate_tile_get_zoom_level (tile));
+      if (cached_texture)
         {
-          g_autoptr(GInputStream) stream = NULL;
-          g_autoptr(GError) error = NULL;
-          g_autoptr(GdkPixbuf) pixbuf = NULL;
-          g_autoptr(GdkTexture) texture = NULL;
-          QueueMember *member = link->data;
-
-          move_queue_member_to_head (priv->queue, link);
-
-          stream = g_memory_input_stream_new_from_data (member->data, member->size, NULL);
-          pixbuf = gdk_pixbuf_new_from_stream (stream, NULL, &error);
-          if (!pixbuf)
-            {
-              if (next_source)
-                shumate_map_source_fill_tile (next_source, tile, cancellable);
-
-              return;
-            }
-
           if (SHUMATE_IS_TILE_CACHE (next_source))
             shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
 
-          texture = gdk_texture_new_for_pixbuf (pixbuf);
-          shumate_tile_set_texture (tile, texture);
+          shumate_tile_set_texture (tile, cached_texture);
           shumate_tile_set_fade_in (tile, FALSE);
           shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
           return;
         }
+
+      if (index != NO_NODE)
+        {
+          TileNode *node = &priv->nodes[index];
+          TileDecodedData *data = g_slice_new0 (TileDecodedData);
+
+          data->self = g_object_ref (memory_cache);
+          data->tile = g_object_ref (tile);
+          if (cancellable)
+            data->cancellable = g_object_ref (cancellable);
+
+          shumate_tile_decode_async (node->data,
+                tile,
+                cancellable,
+                on_tile_decoded,
+                data);
+          return;
+        }
     }
 
   if (SHUMATE_IS_MAP_SOURCE (next_source))
@@ -332,8 +1099,7 @@ fill_tile (ShumateMapSource *map_source,
 static void
 store_tile (ShumateTileCache *tile_cache,
     ShumateTile *tile,
-    const char *contents,
-    gsize size)
+    GBytes *bytes)
 {
   g_return_if_fail (SHUMATE_IS_MEMORY_CACHE (tile_cache));
 
@@ -341,38 +1107,72 @@ store_tile (ShumateTileCache *tile_cache,
   ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
   ShumateMemoryCache *memory_cache = SHUMATE_MEMORY_CACHE (tile_cache);
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
-  GList *link;
-  char *key;
+  gsize size = g_bytes_get_size (bytes);
+  TileKey key;
+  gboolean found;
+  guint slot;
+  guint index;
 
-  key = generate_queue_key (memory_cache, tile);
-  link = g_hash_table_lookup (priv->hash_table, key);
-  if (link)
+  /* Would push everything else out */
+  if (priv->byte_limit != 0 && size > priv->byte_limit)
+    goto next;
+
+  /* Would push out the tiles of the views for a tile nobody draws */
+  if (shumate_tile_get_store_only (tile))
+    goto next;
+
+  tile_key_init (&key, memory_cache, tile);
+  slot = find_slot (priv, &key, &found);
+  index = found ? priv->slots[slot] - 1 : NO_NODE;
+
+  if (index != NO_NODE && priv->nodes[index].queue != QUEUE_GHOSTS)
     {
-      move_queue_member_to_head (priv->queue, link);
-      g_free (key);
+      /* The tile may have been downloaded again after it expired */
+      priv->data_size -= g_bytes_get_size (priv->nodes[index].data);
+      g_bytes_unref (priv->nodes[index].data);
+      priv->nodes[index].data = g_bytes_ref (bytes);
+      priv->data_size += size;
+      touch_node (priv, index);
     }
   else
     {
-      QueueMember *member;
+      if (priv->count >= priv->size_limit)
+        evict_one (priv);
 
-      if (priv->queue->length >= priv->size_limit)
+      if (index != NO_NODE)
         {
-          member = g_queue_pop_tail (priv->queue);
-          g_hash_table_remove (priv->hash_table, member->key);
-          delete_queue_member (member, NULL);
+          /* Seen again while 2Q still remembered it, the tile is worth
+           * keeping for longer */
+          queue_unlink (priv, index);
+          queue_push_head (priv, index, QUEUE_MAIN);
         }
+      else
+        {
+          if ((priv->count + priv->length[QUEUE_GHOSTS] + 1) * 2 > priv->n_slots)
+            grow_slots (priv);
+
+          /* Evicting and growing move the slots around */
+          slot = find_slot (priv, &key, &found);
 
-      member = g_slice_new (QueueMember);
-      member->key = key;
-      member->data = g_memdup (contents, size);
-      member->size = size;
+          index = alloc_node (priv);
+          priv->nodes[index].key = key;
+          queue_push_head (priv, index,
+                           priv->policy == SHUMATE_MEMORY_CACHE_POLICY_TWO_Q ? QUEUE_IN : QUEUE_MAIN);
+          priv->slots[slot] = index + 1;
+        }
 
-      g_queue_push_head (priv->queue, member);
-      g_hash_table_insert (priv->hash_table, g_strdup (key), g_queue_peek_head_link (priv->queue));
+      priv->nodes[index].data = g_bytes_ref (bytes);
+      priv->count++;
+      priv->data_size += size;
     }
 
+  /* The new tile is the most recently used, it fits and stays */
+  evict (priv);
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_FOOTPRINT]);
+
+next:
   if (SHUMATE_IS_TILE_CACHE (next_source))
-    shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (next_source), tile, contents, size);
+    shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (next_source), tile, bytes);
 }
 
 
@@ -401,10 +1201,8 @@ shumate_memory_cache_clean (ShumateMemoryCache *memory_cache)
 {
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
 
-  g_queue_foreach (priv->queue, (GFunc) delete_queue_member, NULL);
-  g_queue_clear (priv->queue);
-  g_hash_table_unref (priv->hash_table);
-  priv->hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  clear_nodes (priv);
+  g_object_notify_by_pspec (G_OBJECT (memory_cache), obj_properties[PROP_FOOTPRINT]);
 }
 
 
@@ -419,14 +1217,16 @@ on_tile_filled (ShumateTileCache *tile_cache,
   ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
   ShumateMemoryCache *memory_cache = SHUMATE_MEMORY_CACHE (tile_cache);
   ShumateMemoryCachePrivate *priv = shumate_memory_cache_get_instance_private (memory_cache);
-  GList *link;
-  char *key;
-
-  key = generate_queue_key (memory_cache, tile);
-  link = g_hash_table_lookup (priv->hash_table, key);
-  g_free (key);
-  if (link)
-    move_queue_member_to_head (priv->queue, link);
+  TileKey key;
+  guint index;
+
+  if (!shumate_tile_get_store_only (tile))
+    {
+      tile_key_init (&key, memory_cache, tile);
+      index = lookup_node (priv, &key);
+      if (index != NO_NODE)
+        touch_node (priv, index);
+    }
 
   if (SHUMATE_IS_TILE_CACHE (next_source))
     shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
@@ -29,6 +29,23 @@
 
 G_BEGIN_DECLS
 
+/**
+ * ShumateMemoryCachePolicy:
+ * @SHUMATE_MEMORY_CACHE_POLICY_LRU: the least recently used tiles are
+ *   dropped first
+ * @SHUMATE_MEMORY_CACHE_POLICY_TWO_Q: the 2Q algorithm: tiles seen once
+ *   only get a quarter of the cache, tiles seen again shortly after they
+ *   were dropped from it are kept in the rest of the cache, in least
+ *   recently used order
+ *
+ * How a #ShumateMemoryCache picks the tiles it drops when it is full.
+ */
+typedef enum
+{
+  SHUMATE_MEMORY_CACHE_POLICY_LRU,
+  SHUMATE_MEMORY_CACHE_POLICY_TWO_Q
+} ShumateMemoryCachePolicy;
+
 #define SHUMATE_TYPE_MEMORY_CACHE shumate_memory_cache_get_type ()
 G_DECLARE_DERIVABLE_TYPE (ShumateMemoryCache, shumate_memory_cache, SHUMATE, MEMORY_CACHE, ShumateTileCache)
 
@@ -49,6 +66,14 @@ ShumateMemoryCache *shumate_memory_cache_new_full (guint size_limit);
 guint shumate_memory_cache_get_size_limit (ShumateMemoryCache *memory_cache);
 void shumate_memory_cache_set_size_limit (ShumateMemoryCache *memory_cache,
     guint size_limit);
+guint64 shumate_memory_cache_get_byte_limit (ShumateMemoryCache *memory_cache);
+void shumate_memory_cache_set_byte_limit (ShumateMemoryCache *memory_cache,
+    guint64 byte_limit);
+guint64 shumate_memory_cache_get_footprint (ShumateMemoryCache *memory_cache);
+guint64 shumate_memory_cache_get_reclaimed (ShumateMemoryCache *memory_cache);
+ShumateMemoryCachePolicy shumate_memory_cache_get_policy (ShumateMemoryCache *memory_cache);
+void shumate_memory_cache_set_policy (ShumateMemoryCache *memory_cache,
+    ShumateMemoryCachePolicy policy);
 
 void shumate_memory_cache_clean (ShumateMemoryCache *memory_cache);
 
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHUMATE_NETWORK_TILE_SOURCE_PRIVATE_H__
+#define __SHUMATE_NETWORK_TILE_SOURCE_PRIVATE_H__
+
+#include <libsoup/soup.h>
+
+#include "shumate-network-tile-source.h"
+
+/* After this many consecutive failures a host is considered down */
+#define HOST_FAILURE_THRESHOLD 3
+
+/* At most this many tiles missing on the server are remembered, the oldest
+ * ones are forgotten first */
+#define MISSING_TILES_MAX 4096
+
+char *shumate_network_tile_source_get_tile_uri (ShumateNetworkTileSource *self,
+                                                int                       x,
+                                                int                       y,
+                                                int                       z);
+
+gint64 shumate_network_tile_source_parse_expiry_time (SoupMessageHeaders *headers);
+
+#endif /* __SHUMATE_NETWORK_TILE_SOURCE_PRIVATE_H__ */
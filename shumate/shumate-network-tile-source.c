@@ -35,6 +35,7 @@
 #include "config.h"
 
 #include "shumate-network-tile-source.h"
+#include "shumate-network-tile-source-private.h"
 
 #define DEBUG_FLAG SHUMATE_DEBUG_LOADING
 #include "shumate-debug.h"
@@ -43,6 +44,8 @@
 #include "shumate-enum-types.h"
 #include "shumate-map-source.h"
 #include "shumate-marshal.h"
+#include "shumate-tile-decoder-private.h"
+#include "shumate-tile-private.h"
 
 #include <errno.h>
 #include <gdk/gdk.h>
@@ -62,16 +65,58 @@ enum
   PROP_OFFLINE,
   PROP_PROXY_URI,
   PROP_MAX_CONNS,
-  PROP_USER_AGENT
+  PROP_USER_AGENT,
+  PROP_MISSING_TILE_TTL
 };
 
+typedef enum
+{
+  URI_OP_LITERAL,
+  URI_OP_X,
+  URI_OP_Y,
+  URI_OP_TMSY,
+  URI_OP_Z,
+  URI_OP_SUBDOMAIN,
+  URI_OP_QUADKEY,
+} UriOpKind;
+
+/* One step of a compiled URI format. Literals are slices of uri_format. */
+typedef struct
+{
+  UriOpKind kind;
+  guint offset;
+  guint length;
+} UriOp;
+
 typedef struct
 {
   gboolean offline;
   char *uri_format;
+  GArray *uri_ops; /* UriOp */
   char *proxy_uri;
   SoupSession *soup_session;
   int max_conns;
+
+  /* Downloads in progress, keyed by the packed tile coordinates */
+  GHashTable *fetches;
+
+  /* Downloads waiting for a connection. At most max_conns requests run at
+   * once; the next one sent is the one with the best priority at that
+   * time, so tiles moving closer to the center of the view go first. */
+  GPtrArray *pending_fetches;
+  guint n_running;
+  guint dispatch_idle_id;
+
+  /* HostHealth of the servers that failed recently, keyed by host name */
+  GHashTable *hosts;
+
+  /* Tiles the server answered 404 or 410 for, keyed by the packed tile
+   * coordinates, see MissingTile */
+  GHashTable *missing_tiles;
+  /* The same tiles, oldest first. They all get the same delay, so this is
+   * also the order they expire in. */
+  GQueue missing_tiles_order;
+  guint missing_tile_ttl;
 } ShumateNetworkTileSourcePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShumateNetworkTileSource, shumate_network_tile_source, SHUMATE_TYPE_TILE_SOURCE);
@@ -81,34 +126,101 @@ G_DEFINE_TYPE_WITH_PRIVATE (ShumateNetworkTileSource, shumate_network_tile_sourc
  */
 #define MAX_CONNS_DEFAULT 2
 
+/* Once a host is down, see HOST_FAILURE_THRESHOLD, no request is sent to it
+ * until its backoff delay is over. The delay doubles with every failure that
+ * follows, up to the maximum. */
+#define HOST_BACKOFF_MIN (G_USEC_PER_SEC)
+#define HOST_BACKOFF_MAX (5 * 60 * G_USEC_PER_SEC)
+
+/* Tiles outside the coverage of the server are not requested again for
+ * this many seconds by default */
+#define MISSING_TILE_TTL_DEFAULT (60 * 60)
+
+/* Tile URIs shorter than this are formatted on the stack */
+#define URI_BUFFER_SIZE 512
+
+/* Subdomains the {s} placeholder rotates through */
+static const char uri_subdomains[] = "abc";
+
+static const struct
+{
+  const char *hash_name;
+  const char *brace_name;
+  UriOpKind kind;
+} uri_placeholders[] = {
+  { "X", "x", URI_OP_X },
+  { "Y", "y", URI_OP_Y },
+  { "TMSY", "-y", URI_OP_TMSY },
+  { "Z", "z", URI_OP_Z },
+  { "S", "s", URI_OP_SUBDOMAIN },
+  { "Q", "q", URI_OP_QUADKEY },
+};
+
+typedef struct
+{
+  guint failures; /* Consecutive failed requests */
+  gint64 retry_time; /* Monotonic time the host may be tried again */
+} HostHealth;
+
+typedef struct
+{
+  guint64 key;
+  gint64 expiry_time; /* Monotonic time */
+  GList link; /* In missing_tiles_order */
+} MissingTile;
+
+/*
+ * A download shared by every tile requesting the same coordinates while it
+ * runs. It has its own cancellable, which is only cancelled once none of
+ * the waiting tiles wants the result anymore.
+ */
 typedef struct
 {
   ShumateNetworkTileSource *self;
+  guint64 key;
+  int x;
+  int y;
+  int z;
+  /* Whether the request revalidates a cached tile, in which case the server
+   * may answer without a body */
+  gboolean conditional;
+  /* Whether the request was sent, and whether it still uses a connection */
+  gboolean sent;
+  gboolean running;
   GCancellable *cancellable;
-  ShumateTile *tile;
+  GPtrArray *waiters;
+  guint n_active;
   SoupMessage *msg;
-} TileLoadedData;
+  char *etag;
+  gint64 expiry_time;
+  GOutputStream *body;
+  GBytes *bytes;
+} TileFetch;
 
 typedef struct
 {
-  ShumateNetworkTileSource *self;
-  GCancellable *cancellable;
+  TileFetch *fetch;
   ShumateTile *tile;
-  char *etag;
-} TileRenderedData;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+  gulong state_id;
+  gboolean active;
+} TileFetchWaiter;
 
 
 static void fill_tile (ShumateMapSource *map_source,
                        ShumateTile      *tile,
                        GCancellable     *cancellable);
-static void tile_state_notify (ShumateTile *tile,
-    G_GNUC_UNUSED GParamSpec *pspec,
-    GCancellable *cancellable);
+static void tile_fetch_dispatch (ShumateNetworkTileSource *self);
+static void tile_fetch_free (TileFetch *fetch);
+static void forget_missing_tiles (ShumateNetworkTileSource *self);
 
-static char *get_tile_uri (ShumateNetworkTileSource *source,
-    int x,
-    int y,
-    int z);
+static gsize format_tile_uri (ShumateNetworkTileSource *self,
+                               int                       x,
+                               int                       y,
+                               int                       z,
+                               char                     *buffer,
+                               gsize                     size);
 
 static void
 shumate_network_tile_source_get_property (GObject *object,
@@ -137,6 +249,10 @@ shumate_network_tile_source_get_property (GObject *object,
       g_value_set_int (value, priv->max_conns);
       break;
 
+    case PROP_MISSING_TILE_TTL:
+      g_value_set_uint (value, priv->missing_tile_ttl);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -173,6 +289,10 @@ shumate_network_tile_source_set_property (GObject *object,
       shumate_network_tile_source_set_user_agent (tile_source, g_value_get_string (value));
       break;
 
+    case PROP_MISSING_TILE_TTL:
+      shumate_network_tile_source_set_missing_tile_ttl (tile_source, g_value_get_uint (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -185,6 +305,16 @@ shumate_network_tile_source_dispose (GObject *object)
   ShumateNetworkTileSource *tile_source  = SHUMATE_NETWORK_TILE_SOURCE (object);
   ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (tile_source);
 
+  if (priv->dispatch_idle_id != 0)
+    {
+      g_source_remove (priv->dispatch_idle_id);
+      priv->dispatch_idle_id = 0;
+    }
+
+  /* Never sent, so nothing else will free them */
+  while (priv->pending_fetches && priv->pending_fetches->len > 0)
+    tile_fetch_free (g_ptr_array_steal_index_fast (priv->pending_fetches, priv->pending_fetches->len - 1));
+
   if (priv->soup_session)
     {
       soup_session_abort (priv->soup_session);
@@ -203,6 +333,12 @@ shumate_network_tile_source_finalize (GObject *object)
 
   g_clear_pointer (&priv->uri_format, g_free);
   g_clear_pointer (&priv->proxy_uri, g_free);
+  g_clear_pointer (&priv->uri_ops, g_array_unref);
+  g_clear_pointer (&priv->fetches, g_hash_table_unref);
+  g_clear_pointer (&priv->pending_fetches, g_ptr_array_unref);
+  g_clear_pointer (&priv->hosts, g_hash_table_unref);
+  forget_missing_tiles (tile_source);
+  g_clear_pointer (&priv->missing_tiles, g_hash_table_unref);
 
   G_OBJECT_CLASS (shumate_network_tile_source_parent_class)->finalize (object);
 }
@@ -289,6 +425,44 @@ shumate_network_tile_source_class_init (ShumateNetworkTileSourceClass *klass)
         G_PARAM_WRITABLE);
 
   g_object_class_install_property (object_class, PROP_USER_AGENT, pspec);
+
+  /**
+   * ShumateNetworkTileSource:missing-tile-ttl:
+   *
+   * How long, in seconds, a tile the server answered "404 Not Found" or
+   * "410 Gone" for isn't requested again. Such tiles are typically outside
+   * of the area covered by the server. 0 disables this.
+   */
+  pspec = g_param_spec_uint ("missing-tile-ttl",
+        "Missing Tile TTL",
+        "How long tiles missing on the server aren't requested again",
+        0,
+        G_MAXUINT,
+        MISSING_TILE_TTL_DEFAULT,
+        G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY);
+
+  g_object_class_install_property (object_class, PROP_MISSING_TILE_TTL, pspec);
+}
+
+
+/* Host names are compared without case */
+static guint
+host_hash (gconstpointer key)
+{
+  guint hash = 5381;
+
+  for (const char *p = key; *p != '\0'; p++)
+    hash = (hash << 5) + hash + g_ascii_tolower (*p);
+
+  return hash;
+}
+
+
+static gboolean
+host_equal (gconstpointer a,
+            gconstpointer b)
+{
+  return g_ascii_strcasecmp (a, b) == 0;
 }
 
 
@@ -299,8 +473,14 @@ shumate_network_tile_source_init (ShumateNetworkTileSource *tile_source)
 
   priv->proxy_uri = NULL;
   priv->uri_format = NULL;
+  priv->uri_ops = g_array_new (FALSE, FALSE, sizeof (UriOp));
   priv->offline = FALSE;
   priv->max_conns = MAX_CONNS_DEFAULT;
+  priv->fetches = g_hash_table_new (g_int64_hash, g_int64_equal);
+  priv->pending_fetches = g_ptr_array_new ();
+  priv->hosts = g_hash_table_new_full (host_hash, host_equal, g_free, g_free);
+  priv->missing_tiles = g_hash_table_new (g_int64_hash, g_int64_equal);
+  priv->missing_tile_ttl = MISSING_TILE_TTL_DEFAULT;
 
   priv->soup_session = soup_session_new_with_options (
         "proxy-uri", NULL,
@@ -363,6 +543,131 @@ shumate_network_tile_source_new_full (const char *id,
 }
 
 
+static void
+append_uri_literal (GArray *ops,
+                    guint   offset,
+                    guint   length)
+{
+  UriOp op = { URI_OP_LITERAL, offset, length };
+
+  if (length == 0)
+    return;
+
+  if (ops->len > 0)
+    {
+      UriOp *last = &g_array_index (ops, UriOp, ops->len - 1);
+
+      if (last->kind == URI_OP_LITERAL && last->offset + last->length == offset)
+        {
+          last->length += length;
+          return;
+        }
+    }
+
+  g_array_append_val (ops, op);
+}
+
+static void
+append_uri_op (GArray    *ops,
+               UriOpKind  kind)
+{
+  UriOp op = { kind, 0, 0 };
+
+  g_array_append_val (ops, op);
+}
+
+/* Parses the {name} placeholders of a part of the format outside of "#" */
+static void
+compile_uri_literal (GArray     *ops,
+                     const char *format,
+                     guint       offset,
+                     guint       length)
+{
+  guint start = offset;
+  guint end = offset + length;
+
+  for (guint i = offset; i < end; i++)
+    {
+      const char *close;
+      guint name_length;
+
+      if (format[i] != '{')
+        continue;
+
+      close = memchr (format + i, '}', end - i);
+      if (close == NULL)
+        break;
+
+      name_length = close - (format + i) - 1;
+      for (guint j = 0; j < G_N_ELEMENTS (uri_placeholders); j++)
+        {
+          if (strlen (uri_placeholders[j].brace_name) == name_length &&
+              strncmp (format + i + 1, uri_placeholders[j].brace_name, name_length) == 0)
+            {
+              append_uri_literal (ops, start, i - start);
+              append_uri_op (ops, uri_placeholders[j].kind);
+              i += name_length + 1;
+              start = i + 1;
+              break;
+            }
+        }
+    }
+
+  append_uri_literal (ops, start, end - start);
+}
+
+/*
+ * Turns the URI format into a list of operations, so that the URI of a tile
+ * is formatted without parsing it again. The format is split on "#": a part
+ * which is the name of a placeholder, such as "X" in "#X#", becomes its
+ * value, and the other parts are copied with their {name} placeholders
+ * replaced. The "#" themselves are dropped.
+ */
+static void
+compile_uri_format (ShumateNetworkTileSource *self)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  const char *format = priv->uri_format;
+  const char *token;
+
+  g_array_set_size (priv->uri_ops, 0);
+
+  if (format == NULL)
+    return;
+
+  token = format;
+  while (TRUE)
+    {
+      const char *end = strchr (token, '#');
+      guint length;
+      gboolean found = FALSE;
+
+      if (end == NULL)
+        end = token + strlen (token);
+      length = end - token;
+
+      for (guint i = 0; i < G_N_ELEMENTS (uri_placeholders); i++)
+        {
+          if (strlen (uri_placeholders[i].hash_name) == length &&
+              strncmp (token, uri_placeholders[i].hash_name, length) == 0)
+            {
+              append_uri_op (priv->uri_ops, uri_placeholders[i].kind);
+              found = TRUE;
+              break;
+            }
+        }
+
+      if (!found)
+        compile_uri_literal (priv->uri_ops, format, token - format, length);
+
+      if (*end == '\0')
+        break;
+
+      token = end + 1;
+    }
+}
+
+
 /**
  * shumate_network_tile_source_get_uri_format:
  * @tile_source: the #ShumateNetworkTileSource
@@ -391,11 +696,19 @@ shumate_network_tile_source_get_uri_format (ShumateNetworkTileSource *tile_sourc
  * A URI format is a URI where x, y and zoom level information have been
  * marked for parsing and insertion.  There can be an unlimited number of
  * marked items in a URI format.  They are delimited by "#" before and after
- * the variable name. There are 4 defined variable names: X, Y, Z, and TMSY for
- * Y in TMS coordinates.
+ * the variable name. There are 6 defined variable names: X, Y, Z, TMSY for
+ * Y in TMS coordinates, S for a subdomain among a, b and c, chosen from the
+ * tile coordinates to spread the requests over several hosts, and Q for the
+ * quadkey of the tile as used by Bing Maps.
+ *
+ * The same variables can be written between braces: {x}, {y}, {z}, {-y},
+ * {s} and {q}.
  *
  * For example, this is the OpenStreetMap URI format:
  * "http://tile.openstreetmap.org/\#Z\#/\#X\#/\#Y\#.png"
+ *
+ * The format is parsed once here, so building the URI of each tile is
+ * cheap.
  */
 void
 shumate_network_tile_source_set_uri_format (ShumateNetworkTileSource *tile_source,
@@ -407,6 +720,7 @@ shumate_network_tile_source_set_uri_format (ShumateNetworkTileSource *tile_sourc
 
   g_free (priv->uri_format);
   priv->uri_format = g_strdup (uri_format);
+  compile_uri_format (tile_source);
 
   g_object_notify (G_OBJECT (tile_source), "uri-format");
 }
@@ -554,6 +868,55 @@ shumate_network_tile_source_set_max_conns (ShumateNetworkTileSource *tile_source
       NULL);
 
   g_object_notify (G_OBJECT (tile_source), "max_conns");
+
+  tile_fetch_dispatch (tile_source);
+}
+
+/**
+ * shumate_network_tile_source_get_missing_tile_ttl:
+ * @tile_source: the #ShumateNetworkTileSource
+ *
+ * Gets how long tiles missing on the server aren't requested again.
+ *
+ * Returns: the delay in seconds
+ */
+guint
+shumate_network_tile_source_get_missing_tile_ttl (ShumateNetworkTileSource *tile_source)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (tile_source);
+
+  g_return_val_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (tile_source), 0);
+
+  return priv->missing_tile_ttl;
+}
+
+
+/**
+ * shumate_network_tile_source_set_missing_tile_ttl:
+ * @tile_source: the #ShumateNetworkTileSource
+ * @ttl: the delay in seconds
+ *
+ * Sets how long, in seconds, a tile the server answered "404 Not Found" or
+ * "410 Gone" for isn't requested again. The error tile is displayed instead
+ * in the meantime. 0 disables this.
+ */
+void
+shumate_network_tile_source_set_missing_tile_ttl (ShumateNetworkTileSource *tile_source,
+    guint ttl)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (tile_source);
+
+  g_return_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (tile_source));
+
+  if (priv->missing_tile_ttl == ttl)
+    return;
+
+  priv->missing_tile_ttl = ttl;
+
+  /* Entries were added with the previous delay */
+  forget_missing_tiles (tile_source);
+
+  g_object_notify (G_OBJECT (tile_source), "missing-tile-ttl");
 }
 
 /**
@@ -579,113 +942,791 @@ shumate_network_tile_source_set_user_agent (
 }
 
 
-#define SIZE 8
-static char *
-get_tile_uri (ShumateNetworkTileSource *tile_source,
-    int x,
-    int y,
-    int z)
+static inline void
+uri_append (char       *buffer,
+            gsize       size,
+            gsize      *length,
+            const char *data,
+            gsize       n)
 {
-  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (tile_source);
+  if (*length < size)
+    memcpy (buffer + *length, data, MIN (n, size - *length));
+
+  *length += n;
+}
+
+static inline void
+uri_append_int (char  *buffer,
+                gsize  size,
+                gsize *length,
+                int    value)
+{
+  char digits[16];
+  int n = g_snprintf (digits, sizeof digits, "%d", value);
 
-  char **tokens;
-  char *token;
-  GString *ret;
-  int i = 0;
+  uri_append (buffer, size, length, digits, n);
+}
 
-  tokens = g_strsplit (priv->uri_format, "#", 20);
-  token = tokens[i];
-  ret = g_string_sized_new (strlen (priv->uri_format));
+/*
+ * Formats the URI of a tile into @buffer, which is always nul-terminated
+ * when @size isn't 0. Returns the length of the full URI: when it is not
+ * smaller than @size, the URI was truncated.
+ */
+static gsize
+format_tile_uri (ShumateNetworkTileSource *self,
+                 int                       x,
+                 int                       y,
+                 int                       z,
+                 char                     *buffer,
+                 gsize                     size)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  gsize length = 0;
 
-  while (token != NULL)
+  for (guint i = 0; i < priv->uri_ops->len; i++)
     {
-      int number = G_MAXINT;
-      char value[SIZE];
-
-      if (strcmp (token, "X") == 0)
-        number = x;
-      if (strcmp (token, "Y") == 0)
-        number = y;
-      if (strcmp (token, "TMSY") == 0){
-        int ymax = 1 << z;
-        number = ymax - y - 1;
-      }
-      if (strcmp (token, "Z") == 0)
-        number = z;
-
-      if (number != G_MAXINT)
+      const UriOp *op = &g_array_index (priv->uri_ops, UriOp, i);
+
+      switch (op->kind)
         {
-          g_snprintf (value, SIZE, "%d", number);
-          g_string_append (ret, value);
+        case URI_OP_LITERAL:
+          uri_append (buffer, size, &length, priv->uri_format + op->offset, op->length);
+          break;
+
+        case URI_OP_X:
+          uri_append_int (buffer, size, &length, x);
+          break;
+
+        case URI_OP_Y:
+          uri_append_int (buffer, size, &length, y);
+          break;
+
+        case URI_OP_TMSY:
+          uri_append_int (buffer, size, &length, (1 << z) - y - 1);
+          break;
+
+        case URI_OP_Z:
+          uri_append_int (buffer, size, &length, z);
+          break;
+
+        case URI_OP_SUBDOMAIN:
+          /* The same tile always comes from the same host, which keeps
+           * HTTP caches useful */
+          uri_append (buffer, size, &length,
+                      &uri_subdomains[(x + y) % (sizeof uri_subdomains - 1)], 1);
+          break;
+
+        case URI_OP_QUADKEY:
+          for (int level = z; level > 0; level--)
+            {
+              int mask = 1 << (level - 1);
+              char digit = '0';
+
+              if (x & mask)
+                digit += 1;
+              if (y & mask)
+                digit += 2;
+
+              uri_append (buffer, size, &length, &digit, 1);
+            }
+          break;
+
+        default:
+          g_assert_not_reached ();
         }
+    }
+
+  if (size > 0)
+    buffer[MIN (length, size - 1)] = '\0';
+
+  return length;
+}
+
+
+/* The URI of a tile, as it is requested */
+char *
+shumate_network_tile_source_get_tile_uri (ShumateNetworkTileSource *self,
+                                          int                       x,
+                                          int                       y,
+                                          int                       z)
+{
+  gsize length;
+  char *uri;
+
+  g_return_val_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (self), NULL);
+
+  length = format_tile_uri (self, x, y, z, NULL, 0);
+  uri = g_malloc (length + 1);
+  format_tile_uri (self, x, y, z, uri, length + 1);
+
+  return uri;
+}
+
+
+static inline guint64
+fetch_key (int x,
+           int y,
+           int z)
+{
+  return ((guint64) z << 58) | ((guint64) x << 29) | (guint64) y;
+}
+
+static const char *
+tile_fetch_get_host (TileFetch *fetch)
+{
+  SoupURI *uri = fetch->msg ? soup_message_get_uri (fetch->msg) : NULL;
+
+  return uri ? soup_uri_get_host (uri) : NULL;
+}
+
+/* Whether requests may be sent to @host */
+static gboolean
+host_is_available (ShumateNetworkTileSource *self,
+                   const char               *host)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  HostHealth *health;
+
+  if (host == NULL)
+    return TRUE;
+
+  health = g_hash_table_lookup (priv->hosts, host);
+
+  return health == NULL || g_get_monotonic_time () >= health->retry_time;
+}
+
+static gboolean
+tile_fetch_host_is_available (TileFetch *fetch)
+{
+  return host_is_available (fetch->self, tile_fetch_get_host (fetch));
+}
+
+/*
+ * Whether the tile may be downloaded from its server. Only the host part of
+ * the formatted URI is looked at, no message is built for this.
+ */
+static gboolean
+tile_host_is_available (ShumateNetworkTileSource *self,
+                        int                       x,
+                        int                       y,
+                        int                       z)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  char uri_buffer[URI_BUFFER_SIZE];
+  g_autofree char *long_uri = NULL;
+  g_autofree char *host = NULL;
+  const char *uri = uri_buffer;
+  const char *host_start;
+  gsize uri_length;
+  gsize host_length;
+
+  /* Nothing failed yet, which is the usual case */
+  if (g_hash_table_size (priv->hosts) == 0)
+    return TRUE;
+
+  uri_length = format_tile_uri (self, x, y, z, uri_buffer, sizeof uri_buffer);
+  if (uri_length >= sizeof uri_buffer)
+    {
+      long_uri = g_malloc (uri_length + 1);
+      format_tile_uri (self, x, y, z, long_uri, uri_length + 1);
+      uri = long_uri;
+    }
+
+  host_start = strstr (uri, "://");
+  if (host_start == NULL)
+    return TRUE;
+
+  host_start += 3;
+  host_length = strcspn (host_start, "/?#");
+
+  /* Skip the user info, then drop the port */
+  for (gsize i = host_length; i > 0; i--)
+    {
+      if (host_start[i - 1] == '@')
+        {
+          host_start += i;
+          host_length -= i;
+          break;
+        }
+    }
+  if (host_start[0] != '[')
+    host_length = MIN (host_length, strcspn (host_start, ":"));
+
+  host = g_strndup (host_start, host_length);
+
+  return host_is_available (self, host);
+}
+
+static void
+tile_fetch_host_failed (TileFetch *fetch)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fetch->self);
+  const char *host = tile_fetch_get_host (fetch);
+  HostHealth *health;
+  gint64 backoff;
+
+  if (host == NULL)
+    return;
+
+  health = g_hash_table_lookup (priv->hosts, host);
+  if (health == NULL)
+    {
+      health = g_new0 (HostHealth, 1);
+      g_hash_table_insert (priv->hosts, g_strdup (host), health);
+    }
+
+  health->failures++;
+  if (health->failures < HOST_FAILURE_THRESHOLD)
+    return;
+
+  backoff = (gint64) HOST_BACKOFF_MIN << MIN (health->failures - HOST_FAILURE_THRESHOLD, 16);
+  backoff = MIN (backoff, HOST_BACKOFF_MAX);
+  health->retry_time = g_get_monotonic_time () + backoff;
+
+  DEBUG ("%s failed %u times, not trying it again for %" G_GINT64_FORMAT " s",
+      host, health->failures, backoff / G_USEC_PER_SEC);
+}
+
+static void
+tile_fetch_host_succeeded (TileFetch *fetch)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fetch->self);
+  const char *host = tile_fetch_get_host (fetch);
+
+  if (host != NULL)
+    g_hash_table_remove (priv->hosts, host);
+}
+
+static void
+forget_missing_tile (ShumateNetworkTileSource *self,
+                     MissingTile              *missing)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+
+  g_hash_table_remove (priv->missing_tiles, &missing->key);
+  g_queue_unlink (&priv->missing_tiles_order, &missing->link);
+  g_free (missing);
+}
+
+static void
+forget_missing_tiles (ShumateNetworkTileSource *self)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+
+  while (priv->missing_tiles_order.head != NULL)
+    forget_missing_tile (self, priv->missing_tiles_order.head->data);
+}
+
+static void
+remember_missing_tile (ShumateNetworkTileSource *self,
+                       guint64                   key)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  MissingTile *missing;
+  GList *oldest;
+  gint64 now;
+
+  if (priv->missing_tile_ttl == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  missing = g_hash_table_lookup (priv->missing_tiles, &key);
+  if (missing != NULL)
+    forget_missing_tile (self, missing);
+
+  /* Drop the entries which expired, then the oldest ones if there are still
+   * too many */
+  while ((oldest = priv->missing_tiles_order.head) != NULL &&
+         (((MissingTile *) oldest->data)->expiry_time <= now ||
+          g_hash_table_size (priv->missing_tiles) >= MISSING_TILES_MAX))
+    forget_missing_tile (self, oldest->data);
+
+  missing = g_new0 (MissingTile, 1);
+  missing->key = key;
+  missing->expiry_time = now + (gint64) priv->missing_tile_ttl * G_USEC_PER_SEC;
+  missing->link.data = missing;
+
+  g_hash_table_insert (priv->missing_tiles, &missing->key, missing);
+  g_queue_push_tail_link (&priv->missing_tiles_order, &missing->link);
+}
+
+static gboolean
+is_missing_tile (ShumateNetworkTileSource *self,
+                 guint64                   key)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  MissingTile *missing = g_hash_table_lookup (priv->missing_tiles, &key);
+
+  if (missing == NULL)
+    return FALSE;
+
+  if (missing->expiry_time <= g_get_monotonic_time ())
+    {
+      forget_missing_tile (self, missing);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+tile_fetch_waiter_free (TileFetchWaiter *waiter)
+{
+  if (waiter->cancelled_id != 0)
+    g_cancellable_disconnect (waiter->cancellable, waiter->cancelled_id);
+  if (waiter->state_id != 0)
+    g_signal_handler_disconnect (waiter->tile, waiter->state_id);
+
+  g_clear_object (&waiter->tile);
+  g_clear_object (&waiter->cancellable);
+  g_slice_free (TileFetchWaiter, waiter);
+}
+
+/* Stops new requests from joining the fetch */
+static void
+tile_fetch_unregister (TileFetch *fetch)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fetch->self);
+
+  if (g_hash_table_lookup (priv->fetches, &fetch->key) == fetch)
+    g_hash_table_remove (priv->fetches, &fetch->key);
+}
+
+static void
+tile_fetch_free (TileFetch *fetch)
+{
+  tile_fetch_unregister (fetch);
+
+  g_clear_pointer (&fetch->waiters, g_ptr_array_unref);
+  g_clear_object (&fetch->cancellable);
+  g_clear_object (&fetch->msg);
+  g_clear_pointer (&fetch->etag, g_free);
+  g_clear_object (&fetch->body);
+  g_clear_pointer (&fetch->bytes, g_bytes_unref);
+  g_clear_object (&fetch->self);
+  g_slice_free (TileFetch, fetch);
+}
+
+static int tile_fetch_get_priority (TileFetch *fetch);
+static void tile_fetch_fail (TileFetch *fetch);
+static void on_message_sent (GObject      *source_object,
+                             GAsyncResult *res,
+                             gpointer      user_data);
+
+static void
+tile_fetch_send (TileFetch *fetch)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fetch->self);
+
+  fetch->sent = TRUE;
+  fetch->running = TRUE;
+  priv->n_running++;
+
+  soup_session_send_async (priv->soup_session, fetch->msg, fetch->cancellable, on_message_sent, fetch);
+}
+
+/*
+ * Revalidations only refresh tiles that are already displayed, so they are
+ * sent after the downloads of tiles that have nothing to show yet.
+ */
+static int
+tile_fetch_get_send_priority (TileFetch *fetch)
+{
+  int priority = tile_fetch_get_priority (fetch);
+
+  if (fetch->conditional)
+    priority += SHUMATE_TILE_PRIORITY_PREFETCH;
+
+  return priority;
+}
+
+/* Sends the best pending requests while connections are available */
+static void
+tile_fetch_dispatch (ShumateNetworkTileSource *self)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+  g_autoptr(ShumateNetworkTileSource) self_ref = g_object_ref (self);
+
+  for (guint i = priv->pending_fetches->len; i > 0; i--)
+    {
+      TileFetch *fetch = g_ptr_array_index (priv->pending_fetches, i - 1);
+
+      if (fetch->n_active == 0)
+        tile_fetch_free (g_ptr_array_steal_index_fast (priv->pending_fetches, i - 1));
+    }
+
+  while (priv->soup_session &&
+         priv->n_running < (guint) MAX (priv->max_conns, 1) &&
+         priv->pending_fetches->len > 0)
+    {
+      TileFetch *fetch;
+      guint best = 0;
+      int best_priority = tile_fetch_get_send_priority (g_ptr_array_index (priv->pending_fetches, 0));
+
+      /* Priorities change as the view moves, so they are only compared
+       * when a connection frees up */
+      for (guint i = 1; i < priv->pending_fetches->len; i++)
+        {
+          int priority = tile_fetch_get_send_priority (g_ptr_array_index (priv->pending_fetches, i));
+
+          if (priority < best_priority)
+            {
+              best = i;
+              best_priority = priority;
+            }
+        }
+
+      fetch = g_ptr_array_steal_index_fast (priv->pending_fetches, best);
+
+      /* The server went down while the request was waiting */
+      if (!tile_fetch_host_is_available (fetch))
+        tile_fetch_fail (fetch);
       else
-        g_string_append (ret, token);
+        tile_fetch_send (fetch);
+    }
+}
 
-      token = tokens[++i];
+static gboolean
+dispatch_idle_cb (gpointer user_data)
+{
+  ShumateNetworkTileSource *self = user_data;
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+
+  priv->dispatch_idle_id = 0;
+  tile_fetch_dispatch (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+tile_fetch_queue_dispatch (ShumateNetworkTileSource *self)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
+
+  if (priv->dispatch_idle_id == 0)
+    priv->dispatch_idle_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                              dispatch_idle_cb,
+                                              g_object_ref (self),
+                                              g_object_unref);
+}
+
+/* The request doesn't need its connection anymore */
+static void
+tile_fetch_release (TileFetch *fetch)
+{
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fetch->self);
+
+  if (!fetch->running)
+    return;
+
+  fetch->running = FALSE;
+  priv->n_running--;
+  tile_fetch_dispatch (fetch->self);
+}
+
+/*
+ * Called when a waiting tile doesn't want the result anymore. The download
+ * itself is only cancelled when it was the last one.
+ */
+static void
+tile_fetch_detach_waiter (TileFetchWaiter *waiter)
+{
+  TileFetch *fetch = waiter->fetch;
+
+  if (!waiter->active)
+    return;
+
+  waiter->active = FALSE;
+  fetch->n_active--;
+
+  if (fetch->n_active == 0)
+    {
+      DEBUG ("Canceling download of tile %d, %d", fetch->x, fetch->y);
+      tile_fetch_unregister (fetch);
+
+      /* This may run from a cancellable handler, where the waiters can't be
+       * disconnected: a request that wasn't sent yet is dropped later. */
+      if (fetch->sent)
+        g_cancellable_cancel (fetch->cancellable);
+      else
+        tile_fetch_queue_dispatch (fetch->self);
+    }
+}
+
+static void
+on_waiter_cancelled (GCancellable    *cancellable,
+                     TileFetchWaiter *waiter)
+{
+  tile_fetch_detach_waiter (waiter);
+}
+
+static void
+on_waiter_tile_state (ShumateTile     *tile,
+                      GParamSpec      *pspec,
+                      TileFetchWaiter *waiter)
+{
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
+    tile_fetch_detach_waiter (waiter);
+}
+
+/*
+ * Unregisters the fetch and disconnects the waiters, so that they can be
+ * given the result without calling back into the fetch.
+ */
+static void
+tile_fetch_complete (TileFetch *fetch)
+{
+  tile_fetch_unregister (fetch);
+
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      TileFetchWaiter *waiter = g_ptr_array_index (fetch->waiters, i);
+
+      if (waiter->cancelled_id != 0)
+        g_cancellable_disconnect (waiter->cancellable, waiter->cancelled_id);
+      if (waiter->state_id != 0)
+        g_signal_handler_disconnect (waiter->tile, waiter->state_id);
+      waiter->cancelled_id = 0;
+      waiter->state_id = 0;
     }
+}
+
+/* Hands the tiles still waiting over to the next source */
+static void
+tile_fetch_fail (TileFetch *fetch)
+{
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (SHUMATE_MAP_SOURCE (fetch->self));
+
+  tile_fetch_complete (fetch);
+
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      TileFetchWaiter *waiter = g_ptr_array_index (fetch->waiters, i);
 
-  token = ret->str;
-  g_string_free (ret, FALSE);
-  g_strfreev (tokens);
+      if (waiter->active && next_source)
+        shumate_map_source_fill_tile (next_source, waiter->tile, waiter->cancellable);
+    }
 
-  return token;
+  tile_fetch_free (fetch);
 }
 
+/* The active waiting tile with the best priority, if any */
+static ShumateTile *
+tile_fetch_get_first_tile (TileFetch *fetch)
+{
+  ShumateTile *first = NULL;
+
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      TileFetchWaiter *waiter = g_ptr_array_index (fetch->waiters, i);
+
+      if (waiter->active &&
+          (!first || shumate_tile_get_priority (waiter->tile) < shumate_tile_get_priority (first)))
+        first = waiter->tile;
+    }
+
+  return first;
+}
+
+/* Whether some active waiting tile is drawn, see shumate_tile_set_store_only() */
+static gboolean
+tile_fetch_is_displayed (TileFetch *fetch)
+{
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      TileFetchWaiter *waiter = g_ptr_array_index (fetch->waiters, i);
+
+      if (waiter->active && !shumate_tile_get_store_only (waiter->tile))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static int
+tile_fetch_get_priority (TileFetch *fetch)
+{
+  ShumateTile *first = tile_fetch_get_first_tile (fetch);
+
+  return first ? shumate_tile_get_priority (first) : SHUMATE_TILE_PRIORITY_VISIBLE;
+}
 
 static void
-on_pixbuf_created (GObject      *source_object,
-                   GAsyncResult *res,
-                   gpointer      user_data)
+on_tile_decoded (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
 {
-  TileRenderedData *rendered_data = (TileRenderedData *) user_data;
-  g_autoptr(ShumateNetworkTileSource) self = g_steal_pointer (&rendered_data->self);
-  g_autoptr(GCancellable) cancellable = g_steal_pointer (&rendered_data->cancellable);
-  g_autoptr(ShumateTile) tile = g_steal_pointer (&rendered_data->tile);
+  TileFetch *fetch = user_data;
   g_autoptr(GError) error = NULL;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
   g_autoptr(GdkTexture) texture = NULL;
-  g_autofree char *etag = g_steal_pointer (&rendered_data->etag);
-  ShumateTileCache *tile_cache = shumate_tile_source_get_cache (SHUMATE_TILE_SOURCE (self));
+  ShumateTileCache *tile_cache = shumate_tile_source_get_cache (SHUMATE_TILE_SOURCE (fetch->self));
+  gboolean stored = FALSE;
 
-  g_slice_free (TileRenderedData, rendered_data);
-  g_signal_handlers_disconnect_by_func (tile, tile_state_notify, cancellable);
-
-  pixbuf = gdk_pixbuf_new_from_stream_finish (res, &error);
-  if (!pixbuf)
+  texture = shumate_tile_decode_finish (res, &error);
+  if (!texture)
     {
-      ShumateMapSource *next_source = shumate_map_source_get_next_source (SHUMATE_MAP_SOURCE (self));
       if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
         {
-          DEBUG ("Download of tile %d, %d got cancelled",
-              shumate_tile_get_x (tile), shumate_tile_get_y (tile));
+          DEBUG ("Download of tile %d, %d got cancelled", fetch->x, fetch->y);
+          tile_fetch_free (fetch);
           return;
         }
 
-      if (next_source)
-        shumate_map_source_fill_tile (next_source, tile, cancellable);
+      tile_fetch_fail (fetch);
+      return;
+    }
+
+  tile_fetch_complete (fetch);
+
+  /* Tiles only downloaded for the persistent caches are still decoded, so
+   * that broken data isn't stored, but their texture isn't kept */
+  if (tile_fetch_is_displayed (fetch))
+    shumate_texture_cache_insert (shumate_texture_cache_get_default (),
+        shumate_map_source_get_id (SHUMATE_MAP_SOURCE (fetch->self)),
+        fetch->x,
+        fetch->y,
+        fetch->z,
+        texture);
+
+  for (guint i = 0; i < fetch->waiters->len; i++)
+    {
+      TileFetchWaiter *waiter = g_ptr_array_index (fetch->waiters, i);
+
+      if (!waiter->active)
+        continue;
+
+      if (fetch->etag != NULL)
+        shumate_tile_set_etag (waiter->tile, fetch->etag);
+      shumate_tile_set_expiry_time (waiter->tile, fetch->expiry_time);
+
+      /* Cache the data as it was received, it decodes fine */
+      if (tile_cache && !stored)
+        {
+          shumate_tile_cache_store_tile (tile_cache, waiter->tile, fetch->bytes);
+          stored = TRUE;
+        }
+
+      shumate_tile_set_texture (waiter->tile, texture);
+      shumate_tile_set_fade_in (waiter->tile, TRUE);
+      shumate_tile_set_state (waiter->tile, SHUMATE_STATE_DONE);
+    }
+
+  tile_fetch_free (fetch);
+}
+
+static void
+on_body_read (GObject      *source_object,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+  TileFetch *fetch = user_data;
+  g_autoptr(GError) error = NULL;
+
+  tile_fetch_release (fetch);
+
+  if (g_output_stream_splice_finish (fetch->body, res, &error) == -1)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          DEBUG ("Download of tile %d, %d got cancelled", fetch->x, fetch->y);
+          tile_fetch_free (fetch);
+          return;
+        }
 
+      DEBUG ("Unable to read tile %d, %d: %s", fetch->x, fetch->y, error->message);
+      tile_fetch_fail (fetch);
       return;
     }
 
+  /* The body is kept as received and shared by the decoder and the caches */
+  fetch->bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (fetch->body));
+
+  shumate_tile_decode_async (fetch->bytes,
+      tile_fetch_get_first_tile (fetch),
+      fetch->cancellable,
+      on_tile_decoded,
+      fetch);
+}
 
-  if (etag != NULL)
-    shumate_tile_set_etag (tile, etag);
+/*
+ * Computes until when a response may be used without revalidating it, from
+ * its Cache-Control or Expires headers. Returns 0 when the server doesn't
+ * say, and leaves the choice to the cache.
+ *
+ * Like RFC 7234 §4.2.1 says, Expires is taken relative to the Date of the
+ * response when there is one, so a wrong local clock doesn't matter.
+ */
+gint64
+shumate_network_tile_source_parse_expiry_time (SoupMessageHeaders *headers)
+{
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  const char *cache_control;
+  const char *expires;
 
-  if (tile_cache)
+  cache_control = soup_message_headers_get_list (headers, "Cache-Control");
+  if (cache_control)
     {
-      g_autoptr(GError) error = NULL;
-      g_autofree char *buffer = NULL;
-      gsize buffer_size;
-      if (!gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, "png", &error, NULL))
-        g_warning ("Unable to export tile: %s", error->message);
-      else
-        shumate_tile_cache_store_tile (tile_cache, tile, buffer, buffer_size);
+      GHashTable *directives = soup_header_parse_param_list (cache_control);
+      const char *max_age = g_hash_table_lookup (directives, "max-age");
+      gboolean no_cache = g_hash_table_contains (directives, "no-cache") ||
+                          g_hash_table_contains (directives, "no-store");
+      gint64 lifetime = -1;
+
+      if (max_age)
+        {
+          char *end;
+          gint64 value = g_ascii_strtoll (max_age, &end, 10);
+
+          if (end != max_age && *end == '\0' && value >= 0)
+            lifetime = value;
+        }
+
+      soup_header_free_param_list (directives);
+
+      if (no_cache)
+        return now;
+
+      if (lifetime >= 0)
+        {
+          const char *age = soup_message_headers_get_one (headers, "Age");
+
+          /* The response may have spent some time in a proxy cache */
+          if (age)
+            lifetime -= CLAMP (g_ascii_strtoll (age, NULL, 10), 0, lifetime);
+
+          return now + lifetime;
+        }
     }
 
-  texture = gdk_texture_new_for_pixbuf (pixbuf);
-  shumate_tile_set_texture (tile, texture);
-  shumate_tile_set_fade_in (tile, TRUE);
-  shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+  expires = soup_message_headers_get_one (headers, "Expires");
+  if (expires)
+    {
+      SoupDate *expires_date = soup_date_new_from_string (expires);
+      const char *date = soup_message_headers_get_one (headers, "Date");
+      SoupDate *response_date;
+      gint64 expiry_time;
+
+      /* Invalid dates such as "0" mean that the response already expired */
+      if (expires_date == NULL)
+        return now;
+
+      expiry_time = soup_date_to_time_t (expires_date);
+      soup_date_free (expires_date);
+
+      response_date = date ? soup_date_new_from_string (date) : NULL;
+      if (response_date)
+        {
+          gint64 lifetime = expiry_time - soup_date_to_time_t (response_date);
+
+          soup_date_free (response_date);
+          return now + MAX (lifetime, 0);
+        }
+
+      return MAX (expiry_time, 1);
+    }
+
+  return 0;
 }
 
 static void
@@ -693,89 +1734,98 @@ on_message_sent (GObject *source_object,
                  GAsyncResult *res,
                  gpointer user_data)
 {
-  TileLoadedData *callback_data = (TileLoadedData *) user_data;
-  g_autoptr(SoupMessage) msg = g_steal_pointer (&callback_data->msg);
-  g_autoptr(ShumateNetworkTileSource) self = g_steal_pointer (&callback_data->self);
-  g_autoptr(GCancellable) cancellable = g_steal_pointer (&callback_data->cancellable);
-  g_autoptr(ShumateTile) tile = g_steal_pointer (&callback_data->tile);
+  TileFetch *fetch = user_data;
   g_autoptr(GInputStream) input_stream = NULL;
   g_autoptr(GError) error = NULL;
-  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (self);
-  ShumateTileSource *tile_source = SHUMATE_TILE_SOURCE (self);
-  ShumateTileCache *tile_cache = shumate_tile_source_get_cache (tile_source);
-  ShumateMapSource *next_source = shumate_map_source_get_next_source (SHUMATE_MAP_SOURCE (self));
+  ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (fetch->self);
+  ShumateTileCache *tile_cache = shumate_tile_source_get_cache (SHUMATE_TILE_SOURCE (fetch->self));
   const char *etag;
-  TileRenderedData *data;
-
-  g_slice_free (TileLoadedData, callback_data);
+  guint status;
 
   input_stream = soup_session_send_finish (priv->soup_session, res, &error);
-  if (!input_stream)
+  if (!input_stream && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        {
-          DEBUG ("Download of tile %d, %d got cancelled",
-              shumate_tile_get_x (tile), shumate_tile_get_y (tile));
-
-          g_signal_handlers_disconnect_by_func (tile, tile_state_notify, cancellable);
-          return;
-        }
+      DEBUG ("Download of tile %d, %d got cancelled", fetch->x, fetch->y);
+      tile_fetch_release (fetch);
+      tile_fetch_free (fetch);
+      return;
     }
-  
-  DEBUG ("Got reply %d", msg->status_code);
 
-  if (msg->status_code == SOUP_STATUS_NOT_MODIFIED)
+  status = fetch->msg->status_code;
+  DEBUG ("Got reply %d", status);
+
+  /* Track the health of the server before releasing the connection, which
+   * sends the next request. 429 is "Too Many Requests". */
+  if (!input_stream ||
+      SOUP_STATUS_IS_TRANSPORT_ERROR (status) ||
+      SOUP_STATUS_IS_SERVER_ERROR (status) ||
+      status == 429)
+    tile_fetch_host_failed (fetch);
+  else
+    tile_fetch_host_succeeded (fetch);
+
+  if (input_stream && status == SOUP_STATUS_NOT_MODIFIED)
     {
-      if (tile_cache)
-        shumate_tile_cache_refresh_tile_time (tile_cache, tile);
+      tile_fetch_release (fetch);
+
+      /* The server tells again for how long the tile stays fresh */
+      fetch->expiry_time = shumate_network_tile_source_parse_expiry_time (fetch->msg->response_headers);
+
+      /* Only tiles that already have their data join a conditional fetch */
+      tile_fetch_complete (fetch);
+
+      for (guint i = 0; i < fetch->waiters->len; i++)
+        {
+          TileFetchWaiter *waiter = g_ptr_array_index (fetch->waiters, i);
+
+          if (!waiter->active)
+            continue;
+
+          shumate_tile_set_expiry_time (waiter->tile, fetch->expiry_time);
+          if (tile_cache)
+            shumate_tile_cache_refresh_tile_time (tile_cache, waiter->tile);
 
-      g_signal_handlers_disconnect_by_func (tile, tile_state_notify, cancellable);
-      shumate_tile_set_fade_in (tile, TRUE);
-      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+          shumate_tile_set_fade_in (waiter->tile, TRUE);
+          shumate_tile_set_state (waiter->tile, SHUMATE_STATE_DONE);
+        }
+
+      tile_fetch_free (fetch);
       return;
     }
 
-  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+  if (!input_stream || !SOUP_STATUS_IS_SUCCESSFUL (status))
     {
       DEBUG ("Unable to download tile %d, %d: %s",
-          shumate_tile_get_x (tile),
-          shumate_tile_get_y (tile),
-          soup_status_get_phrase (msg->status_code));
+          fetch->x,
+          fetch->y,
+          error ? error->message : soup_status_get_phrase (status));
 
-      g_signal_handlers_disconnect_by_func (tile, tile_state_notify, cancellable);
-      if (next_source)
-        shumate_map_source_fill_tile (next_source, tile, cancellable);
+      /* Usually a tile outside of the area covered by the server */
+      if (status == SOUP_STATUS_NOT_FOUND || status == SOUP_STATUS_GONE)
+        remember_missing_tile (fetch->self, fetch->key);
 
+      tile_fetch_release (fetch);
+      tile_fetch_fail (fetch);
       return;
     }
 
   /* Verify if the server sent an etag and save it */
-  etag = soup_message_headers_get_one (msg->response_headers, "ETag");
+  etag = soup_message_headers_get_one (fetch->msg->response_headers, "ETag");
   DEBUG ("Received ETag %s", etag);
 
-  data = g_slice_new0 (TileRenderedData);
-  data->self = g_object_ref (self);
-  if (data->cancellable)
-    data->cancellable = g_object_ref (cancellable);
-  data->tile = g_object_ref (tile);
-  data->etag = g_strdup (etag);
-
-  gdk_pixbuf_new_from_stream_async (input_stream, cancellable, on_pixbuf_created, data);
+  fetch->etag = g_strdup (etag);
+  fetch->expiry_time = shumate_network_tile_source_parse_expiry_time (fetch->msg->response_headers);
+  fetch->body = g_memory_output_stream_new_resizable ();
+
+  g_output_stream_splice_async (fetch->body,
+      input_stream,
+      G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+      G_PRIORITY_DEFAULT,
+      fetch->cancellable,
+      on_body_read,
+      fetch);
 }
 
-static void
-tile_state_notify (ShumateTile *tile,
-    G_GNUC_UNUSED GParamSpec *pspec,
-    GCancellable *cancellable)
-{
-  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
-    {
-      DEBUG ("Canceling tile download");
-      g_cancellable_cancel (cancellable);
-    }
-}
-
-
 static char *
 get_modified_time_string (ShumateTile *tile)
 {
@@ -791,6 +1841,87 @@ get_modified_time_string (ShumateTile *tile)
 }
 
 
+static TileFetch *
+tile_fetch_new (ShumateNetworkTileSource *self,
+                ShumateTile              *tile)
+{
+  TileFetch *fetch = g_slice_new0 (TileFetch);
+  char uri_buffer[URI_BUFFER_SIZE];
+  g_autofree char *long_uri = NULL;
+  const char *uri = uri_buffer;
+  gsize uri_length;
+
+  fetch->self = g_object_ref (self);
+  fetch->x = shumate_tile_get_x (tile);
+  fetch->y = shumate_tile_get_y (tile);
+  fetch->z = shumate_tile_get_zoom_level (tile);
+  fetch->key = fetch_key (fetch->x, fetch->y, fetch->z);
+  fetch->cancellable = g_cancellable_new ();
+  fetch->waiters = g_ptr_array_new_with_free_func ((GDestroyNotify) tile_fetch_waiter_free);
+
+  uri_length = format_tile_uri (self, fetch->x, fetch->y, fetch->z, uri_buffer, sizeof uri_buffer);
+  if (uri_length >= sizeof uri_buffer)
+    {
+      long_uri = g_malloc (uri_length + 1);
+      format_tile_uri (self, fetch->x, fetch->y, fetch->z, long_uri, uri_length + 1);
+      uri = long_uri;
+    }
+  fetch->msg = soup_message_new (SOUP_METHOD_GET, uri);
+
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_LOADED)
+    {
+      /* validate tile */
+
+      const char *etag = shumate_tile_get_etag (tile);
+      g_autofree char *date = get_modified_time_string (tile);
+
+      /* If an etag is available, only use it.
+       * OSM servers seems to send now as the modified time for all tiles
+       * Omarender servers set the modified time correctly
+       */
+      if (etag)
+        {
+          DEBUG ("If-None-Match: %s", etag);
+          soup_message_headers_append (fetch->msg->request_headers,
+              "If-None-Match", etag);
+          fetch->conditional = TRUE;
+        }
+      else if (date)
+        {
+          DEBUG ("If-Modified-Since %s", date);
+          soup_message_headers_append (fetch->msg->request_headers,
+              "If-Modified-Since", date);
+          fetch->conditional = TRUE;
+        }
+    }
+
+  return fetch;
+}
+
+static void
+tile_fetch_add_waiter (TileFetch    *fetch,
+                       ShumateTile  *tile,
+                       GCancellable *cancellable)
+{
+  TileFetchWaiter *waiter = g_slice_new0 (TileFetchWaiter);
+
+  waiter->fetch = fetch;
+  waiter->tile = g_object_ref (tile);
+  waiter->active = TRUE;
+  fetch->n_active++;
+  g_ptr_array_add (fetch->waiters, waiter);
+
+  shumate_tile_set_downloaded (tile, TRUE);
+
+  if (cancellable)
+    {
+      waiter->cancellable = g_object_ref (cancellable);
+      waiter->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (on_waiter_cancelled), waiter, NULL);
+    }
+
+  waiter->state_id = g_signal_connect (tile, "notify::state", G_CALLBACK (on_waiter_tile_state), waiter);
+}
+
 static void
 fill_tile (ShumateMapSource *map_source,
            ShumateTile      *tile,
@@ -798,6 +1929,7 @@ fill_tile (ShumateMapSource *map_source,
 {
   ShumateNetworkTileSource *tile_source = SHUMATE_NETWORK_TILE_SOURCE (map_source);
   ShumateNetworkTileSourcePrivate *priv = shumate_network_tile_source_get_instance_private (tile_source);
+  ShumateMapSource *next_source;
 
   g_return_if_fail (SHUMATE_IS_NETWORK_TILE_SOURCE (map_source));
   g_return_if_fail (SHUMATE_IS_TILE (tile));
@@ -807,55 +1939,57 @@ fill_tile (ShumateMapSource *map_source,
 
   if (!priv->offline)
     {
-      TileLoadedData *callback_data = g_slice_new0 (TileLoadedData);
-      g_autofree char *uri = NULL;
+      TileFetch *fetch;
+      guint64 key;
 
-      uri = get_tile_uri (tile_source,
-            shumate_tile_get_x (tile),
-            shumate_tile_get_y (tile),
-            shumate_tile_get_zoom_level (tile));
+      if (cancellable && g_cancellable_is_cancelled (cancellable))
+        return;
 
-      callback_data->tile = g_object_ref (tile);
-      callback_data->self = g_object_ref (tile_source);
-      if (cancellable)
-        callback_data->cancellable = g_object_ref (cancellable);
-      callback_data->msg = soup_message_new (SOUP_METHOD_GET, uri);
+      key = fetch_key (shumate_tile_get_x (tile),
+                       shumate_tile_get_y (tile),
+                       shumate_tile_get_zoom_level (tile));
+      fetch = g_hash_table_lookup (priv->fetches, &key);
 
-      if (shumate_tile_get_state (tile) == SHUMATE_STATE_LOADED)
+      /* A tile without data can't use the answer of a conditional request */
+      if (fetch && (!fetch->conditional || shumate_tile_get_state (tile) == SHUMATE_STATE_LOADED))
         {
-          /* validate tile */
-
-          const char *etag = shumate_tile_get_etag (tile);
-          char *date = get_modified_time_string (tile);
+          DEBUG ("Joining the download of tile %d, %d", fetch->x, fetch->y);
+          tile_fetch_add_waiter (fetch, tile, cancellable);
+          return;
+        }
 
-          /* If an etag is available, only use it.
-           * OSM servers seems to send now as the modified time for all tiles
-           * Omarender servers set the modified time correctly
-           */
-          if (etag)
-            {
-              DEBUG ("If-None-Match: %s", etag);
-              soup_message_headers_append (callback_data->msg->request_headers,
-                  "If-None-Match", etag);
-            }
-          else if (date)
-            {
-              DEBUG ("If-Modified-Since %s", date);
-              soup_message_headers_append (callback_data->msg->request_headers,
-                  "If-Modified-Since", date);
-            }
+      if (is_missing_tile (tile_source, key))
+        {
+          DEBUG ("Tile %d, %d is missing on the server",
+              shumate_tile_get_x (tile), shumate_tile_get_y (tile));
+          goto load_next;
+        }
 
-          g_free (date);
+      /* Don't wait for a server known to be down, show the next source */
+      if (!tile_host_is_available (tile_source,
+                                   shumate_tile_get_x (tile),
+                                   shumate_tile_get_y (tile),
+                                   shumate_tile_get_zoom_level (tile)))
+        {
+          DEBUG ("The server of tile %d, %d is unavailable, not downloading it",
+              shumate_tile_get_x (tile), shumate_tile_get_y (tile));
+          goto load_next;
         }
 
-      g_signal_connect_object (tile, "notify::state", G_CALLBACK (tile_state_notify), cancellable, 0);
-      soup_session_send_async (priv->soup_session, callback_data->msg, cancellable, on_message_sent, callback_data);
-    }
-  else
-    {
-      ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+      fetch = tile_fetch_new (tile_source, tile);
 
-      if (SHUMATE_IS_MAP_SOURCE (next_source))
-        shumate_map_source_fill_tile (next_source, tile, cancellable);
+      g_hash_table_replace (priv->fetches, &fetch->key, fetch);
+      tile_fetch_add_waiter (fetch, tile, cancellable);
+
+      /* The layer fills all the tiles it needs at once, let it finish before
+       * picking the best ones to send */
+      g_ptr_array_add (priv->pending_fetches, fetch);
+      tile_fetch_queue_dispatch (tile_source);
+      return;
     }
+
+load_next:
+  next_source = shumate_map_source_get_next_source (map_source);
+  if (SHUMATE_IS_MAP_SOURCE (next_source))
+    shumate_map_source_fill_tile (next_source, tile, cancellable);
 }
@@ -70,6 +70,10 @@ int shumate_network_tile_source_get_max_conns (ShumateNetworkTileSource *tile_so
 void shumate_network_tile_source_set_max_conns (ShumateNetworkTileSource *tile_source,
     int max_conns);
 
+guint shumate_network_tile_source_get_missing_tile_ttl (ShumateNetworkTileSource *tile_source);
+void shumate_network_tile_source_set_missing_tile_ttl (ShumateNetworkTileSource *tile_source,
+    guint ttl);
+
 void shumate_network_tile_source_set_user_agent (ShumateNetworkTileSource *tile_source,
     const char *user_agent);
 
@@ -74,33 +74,12 @@ typedef struct
 G_DEFINE_TYPE_WITH_PRIVATE (ShumatePathLayer, shumate_path_layer, SHUMATE_TYPE_LAYER);
 
 static void
-on_view_longitude_changed (ShumatePathLayer *self,
-                           GParamSpec       *pspec,
-                           ShumateViewport  *view)
+shumate_path_layer_viewport_changed (ShumateLayer          *layer,
+                                     ShumateViewportChange  changes)
 {
-  g_assert (SHUMATE_IS_PATH_LAYER (self));
+  g_assert (SHUMATE_IS_PATH_LAYER (layer));
 
-  gtk_widget_queue_draw (GTK_WIDGET (self));
-}
-
-static void
-on_view_latitude_changed (ShumatePathLayer *self,
-                          GParamSpec       *pspec,
-                          ShumateViewport  *view)
-{
-  g_assert (SHUMATE_IS_PATH_LAYER (self));
-
-  gtk_widget_queue_draw (GTK_WIDGET (self));
-}
-
-static void
-on_view_zoom_level_changed (ShumatePathLayer *self,
-                            GParamSpec       *pspec,
-                            ShumateViewport  *view)
-{
-  g_assert (SHUMATE_IS_PATH_LAYER (self));
-
-  gtk_widget_queue_draw (GTK_WIDGET (self));
+  gtk_widget_queue_draw (GTK_WIDGET (layer));
 }
 
 
@@ -201,22 +180,6 @@ shumate_path_layer_dispose (GObject *object)
   G_OBJECT_CLASS (shumate_path_layer_parent_class)->dispose (object);
 }
 
-static void
-shumate_path_layer_constructed (GObject *object)
-{
-  ShumatePathLayer *self = SHUMATE_PATH_LAYER (object);
-  ShumateViewport *viewport;
-
-  G_OBJECT_CLASS (shumate_path_layer_parent_class)->constructed (object);
-
-  viewport = shumate_layer_get_viewport (SHUMATE_LAYER (self));
-  g_signal_connect_swapped (viewport, "notify::longitude", G_CALLBACK (on_view_longitude_changed), self);
-  g_signal_connect_swapped (viewport, "notify::latitude", G_CALLBACK (on_view_latitude_changed), self);
-  g_signal_connect_swapped (viewport, "notify::zoom-level", G_CALLBACK (on_view_zoom_level_changed), self);
-
-}
-
-
 static void
 shumate_path_layer_finalize (GObject *object)
 {
@@ -288,15 +251,17 @@ shumate_path_layer_class_init (ShumatePathLayerClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
+  ShumateLayerClass *layer_class = SHUMATE_LAYER_CLASS (klass);
 
   object_class->finalize = shumate_path_layer_finalize;
   object_class->dispose = shumate_path_layer_dispose;
-  object_class->constructed = shumate_path_layer_constructed;
   object_class->get_property = shumate_path_layer_get_property;
   object_class->set_property = shumate_path_layer_set_property;
 
   widget_class->snapshot = shumate_path_layer_snapshot;
 
+  layer_class->viewport_changed = shumate_path_layer_viewport_changed;
+
   /**
    * ShumatePathLayer:closed:
    *
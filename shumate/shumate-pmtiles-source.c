@@ -0,0 +1,759 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * SECTION:shumate-pmtiles-source
+ * @short_description: A tile source serving tiles from a PMTiles archive
+ *
+ * #ShumatePmtilesSource loads raster tiles from a
+ * [PMTiles](https://github.com/protomaps/PMTiles) version 3 archive, a
+ * single file holding the tiles along with a compressed index of their
+ * locations. The file is memory mapped and the tiles handed to the decoder
+ * are slices of the mapping, so even multi-gigabyte archives can be used
+ * without reading them into memory.
+ *
+ * The root directory of the index is decoded when the source is created;
+ * leaf directories are decoded the first time a tile they cover is
+ * requested. Tiles missing from the archive are requested from the next
+ * source of the chain.
+ */
+
+#define DEBUG_FLAG SHUMATE_DEBUG_LOADING
+#include "shumate-debug.h"
+
+#include "shumate-pmtiles-source.h"
+#include "shumate-pmtiles-source-private.h"
+#include "shumate-tile-decoder-private.h"
+#include "shumate-tile-private.h"
+
+#include <string.h>
+
+#define HEADER_SIZE 127
+/* Directories can't be nested deeper than this by the specification */
+#define MAX_DIRECTORY_DEPTH 4
+/* Decoded leaf directories kept around */
+#define MAX_LEAF_DIRECTORIES 64
+
+enum
+{
+  PROP_0,
+  PROP_PATH
+};
+
+typedef enum
+{
+  COMPRESSION_UNKNOWN = 0,
+  COMPRESSION_NONE = 1,
+  COMPRESSION_GZIP = 2,
+  COMPRESSION_BROTLI = 3,
+  COMPRESSION_ZSTD = 4,
+} Compression;
+
+typedef enum
+{
+  TILE_TYPE_UNKNOWN = 0,
+  TILE_TYPE_MVT = 1,
+  TILE_TYPE_PNG = 2,
+  TILE_TYPE_JPEG = 3,
+  TILE_TYPE_WEBP = 4,
+} TileType;
+
+/* A directory entry. Entries with a run_length of 0 point to a leaf
+ * directory, other entries to run_length consecutive tiles sharing the
+ * same data. */
+typedef struct
+{
+  guint64 tile_id;
+  guint64 offset;
+  guint32 length;
+  guint32 run_length;
+} DirectoryEntry;
+
+typedef struct
+{
+  guint64 offset;
+  GArray *entries; /* DirectoryEntry */
+} LeafDirectory;
+
+typedef struct
+{
+  char *path;
+
+  GMappedFile *mapped_file;
+  GBytes *contents;
+
+  guint64 leaf_directories_offset;
+  guint64 tile_data_offset;
+  Compression internal_compression;
+  Compression tile_compression;
+
+  GArray *root_directory;
+  /* Decoded leaf directories, the most recently used first, and their
+   * offset -> link in that queue */
+  GQueue *leaf_directories;
+  GHashTable *leaf_directory_links;
+} ShumatePmtilesSourcePrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (ShumatePmtilesSource, shumate_pmtiles_source, SHUMATE_TYPE_TILE_SOURCE);
+
+static void fill_tile (ShumateMapSource *map_source,
+    ShumateTile *tile,
+    GCancellable *cancellable);
+
+
+static void
+shumate_pmtiles_source_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ShumatePmtilesSource *pmtiles_source = SHUMATE_PMTILES_SOURCE (object);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, shumate_pmtiles_source_get_path (pmtiles_source));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+shumate_pmtiles_source_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ShumatePmtilesSource *pmtiles_source = SHUMATE_PMTILES_SOURCE (object);
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (pmtiles_source);
+
+  switch (property_id)
+    {
+    case PROP_PATH:
+      g_free (priv->path);
+      priv->path = g_value_dup_string (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+leaf_directory_free (LeafDirectory *leaf)
+{
+  g_array_unref (leaf->entries);
+  g_free (leaf);
+}
+
+
+static void
+shumate_pmtiles_source_finalize (GObject *object)
+{
+  ShumatePmtilesSource *pmtiles_source = SHUMATE_PMTILES_SOURCE (object);
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (pmtiles_source);
+
+  g_clear_pointer (&priv->leaf_directory_links, g_hash_table_unref);
+  if (priv->leaf_directories)
+    g_queue_free_full (g_steal_pointer (&priv->leaf_directories), (GDestroyNotify) leaf_directory_free);
+  g_clear_pointer (&priv->root_directory, g_array_unref);
+  g_clear_pointer (&priv->contents, g_bytes_unref);
+  g_clear_pointer (&priv->mapped_file, g_mapped_file_unref);
+  g_clear_pointer (&priv->path, g_free);
+
+  G_OBJECT_CLASS (shumate_pmtiles_source_parent_class)->finalize (object);
+}
+
+
+static guint64
+read_uint64 (const guint8 *data)
+{
+  guint64 value;
+
+  memcpy (&value, data, sizeof (value));
+  return GUINT64_FROM_LE (value);
+}
+
+
+static gboolean
+read_varint (const guint8 **data,
+             const guint8  *end,
+             guint64       *value)
+{
+  guint64 result = 0;
+  guint shift = 0;
+
+  while (*data < end && shift < 64)
+    {
+      guint8 byte = *(*data)++;
+
+      result |= (guint64) (byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+        {
+          *value = result;
+          return TRUE;
+        }
+
+      shift += 7;
+    }
+
+  return FALSE;
+}
+
+
+/* Returns a slice of the archive, or NULL if the range is out of bounds */
+static GBytes *
+get_range (ShumatePmtilesSource *self,
+           guint64               offset,
+           guint64               length)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (self);
+  gsize size = g_bytes_get_size (priv->contents);
+
+  if (offset > size || length > size - offset)
+    return NULL;
+
+  return g_bytes_new_from_bytes (priv->contents, offset, length);
+}
+
+
+static GBytes *
+decompress (GBytes       *bytes,
+            Compression   compression,
+            GError      **error)
+{
+  g_autoptr(GZlibDecompressor) decompressor = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GInputStream) converter = NULL;
+  g_autoptr(GOutputStream) output = NULL;
+
+  switch (compression)
+    {
+    case COMPRESSION_UNKNOWN:
+    case COMPRESSION_NONE:
+      return g_bytes_ref (bytes);
+
+    case COMPRESSION_GZIP:
+      decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+      input = g_memory_input_stream_new_from_bytes (bytes);
+      converter = g_converter_input_stream_new (input, G_CONVERTER (decompressor));
+      output = g_memory_output_stream_new_resizable ();
+
+      if (g_output_stream_splice (output, converter,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  NULL, error) < 0)
+        return NULL;
+
+      return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported PMTiles compression %d", compression);
+      return NULL;
+    }
+}
+
+
+/*
+ * Decodes a directory. The entries are stored column by column: all the
+ * tile ID deltas, then the run lengths, the lengths and finally the offsets,
+ * where 0 means the data directly follows the one of the previous entry.
+ */
+static GArray *
+decode_directory (ShumatePmtilesSource  *self,
+                  guint64                offset,
+                  guint64                length,
+                  GError               **error)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (self);
+  g_autoptr(GBytes) compressed = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GArray) entries = NULL;
+  const guint8 *data, *end;
+  gsize size;
+  guint64 n_entries, value, tile_id = 0;
+  guint64 i;
+
+  compressed = get_range (self, offset, length);
+  if (!compressed)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "PMTiles directory is out of bounds");
+      return NULL;
+    }
+
+  bytes = decompress (compressed, priv->internal_compression, error);
+  if (!bytes)
+    return NULL;
+
+  data = g_bytes_get_data (bytes, &size);
+  end = data + size;
+
+  /* Every entry takes at least 4 bytes */
+  if (!read_varint (&data, end, &n_entries) || n_entries > size / 4)
+    goto invalid;
+
+  entries = g_array_sized_new (FALSE, TRUE, sizeof (DirectoryEntry), n_entries);
+  g_array_set_size (entries, n_entries);
+
+  for (i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&data, end, &value))
+        goto invalid;
+
+      tile_id += value;
+      g_array_index (entries, DirectoryEntry, i).tile_id = tile_id;
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&data, end, &value) || value > G_MAXUINT32)
+        goto invalid;
+
+      g_array_index (entries, DirectoryEntry, i).run_length = value;
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&data, end, &value) || value > G_MAXUINT32)
+        goto invalid;
+
+      g_array_index (entries, DirectoryEntry, i).length = value;
+    }
+
+  for (i = 0; i < n_entries; i++)
+    {
+      DirectoryEntry *entry = &g_array_index (entries, DirectoryEntry, i);
+
+      if (!read_varint (&data, end, &value))
+        goto invalid;
+
+      if (value == 0 && i > 0)
+        {
+          DirectoryEntry *previous = &g_array_index (entries, DirectoryEntry, i - 1);
+          entry->offset = previous->offset + previous->length;
+        }
+      else if (value == 0)
+        goto invalid;
+      else
+        entry->offset = value - 1;
+    }
+
+  return g_steal_pointer (&entries);
+
+invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Invalid PMTiles directory");
+  return NULL;
+}
+
+
+static void
+rotate (guint64  n,
+        guint64 *x,
+        guint64 *y,
+        guint64  rx,
+        guint64  ry)
+{
+  if (ry == 0)
+    {
+      guint64 t;
+
+      if (rx == 1)
+        {
+          *x = n - 1 - *x;
+          *y = n - 1 - *y;
+        }
+
+      t = *x;
+      *x = *y;
+      *y = t;
+    }
+}
+
+
+/* Tiles are numbered along a Hilbert curve, zoom level after zoom level */
+guint64
+shumate_pmtiles_zxy_to_tile_id (guint zoom_level,
+                                guint x,
+                                guint y)
+{
+  guint64 n = G_GUINT64_CONSTANT (1) << zoom_level;
+  guint64 tx = x, ty = y;
+  guint64 tile_id = 0;
+  guint64 s;
+
+  /* Number of tiles on all the zoom levels above */
+  tile_id = (n * n - 1) / 3;
+
+  for (s = n / 2; s > 0; s /= 2)
+    {
+      guint64 rx = (tx & s) > 0;
+      guint64 ry = (ty & s) > 0;
+
+      tile_id += s * s * ((3 * rx) ^ ry);
+      rotate (n, &tx, &ty, rx, ry);
+    }
+
+  return tile_id;
+}
+
+
+/* Finds the last entry starting at or before tile_id */
+static const DirectoryEntry *
+find_entry (GArray  *directory,
+            guint64  tile_id)
+{
+  guint low = 0, high = directory->len;
+
+  while (low < high)
+    {
+      guint mid = low + (high - low) / 2;
+
+      if (g_array_index (directory, DirectoryEntry, mid).tile_id <= tile_id)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (low == 0)
+    return NULL;
+
+  return &g_array_index (directory, DirectoryEntry, low - 1);
+}
+
+
+/* Decodes a leaf directory, or takes it from the ones kept around. The least
+ * recently used one is dropped to make room. */
+static GArray *
+get_leaf_directory (ShumatePmtilesSource *self,
+                    const DirectoryEntry *entry)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (self);
+  g_autoptr(GError) error = NULL;
+  guint64 offset = priv->leaf_directories_offset + entry->offset;
+  LeafDirectory *leaf;
+  GArray *directory;
+  GList *link;
+
+  link = g_hash_table_lookup (priv->leaf_directory_links, &offset);
+  if (link)
+    {
+      g_queue_unlink (priv->leaf_directories, link);
+      g_queue_push_head_link (priv->leaf_directories, link);
+
+      return ((LeafDirectory *) link->data)->entries;
+    }
+
+  directory = decode_directory (self, offset, entry->length, &error);
+  if (!directory)
+    {
+      DEBUG ("Failed to read leaf directory: %s", error->message);
+      return NULL;
+    }
+
+  if (g_queue_get_length (priv->leaf_directories) >= MAX_LEAF_DIRECTORIES)
+    {
+      leaf = g_queue_pop_tail (priv->leaf_directories);
+      g_hash_table_remove (priv->leaf_directory_links, &leaf->offset);
+      leaf_directory_free (leaf);
+    }
+
+  leaf = g_new (LeafDirectory, 1);
+  leaf->offset = offset;
+  leaf->entries = directory;
+  g_queue_push_head (priv->leaf_directories, leaf);
+  g_hash_table_insert (priv->leaf_directory_links, &leaf->offset, g_queue_peek_head_link (priv->leaf_directories));
+
+  return directory;
+}
+
+
+static GBytes *
+read_tile (ShumatePmtilesSource *self,
+           guint                 x,
+           guint                 y,
+           guint                 zoom_level)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (self);
+  GArray *directory = priv->root_directory;
+  guint64 tile_id;
+  int depth;
+
+  if (zoom_level > 31 || x >= (1u << zoom_level) || y >= (1u << zoom_level))
+    return NULL;
+
+  tile_id = shumate_pmtiles_zxy_to_tile_id (zoom_level, x, y);
+
+  for (depth = 0; depth < MAX_DIRECTORY_DEPTH && directory; depth++)
+    {
+      const DirectoryEntry *entry = find_entry (directory, tile_id);
+
+      if (!entry)
+        return NULL;
+
+      if (entry->run_length == 0)
+        {
+          directory = get_leaf_directory (self, entry);
+          continue;
+        }
+
+      if (tile_id - entry->tile_id >= entry->run_length)
+        return NULL;
+
+      return get_range (self, priv->tile_data_offset + entry->offset, entry->length);
+    }
+
+  return NULL;
+}
+
+
+/*
+ * The id keys the texture cache, shared by the whole process, and names a
+ * directory of #ShumateFileCache: it is made from the canonical path of the
+ * file, since archives in different directories often share a file name.
+ */
+static char *
+get_source_id (const char *path)
+{
+  g_autofree char *canonical_path = g_canonicalize_filename (path, NULL);
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, canonical_path, -1);
+
+  return g_strconcat ("pmtiles-", checksum, NULL);
+}
+
+
+static gboolean
+load_archive (ShumatePmtilesSource  *self,
+              GError               **error)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (self);
+  ShumateTileSource *tile_source = SHUMATE_TILE_SOURCE (self);
+  const guint8 *header;
+  TileType tile_type;
+
+  priv->mapped_file = g_mapped_file_new (priv->path, FALSE, error);
+  if (!priv->mapped_file)
+    return FALSE;
+
+  priv->contents = g_mapped_file_get_bytes (priv->mapped_file);
+  header = g_bytes_get_data (priv->contents, NULL);
+
+  if (g_bytes_get_size (priv->contents) < HEADER_SIZE
+      || memcmp (header, "PMTiles", 7) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "'%s' is not a PMTiles file", priv->path);
+      return FALSE;
+    }
+
+  if (header[7] != 3)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "PMTiles version %d of '%s' is not supported", header[7], priv->path);
+      return FALSE;
+    }
+
+  priv->leaf_directories_offset = read_uint64 (header + 40);
+  priv->tile_data_offset = read_uint64 (header + 56);
+  priv->internal_compression = header[97];
+  priv->tile_compression = header[98];
+  tile_type = header[99];
+
+  if (tile_type == TILE_TYPE_MVT)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "'%s' contains vector tiles, only raster tiles are supported", priv->path);
+      return FALSE;
+    }
+
+  priv->root_directory = decode_directory (self,
+                                           read_uint64 (header + 8),
+                                           read_uint64 (header + 16),
+                                           error);
+  if (!priv->root_directory)
+    return FALSE;
+
+  if (!shumate_map_source_get_id (SHUMATE_MAP_SOURCE (self)))
+    {
+      g_autofree char *id = get_source_id (priv->path);
+      g_autofree char *name = g_path_get_basename (priv->path);
+
+      shumate_tile_source_set_id (tile_source, id);
+      shumate_tile_source_set_name (tile_source, name);
+      shumate_tile_source_set_min_zoom_level (tile_source, header[100]);
+      shumate_tile_source_set_max_zoom_level (tile_source, header[101]);
+    }
+
+  DEBUG ("Opened '%s', %u root directory entries", priv->path, priv->root_directory->len);
+
+  return TRUE;
+}
+
+
+static void
+shumate_pmtiles_source_constructed (GObject *object)
+{
+  ShumatePmtilesSource *pmtiles_source = SHUMATE_PMTILES_SOURCE (object);
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (pmtiles_source);
+  g_autoptr(GError) error = NULL;
+
+  G_OBJECT_CLASS (shumate_pmtiles_source_parent_class)->constructed (object);
+
+  if (!priv->path)
+    {
+      g_warning ("ShumatePmtilesSource created without a path");
+      return;
+    }
+
+  if (!load_archive (pmtiles_source, &error))
+    {
+      g_warning ("Failed to open '%s': %s", priv->path, error->message);
+      g_clear_pointer (&priv->root_directory, g_array_unref);
+    }
+}
+
+
+static void
+shumate_pmtiles_source_class_init (ShumatePmtilesSourceClass *klass)
+{
+  ShumateMapSourceClass *map_source_class = SHUMATE_MAP_SOURCE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *pspec;
+
+  object_class->finalize = shumate_pmtiles_source_finalize;
+  object_class->get_property = shumate_pmtiles_source_get_property;
+  object_class->set_property = shumate_pmtiles_source_set_property;
+  object_class->constructed = shumate_pmtiles_source_constructed;
+
+  map_source_class->fill_tile = fill_tile;
+
+  /**
+   * ShumatePmtilesSource:path:
+   *
+   * The path of the PMTiles file the tiles are read from.
+   */
+  pspec = g_param_spec_string ("path",
+        "Path",
+        "The path of the PMTiles file",
+        NULL,
+        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_PATH, pspec);
+}
+
+
+static void
+shumate_pmtiles_source_init (ShumatePmtilesSource *pmtiles_source)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (pmtiles_source);
+
+  priv->leaf_directories = g_queue_new ();
+  priv->leaf_directory_links = g_hash_table_new (g_int64_hash, g_int64_equal);
+}
+
+
+/**
+ * shumate_pmtiles_source_new_full:
+ * @path: the path of a PMTiles file
+ *
+ * Constructor of #ShumatePmtilesSource. The source is named after the file
+ * and covers the zoom levels listed in its header.
+ *
+ * Returns: a constructed #ShumatePmtilesSource
+ */
+ShumatePmtilesSource *
+shumate_pmtiles_source_new_full (const char *path)
+{
+  return g_object_new (SHUMATE_TYPE_PMTILES_SOURCE,
+        "path", path,
+        NULL);
+}
+
+
+/**
+ * shumate_pmtiles_source_get_path:
+ * @pmtiles_source: a #ShumatePmtilesSource
+ *
+ * Gets the path of the PMTiles file the tiles are read from.
+ *
+ * Returns: the path of the file
+ */
+const char *
+shumate_pmtiles_source_get_path (ShumatePmtilesSource *pmtiles_source)
+{
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (pmtiles_source);
+
+  g_return_val_if_fail (SHUMATE_IS_PMTILES_SOURCE (pmtiles_source), NULL);
+
+  return priv->path;
+}
+
+
+static void
+fill_tile (ShumateMapSource *map_source,
+           ShumateTile      *tile,
+           GCancellable     *cancellable)
+{
+  ShumatePmtilesSource *self = (ShumatePmtilesSource *)map_source;
+  ShumatePmtilesSourcePrivate *priv = shumate_pmtiles_source_get_instance_private (self);
+  ShumateMapSource *next_source = shumate_map_source_get_next_source (map_source);
+
+  g_return_if_fail (SHUMATE_IS_PMTILES_SOURCE (self));
+  g_return_if_fail (SHUMATE_IS_TILE (tile));
+
+  if (shumate_tile_get_state (tile) == SHUMATE_STATE_DONE)
+    return;
+
+  if (shumate_tile_get_state (tile) != SHUMATE_STATE_LOADED && priv->root_directory)
+    {
+      g_autoptr(GBytes) slice = NULL;
+      g_autoptr(GBytes) bytes = NULL;
+      g_autoptr(GError) error = NULL;
+
+      slice = read_tile (self,
+          shumate_tile_get_x (tile),
+          shumate_tile_get_y (tile),
+          shumate_tile_get_zoom_level (tile));
+
+      if (slice)
+        bytes = decompress (slice, priv->tile_compression, &error);
+
+      if (error)
+        DEBUG ("Failed to read tile: %s", error->message);
+
+      if (bytes)
+        {
+          shumate_tile_decode_for_source (bytes, map_source, tile, cancellable);
+          return;
+        }
+    }
+
+  if (SHUMATE_IS_MAP_SOURCE (next_source))
+    shumate_map_source_fill_tile (next_source, tile, cancellable);
+  else
+    {
+      /* Last source of the chain: the tile is used as it is, even if it
+       * wasn't validated or has nothing to show */
+      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+    }
+}
@@ -41,6 +41,7 @@
 
 #include "shumate-scale.h"
 #include "shumate-enum-types.h"
+#include "shumate-viewport-private.h"
 
 #include <glib-object.h>
 #include <math.h>
@@ -64,6 +65,7 @@ struct _ShumateScale
   guint max_scale_width;
 
   ShumateViewport *viewport;
+  ShumateViewportWatch *viewport_watch;
 
   GtkWidget *metric_label;
   GtkWidget *imperial_label;
@@ -91,7 +93,7 @@ shumate_scale_compute_length (ShumateScale *self,
                               gboolean     *out_is_small_unit)
 {
   ShumateMapSource *map_source;
-  int zoom_level;
+  double zoom_level;
   double lat, lon;
   float scale_width;
   float base;
@@ -208,21 +210,15 @@ shumate_scale_on_scale_changed (ShumateScale *self)
   gtk_widget_queue_resize (GTK_WIDGET (self));
 }
 
+/* Viewport changes are applied at most once per frame */
 static void
-on_latitude_changed (ShumateScale *self,
-                     G_GNUC_UNUSED GParamSpec *pspec,
-                     ShumateViewport *viewport)
+on_viewport_changed (GtkWidget             *widget,
+                     ShumateViewportChange  changes)
 {
-  shumate_scale_on_scale_changed (self);
-}
-
-
-static void
-on_zoom_level_changed (ShumateScale *self,
-                       G_GNUC_UNUSED GParamSpec *pspec,
-                       ShumateViewport *viewport)
-{
-  shumate_scale_on_scale_changed (self);
+  if (changes & (SHUMATE_VIEWPORT_CHANGE_LOCATION |
+                 SHUMATE_VIEWPORT_CHANGE_ZOOM_LEVEL |
+                 SHUMATE_VIEWPORT_CHANGE_REFERENCE_MAP_SOURCE))
+    shumate_scale_on_scale_changed (SHUMATE_SCALE (widget));
 }
 
 static void
@@ -281,7 +277,7 @@ shumate_scale_dispose (GObject *object)
 {
   ShumateScale *scale = SHUMATE_SCALE (object);
 
-  g_signal_handlers_disconnect_by_data (scale->viewport, scale);
+  g_clear_pointer (&scale->viewport_watch, shumate_viewport_unwatch);
   g_clear_object (&scale->viewport);
   g_clear_pointer (&scale->metric_label, gtk_widget_unparent);
   g_clear_pointer (&scale->imperial_label, gtk_widget_unparent);
@@ -294,8 +290,7 @@ shumate_scale_constructed (GObject *object)
 {
   ShumateScale *scale = SHUMATE_SCALE (object);
 
-  g_signal_connect_swapped (scale->viewport, "notify::latitude", G_CALLBACK (on_latitude_changed), scale);
-  g_signal_connect_swapped (scale->viewport, "notify::zoom-level", G_CALLBACK (on_zoom_level_changed), scale);
+  scale->viewport_watch = shumate_viewport_watch (scale->viewport, GTK_WIDGET (scale), on_viewport_changed);
   shumate_scale_on_scale_changed (scale);
 
   G_OBJECT_CLASS (shumate_scale_parent_class)->constructed (object);
@@ -0,0 +1,554 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * SECTION:shumate-texture-cache
+ * @short_description: Keeps decoded tile textures in memory
+ *
+ * #ShumateTextureCache keeps the #GdkTexture objects of recently displayed
+ * tiles, so that showing a tile again doesn't require decoding its image
+ * data. Textures are identified by the map source id and the tile
+ * coordinates and the least recently used ones are dropped once the
+ * cache grows over its size limit, expressed in bytes of texture memory.
+ *
+ * #ShumateMemoryCache looks tiles up in the default texture cache, see
+ * shumate_texture_cache_get_default(), before decoding the tile data it
+ * holds.
+ *
+ * When the system runs low on memory, as reported by #GMemoryMonitor, the
+ * least recently used textures are dropped: half of them on a low warning,
+ * all of them on more severe ones. Textures of the tiles on screen stay
+ * alive as long as the tiles use them.
+ */
+
+#define DEBUG_FLAG SHUMATE_DEBUG_CACHE
+#include "shumate-debug.h"
+
+#include "shumate-texture-cache.h"
+
+#define DEFAULT_SIZE_LIMIT (64 * 1024 * 1024)
+
+struct _ShumateTextureCache
+{
+  GObject parent_instance;
+
+  guint64 size_limit;
+  guint64 size;
+  guint64 reclaimed;
+  GQueue *queue;
+  GHashTable *hash_table;
+  GMemoryMonitor *memory_monitor;
+  GMemoryMonitorWarningLevel pending_level;
+  guint release_source_id;
+};
+
+G_DEFINE_TYPE (ShumateTextureCache, shumate_texture_cache, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_SIZE_LIMIT = 1,
+  PROP_SIZE,
+  PROP_RECLAIMED,
+  N_PROPERTIES
+};
+
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
+
+typedef struct
+{
+  const char *source_id; /* interned */
+  guint x;
+  guint y;
+  guint zoom_level;
+} TextureKey;
+
+typedef struct
+{
+  TextureKey key;
+  GdkTexture *texture;
+  gsize size;
+} QueueMember;
+
+static guint
+texture_key_hash (gconstpointer data)
+{
+  const TextureKey *key = data;
+
+  return g_direct_hash (key->source_id) ^ (key->x * 7919u) ^ (key->y * 104729u) ^ (key->zoom_level << 27);
+}
+
+static gboolean
+texture_key_equal (gconstpointer a,
+                   gconstpointer b)
+{
+  const TextureKey *key_a = a;
+  const TextureKey *key_b = b;
+
+  return key_a->source_id == key_b->source_id &&
+         key_a->x == key_b->x &&
+         key_a->y == key_b->y &&
+         key_a->zoom_level == key_b->zoom_level;
+}
+
+static void
+delete_queue_member (QueueMember *member,
+                     gpointer     user_data)
+{
+  if (member)
+    {
+      g_clear_object (&member->texture);
+      g_slice_free (QueueMember, member);
+    }
+}
+
+static void
+shumate_texture_cache_evict_to (ShumateTextureCache *self,
+                                guint64              target_size)
+{
+  while (self->size > target_size && !g_queue_is_empty (self->queue))
+    {
+      QueueMember *member = g_queue_pop_tail (self->queue);
+
+      g_hash_table_remove (self->hash_table, &member->key);
+      self->size -= member->size;
+      delete_queue_member (member, NULL);
+    }
+}
+
+static void
+shumate_texture_cache_evict (ShumateTextureCache *self)
+{
+  shumate_texture_cache_evict_to (self, self->size_limit);
+}
+
+static gboolean
+release_textures_cb (gpointer user_data)
+{
+  ShumateTextureCache *self = user_data;
+  GMemoryMonitorWarningLevel level = self->pending_level;
+  guint64 old_size = self->size;
+
+  self->release_source_id = 0;
+  self->pending_level = 0;
+
+  /* Decoded textures are the largest and the quickest to get back */
+  if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+    shumate_texture_cache_evict_to (self, 0);
+  else
+    shumate_texture_cache_evict_to (self, self->size / 2);
+
+  if (old_size == self->size)
+    return G_SOURCE_REMOVE;
+
+  self->reclaimed += old_size - self->size;
+  DEBUG ("Low memory warning %d, dropped %" G_GUINT64_FORMAT " bytes of textures",
+      level, old_size - self->size);
+
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_SIZE]);
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_RECLAIMED]);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Textures are only dropped once the other handlers of the warning, such as
+ * the map layers dropping their off-screen tiles, let go of theirs.
+ */
+static void
+on_low_memory_warning (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       ShumateTextureCache        *self)
+{
+  self->pending_level = MAX (self->pending_level, level);
+
+  if (self->release_source_id == 0)
+    self->release_source_id = g_idle_add_full (G_PRIORITY_HIGH, release_textures_cb, self, NULL);
+}
+
+static void
+shumate_texture_cache_get_property (GObject    *object,
+                                    guint       property_id,
+                                    GValue     *value,
+                                    GParamSpec *pspec)
+{
+  ShumateTextureCache *self = SHUMATE_TEXTURE_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_SIZE_LIMIT:
+      g_value_set_uint64 (value, self->size_limit);
+      break;
+
+    case PROP_SIZE:
+      g_value_set_uint64 (value, self->size);
+      break;
+
+    case PROP_RECLAIMED:
+      g_value_set_uint64 (value, self->reclaimed);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+shumate_texture_cache_set_property (GObject      *object,
+                                    guint         property_id,
+                                    const GValue *value,
+                                    GParamSpec   *pspec)
+{
+  ShumateTextureCache *self = SHUMATE_TEXTURE_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_SIZE_LIMIT:
+      shumate_texture_cache_set_size_limit (self, g_value_get_uint64 (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+      break;
+    }
+}
+
+static void
+shumate_texture_cache_finalize (GObject *object)
+{
+  ShumateTextureCache *self = SHUMATE_TEXTURE_CACHE (object);
+
+  g_queue_free_full (self->queue, (GDestroyNotify) delete_queue_member);
+  g_clear_pointer (&self->hash_table, g_hash_table_unref);
+  g_clear_handle_id (&self->release_source_id, g_source_remove);
+  g_clear_object (&self->memory_monitor);
+
+  G_OBJECT_CLASS (shumate_texture_cache_parent_class)->finalize (object);
+}
+
+static void
+shumate_texture_cache_class_init (ShumateTextureCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = shumate_texture_cache_get_property;
+  object_class->set_property = shumate_texture_cache_set_property;
+  object_class->finalize = shumate_texture_cache_finalize;
+
+  /**
+   * ShumateTextureCache:size-limit:
+   *
+   * The maximum amount of texture memory, in bytes, kept by the cache.
+   */
+  obj_properties[PROP_SIZE_LIMIT] =
+    g_param_spec_uint64 ("size-limit",
+                         "Size Limit",
+                         "Maximal size of the stored textures in bytes",
+                         0,
+                         G_MAXUINT64,
+                         DEFAULT_SIZE_LIMIT,
+                         G_PARAM_CONSTRUCT | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ShumateTextureCache:size:
+   *
+   * The amount of texture memory, in bytes, currently held by the cache.
+   */
+  obj_properties[PROP_SIZE] =
+    g_param_spec_uint64 ("size",
+                         "Size",
+                         "Size of the stored textures in bytes",
+                         0,
+                         G_MAXUINT64,
+                         0,
+                         G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * ShumateTextureCache:reclaimed:
+   *
+   * The amount of texture memory, in bytes, the cache dropped so far
+   * because the system was low on memory. A dropped texture is only freed
+   * once the tiles drawing it let go of it too.
+   */
+  obj_properties[PROP_RECLAIMED] =
+    g_param_spec_uint64 ("reclaimed",
+                         "Reclaimed",
+                         "Size of the textures dropped on low memory in bytes",
+                         0,
+                         G_MAXUINT64,
+                         0,
+                         G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     N_PROPERTIES,
+                                     obj_properties);
+}
+
+static void
+shumate_texture_cache_init (ShumateTextureCache *self)
+{
+  self->queue = g_queue_new ();
+  self->hash_table = g_hash_table_new (texture_key_hash, texture_key_equal);
+
+  self->memory_monitor = g_memory_monitor_dup_default ();
+  g_signal_connect_object (self->memory_monitor, "low-memory-warning",
+                           G_CALLBACK (on_low_memory_warning), self, 0);
+}
+
+/**
+ * shumate_texture_cache_new_full:
+ * @size_limit: maximum size of the stored textures in bytes
+ *
+ * Creates a new #ShumateTextureCache.
+ *
+ * Returns: a new #ShumateTextureCache
+ */
+ShumateTextureCache *
+shumate_texture_cache_new_full (guint64 size_limit)
+{
+  return g_object_new (SHUMATE_TYPE_TEXTURE_CACHE,
+                       "size-limit", size_limit,
+                       NULL);
+}
+
+/**
+ * shumate_texture_cache_get_default:
+ *
+ * Gets the texture cache shared by the map sources of the application.
+ *
+ * Returns: (transfer none): the default #ShumateTextureCache
+ */
+ShumateTextureCache *
+shumate_texture_cache_get_default (void)
+{
+  static ShumateTextureCache *default_cache = NULL;
+
+  if (g_once_init_enter (&default_cache))
+    g_once_init_leave (&default_cache, shumate_texture_cache_new_full (DEFAULT_SIZE_LIMIT));
+
+  return default_cache;
+}
+
+/**
+ * shumate_texture_cache_get_size_limit:
+ * @self: a #ShumateTextureCache
+ *
+ * Gets the maximum amount of texture memory kept by the cache.
+ *
+ * Returns: the size limit in bytes
+ */
+guint64
+shumate_texture_cache_get_size_limit (ShumateTextureCache *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_TEXTURE_CACHE (self), 0);
+
+  return self->size_limit;
+}
+
+/**
+ * shumate_texture_cache_set_size_limit:
+ * @self: a #ShumateTextureCache
+ * @size_limit: maximum size of the stored textures in bytes
+ *
+ * Sets the maximum amount of texture memory kept by the cache. Textures
+ * are dropped right away if the cache is over the new limit.
+ */
+void
+shumate_texture_cache_set_size_limit (ShumateTextureCache *self,
+                                      guint64              size_limit)
+{
+  guint64 old_size;
+
+  g_return_if_fail (SHUMATE_IS_TEXTURE_CACHE (self));
+
+  if (self->size_limit == size_limit)
+    return;
+
+  self->size_limit = size_limit;
+  old_size = self->size;
+  shumate_texture_cache_evict (self);
+
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_SIZE_LIMIT]);
+  if (old_size != self->size)
+    g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_SIZE]);
+}
+
+/**
+ * shumate_texture_cache_get_size:
+ * @self: a #ShumateTextureCache
+ *
+ * Gets the amount of texture memory currently held by the cache.
+ *
+ * Returns: the size of the stored textures in bytes
+ */
+guint64
+shumate_texture_cache_get_size (ShumateTextureCache *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_TEXTURE_CACHE (self), 0);
+
+  return self->size;
+}
+
+/**
+ * shumate_texture_cache_get_reclaimed:
+ * @self: a #ShumateTextureCache
+ *
+ * Gets the amount of texture memory the cache dropped so far because the
+ * system was low on memory, see #ShumateTextureCache:reclaimed.
+ *
+ * Returns: the size of the dropped textures in bytes
+ */
+guint64
+shumate_texture_cache_get_reclaimed (ShumateTextureCache *self)
+{
+  g_return_val_if_fail (SHUMATE_IS_TEXTURE_CACHE (self), 0);
+
+  return self->reclaimed;
+}
+
+/**
+ * shumate_texture_cache_lookup:
+ * @self: a #ShumateTextureCache
+ * @source_id: the id of the map source
+ * @x: the x coordinate of the tile
+ * @y: the y coordinate of the tile
+ * @zoom_level: the zoom level of the tile
+ *
+ * Looks up the texture of a tile and marks it as recently used.
+ *
+ * Returns: (transfer none) (nullable): the texture of the tile, or %NULL
+ * if it isn't in the cache
+ */
+GdkTexture *
+shumate_texture_cache_lookup (ShumateTextureCache *self,
+                              const char          *source_id,
+                              guint                x,
+                              guint                y,
+                              guint                zoom_level)
+{
+  TextureKey key;
+  GList *link;
+
+  g_return_val_if_fail (SHUMATE_IS_TEXTURE_CACHE (self), NULL);
+
+  if (!source_id)
+    return NULL;
+
+  key.source_id = g_intern_string (source_id);
+  key.x = x;
+  key.y = y;
+  key.zoom_level = zoom_level;
+
+  link = g_hash_table_lookup (self->hash_table, &key);
+  if (!link)
+    return NULL;
+
+  g_queue_unlink (self->queue, link);
+  g_queue_push_head_link (self->queue, link);
+
+  return ((QueueMember *) link->data)->texture;
+}
+
+/**
+ * shumate_texture_cache_insert:
+ * @self: a #ShumateTextureCache
+ * @source_id: the id of the map source
+ * @x: the x coordinate of the tile
+ * @y: the y coordinate of the tile
+ * @zoom_level: the zoom level of the tile
+ * @texture: the texture of the tile
+ *
+ * Stores the texture of a tile, replacing any texture previously stored
+ * for the same tile.
+ */
+void
+shumate_texture_cache_insert (ShumateTextureCache *self,
+                              const char          *source_id,
+                              guint                x,
+                              guint                y,
+                              guint                zoom_level,
+                              GdkTexture          *texture)
+{
+  QueueMember *member;
+  TextureKey key;
+  GList *link;
+  gsize size;
+
+  g_return_if_fail (SHUMATE_IS_TEXTURE_CACHE (self));
+  g_return_if_fail (GDK_IS_TEXTURE (texture));
+
+  if (!source_id)
+    return;
+
+  size = (gsize) gdk_texture_get_width (texture) * gdk_texture_get_height (texture) * 4;
+  if (size > self->size_limit)
+    return;
+
+  key.source_id = g_intern_string (source_id);
+  key.x = x;
+  key.y = y;
+  key.zoom_level = zoom_level;
+
+  link = g_hash_table_lookup (self->hash_table, &key);
+  if (link)
+    {
+      member = link->data;
+      g_set_object (&member->texture, texture);
+      self->size -= member->size;
+      member->size = size;
+
+      g_queue_unlink (self->queue, link);
+      g_queue_push_head_link (self->queue, link);
+    }
+  else
+    {
+      member = g_slice_new (QueueMember);
+      member->key = key;
+      member->texture = g_object_ref (texture);
+      member->size = size;
+
+      g_queue_push_head (self->queue, member);
+      g_hash_table_insert (self->hash_table, &member->key, g_queue_peek_head_link (self->queue));
+    }
+
+  self->size += size;
+  DEBUG ("Stored texture %u/%u/%u/%s, cache size %" G_GUINT64_FORMAT,
+      zoom_level, x, y, source_id, self->size);
+
+  shumate_texture_cache_evict (self);
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_SIZE]);
+}
+
+/**
+ * shumate_texture_cache_clean:
+ * @self: a #ShumateTextureCache
+ *
+ * Drops all the textures stored in the cache.
+ */
+void
+shumate_texture_cache_clean (ShumateTextureCache *self)
+{
+  g_return_if_fail (SHUMATE_IS_TEXTURE_CACHE (self));
+
+  g_hash_table_remove_all (self->hash_table);
+  g_queue_foreach (self->queue, (GFunc) delete_queue_member, NULL);
+  g_queue_clear (self->queue);
+  self->size = 0;
+
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_SIZE]);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#if !defined (__SHUMATE_SHUMATE_H_INSIDE__) && !defined (SHUMATE_COMPILATION)
+#error "Only <shumate/shumate.h> can be included directly."
+#endif
+
+#ifndef _SHUMATE_TEXTURE_CACHE_H_
+#define _SHUMATE_TEXTURE_CACHE_H_
+
+#include <glib-object.h>
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+#define SHUMATE_TYPE_TEXTURE_CACHE shumate_texture_cache_get_type ()
+G_DECLARE_FINAL_TYPE (ShumateTextureCache, shumate_texture_cache, SHUMATE, TEXTURE_CACHE, GObject)
+
+ShumateTextureCache *shumate_texture_cache_new_full (guint64 size_limit);
+ShumateTextureCache *shumate_texture_cache_get_default (void);
+
+guint64 shumate_texture_cache_get_size_limit (ShumateTextureCache *self);
+void shumate_texture_cache_set_size_limit (ShumateTextureCache *self,
+                                           guint64              size_limit);
+guint64 shumate_texture_cache_get_size (ShumateTextureCache *self);
+guint64 shumate_texture_cache_get_reclaimed (ShumateTextureCache *self);
+
+GdkTexture *shumate_texture_cache_lookup (ShumateTextureCache *self,
+                                          const char          *source_id,
+                                          guint                x,
+                                          guint                y,
+                                          guint                zoom_level);
+void shumate_texture_cache_insert (ShumateTextureCache *self,
+                                   const char          *source_id,
+                                   guint                x,
+                                   guint                y,
+                                   guint                zoom_level,
+                                   GdkTexture          *texture);
+
+void shumate_texture_cache_clean (ShumateTextureCache *self);
+
+G_END_DECLS
+
+#endif /* _SHUMATE_TEXTURE_CACHE_H_ */
@@ -72,20 +72,22 @@ shumate_tile_cache_init (ShumateTileCache *tile_cache)
  * shumate_tile_cache_store_tile:
  * @tile_cache: a #ShumateTileCache
  * @tile: a #ShumateTile
- * @contents: the tile contents that should be stored
- * @size: size of the contents in bytes
+ * @bytes: the tile contents that should be stored
  *
- * Stores the tile including the metadata into the cache.
+ * Stores the tile including the metadata into the cache. The contents are
+ * the data as received from the tile source; caches keep a reference to
+ * @bytes rather than copying it whenever they can, so the same buffer is
+ * shared by all the caches of a chain.
  */
 void
 shumate_tile_cache_store_tile (ShumateTileCache *tile_cache,
     ShumateTile *tile,
-    const char *contents,
-    gsize size)
+    GBytes *bytes)
 {
   g_return_if_fail (SHUMATE_IS_TILE_CACHE (tile_cache));
+  g_return_if_fail (bytes != NULL);
 
-  SHUMATE_TILE_CACHE_GET_CLASS (tile_cache)->store_tile (tile_cache, tile, contents, size);
+  SHUMATE_TILE_CACHE_GET_CLASS (tile_cache)->store_tile (tile_cache, tile, bytes);
 }
 
 
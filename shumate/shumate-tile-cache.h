@@ -44,8 +44,7 @@ struct _ShumateTileCacheClass
 
   void (*store_tile)(ShumateTileCache *tile_cache,
       ShumateTile *tile,
-      const char *contents,
-      gsize size);
+      GBytes *bytes);
   void (*refresh_tile_time)(ShumateTileCache *tile_cache,
       ShumateTile *tile);
   void (*on_tile_filled)(ShumateTileCache *tile_cache,
@@ -54,8 +53,7 @@ struct _ShumateTileCacheClass
 
 void shumate_tile_cache_store_tile (ShumateTileCache *tile_cache,
     ShumateTile *tile,
-    const char *contents,
-    gsize size);
+    GBytes *bytes);
 void shumate_tile_cache_refresh_tile_time (ShumateTileCache *tile_cache,
     ShumateTile *tile);
 void shumate_tile_cache_on_tile_filled (ShumateTileCache *tile_cache,
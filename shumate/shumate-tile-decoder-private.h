@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHUMATE_TILE_DECODER_PRIVATE_H__
+#define __SHUMATE_TILE_DECODER_PRIVATE_H__
+
+#include <gio/gio.h>
+#include <gtk/gtk.h>
+
+#include "shumate-map-source.h"
+#include "shumate-tile.h"
+
+/* How long a tile stays fresh when the server didn't tell */
+#define SHUMATE_TILE_DEFAULT_FRESHNESS (7 * G_TIME_SPAN_DAY)
+
+void shumate_tile_decode_async (GBytes              *bytes,
+                                ShumateTile         *tile,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data);
+GdkTexture *shumate_tile_decode_finish (GAsyncResult  *result,
+                                        GError       **error);
+
+gboolean shumate_tile_decode_finish_for_source (GAsyncResult     *result,
+                                                ShumateMapSource *map_source,
+                                                ShumateTile      *tile,
+                                                GCancellable     *cancellable);
+void shumate_tile_decode_for_source (GBytes           *bytes,
+                                     ShumateMapSource *map_source,
+                                     ShumateTile      *tile,
+                                     GCancellable     *cancellable);
+
+gboolean shumate_tile_is_expired (ShumateTile *tile);
+void shumate_tile_finish_cached (ShumateMapSource *cache,
+                                 ShumateTile      *tile,
+                                 gboolean          revalidate,
+                                 GCancellable     *cancellable);
+
+#endif /* __SHUMATE_TILE_DECODER_PRIVATE_H__ */
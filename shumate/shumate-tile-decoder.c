@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Decodes tile images on a small pool of worker threads, so that the main
+ * loop only has to wrap the decoded pixels into a #GdkTexture.
+ *
+ * Each owner of tiles, usually the viewport of a view (see
+ * shumate_tile_set_owner()), has its own queue of pending jobs, kept sorted
+ * by the priority they were queued with (see shumate_tile_get_priority()),
+ * then by arrival order, so its visible tiles are decoded before its
+ * prefetched ones. The workers take turns between the queues, so a view
+ * loading a lot of tiles doesn't hold back the others. Jobs whose
+ * #GCancellable got cancelled while they were waiting are dropped without
+ * decoding.
+ *
+ * The thread pool is shared by the whole process on purpose: the number of
+ * decoding threads stays bounded however many views there are. Its threads
+ * are not exclusive, so GLib stops them once they have been idle for a while.
+ */
+
+#define DEBUG_FLAG SHUMATE_DEBUG_LOADING
+#include "shumate-debug.h"
+
+#include "shumate-tile-decoder-private.h"
+#include "shumate-texture-cache.h"
+#include "shumate-tile-cache.h"
+#include "shumate-tile-private.h"
+
+#define MAX_DECODER_THREADS 4
+
+typedef struct
+{
+  GTask *task;
+  GBytes *bytes;
+  int priority;
+  guint sequence;
+} DecodeJob;
+
+/* The pending jobs of one owner */
+typedef struct
+{
+  gconstpointer owner;
+  GSequence *jobs;
+} DecodeQueue;
+
+/* Protects the queues, which are filled on the main thread and emptied by
+ * the workers */
+static GMutex queues_lock;
+/* Owner → DecodeQueue, only for the owners with pending jobs */
+static GHashTable *queues;
+/* The same queues, in the order they get their next turn */
+static GQueue turns = G_QUEUE_INIT;
+
+static void
+decode_job_free (DecodeJob *job)
+{
+  g_clear_object (&job->task);
+  g_clear_pointer (&job->bytes, g_bytes_unref);
+  g_slice_free (DecodeJob, job);
+}
+
+static int
+decode_job_compare (gconstpointer a,
+                    gconstpointer b,
+                    gpointer      user_data)
+{
+  const DecodeJob *job_a = a;
+  const DecodeJob *job_b = b;
+
+  if (job_a->priority != job_b->priority)
+    return job_a->priority < job_b->priority ? -1 : 1;
+
+  /* Unsigned difference keeps the order right when the counter wraps */
+  return (int) (job_a->sequence - job_b->sequence);
+}
+
+static void
+decode_queue_free (DecodeQueue *queue)
+{
+  g_sequence_free (queue->jobs);
+  g_slice_free (DecodeQueue, queue);
+}
+
+static void
+decode_queue_push (gconstpointer  owner,
+                   DecodeJob     *job)
+{
+  DecodeQueue *queue;
+
+  g_mutex_lock (&queues_lock);
+
+  if (!queues)
+    queues = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  queue = g_hash_table_lookup (queues, owner);
+  if (!queue)
+    {
+      queue = g_slice_new0 (DecodeQueue);
+      queue->owner = owner;
+      queue->jobs = g_sequence_new (NULL);
+      g_hash_table_insert (queues, (gpointer) owner, queue);
+      g_queue_push_tail (&turns, queue);
+    }
+
+  g_sequence_insert_sorted (queue->jobs, job, decode_job_compare, NULL);
+
+  g_mutex_unlock (&queues_lock);
+}
+
+/* Takes the best job of the queue whose turn it is */
+static DecodeJob *
+decode_queue_pop (void)
+{
+  DecodeQueue *queue;
+  GSequenceIter *first;
+  DecodeJob *job;
+
+  g_mutex_lock (&queues_lock);
+
+  queue = g_queue_pop_head (&turns);
+  g_assert (queue != NULL);
+
+  first = g_sequence_get_begin_iter (queue->jobs);
+  job = g_sequence_get (first);
+  g_sequence_remove (first);
+
+  if (g_sequence_is_empty (queue->jobs))
+    {
+      g_hash_table_remove (queues, queue->owner);
+      decode_queue_free (queue);
+    }
+  else
+    g_queue_push_tail (&turns, queue);
+
+  g_mutex_unlock (&queues_lock);
+
+  return job;
+}
+
+/* The pool only gets a token per job, the worker picks which job it runs */
+static void
+decode_job_run (gpointer data,
+                gpointer user_data)
+{
+  DecodeJob *job = decode_queue_pop ();
+  GCancellable *cancellable = g_task_get_cancellable (job->task);
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GError) error = NULL;
+  GdkPixbuf *pixbuf;
+
+  if (g_task_return_error_if_cancelled (job->task))
+    {
+      decode_job_free (job);
+      return;
+    }
+
+  stream = g_memory_input_stream_new_from_bytes (job->bytes);
+  pixbuf = gdk_pixbuf_new_from_stream (stream, cancellable, &error);
+  if (pixbuf)
+    g_task_return_pointer (job->task, pixbuf, g_object_unref);
+  else
+    g_task_return_error (job->task, g_steal_pointer (&error));
+
+  decode_job_free (job);
+}
+
+static GThreadPool *
+get_decoder_pool (void)
+{
+  static GThreadPool *pool = NULL;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *new_pool;
+      int n_threads = CLAMP ((int) g_get_num_processors () - 1, 1, MAX_DECODER_THREADS);
+
+      new_pool = g_thread_pool_new (decode_job_run, NULL, n_threads, FALSE, NULL);
+      DEBUG ("Decoding tiles on %d threads", n_threads);
+
+      g_once_init_leave (&pool, new_pool);
+    }
+
+  return pool;
+}
+
+/*
+ * shumate_tile_decode_async:
+ * @bytes: the encoded tile image
+ * @tile: (nullable): the tile being loaded, which gives the priority and the
+ *   owner of the job
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called on the current thread-default main context when done
+ * @user_data: data for @callback
+ *
+ * Decodes @bytes on a worker thread.
+ */
+void
+shumate_tile_decode_async (GBytes              *bytes,
+                           ShumateTile         *tile,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+  static guint sequence = 0;
+  DecodeJob *job;
+
+  g_return_if_fail (bytes != NULL);
+  g_return_if_fail (tile == NULL || SHUMATE_IS_TILE (tile));
+
+  job = g_slice_new0 (DecodeJob);
+  job->task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (job->task, shumate_tile_decode_async);
+  job->bytes = g_bytes_ref (bytes);
+  job->priority = tile ? shumate_tile_get_priority (tile) : SHUMATE_TILE_PRIORITY_VISIBLE;
+  job->sequence = sequence++;
+
+  decode_queue_push (tile ? shumate_tile_get_owner (tile) : NULL, job);
+  g_thread_pool_push (get_decoder_pool (), GINT_TO_POINTER (1), NULL);
+}
+
+/*
+ * shumate_tile_decode_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finishes decoding a tile and wraps the pixels into a texture.
+ *
+ * Returns: (transfer full) (nullable): the texture of the tile, or %NULL
+ * if decoding failed or was cancelled
+ */
+GdkTexture *
+shumate_tile_decode_finish (GAsyncResult  *result,
+                            GError       **error)
+{
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  pixbuf = g_task_propagate_pointer (G_TASK (result), error);
+  if (!pixbuf)
+    return NULL;
+
+  return gdk_texture_new_for_pixbuf (pixbuf);
+}
+
+/*
+ * shumate_tile_decode_finish_for_source:
+ * @result: the #GAsyncResult passed to the callback
+ * @map_source: the source whose data was decoded
+ * @tile: the tile being loaded
+ * @cancellable: (nullable): the #GCancellable the tile is loaded with
+ *
+ * Finishes decoding the data @map_source has for @tile. The texture is added
+ * to the default texture cache and set on @tile. If decoding failed, @tile
+ * is handed to the next source of the chain, or marked done when there is
+ * none; nothing happens if it was cancelled.
+ *
+ * Returns: whether @tile got its texture
+ */
+gboolean
+shumate_tile_decode_finish_for_source (GAsyncResult     *result,
+                                       ShumateMapSource *map_source,
+                                       ShumateTile      *tile,
+                                       GCancellable     *cancellable)
+{
+  ShumateMapSource *next_source;
+  g_autoptr(GdkTexture) texture = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_return_val_if_fail (SHUMATE_IS_MAP_SOURCE (map_source), FALSE);
+  g_return_val_if_fail (SHUMATE_IS_TILE (tile), FALSE);
+
+  texture = shumate_tile_decode_finish (result, &error);
+  if (!texture)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return FALSE;
+
+      DEBUG ("Tile rendering failed: %s", error->message);
+
+      next_source = shumate_map_source_get_next_source (map_source);
+      if (SHUMATE_IS_MAP_SOURCE (next_source))
+        shumate_map_source_fill_tile (next_source, tile, cancellable);
+      else
+        {
+          /* Last source of the chain and nothing to show */
+          shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+        }
+
+      return FALSE;
+    }
+
+  shumate_texture_cache_insert (shumate_texture_cache_get_default (),
+      shumate_map_source_get_id (map_source),
+      shumate_tile_get_x (tile),
+      shumate_tile_get_y (tile),
+      shumate_tile_get_zoom_level (tile),
+      texture);
+  shumate_tile_set_texture (tile, texture);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  ShumateMapSource *map_source;
+  ShumateTile *tile;
+  GCancellable *cancellable;
+} TileDecodedData;
+
+static void
+tile_decoded_data_free (TileDecodedData *data)
+{
+  g_clear_object (&data->map_source);
+  g_clear_object (&data->tile);
+  g_clear_object (&data->cancellable);
+  g_slice_free (TileDecodedData, data);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (TileDecodedData, tile_decoded_data_free)
+
+static void
+on_tile_decoded (GObject      *source_object,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+  g_autoptr(TileDecodedData) data = user_data;
+
+  if (!shumate_tile_decode_finish_for_source (res, data->map_source,
+                                              data->tile, data->cancellable))
+    return;
+
+  shumate_tile_set_fade_in (data->tile, FALSE);
+  shumate_tile_set_state (data->tile, SHUMATE_STATE_DONE);
+}
+
+/*
+ * shumate_tile_decode_for_source:
+ * @bytes: the data of the tile
+ * @map_source: the source @bytes come from
+ * @tile: the tile being loaded
+ * @cancellable: (nullable): the #GCancellable the tile is loaded with
+ *
+ * Loads @tile from the data of a local source, such as a tile archive,
+ * which has nothing to revalidate: @tile is done once it is decoded. See
+ * shumate_tile_decode_finish_for_source() for the errors.
+ */
+void
+shumate_tile_decode_for_source (GBytes           *bytes,
+                                ShumateMapSource *map_source,
+                                ShumateTile      *tile,
+                                GCancellable     *cancellable)
+{
+  TileDecodedData *data;
+
+  g_return_if_fail (bytes != NULL);
+  g_return_if_fail (SHUMATE_IS_MAP_SOURCE (map_source));
+  g_return_if_fail (SHUMATE_IS_TILE (tile));
+
+  data = g_slice_new0 (TileDecodedData);
+  data->map_source = g_object_ref (map_source);
+  data->tile = g_object_ref (tile);
+  if (cancellable)
+    data->cancellable = g_object_ref (cancellable);
+
+  shumate_tile_decode_async (bytes, tile, cancellable, on_tile_decoded, data);
+}
+
+/*
+ * shumate_tile_is_expired:
+ * @tile: a tile loaded from a cache, with its metadata set
+ *
+ * Checks whether @tile has to be revalidated: when the server told when it
+ * expires, after that time, and otherwise when it was modified longer than
+ * %SHUMATE_TILE_DEFAULT_FRESHNESS ago. Tiles without either are expired.
+ *
+ * Returns: whether @tile is stale
+ */
+gboolean
+shumate_tile_is_expired (ShumateTile *tile)
+{
+  GDateTime *modified_time;
+  gint64 expiry_time;
+  gboolean expired = TRUE;
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (tile), FALSE);
+
+  expiry_time = shumate_tile_get_expiry_time (tile);
+  modified_time = shumate_tile_get_modified_time (tile);
+  if (expiry_time != 0)
+    {
+      /* The server told how long the tile stays fresh */
+      expired = (expiry_time <= g_get_real_time () / G_USEC_PER_SEC);
+    }
+  else if (modified_time)
+    {
+      g_autoptr(GDateTime) now = g_date_time_new_now_utc ();
+
+      expired = (g_date_time_difference (now, modified_time) > SHUMATE_TILE_DEFAULT_FRESHNESS);
+    }
+
+  DEBUG ("%p is %s expired", tile, (expired ? "" : "not"));
+
+  return expired;
+}
+
+/*
+ * shumate_tile_finish_cached:
+ * @cache: the cache @tile was loaded from
+ * @tile: the tile, with its data and metadata set
+ * @revalidate: whether the next source has to check @tile again, see
+ *   shumate_tile_is_expired()
+ * @cancellable: (nullable): the #GCancellable the tile is loaded with
+ *
+ * Finishes loading a tile whose data was in @cache. The next caches of the
+ * chain are told about it. A fresh tile is done; a stale one stays displayed
+ * while the next source revalidates it, and is used as it is at the end of
+ * the chain.
+ */
+void
+shumate_tile_finish_cached (ShumateMapSource *cache,
+                            ShumateTile      *tile,
+                            gboolean          revalidate,
+                            GCancellable     *cancellable)
+{
+  ShumateMapSource *next_source;
+
+  g_return_if_fail (SHUMATE_IS_MAP_SOURCE (cache));
+  g_return_if_fail (SHUMATE_IS_TILE (tile));
+
+  next_source = shumate_map_source_get_next_source (cache);
+
+  /* Notify other caches that the tile has been filled */
+  if (SHUMATE_IS_TILE_CACHE (next_source))
+    shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (next_source), tile);
+
+  if (!revalidate)
+    {
+      shumate_tile_set_fade_in (tile, FALSE);
+      shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+      return;
+    }
+
+  /* The next source revalidates it with its etag or modification time and
+   * replaces it if it changed */
+  if (SHUMATE_IS_MAP_SOURCE (next_source))
+    shumate_map_source_fill_tile (next_source, tile, cancellable);
+  else
+    shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHUMATE_TILE_PRIVATE_H__
+#define __SHUMATE_TILE_PRIVATE_H__
+
+#include "shumate-tile.h"
+
+/* Tiles with a lower priority value are loaded first. Visible tiles use
+ * SHUMATE_TILE_PRIORITY_VISIBLE plus their squared distance, in tiles, to the
+ * center of the view. */
+#define SHUMATE_TILE_PRIORITY_VISIBLE 0
+#define SHUMATE_TILE_PRIORITY_PREFETCH 1000
+
+int shumate_tile_get_priority (ShumateTile *self);
+void shumate_tile_set_priority (ShumateTile *self,
+                                int          priority);
+
+gconstpointer shumate_tile_get_owner (ShumateTile *self);
+void shumate_tile_set_owner (ShumateTile   *self,
+                             gconstpointer  owner);
+
+gboolean shumate_tile_get_store_only (ShumateTile *self);
+void shumate_tile_set_store_only (ShumateTile *self,
+                                  gboolean     store_only);
+
+gboolean shumate_tile_get_downloaded (ShumateTile *self);
+void shumate_tile_set_downloaded (ShumateTile *self,
+                                  gboolean     downloaded);
+
+gboolean shumate_tile_get_failed (ShumateTile *self);
+void shumate_tile_set_failed (ShumateTile *self,
+                              gboolean     failed);
+
+gint64 shumate_tile_get_expiry_time (ShumateTile *self);
+void shumate_tile_set_expiry_time (ShumateTile *self,
+                                   gint64       expiry_time);
+
+/* Up to this many textures can be drawn while the tile has none: an
+ * ancestor tile with the four children on top of it */
+#define SHUMATE_TILE_MAX_PLACEHOLDERS 5
+
+void shumate_tile_add_placeholder (ShumateTile           *self,
+                                   GdkTexture            *texture,
+                                   const graphene_rect_t *bounds);
+void shumate_tile_clear_placeholders (ShumateTile *self);
+void shumate_tile_release_texture (ShumateTile *self);
+
+void shumate_tile_snapshot_at (ShumateTile *self,
+                               GtkSnapshot *snapshot,
+                               float        x,
+                               float        y);
+
+#endif /* __SHUMATE_TILE_PRIVATE_H__ */
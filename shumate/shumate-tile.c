@@ -27,6 +27,7 @@
  */
 
 #include "shumate-tile.h"
+#include "shumate-tile-private.h"
 
 #include "shumate-enum-types.h"
 #include "shumate-marshal.h"
@@ -47,7 +48,19 @@ typedef struct
 
   GDateTime *modified_time; /* The last modified time of the cache */
   char *etag; /* The HTTP ETag sent by the server */
+  gint64 expiry_time; /* Unix time the server's copy may change, 0 if unknown */
   GdkTexture *texture;
+
+  int priority; /* Loading priority, see shumate_tile_set_priority() */
+  gconstpointer owner; /* What the tile is loaded for, only used as a key */
+  gboolean store_only; /* Only fills the persistent caches, never drawn */
+  gboolean downloaded; /* A request was sent to a server for the tile */
+  gboolean failed; /* No source could load the tile */
+
+  /* Drawn instead of the texture until it is loaded */
+  GdkTexture *placeholders[SHUMATE_TILE_MAX_PLACEHOLDERS];
+  graphene_rect_t placeholder_bounds[SHUMATE_TILE_MAX_PLACEHOLDERS];
+  guint n_placeholders;
 } ShumateTilePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShumateTile, shumate_tile, GTK_TYPE_WIDGET);
@@ -72,20 +85,7 @@ static void
 shumate_tile_snapshot (GtkWidget   *widget,
                        GtkSnapshot *snapshot)
 {
-  ShumateTile *self = SHUMATE_TILE (widget);
-  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
-  GdkTexture *texture = priv->texture;
-
-  if (texture)
-    {
-      gtk_snapshot_append_texture (snapshot,
-                                   texture,
-                                   &GRAPHENE_RECT_INIT(
-                                     0, 0,
-                                     gdk_texture_get_width (texture),
-                                     gdk_texture_get_height (texture)
-                                   ));
-    }
+  shumate_tile_snapshot_at (SHUMATE_TILE (widget), snapshot, 0, 0);
 }
 
 static GtkSizeRequestMode 
@@ -225,6 +225,7 @@ shumate_tile_dispose (GObject *object)
 
   g_clear_object (&priv->texture);
   g_clear_pointer (&priv->modified_time, g_date_time_unref);
+  shumate_tile_clear_placeholders (self);
 
   G_OBJECT_CLASS (shumate_tile_parent_class)->dispose (object);
 }
@@ -805,9 +806,360 @@ shumate_tile_set_texture (ShumateTile *self,
 
   g_return_if_fail (SHUMATE_TILE (self));
 
+  if (texture)
+    shumate_tile_clear_placeholders (self);
+
   if (g_set_object (&priv->texture, texture))
     {
       g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_TEXTURE]);
       gtk_widget_queue_draw (GTK_WIDGET (self));
     }
 }
+
+/*
+ * shumate_tile_get_priority:
+ * @self: a #ShumateTile
+ *
+ * Gets the loading priority of the tile.
+ *
+ * Returns: the priority, lower values are loaded first
+ */
+int
+shumate_tile_get_priority (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (self), SHUMATE_TILE_PRIORITY_VISIBLE);
+
+  return priv->priority;
+}
+
+/*
+ * shumate_tile_set_priority:
+ * @self: a #ShumateTile
+ * @priority: the loading priority
+ *
+ * Sets the priority the tile is loaded and decoded with, relative to the
+ * other tiles. Visible tiles use %SHUMATE_TILE_PRIORITY_VISIBLE, which is
+ * the default.
+ */
+void
+shumate_tile_set_priority (ShumateTile *self,
+                           int          priority)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  priv->priority = priority;
+}
+
+/*
+ * shumate_tile_get_owner:
+ * @self: a #ShumateTile
+ *
+ * Gets what the tile is loaded for, see shumate_tile_set_owner().
+ *
+ * Returns: (nullable): the owner of the tile
+ */
+gconstpointer
+shumate_tile_get_owner (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (self), NULL);
+
+  return priv->owner;
+}
+
+/*
+ * shumate_tile_set_owner:
+ * @self: a #ShumateTile
+ * @owner: (nullable): what the tile is loaded for, usually a #ShumateViewport
+ *
+ * Sets what the tile is loaded for. The owner is never dereferenced, it only
+ * groups the tiles of one view so that the decoder can take turns between
+ * views.
+ */
+void
+shumate_tile_set_owner (ShumateTile   *self,
+                        gconstpointer  owner)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  priv->owner = owner;
+}
+
+/*
+ * shumate_tile_get_store_only:
+ * @self: a #ShumateTile
+ *
+ * Gets whether the tile is only loaded to fill the persistent caches, see
+ * shumate_tile_set_store_only().
+ *
+ * Returns: %TRUE if the tile is never drawn
+ */
+gboolean
+shumate_tile_get_store_only (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (self), FALSE);
+
+  return priv->store_only;
+}
+
+/*
+ * shumate_tile_set_store_only:
+ * @self: a #ShumateTile
+ * @store_only: whether the tile is never drawn
+ *
+ * Marks a tile that is only loaded so that the persistent caches of the
+ * chain hold its data, such as the tiles of a region download. Such tiles
+ * skip the memory cache and the texture cache so that they don't push out
+ * the tiles of the views, and the persistent caches don't decode them.
+ * They may get no texture at all.
+ */
+void
+shumate_tile_set_store_only (ShumateTile *self,
+                             gboolean     store_only)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  priv->store_only = !!store_only;
+}
+
+/*
+ * shumate_tile_get_downloaded:
+ * @self: a #ShumateTile
+ *
+ * Gets whether the tile was requested from a server, see
+ * shumate_tile_set_downloaded().
+ *
+ * Returns: %TRUE if loading the tile went to the network
+ */
+gboolean
+shumate_tile_get_downloaded (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (self), FALSE);
+
+  return priv->downloaded;
+}
+
+/*
+ * shumate_tile_set_downloaded:
+ * @self: a #ShumateTile
+ * @downloaded: whether the tile was requested from a server
+ *
+ * Set by the network sources when the tile waits for a request, new or
+ * already running, rather than being answered by a cache of the chain.
+ */
+void
+shumate_tile_set_downloaded (ShumateTile *self,
+                             gboolean     downloaded)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  priv->downloaded = !!downloaded;
+}
+
+/*
+ * shumate_tile_get_failed:
+ * @self: a #ShumateTile
+ *
+ * Gets whether no source of the chain could load the tile, see
+ * shumate_tile_set_failed().
+ *
+ * Returns: %TRUE if the tile is done without its data
+ */
+gboolean
+shumate_tile_get_failed (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (self), FALSE);
+
+  return priv->failed;
+}
+
+/*
+ * shumate_tile_set_failed:
+ * @self: a #ShumateTile
+ * @failed: whether the tile couldn't be loaded
+ *
+ * Set by #ShumateErrorTileSource, the end of the chain, when it draws its
+ * placeholder because the sources before it had nothing.
+ */
+void
+shumate_tile_set_failed (ShumateTile *self,
+                         gboolean     failed)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  priv->failed = !!failed;
+}
+
+/*
+ * shumate_tile_get_expiry_time:
+ * @self: a #ShumateTile
+ *
+ * Gets when the data of the tile stops being fresh, as told by the
+ * Cache-Control or Expires headers of the server.
+ *
+ * Returns: a Unix time in seconds, or 0 if it is unknown
+ */
+gint64
+shumate_tile_get_expiry_time (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_val_if_fail (SHUMATE_IS_TILE (self), 0);
+
+  return priv->expiry_time;
+}
+
+/*
+ * shumate_tile_set_expiry_time:
+ * @self: a #ShumateTile
+ * @expiry_time: a Unix time in seconds, or 0 if it is unknown
+ *
+ * Sets when the data of the tile stops being fresh and has to be
+ * revalidated with the server.
+ */
+void
+shumate_tile_set_expiry_time (ShumateTile *self,
+                              gint64       expiry_time)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  priv->expiry_time = expiry_time;
+}
+
+/*
+ * shumate_tile_add_placeholder:
+ * @self: a #ShumateTile
+ * @texture: a texture covering part of the tile
+ * @bounds: where to draw @texture, relative to the tile
+ *
+ * Adds a texture drawn while the tile doesn't have its own, typically the
+ * tile of another zoom level scaled to cover the same area. Whatever falls
+ * outside of the tile is clipped. Placeholders are dropped when the tile
+ * gets a texture.
+ */
+void
+shumate_tile_add_placeholder (ShumateTile           *self,
+                              GdkTexture            *texture,
+                              const graphene_rect_t *bounds)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+  g_return_if_fail (GDK_IS_TEXTURE (texture));
+  g_return_if_fail (priv->n_placeholders < SHUMATE_TILE_MAX_PLACEHOLDERS);
+
+  priv->placeholders[priv->n_placeholders] = g_object_ref (texture);
+  priv->placeholder_bounds[priv->n_placeholders] = *bounds;
+  priv->n_placeholders++;
+
+  if (!priv->texture)
+    gtk_widget_queue_draw (GTK_WIDGET (self));
+}
+
+/*
+ * shumate_tile_snapshot_at:
+ * @self: a #ShumateTile
+ * @snapshot: a #GtkSnapshot
+ * @x: the x coordinate of the tile in @snapshot
+ * @y: the y coordinate of the tile in @snapshot
+ *
+ * Appends the texture of the tile, or its placeholders, at the given
+ * position without pushing a transform. This lets a layer draw many tiles
+ * that are not widgets of their own.
+ */
+void
+shumate_tile_snapshot_at (ShumateTile *self,
+                          GtkSnapshot *snapshot,
+                          float        x,
+                          float        y)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  if (priv->texture)
+    {
+      gtk_snapshot_append_texture (snapshot,
+                                   priv->texture,
+                                   &GRAPHENE_RECT_INIT (x, y, priv->size, priv->size));
+    }
+  else if (priv->n_placeholders > 0)
+    {
+      gtk_snapshot_push_clip (snapshot, &GRAPHENE_RECT_INIT (x, y, priv->size, priv->size));
+
+      for (guint i = 0; i < priv->n_placeholders; i++)
+        {
+          graphene_rect_t bounds;
+
+          graphene_rect_offset_r (&priv->placeholder_bounds[i], x, y, &bounds);
+          gtk_snapshot_append_texture (snapshot, priv->placeholders[i], &bounds);
+        }
+
+      gtk_snapshot_pop (snapshot);
+    }
+}
+
+/*
+ * shumate_tile_clear_placeholders:
+ * @self: a #ShumateTile
+ *
+ * Removes the placeholders added with shumate_tile_add_placeholder().
+ */
+void
+shumate_tile_clear_placeholders (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  if (priv->n_placeholders == 0)
+    return;
+
+  for (guint i = 0; i < priv->n_placeholders; i++)
+    g_clear_object (&priv->placeholders[i]);
+
+  priv->n_placeholders = 0;
+
+  if (!priv->texture)
+    gtk_widget_queue_draw (GTK_WIDGET (self));
+}
+
+/*
+ * shumate_tile_release_texture:
+ * @self: a #ShumateTile
+ *
+ * Drops the texture of a tile that isn't drawn anymore, for when memory is
+ * low. Whoever else still holds the tile doesn't keep the texture alive.
+ */
+void
+shumate_tile_release_texture (ShumateTile *self)
+{
+  ShumateTilePrivate *priv = shumate_tile_get_instance_private (self);
+
+  g_return_if_fail (SHUMATE_IS_TILE (self));
+
+  if (!priv->texture)
+    return;
+
+  g_clear_object (&priv->texture);
+  g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_TEXTURE]);
+}
@@ -96,6 +96,9 @@ static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
    level < shumate_map_source_get_min_zoom_level (priv->map_source) || \
            level > shumate_map_source_get_max_zoom_level (priv->map_source))
 
+/* Touchpad scrolling, in pixels, that zooms by one level */
+#define SURFACE_SCROLL_PER_ZOOM_LEVEL 200.0
+
 /* Between state values for go_to */
 typedef struct
 {
@@ -162,7 +165,7 @@ typedef struct
   double current_y;
 
   /* Zoom gesture */
-  guint initial_gesture_zoom;
+  double initial_gesture_zoom;
   double focus_lat;
   double focus_lon;
   gboolean zoom_started;
@@ -269,8 +272,8 @@ on_drag_gesture_drag_update (ShumateView    *self,
   ShumateMapSource *map_source;
   double x, y;
   double lat, lon;
-  guint zoom_level;
-  guint tile_size, max_x, max_y;
+  double zoom_level;
+  double max_x, max_y;
 
   g_assert (SHUMATE_IS_VIEW (self));
 
@@ -282,9 +285,7 @@ on_drag_gesture_drag_update (ShumateView    *self,
   x = shumate_map_source_get_x (map_source, zoom_level, priv->drag_begin_lon) - offset_x;
   y = shumate_map_source_get_y (map_source, zoom_level, priv->drag_begin_lat) - offset_y;
 
-  tile_size = shumate_map_source_get_tile_size (map_source);
-  max_x = shumate_map_source_get_column_count (map_source, zoom_level) * tile_size;
-  max_y = shumate_map_source_get_row_count (map_source, zoom_level) * tile_size;
+  max_x = max_y = shumate_map_source_get_tile_size (map_source) * pow (2.0, zoom_level);
 
   x = fmod (x, max_x);
   if (x < 0)
@@ -310,8 +311,8 @@ on_drag_gesture_drag_end (ShumateView    *self,
   ShumateMapSource *map_source;
   double x, y;
   double lat, lon;
-  guint zoom_level;
-  guint tile_size, max_x, max_y;
+  double zoom_level;
+  double max_x, max_y;
 
   g_assert (SHUMATE_IS_VIEW (self));
 
@@ -325,9 +326,7 @@ on_drag_gesture_drag_end (ShumateView    *self,
   x = shumate_map_source_get_x (map_source, zoom_level, priv->drag_begin_lon) - offset_x;
   y = shumate_map_source_get_y (map_source, zoom_level, priv->drag_begin_lat) - offset_y;
 
-  tile_size = shumate_map_source_get_tile_size (map_source);
-  max_x = shumate_map_source_get_column_count (map_source, zoom_level) * tile_size;
-  max_y = shumate_map_source_get_row_count (map_source, zoom_level) * tile_size;
+  max_x = max_y = shumate_map_source_get_tile_size (map_source) * pow (2.0, zoom_level);
 
   x = fmod (x, max_x);
   if (x < 0)
@@ -345,57 +344,140 @@ on_drag_gesture_drag_end (ShumateView    *self,
   priv->drag_begin_lat = 0;
 }
 
-static gboolean
-on_scroll_controller_scroll (ShumateView              *self,
-                             double                   dx,
-                             double                   dy,
-                             GtkEventControllerScroll *controller)
+/*
+ * Sets the zoom level while keeping the map point under the widget
+ * coordinates @x, @y in place.
+ */
+static void
+view_set_zoom_level_at (ShumateView *self,
+                        double       zoom_level,
+                        double       x,
+                        double       y)
 {
   ShumateViewPrivate *priv = shumate_view_get_instance_private (self);
   ShumateMapSource *map_source;
-  double scroll_latitude, scroll_longitude;
+  double focus_latitude, focus_longitude;
   double view_lon, view_lat;
+  double focus_map_x, focus_map_y;
+  double view_center_x, view_center_y;
+  double x_offset, y_offset;
+
+  map_source = shumate_viewport_get_reference_map_source (priv->viewport);
+  if (!map_source)
+    {
+      shumate_viewport_set_zoom_level (priv->viewport, zoom_level);
+      return;
+    }
 
   g_object_freeze_notify (G_OBJECT (priv->viewport));
   view_lon = shumate_location_get_longitude (SHUMATE_LOCATION (priv->viewport));
   view_lat = shumate_location_get_latitude (SHUMATE_LOCATION (priv->viewport));
+  focus_longitude = shumate_viewport_widget_x_to_longitude (priv->viewport, GTK_WIDGET (self), x);
+  focus_latitude = shumate_viewport_widget_y_to_latitude (priv->viewport, GTK_WIDGET (self), y);
 
-  map_source = shumate_viewport_get_reference_map_source (priv->viewport);
-  if (map_source)
+  shumate_viewport_set_zoom_level (priv->viewport, zoom_level);
+
+  focus_map_x = shumate_viewport_longitude_to_widget_x (priv->viewport, GTK_WIDGET (self), focus_longitude);
+  focus_map_y = shumate_viewport_latitude_to_widget_y (priv->viewport, GTK_WIDGET (self), focus_latitude);
+
+  zoom_level = shumate_viewport_get_zoom_level (priv->viewport);
+  view_center_x = shumate_map_source_get_x (map_source, zoom_level, view_lon);
+  view_center_y = shumate_map_source_get_y (map_source, zoom_level, view_lat);
+  x_offset = focus_map_x - x;
+  y_offset = focus_map_y - y;
+  shumate_location_set_location (SHUMATE_LOCATION (priv->viewport),
+                                 shumate_map_source_get_latitude (map_source, zoom_level, view_center_y + y_offset),
+                                 shumate_map_source_get_longitude (map_source, zoom_level, view_center_x + x_offset));
+  g_object_thaw_notify (G_OBJECT (priv->viewport));
+}
+
+static gboolean
+on_scroll_controller_scroll (ShumateView              *self,
+                             double                   dx,
+                             double                   dy,
+                             GtkEventControllerScroll *controller)
+{
+  ShumateViewPrivate *priv = shumate_view_get_instance_private (self);
+  double zoom_level = shumate_viewport_get_zoom_level (priv->viewport);
+  int steps;
+
+#if GTK_CHECK_VERSION (4, 8, 0)
+  /* Touchpads scroll by pixels, which zoom smoothly */
+  if (gtk_event_controller_scroll_get_unit (controller) == GDK_SCROLL_UNIT_SURFACE)
     {
-      scroll_longitude = shumate_viewport_widget_x_to_longitude (priv->viewport, GTK_WIDGET (self), priv->current_x);
-      scroll_latitude = shumate_viewport_widget_y_to_latitude (priv->viewport, GTK_WIDGET (self), priv->current_y);
+      priv->accumulated_scroll_dy = 0;
+      view_set_zoom_level_at (self, zoom_level + dy / SURFACE_SCROLL_PER_ZOOM_LEVEL,
+                              priv->current_x, priv->current_y);
+      return TRUE;
     }
+#endif
+
+  /* Wheels zoom by whole levels. High resolution wheels send fractions of
+   * a click, which add up to a step. */
+  if ((dy > 0) != (priv->accumulated_scroll_dy > 0))
+    priv->accumulated_scroll_dy = 0;
 
+  priv->accumulated_scroll_dy += dy;
+  // add some small value to avoid missing step for values like 0.999999
   if (dy > 0)
-    shumate_viewport_zoom_in (priv->viewport);
+    steps = (int) (priv->accumulated_scroll_dy + 0.01);
   else
-    shumate_viewport_zoom_out (priv->viewport);
+    steps = (int) (priv->accumulated_scroll_dy - 0.01);
 
-  if (map_source)
-    {
-      double scroll_map_x, scroll_map_y;
-      double view_center_x, view_center_y;
-      double x_offset, y_offset;
-      guint zoom_level;
-
-      scroll_map_x = shumate_viewport_longitude_to_widget_x (priv->viewport, GTK_WIDGET (self), scroll_longitude);
-      scroll_map_y = shumate_viewport_latitude_to_widget_y (priv->viewport, GTK_WIDGET (self), scroll_latitude);
-
-      zoom_level = shumate_viewport_get_zoom_level (priv->viewport);
-      view_center_x = shumate_map_source_get_x (map_source, zoom_level, view_lon);
-      view_center_y = shumate_map_source_get_y (map_source, zoom_level, view_lat);
-      x_offset = scroll_map_x - priv->current_x;
-      y_offset = scroll_map_y - priv->current_y;
-      shumate_location_set_location (SHUMATE_LOCATION (priv->viewport),
-                                     shumate_map_source_get_latitude (map_source, zoom_level, view_center_y + y_offset),
-                                     shumate_map_source_get_longitude (map_source, zoom_level, view_center_x + x_offset));
-    }
-  g_object_thaw_notify (G_OBJECT (priv->viewport));
+  if (steps == 0)
+    return TRUE;
+
+  priv->accumulated_scroll_dy -= steps;
+
+  /* Land on an integer level, like shumate_viewport_zoom_in() does */
+  if (steps > 0)
+    zoom_level = floor (zoom_level + 0.01) + steps;
+  else
+    zoom_level = ceil (zoom_level - 0.01) + steps;
+
+  view_set_zoom_level_at (self, zoom_level, priv->current_x, priv->current_y);
 
   return TRUE;
 }
 
+static void
+on_zoom_gesture_begin (ShumateView      *self,
+                       GdkEventSequence *sequence,
+                       GtkGestureZoom   *gesture)
+{
+  ShumateViewPrivate *priv = shumate_view_get_instance_private (self);
+
+  priv->initial_gesture_zoom = shumate_viewport_get_zoom_level (priv->viewport);
+  priv->zoom_started = TRUE;
+}
+
+static void
+on_zoom_gesture_scale_changed (ShumateView    *self,
+                               double          scale,
+                               GtkGestureZoom *gesture)
+{
+  ShumateViewPrivate *priv = shumate_view_get_instance_private (self);
+  double x, y;
+
+  if (!priv->zoom_started || scale <= 0)
+    return;
+
+  if (!gtk_gesture_get_bounding_box_center (GTK_GESTURE (gesture), &x, &y))
+    return;
+
+  view_set_zoom_level_at (self, priv->initial_gesture_zoom + log2 (scale), x, y);
+}
+
+static void
+on_zoom_gesture_end (ShumateView      *self,
+                     GdkEventSequence *sequence,
+                     GtkGestureZoom   *gesture)
+{
+  ShumateViewPrivate *priv = shumate_view_get_instance_private (self);
+
+  priv->zoom_started = FALSE;
+}
+
 static void
 on_motion_controller_motion (ShumateView              *self,
                              double                   x,
@@ -695,6 +777,7 @@ shumate_view_init (ShumateView *view)
 {
   ShumateViewPrivate *priv = shumate_view_get_instance_private (view);
   GtkGesture *drag_gesture;
+  GtkGesture *zoom_gesture;
   GtkEventController *scroll_controller;
   GtkEventController *motion_controller;
 
@@ -726,7 +809,13 @@ shumate_view_init (ShumateView *view)
   g_signal_connect_swapped (drag_gesture, "drag-end", G_CALLBACK (on_drag_gesture_drag_end), view);
   gtk_widget_add_controller (GTK_WIDGET (view), GTK_EVENT_CONTROLLER (drag_gesture));
 
-  scroll_controller = gtk_event_controller_scroll_new (GTK_EVENT_CONTROLLER_SCROLL_VERTICAL|GTK_EVENT_CONTROLLER_SCROLL_DISCRETE);
+  zoom_gesture = gtk_gesture_zoom_new ();
+  g_signal_connect_swapped (zoom_gesture, "begin", G_CALLBACK (on_zoom_gesture_begin), view);
+  g_signal_connect_swapped (zoom_gesture, "scale-changed", G_CALLBACK (on_zoom_gesture_scale_changed), view);
+  g_signal_connect_swapped (zoom_gesture, "end", G_CALLBACK (on_zoom_gesture_end), view);
+  gtk_widget_add_controller (GTK_WIDGET (view), GTK_EVENT_CONTROLLER (zoom_gesture));
+
+  scroll_controller = gtk_event_controller_scroll_new (GTK_EVENT_CONTROLLER_SCROLL_VERTICAL);
   g_signal_connect_swapped (scroll_controller, "scroll", G_CALLBACK (on_scroll_controller_scroll), view);
   gtk_widget_add_controller (GTK_WIDGET (view), scroll_controller);
 
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2021 libshumate contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHUMATE_VIEWPORT_PRIVATE_H__
+#define __SHUMATE_VIEWPORT_PRIVATE_H__
+
+#include <gtk/gtk.h>
+
+#include "shumate-viewport.h"
+
+typedef void (*ShumateViewportChangedFunc) (GtkWidget             *widget,
+                                            ShumateViewportChange  changes);
+
+typedef struct _ShumateViewportWatch ShumateViewportWatch;
+
+ShumateViewportWatch *shumate_viewport_watch (ShumateViewport            *self,
+                                              GtkWidget                  *widget,
+                                              ShumateViewportChangedFunc  func);
+void shumate_viewport_unwatch (ShumateViewportWatch *watch);
+
+#endif /* __SHUMATE_VIEWPORT_PRIVATE_H__ */
@@ -24,15 +24,30 @@
  * Written by: Chris Lord <chris@openedhand.com>
  */
 
-#include "shumate-viewport.h"
+#include "shumate-viewport-private.h"
 #include "shumate-location.h"
 
+#include <math.h>
+
 /**
  * SECTION:shumate-viewport
  * @short_description: The Object holding the coordinate and zoom-level state of
  * the current view.
  */
 
+/* Batches the changes of a viewport for a widget, see shumate_viewport_watch() */
+struct _ShumateViewportWatch
+{
+  ShumateViewport *viewport;
+  GtkWidget *widget;
+  ShumateViewportChangedFunc func;
+  gulong notify_id;
+
+  /* Changes accumulated until the next frame of the widget */
+  ShumateViewportChange pending_changes;
+  guint tick_id;
+};
+
 struct _ShumateViewport
 {
   GObject parent_instance;
@@ -40,7 +55,7 @@ struct _ShumateViewport
   double lon;
   double lat;
 
-  guint zoom_level;
+  double zoom_level;
   guint min_zoom_level;
   guint max_zoom_level;
 
@@ -112,7 +127,7 @@ shumate_viewport_get_property (GObject    *object,
   switch (prop_id)
     {
     case PROP_ZOOM_LEVEL:
-      g_value_set_uint (value, self->zoom_level);
+      g_value_set_double (value, self->zoom_level);
       break;
 
     case PROP_MIN_ZOOM_LEVEL:
@@ -152,7 +167,7 @@ shumate_viewport_set_property (GObject      *object,
   switch (prop_id)
     {
     case PROP_ZOOM_LEVEL:
-      shumate_viewport_set_zoom_level (self, g_value_get_uint (value));
+      shumate_viewport_set_zoom_level (self, g_value_get_double (value));
       break;
 
     case PROP_MIN_ZOOM_LEVEL:
@@ -205,14 +220,15 @@ shumate_viewport_class_init (ShumateViewportClass *klass)
   /**
    * ShumateViewport:zoom-level:
    *
-   * The level of zoom of the content.
+   * The level of zoom of the content. It may be fractional, in which case
+   * the tiles of the integer level below it are drawn scaled up.
    */
   obj_properties[PROP_ZOOM_LEVEL] =
-    g_param_spec_uint ("zoom-level",
-                       "Zoom level",
-                       "The level of zoom of the map",
-                       0, 20, 3,
-                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+    g_param_spec_double ("zoom-level",
+                         "Zoom level",
+                         "The level of zoom of the map",
+                         0, 20, 3,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
 
   /**
    * ShumateViewport:min-zoom-level:
@@ -292,17 +308,21 @@ shumate_viewport_new (void)
 /**
  * shumate_viewport_set_zoom_level:
  * @self: a #ShumateViewport
- * @zoom_level: the zoom level
+ * @zoom_level: the zoom level, which may be fractional
  *
  * Set the zoom level
  */
 void
 shumate_viewport_set_zoom_level (ShumateViewport *self,
-                                 guint            zoom_level)
+                                 double           zoom_level)
 {
   g_return_if_fail (SHUMATE_IS_VIEWPORT (self));
 
-  self->zoom_level = CLAMP (zoom_level, self->min_zoom_level, self->max_zoom_level);
+  zoom_level = CLAMP (zoom_level, self->min_zoom_level, self->max_zoom_level);
+  if (self->zoom_level == zoom_level)
+    return;
+
+  self->zoom_level = zoom_level;
   g_object_notify_by_pspec (G_OBJECT (self), obj_properties[PROP_ZOOM_LEVEL]);
 }
 
@@ -314,10 +334,10 @@ shumate_viewport_set_zoom_level (ShumateViewport *self,
  * 
  * Returns: the current zoom level
  */
-guint
+double
 shumate_viewport_get_zoom_level (ShumateViewport *self)
 {
-  g_return_val_if_fail (SHUMATE_IS_VIEWPORT (self), 0U);
+  g_return_val_if_fail (SHUMATE_IS_VIEWPORT (self), 0.0);
 
   return self->zoom_level;
 }
@@ -371,7 +391,7 @@ shumate_viewport_set_min_zoom_level (ShumateViewport *self,
 {
   g_return_if_fail (SHUMATE_IS_VIEWPORT (self));
 
-  if (self->zoom_level > min_zoom_level)
+  if (self->zoom_level < min_zoom_level)
     shumate_viewport_set_zoom_level (self, min_zoom_level);
 
   self->min_zoom_level = min_zoom_level;
@@ -398,29 +418,29 @@ shumate_viewport_get_min_zoom_level (ShumateViewport *self)
  * shumate_viewport_zoom_in:
  * @self: a #ShumateViewport
  *
- * Increments the zoom level
+ * Increments the zoom level to the next integer level
  */
 void shumate_viewport_zoom_in (ShumateViewport *self)
 {
   g_return_if_fail (SHUMATE_IS_VIEWPORT (self));
 
-  shumate_viewport_set_zoom_level (self, self->zoom_level + 1);
+  shumate_viewport_set_zoom_level (self, floor (self->zoom_level) + 1);
 }
 
 /**
  * shumate_viewport_zoom_out:
  * @self: a #ShumateViewport
  *
- * Decrements the zoom level
+ * Decrements the zoom level to the previous integer level
  */
 void shumate_viewport_zoom_out (ShumateViewport *self)
 {
   g_return_if_fail (SHUMATE_IS_VIEWPORT (self));
 
-  if (self->zoom_level == 0)
+  if (self->zoom_level <= 0)
     return;
 
-  shumate_viewport_set_zoom_level (self, self->zoom_level - 1);
+  shumate_viewport_set_zoom_level (self, ceil (self->zoom_level) - 1);
 }
 
 /**
@@ -597,3 +617,94 @@ shumate_viewport_latitude_to_widget_y (ShumateViewport *self,
   y = shumate_map_source_get_y (self->ref_map_source, self->zoom_level, latitude);
   return y - top_y;
 }
+
+static gboolean
+shumate_viewport_watch_tick_cb (GtkWidget     *widget,
+                                GdkFrameClock *frame_clock,
+                                gpointer       user_data)
+{
+  ShumateViewportWatch *watch = user_data;
+  ShumateViewportChange changes = watch->pending_changes;
+
+  watch->pending_changes = 0;
+  watch->tick_id = 0;
+
+  /* May free the watch */
+  if (changes != 0)
+    watch->func (widget, changes);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_watched_viewport_notify (ShumateViewport      *self,
+                            GParamSpec           *pspec,
+                            ShumateViewportWatch *watch)
+{
+  const char *name = g_param_spec_get_name (pspec);
+
+  if (g_str_equal (name, "latitude") || g_str_equal (name, "longitude"))
+    watch->pending_changes |= SHUMATE_VIEWPORT_CHANGE_LOCATION;
+  else if (g_str_equal (name, "zoom-level"))
+    watch->pending_changes |= SHUMATE_VIEWPORT_CHANGE_ZOOM_LEVEL;
+  else if (g_str_equal (name, "min-zoom-level") || g_str_equal (name, "max-zoom-level"))
+    watch->pending_changes |= SHUMATE_VIEWPORT_CHANGE_ZOOM_RANGE;
+  else if (g_str_equal (name, "reference-map-source"))
+    watch->pending_changes |= SHUMATE_VIEWPORT_CHANGE_REFERENCE_MAP_SOURCE;
+  else
+    return;
+
+  if (watch->tick_id == 0)
+    watch->tick_id = gtk_widget_add_tick_callback (watch->widget, shumate_viewport_watch_tick_cb, watch, NULL);
+}
+
+/*
+ * shumate_viewport_watch:
+ * @self: a #ShumateViewport
+ * @widget: the widget showing something that depends on @self
+ * @func: called with @widget and the #ShumateViewportChange flags of what
+ *   changed
+ *
+ * Follows the changes of @self for @widget. They are accumulated and @func
+ * is called once during the update phase of the next frame of @widget,
+ * however many viewport setters were called in between.
+ *
+ * Returns: (transfer full): the watch, to free with
+ * shumate_viewport_unwatch() at the latest when @widget is disposed
+ */
+ShumateViewportWatch *
+shumate_viewport_watch (ShumateViewport            *self,
+                        GtkWidget                  *widget,
+                        ShumateViewportChangedFunc  func)
+{
+  ShumateViewportWatch *watch;
+
+  g_return_val_if_fail (SHUMATE_IS_VIEWPORT (self), NULL);
+  g_return_val_if_fail (GTK_IS_WIDGET (widget), NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  watch = g_new0 (ShumateViewportWatch, 1);
+  watch->viewport = g_object_ref (self);
+  watch->widget = widget;
+  watch->func = func;
+  watch->notify_id = g_signal_connect (self, "notify", G_CALLBACK (on_watched_viewport_notify), watch);
+
+  return watch;
+}
+
+/*
+ * shumate_viewport_unwatch:
+ * @watch: a #ShumateViewportWatch
+ *
+ * Stops following the viewport, the changes not reported yet are dropped.
+ */
+void
+shumate_viewport_unwatch (ShumateViewportWatch *watch)
+{
+  if (watch->tick_id != 0)
+    gtk_widget_remove_tick_callback (watch->widget, watch->tick_id);
+
+  g_signal_handler_disconnect (watch->viewport, watch->notify_id);
+  g_object_unref (watch->viewport);
+  g_free (watch);
+}
@@ -32,14 +32,32 @@
 
 G_BEGIN_DECLS
 
+/**
+ * ShumateViewportChange:
+ * @SHUMATE_VIEWPORT_CHANGE_LOCATION: the latitude or the longitude changed
+ * @SHUMATE_VIEWPORT_CHANGE_ZOOM_LEVEL: the zoom level changed
+ * @SHUMATE_VIEWPORT_CHANGE_ZOOM_RANGE: the minimal or maximal zoom level changed
+ * @SHUMATE_VIEWPORT_CHANGE_REFERENCE_MAP_SOURCE: the reference map source changed
+ *
+ * The parts of a #ShumateViewport that changed since the last
+ * #ShumateLayer::viewport-changed emission.
+ */
+typedef enum
+{
+  SHUMATE_VIEWPORT_CHANGE_LOCATION = 1 << 0,
+  SHUMATE_VIEWPORT_CHANGE_ZOOM_LEVEL = 1 << 1,
+  SHUMATE_VIEWPORT_CHANGE_ZOOM_RANGE = 1 << 2,
+  SHUMATE_VIEWPORT_CHANGE_REFERENCE_MAP_SOURCE = 1 << 3,
+} ShumateViewportChange;
+
 #define SHUMATE_TYPE_VIEWPORT shumate_viewport_get_type ()
 G_DECLARE_FINAL_TYPE (ShumateViewport, shumate_viewport, SHUMATE, VIEWPORT, GObject)
 
 ShumateViewport *shumate_viewport_new (void);
 
 void shumate_viewport_set_zoom_level (ShumateViewport *self,
-                                      guint            zoom_level);
-guint shumate_viewport_get_zoom_level (ShumateViewport *self);
+                                      double           zoom_level);
+double shumate_viewport_get_zoom_level (ShumateViewport *self);
 
 void shumate_viewport_set_max_zoom_level (ShumateViewport *self,
                                           guint            max_zoom_level);
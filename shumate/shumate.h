@@ -51,9 +51,13 @@
 
 #include "shumate/shumate-network-tile-source.h"
 #include "shumate/shumate-error-tile-source.h"
+#include "shumate/shumate-mbtiles-source.h"
+#include "shumate/shumate-pmtiles-source.h"
 
 #include "shumate/shumate-memory-cache.h"
 #include "shumate/shumate-file-cache.h"
+#include "shumate/shumate-mbtiles-cache.h"
+#include "shumate/shumate-texture-cache.h"
 
 #undef __SHUMATE_SHUMATE_H_INSIDE__
 
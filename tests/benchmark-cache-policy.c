@@ -0,0 +1,167 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+#include <stdio.h>
+
+#include "benchmark-tile-source.h"
+
+#define CACHE_SIZE 200
+#define VIEW_COLUMNS 6
+#define VIEW_ROWS 4
+#define HOME_SIZE 16
+#define N_SESSIONS 20
+#define N_PANS 150
+#define N_JUMP_TILES 400
+
+typedef struct
+{
+  guint zoom;
+  guint x;
+  guint y;
+} TraceEntry;
+
+static ShumateMemoryCache *cache;
+static GBytes *tile_bytes;
+static guint n_misses;
+
+/* Counts the tiles the memory cache didn't have, and gives them to it */
+static void
+on_tile_missed (ShumateTile *tile,
+                gpointer     user_data)
+{
+  n_misses++;
+  shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (cache), tile, tile_bytes);
+}
+
+static GBytes *
+create_tile_bytes (void)
+{
+  g_autoptr(GdkPixbuf) pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
+  g_autoptr(GError) error = NULL;
+  char *buffer;
+  gsize buffer_size;
+
+  gdk_pixbuf_fill (pixbuf, 0xaad3dfff);
+  if (!gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, "png", &error, NULL))
+    g_error ("Unable to create tile: %s", error->message);
+
+  return g_bytes_new_take (buffer, buffer_size);
+}
+
+static void
+add_view (GArray *trace,
+          guint   zoom,
+          guint   x,
+          guint   y)
+{
+  for (guint row = 0; row < VIEW_ROWS; row++)
+    for (guint column = 0; column < VIEW_COLUMNS; column++)
+      g_array_append_val (trace, ((TraceEntry) { zoom, x + column, y + row }));
+}
+
+/*
+ * Sessions of panning around a home area, each interrupted by a jump far
+ * away: a long flight or a region download, whose tiles are only seen once.
+ */
+static GArray *
+create_pan_sessions (void)
+{
+  GArray *trace = g_array_new (FALSE, FALSE, sizeof (TraceEntry));
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  guint home_x = 2000, home_y = 1400;
+
+  for (int session = 0; session < N_SESSIONS; session++)
+    {
+      guint x = home_x + g_rand_int_range (rand, 0, HOME_SIZE);
+      guint y = home_y + g_rand_int_range (rand, 0, HOME_SIZE);
+      guint far_x = g_rand_int_range (rand, 0, 4000);
+      guint far_y = g_rand_int_range (rand, 0, 4000);
+
+      for (int pan = 0; pan < N_PANS; pan++)
+        {
+          x = CLAMP ((int) x + g_rand_int_range (rand, -1, 2), home_x, home_x + HOME_SIZE);
+          y = CLAMP ((int) y + g_rand_int_range (rand, -1, 2), home_y, home_y + HOME_SIZE);
+          add_view (trace, 12, x, y);
+        }
+
+      for (int i = 0; i < N_JUMP_TILES; i++)
+        g_array_append_val (trace, ((TraceEntry) { 12, far_x + i % 20, far_y + i / 20 }));
+    }
+
+  return trace;
+}
+
+/* A recorded trace has one "zoom x y" line per tile request */
+static GArray *
+load_trace (const char *filename)
+{
+  GArray *trace = g_array_new (FALSE, FALSE, sizeof (TraceEntry));
+  g_autofree char *contents = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GStrv) lines = NULL;
+
+  if (!g_file_get_contents (filename, &contents, NULL, &error))
+    g_error ("Unable to read the trace: %s", error->message);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i] != NULL; i++)
+    {
+      TraceEntry entry;
+
+      if (sscanf (lines[i], "%u %u %u", &entry.zoom, &entry.x, &entry.y) == 3)
+        g_array_append_val (trace, entry);
+    }
+
+  return trace;
+}
+
+static double
+replay (GArray                   *trace,
+        ShumateMapSource         *source,
+        ShumateMemoryCachePolicy  policy)
+{
+  cache = g_object_ref_sink (shumate_memory_cache_new_full (CACHE_SIZE));
+  shumate_memory_cache_set_policy (cache, policy);
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (cache), source);
+  n_misses = 0;
+
+  for (guint i = 0; i < trace->len; i++)
+    {
+      TraceEntry *entry = &g_array_index (trace, TraceEntry, i);
+      g_autoptr(ShumateTile) tile = NULL;
+
+      tile = g_object_ref_sink (shumate_tile_new_full (entry->x, entry->y, 256, entry->zoom));
+      shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (cache), tile, NULL);
+
+      /* Hits are decoded in a thread */
+      while (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+  g_clear_object (&cache);
+
+  return 100.0 * (trace->len - n_misses) / trace->len;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(ShumateMapSource) source = NULL;
+  g_autoptr(GArray) trace = NULL;
+
+  gtk_init ();
+
+  /* Every hit has to go through the memory cache */
+  shumate_texture_cache_set_size_limit (shumate_texture_cache_get_default (), 0);
+
+  source = benchmark_tile_source_new (on_tile_missed, NULL);
+  tile_bytes = create_tile_bytes ();
+  trace = argc > 1 ? load_trace (argv[1]) : create_pan_sessions ();
+
+  g_print ("%u tile requests, cache of %d tiles\n", trace->len, CACHE_SIZE);
+  g_print ("LRU hit rate: %5.1f%%\n", replay (trace, source, SHUMATE_MEMORY_CACHE_POLICY_LRU));
+  g_print ("2Q hit rate:  %5.1f%%\n", replay (trace, source, SHUMATE_MEMORY_CACHE_POLICY_TWO_Q));
+
+  g_bytes_unref (tile_bytes);
+
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+
+#include "benchmark-tile-source.h"
+
+#define N_ITERATIONS 200
+
+static void
+benchmark_relayout (ShumateMapSource *source,
+                    int               width,
+                    int               height)
+{
+  ShumateViewport *viewport;
+  ShumateMapLayer *layer;
+  gint64 start, resize_time, pan_time;
+  double longitude;
+
+  viewport = shumate_viewport_new ();
+  shumate_viewport_set_reference_map_source (viewport, source);
+  shumate_viewport_set_zoom_level (viewport, 10);
+  shumate_location_set_location (SHUMATE_LOCATION (viewport), 45.466, -73.75);
+
+  layer = shumate_map_layer_new (source, viewport);
+  g_object_ref_sink (layer);
+
+  /* Full relayouts, alternating between two sizes so the grid is rebuilt */
+  start = g_get_monotonic_time ();
+  for (int i = 0; i < N_ITERATIONS; i++)
+    gtk_widget_size_allocate (GTK_WIDGET (layer),
+                              &(GtkAllocation) { 0, 0, width - (i % 2) * 256, height - (i % 2) * 256 },
+                              -1);
+  resize_time = g_get_monotonic_time () - start;
+
+  gtk_widget_size_allocate (GTK_WIDGET (layer),
+                            &(GtkAllocation) { 0, 0, width, height },
+                            -1);
+
+  /* Pans by a bit more than one tile, which shifts the grid each time. The
+   * layer is not realized so there is no frame clock: emit the per-frame
+   * signal by hand. */
+  longitude = -73.75;
+  start = g_get_monotonic_time ();
+  for (int i = 0; i < N_ITERATIONS; i++)
+    {
+      longitude += 0.4;
+      shumate_location_set_location (SHUMATE_LOCATION (viewport), 45.466, longitude);
+      g_signal_emit_by_name (layer, "viewport-changed", SHUMATE_VIEWPORT_CHANGE_LOCATION);
+    }
+  pan_time = g_get_monotonic_time () - start;
+
+  g_print ("%5dx%-5d resize: %8.1f µs/layout  pan: %8.1f µs/layout\n",
+           width, height,
+           (double) resize_time / N_ITERATIONS,
+           (double) pan_time / N_ITERATIONS);
+
+  g_object_unref (layer);
+  g_object_unref (viewport);
+}
+
+int
+main (int argc, char *argv[])
+{
+  ShumateMapSource *source;
+  static const int sizes[][2] = {
+    { 800, 600 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+    { 7680, 4320 },
+  };
+
+  gtk_init ();
+
+  /* Never touches the network so only layout is measured */
+  source = benchmark_tile_source_new (NULL, NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (sizes); i++)
+    benchmark_relayout (source, sizes[i][0], sizes[i][1]);
+
+  g_object_unref (source);
+
+  return 0;
+}
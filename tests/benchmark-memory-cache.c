@@ -0,0 +1,96 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+
+#include "benchmark-tile-source.h"
+
+#define N_TILES 1024
+#define N_ROUNDS 200
+
+/* What the memory cache did before: a printf key, hashed as a string, to
+ * find a link of the LRU queue */
+static void
+lookup_string_keys (GHashTable  *hash_table,
+                    GQueue      *queue,
+                    ShumateTile *tile,
+                    const char  *source_id)
+{
+  g_autofree char *key = NULL;
+  GList *link;
+
+  key = g_strdup_printf ("%d/%d/%d/%s",
+                         shumate_tile_get_zoom_level (tile),
+                         shumate_tile_get_x (tile),
+                         shumate_tile_get_y (tile),
+                         source_id);
+  link = g_hash_table_lookup (hash_table, key);
+  if (link)
+    {
+      g_queue_unlink (queue, link);
+      g_queue_push_head_link (queue, link);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(ShumateMapSource) source = NULL;
+  g_autoptr(ShumateMemoryCache) cache = NULL;
+  g_autoptr(GHashTable) hash_table = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  ShumateTile *tiles[N_TILES];
+  GQueue queue = G_QUEUE_INIT;
+  gint64 start, string_time, packed_time, store_time;
+
+  gtk_init ();
+
+  /* The memory cache takes its id from the next source */
+  source = benchmark_tile_source_new (NULL, NULL);
+  cache = g_object_ref_sink (shumate_memory_cache_new_full (N_TILES));
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (cache), source);
+
+  bytes = g_bytes_new_static ("tile", 4);
+  hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (int i = 0; i < N_TILES; i++)
+    {
+      tiles[i] = g_object_ref_sink (shumate_tile_new_full (i % 32, i / 32, 256, 12));
+
+      shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (cache), tiles[i], bytes);
+
+      g_queue_push_head (&queue, NULL);
+      g_hash_table_insert (hash_table,
+                           g_strdup_printf ("%d/%d/%d/%s", 12, i % 32, i / 32, "benchmark"),
+                           g_queue_peek_head_link (&queue));
+    }
+
+  start = g_get_monotonic_time ();
+  for (int round = 0; round < N_ROUNDS; round++)
+    for (int i = 0; i < N_TILES; i++)
+      lookup_string_keys (hash_table, &queue, tiles[i], "benchmark");
+  string_time = g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  for (int round = 0; round < N_ROUNDS; round++)
+    for (int i = 0; i < N_TILES; i++)
+      shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (cache), tiles[i]);
+  packed_time = g_get_monotonic_time () - start;
+
+  /* With room for half the tiles, every store evicts the least recently
+   * used one */
+  shumate_memory_cache_set_size_limit (cache, N_TILES / 2);
+  start = g_get_monotonic_time ();
+  for (int round = 0; round < N_ROUNDS; round++)
+    for (int i = 0; i < N_TILES; i++)
+      shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (cache), tiles[i], bytes);
+  store_time = g_get_monotonic_time () - start;
+
+  g_print ("lookup, printf keys: %8.1f ns/tile\n", (double) string_time * 1000 / (N_ROUNDS * N_TILES));
+  g_print ("lookup, packed keys: %8.1f ns/tile\n", (double) packed_time * 1000 / (N_ROUNDS * N_TILES));
+  g_print ("store with eviction: %8.1f ns/tile\n", (double) store_time * 1000 / (N_ROUNDS * N_TILES));
+
+  for (int i = 0; i < N_TILES; i++)
+    g_object_unref (tiles[i]);
+  g_queue_clear (&queue);
+
+  return 0;
+}
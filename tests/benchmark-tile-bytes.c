@@ -0,0 +1,122 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+#include <time.h>
+
+#include "benchmark-tile-source.h"
+
+#define N_TILES 200
+#define TILE_SIZE 256
+
+static GBytes *
+create_tile_bytes (void)
+{
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GError) error = NULL;
+  char *buffer;
+  gsize buffer_size;
+  guchar *pixels;
+  int rowstride;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, TILE_SIZE, TILE_SIZE);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  /* Something that looks a bit like a map: flat areas and some detail */
+  for (int y = 0; y < TILE_SIZE; y++)
+    for (int x = 0; x < TILE_SIZE; x++)
+      {
+        guchar *p = pixels + y * rowstride + x * 4;
+
+        p[0] = (x / 32 + y / 32) % 2 ? 0xf2 : 0xaa;
+        p[1] = (x * y) % 7 == 0 ? 0x80 : 0xef;
+        p[2] = (x ^ y) & 0x10 ? 0xe9 : 0xd3;
+        p[3] = 0xff;
+      }
+
+  if (!gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, "png", &error, NULL))
+    g_error ("Unable to create tile: %s", error->message);
+
+  return g_bytes_new_take (buffer, buffer_size);
+}
+
+typedef struct {
+  GBytes *body;
+  gboolean reencode;
+  ShumateTileCache *cache;
+} StoreData;
+
+/* Does what the network source does with a downloaded tile, before or after
+ * it stopped re-encoding it as PNG, and stores it in the real cache */
+static void
+store_tile (ShumateTile *tile,
+            gpointer     user_data)
+{
+  StoreData *data = user_data;
+  g_autoptr(GInputStream) stream = g_memory_input_stream_new_from_bytes (data->body);
+  g_autoptr(GdkPixbuf) pixbuf = gdk_pixbuf_new_from_stream (stream, NULL, NULL);
+  g_autoptr(GdkTexture) texture = gdk_texture_new_for_pixbuf (pixbuf);
+  g_autoptr(GBytes) bytes = NULL;
+
+  if (data->reencode)
+    {
+      char *buffer;
+      gsize buffer_size;
+
+      gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, "png", NULL, NULL);
+      bytes = g_bytes_new_take (buffer, buffer_size);
+    }
+  else
+    bytes = g_bytes_ref (data->body);
+
+  shumate_tile_cache_store_tile (data->cache, tile, bytes);
+  shumate_tile_set_texture (tile, texture);
+}
+
+static double
+measure (GBytes   *body,
+         gboolean  reencode)
+{
+  g_autoptr(ShumateMapSource) source = NULL;
+  g_autoptr(ShumateMemoryCache) cache = NULL;
+  StoreData data = { body, reencode, NULL };
+  clock_t start;
+
+  /* A new cache each time, so that every tile misses it and goes through
+   * the tile source */
+  source = benchmark_tile_source_new (store_tile, &data);
+  cache = g_object_ref_sink (shumate_memory_cache_new_full (N_TILES));
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (cache), source);
+  shumate_tile_source_set_cache (SHUMATE_TILE_SOURCE (source), SHUMATE_TILE_CACHE (cache));
+  data.cache = SHUMATE_TILE_CACHE (cache);
+
+  start = clock ();
+
+  for (int i = 0; i < N_TILES; i++)
+    {
+      g_autoptr(ShumateTile) tile = NULL;
+
+      tile = g_object_ref_sink (shumate_tile_new_full (i % 16, i / 16, TILE_SIZE, 12));
+      shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (cache), tile, NULL);
+    }
+
+  return (double) (clock () - start) * G_USEC_PER_SEC / CLOCKS_PER_SEC / N_TILES;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GBytes) body = NULL;
+  double reencoded, shared;
+
+  gtk_init ();
+
+  body = create_tile_bytes ();
+  reencoded = measure (body, TRUE);
+  shared = measure (body, FALSE);
+
+  g_print ("tile of %" G_GSIZE_FORMAT " bytes\n", g_bytes_get_size (body));
+  g_print ("decode + PNG re-encode: %8.1f µs CPU/tile\n", reencoded);
+  g_print ("decode + shared bytes:  %8.1f µs CPU/tile\n", shared);
+
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include "benchmark-tile-source.h"
+
+struct _BenchmarkTileSource
+{
+  ShumateTileSource parent_instance;
+
+  BenchmarkFillFunc fill_func;
+  gpointer user_data;
+};
+
+G_DEFINE_TYPE (BenchmarkTileSource, benchmark_tile_source, SHUMATE_TYPE_TILE_SOURCE)
+
+static void
+benchmark_tile_source_fill_tile (ShumateMapSource *map_source,
+                                 ShumateTile      *tile,
+                                 GCancellable     *cancellable)
+{
+  BenchmarkTileSource *self = BENCHMARK_TILE_SOURCE (map_source);
+
+  if (self->fill_func)
+    self->fill_func (tile, self->user_data);
+
+  shumate_tile_set_state (tile, SHUMATE_STATE_DONE);
+}
+
+static void
+benchmark_tile_source_class_init (BenchmarkTileSourceClass *klass)
+{
+  ShumateMapSourceClass *map_source_class = SHUMATE_MAP_SOURCE_CLASS (klass);
+
+  map_source_class->fill_tile = benchmark_tile_source_fill_tile;
+}
+
+static void
+benchmark_tile_source_init (BenchmarkTileSource *self)
+{
+}
+
+/*
+ * Creates a source with the id "benchmark" and 256 pixels tiles for zoom
+ * levels 0 to 19. @fill_func may be %NULL when the benchmark only needs the
+ * tiles to be done.
+ */
+ShumateMapSource *
+benchmark_tile_source_new (BenchmarkFillFunc fill_func,
+                           gpointer          user_data)
+{
+  BenchmarkTileSource *self;
+
+  self = g_object_new (BENCHMARK_TYPE_TILE_SOURCE,
+                       "id", "benchmark",
+                       "tile-size", 256,
+                       "min-zoom-level", 0,
+                       "max-zoom-level", 19,
+                       NULL);
+  self->fill_func = fill_func;
+  self->user_data = user_data;
+
+  return g_object_ref_sink (SHUMATE_MAP_SOURCE (self));
+}
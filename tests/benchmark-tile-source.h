@@ -0,0 +1,21 @@
+#ifndef __BENCHMARK_TILE_SOURCE_H__
+#define __BENCHMARK_TILE_SOURCE_H__
+
+#include <shumate/shumate.h>
+
+G_BEGIN_DECLS
+
+/* A tile source which never touches the network, shared by the benchmarks */
+#define BENCHMARK_TYPE_TILE_SOURCE (benchmark_tile_source_get_type ())
+G_DECLARE_FINAL_TYPE (BenchmarkTileSource, benchmark_tile_source, BENCHMARK, TILE_SOURCE, ShumateTileSource)
+
+/* Called for each tile the source fills, before it is marked as done */
+typedef void (*BenchmarkFillFunc) (ShumateTile *tile,
+                                   gpointer     user_data);
+
+ShumateMapSource *benchmark_tile_source_new (BenchmarkFillFunc fill_func,
+                                             gpointer          user_data);
+
+G_END_DECLS
+
+#endif /* __BENCHMARK_TILE_SOURCE_H__ */
@@ -0,0 +1,342 @@
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <shumate/shumate.h>
+#include <sqlite3.h>
+
+#include "benchmark-tile-source.h"
+
+#define ZOOM_LEVEL 12
+
+/* Runs a query returning a single integer on the database of the cache */
+static gint64
+query_int (const char *cache_dir,
+           const char *sql)
+{
+  g_autofree char *db_filename = g_build_filename (cache_dir, "cache.db", NULL);
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+  gint64 value;
+
+  g_assert_cmpint (sqlite3_open_v2 (db_filename, &db, SQLITE_OPEN_READONLY, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  value = sqlite3_column_int64 (stmt, 0);
+
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+  return value;
+}
+
+/* Creates a database like the versions before the blobs did, with the tile
+ * @tile_filename in it if it isn't %NULL */
+static void
+create_legacy_cache (const char *cache_dir,
+                     const char *tile_filename,
+                     GBytes     *bytes)
+{
+  g_autofree char *db_filename = g_build_filename (cache_dir, "cache.db", NULL);
+  g_autofree char *tile_dir = NULL;
+  g_autofree char *sql = NULL;
+  g_autoptr(GError) error = NULL;
+  sqlite3 *db = NULL;
+
+  g_assert_cmpint (sqlite3_open_v2 (db_filename, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (db,
+                                 "CREATE TABLE tiles (filename TEXT PRIMARY KEY, etag TEXT, popularity INT DEFAULT 1, size INT DEFAULT 0)",
+                                 NULL, NULL, NULL), ==, SQLITE_OK);
+
+  if (tile_filename != NULL)
+    {
+      tile_dir = g_path_get_dirname (tile_filename);
+      g_assert_cmpint (g_mkdir_with_parents (tile_dir, 0700), ==, 0);
+      g_file_set_contents (tile_filename, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), &error);
+      g_assert_no_error (error);
+
+      sql = g_strdup_printf ("INSERT INTO tiles (filename, size) VALUES ('%s', %" G_GSIZE_FORMAT ")",
+                             tile_filename, g_bytes_get_size (bytes));
+      g_assert_cmpint (sqlite3_exec (db, sql, NULL, NULL, NULL), ==, SQLITE_OK);
+    }
+
+  sqlite3_close (db);
+}
+
+static void
+remove_cache_dir (const char *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *child = g_build_filename (path, name, NULL);
+
+      if (g_file_test (child, G_FILE_TEST_IS_DIR))
+        remove_cache_dir (child);
+      else
+        g_remove (child);
+    }
+
+  g_dir_close (dir);
+  g_rmdir (path);
+}
+
+static ShumateFileCache *
+file_cache_new (const char *cache_dir)
+{
+  g_autoptr(ShumateMapSource) source = benchmark_tile_source_new (NULL, NULL);
+  ShumateFileCache *file_cache;
+
+  /* The cache takes its id from the next source */
+  file_cache = g_object_ref_sink (shumate_file_cache_new_full (100000000, cache_dir));
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (file_cache), source);
+
+  return file_cache;
+}
+
+static char *
+get_tile_filename (const char *cache_dir,
+                   int         x)
+{
+  return g_strdup_printf ("%s" G_DIR_SEPARATOR_S "benchmark" G_DIR_SEPARATOR_S
+                          "%d" G_DIR_SEPARATOR_S "%d" G_DIR_SEPARATOR_S "0.png",
+                          cache_dir, ZOOM_LEVEL, x);
+}
+
+static char *
+get_blob_filename (const char *cache_dir,
+                   GBytes     *bytes)
+{
+  g_autofree char *hash = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+  char prefix[3] = { hash[0], hash[1], '\0' };
+
+  return g_build_filename (cache_dir, "blobs", prefix, hash, NULL);
+}
+
+static void
+store_tile (ShumateFileCache *file_cache,
+            int               x,
+            GBytes           *bytes)
+{
+  g_autoptr(ShumateTile) tile = g_object_ref_sink (shumate_tile_new_full (x, 0, 256, ZOOM_LEVEL));
+
+  shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (file_cache), tile, bytes);
+}
+
+static void
+use_tile (ShumateFileCache *file_cache,
+          int               x)
+{
+  g_autoptr(ShumateTile) tile = g_object_ref_sink (shumate_tile_new_full (x, 0, 256, ZOOM_LEVEL));
+
+  shumate_tile_cache_on_tile_filled (SHUMATE_TILE_CACHE (file_cache), tile);
+}
+
+static void
+on_purged (GObject      *source_object,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  gboolean *done = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_true (shumate_file_cache_purge_finish (SHUMATE_FILE_CACHE (source_object), result, &error));
+  g_assert_no_error (error);
+  *done = TRUE;
+}
+
+/* Purges the cache down to @size_limit. The purge comes after the changes
+ * queued so far, which are written once it is done. */
+static void
+purge (ShumateFileCache *file_cache,
+       guint64           size_limit)
+{
+  gboolean done = FALSE;
+
+  shumate_file_cache_set_size_limit (file_cache, size_limit);
+  shumate_file_cache_purge_async (file_cache, NULL, on_purged, &done);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Opens the cache, and waits for the writer to be done with the work queued
+ * when it was opened before closing it */
+static void
+open_file_cache (const char *cache_dir)
+{
+  g_autoptr(ShumateFileCache) file_cache = file_cache_new (cache_dir);
+
+  purge (file_cache, 100000000);
+}
+
+/* A database created by an older version, without incremental vacuuming, is
+ * rebuilt once when it is opened and not anymore after that */
+static void
+test_file_cache_auto_vacuum (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *cache_dir = NULL;
+
+  cache_dir = g_dir_make_tmp ("shumate-file-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  create_legacy_cache (cache_dir, NULL, NULL);
+  g_assert_cmpint (query_int (cache_dir, "PRAGMA auto_vacuum;"), ==, 0);
+
+  open_file_cache (cache_dir);
+  g_assert_cmpint (query_int (cache_dir, "PRAGMA auto_vacuum;"), ==, 2);
+
+  open_file_cache (cache_dir);
+  g_assert_cmpint (query_int (cache_dir, "PRAGMA auto_vacuum;"), ==, 2);
+
+  remove_cache_dir (cache_dir);
+}
+
+/* Tiles with the same data share a blob, which counts once in the size of
+ * the cache and goes away with the last tile using it */
+static void
+test_file_cache_shared_blobs (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(ShumateFileCache) file_cache = NULL;
+  g_autofree char *cache_dir = NULL;
+  g_autofree char *shared_blob = NULL;
+  g_autofree char *other_blob = NULL;
+  g_autofree char *shared_filename = NULL;
+  g_autofree char *sql = NULL;
+  g_autoptr(GBytes) shared_bytes = g_bytes_new_take (g_strnfill (100, 'a'), 100);
+  g_autoptr(GBytes) other_bytes = g_bytes_new_take (g_strnfill (200, 'b'), 200);
+
+  cache_dir = g_dir_make_tmp ("shumate-file-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+  shared_blob = get_blob_filename (cache_dir, shared_bytes);
+  other_blob = get_blob_filename (cache_dir, other_bytes);
+  shared_filename = get_tile_filename (cache_dir, 1);
+
+  file_cache = file_cache_new (cache_dir);
+  store_tile (file_cache, 0, shared_bytes);
+  store_tile (file_cache, 1, shared_bytes);
+  store_tile (file_cache, 2, other_bytes);
+
+  /* Purged in the order 0, 2, 1 */
+  use_tile (file_cache, 1);
+  use_tile (file_cache, 1);
+  use_tile (file_cache, 2);
+
+  purge (file_cache, 100000000);
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM tiles"), ==, 3);
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM blobs"), ==, 2);
+  g_assert_cmpint (query_int (cache_dir, "SELECT MAX (refcount) FROM blobs"), ==, 2);
+  g_assert_cmpint (query_int (cache_dir, "SELECT value FROM metadata WHERE key = 'total_size'"), ==, 300);
+  g_assert_true (g_file_test (shared_blob, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (other_blob, G_FILE_TEST_EXISTS));
+
+  /* Tile 0 frees nothing since tile 1 shares its blob, tile 2 goes too */
+  purge (file_cache, 100);
+  sql = g_strdup_printf ("SELECT COUNT(*) FROM tiles WHERE filename = '%s'", shared_filename);
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM tiles"), ==, 1);
+  g_assert_cmpint (query_int (cache_dir, sql), ==, 1);
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM blobs"), ==, 1);
+  g_assert_cmpint (query_int (cache_dir, "SELECT refcount FROM blobs"), ==, 1);
+  g_assert_cmpint (query_int (cache_dir, "SELECT value FROM metadata WHERE key = 'total_size'"), ==, 100);
+  g_assert_true (g_file_test (shared_blob, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (other_blob, G_FILE_TEST_EXISTS));
+
+  /* The last tile takes the blob with it */
+  purge (file_cache, 0);
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM tiles"), ==, 0);
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM blobs"), ==, 0);
+  g_assert_cmpint (query_int (cache_dir, "SELECT value FROM metadata WHERE key = 'total_size'"), ==, 0);
+  g_assert_false (g_file_test (shared_blob, G_FILE_TEST_EXISTS));
+
+  g_clear_object (&file_cache);
+  remove_cache_dir (cache_dir);
+}
+
+static void
+on_purge_cancelled (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  gboolean *done = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (shumate_file_cache_purge_finish (SHUMATE_FILE_CACHE (source_object), result, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  *done = TRUE;
+}
+
+/* A purge cancelled before the writer gets to it is skipped */
+static void
+test_file_cache_cancelled_purge (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(ShumateFileCache) file_cache = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autofree char *cache_dir = NULL;
+  g_autoptr(GBytes) bytes = g_bytes_new_take (g_strnfill (100, 'a'), 100);
+  gboolean done = FALSE;
+
+  cache_dir = g_dir_make_tmp ("shumate-file-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  file_cache = file_cache_new (cache_dir);
+  store_tile (file_cache, 0, bytes);
+  purge (file_cache, 100000000);
+
+  g_cancellable_cancel (cancellable);
+  shumate_file_cache_set_size_limit (file_cache, 0);
+  shumate_file_cache_purge_async (file_cache, cancellable, on_purge_cancelled, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (query_int (cache_dir, "SELECT COUNT(*) FROM tiles"), ==, 1);
+
+  g_clear_object (&file_cache);
+  remove_cache_dir (cache_dir);
+}
+
+/* Storing a tile again deletes the file an older version stored it in */
+static void
+test_file_cache_legacy_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(ShumateFileCache) file_cache = NULL;
+  g_autofree char *cache_dir = NULL;
+  g_autofree char *tile_filename = NULL;
+  g_autoptr(GBytes) old_bytes = g_bytes_new_take (g_strnfill (300, 'a'), 300);
+  g_autoptr(GBytes) new_bytes = g_bytes_new_take (g_strnfill (100, 'b'), 100);
+
+  cache_dir = g_dir_make_tmp ("shumate-file-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+  tile_filename = get_tile_filename (cache_dir, 0);
+  create_legacy_cache (cache_dir, tile_filename, old_bytes);
+
+  file_cache = file_cache_new (cache_dir);
+  purge (file_cache, 100000000);
+  g_assert_cmpint (query_int (cache_dir, "SELECT value FROM metadata WHERE key = 'total_size'"), ==, 300);
+
+  store_tile (file_cache, 0, new_bytes);
+  purge (file_cache, 100000000);
+  g_assert_cmpint (query_int (cache_dir, "SELECT value FROM metadata WHERE key = 'total_size'"), ==, 100);
+  g_assert_false (g_file_test (tile_filename, G_FILE_TEST_EXISTS));
+
+  g_clear_object (&file_cache);
+  remove_cache_dir (cache_dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/file-cache/auto-vacuum", test_file_cache_auto_vacuum);
+  g_test_add_func ("/file-cache/shared-blobs", test_file_cache_shared_blobs);
+  g_test_add_func ("/file-cache/cancelled-purge", test_file_cache_cancelled_purge);
+  g_test_add_func ("/file-cache/legacy-file", test_file_cache_legacy_file);
+
+  return g_test_run ();
+}
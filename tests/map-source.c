@@ -0,0 +1,266 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+#include <stdio.h>
+
+/* A tile source which completes its tiles from an idle, like the sources
+ * which load them from the network or from disk. If fail_odd_columns is set,
+ * the tiles of odd columns go to the next source instead. */
+#define TEST_TYPE_ASYNC_SOURCE (test_async_source_get_type ())
+G_DECLARE_FINAL_TYPE (TestAsyncSource, test_async_source, TEST, ASYNC_SOURCE, ShumateTileSource)
+
+struct _TestAsyncSource
+{
+  ShumateTileSource parent_instance;
+
+  GHashTable *filled; /* "zoom/x/y" of the tiles asked for */
+  gboolean fail_odd_columns;
+};
+
+G_DEFINE_TYPE (TestAsyncSource, test_async_source, SHUMATE_TYPE_TILE_SOURCE)
+
+static gboolean
+complete_tile_cb (gpointer user_data)
+{
+  shumate_tile_set_state (SHUMATE_TILE (user_data), SHUMATE_STATE_DONE);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_async_source_fill_tile (ShumateMapSource *map_source,
+                             ShumateTile      *tile,
+                             GCancellable     *cancellable)
+{
+  TestAsyncSource *self = TEST_ASYNC_SOURCE (map_source);
+
+  g_hash_table_add (self->filled,
+                    g_strdup_printf ("%u/%u/%u",
+                                     shumate_tile_get_zoom_level (tile),
+                                     shumate_tile_get_x (tile),
+                                     shumate_tile_get_y (tile)));
+
+  if (self->fail_odd_columns && shumate_tile_get_x (tile) % 2 == 1)
+    {
+      shumate_map_source_fill_tile (shumate_map_source_get_next_source (map_source), tile, cancellable);
+      return;
+    }
+
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, complete_tile_cb, g_object_ref (tile), g_object_unref);
+}
+
+static void
+test_async_source_finalize (GObject *object)
+{
+  TestAsyncSource *self = TEST_ASYNC_SOURCE (object);
+
+  g_hash_table_unref (self->filled);
+
+  G_OBJECT_CLASS (test_async_source_parent_class)->finalize (object);
+}
+
+static void
+test_async_source_class_init (TestAsyncSourceClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ShumateMapSourceClass *map_source_class = SHUMATE_MAP_SOURCE_CLASS (klass);
+
+  object_class->finalize = test_async_source_finalize;
+  map_source_class->fill_tile = test_async_source_fill_tile;
+}
+
+static void
+test_async_source_init (TestAsyncSource *self)
+{
+  self->filled = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static TestAsyncSource *
+test_async_source_new (void)
+{
+  return g_object_ref_sink (g_object_new (TEST_TYPE_ASYNC_SOURCE,
+                                          "id", "test",
+                                          "tile-size", 256,
+                                          "min-zoom-level", 0,
+                                          "max-zoom-level", 19,
+                                          NULL));
+}
+
+typedef struct {
+  guint64 n_progress;
+  guint64 n_failed;
+  guint64 n_tiles;
+  guint64 cancel_after;
+  GCancellable *cancellable;
+  gboolean done;
+  gboolean result;
+  GError *error;
+} DownloadData;
+
+static void
+on_progress (ShumateMapSource *map_source,
+             guint64           n_done,
+             guint64           n_failed,
+             guint64           n_tiles,
+             gpointer          user_data)
+{
+  DownloadData *data = user_data;
+
+  data->n_progress++;
+  data->n_tiles = n_tiles;
+  g_assert_cmpuint (n_done, ==, data->n_progress);
+  g_assert_cmpuint (n_done, <=, n_tiles);
+  g_assert_cmpuint (n_failed, >=, data->n_failed);
+  g_assert_cmpuint (n_failed, <=, n_done);
+  data->n_failed = n_failed;
+
+  if (data->cancellable && n_done == data->cancel_after)
+    g_cancellable_cancel (data->cancellable);
+}
+
+static void
+on_download_done (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+  DownloadData *data = user_data;
+
+  data->result = shumate_map_source_download_region_finish (SHUMATE_MAP_SOURCE (source_object), res, &data->error);
+  data->done = TRUE;
+}
+
+static void
+download_region (ShumateMapSource *source,
+                 double            min_latitude,
+                 double            min_longitude,
+                 double            max_latitude,
+                 double            max_longitude,
+                 guint             min_zoom,
+                 guint             max_zoom,
+                 DownloadData     *data)
+{
+  shumate_map_source_download_region_async (source,
+                                            min_latitude, min_longitude,
+                                            max_latitude, max_longitude,
+                                            min_zoom, max_zoom,
+                                            data->cancellable,
+                                            on_progress, data, NULL,
+                                            on_download_done, data);
+
+  /* The caller keeps no reference to the download while it runs */
+  while (!data->done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_map_source_download_region (void)
+{
+  g_autoptr(TestAsyncSource) source = test_async_source_new ();
+  DownloadData data = { 0 };
+  guint64 n_tiles;
+
+  /* 1 + 4 + 16 + 64 tiles, more than run at once */
+  n_tiles = shumate_map_source_estimate_region (SHUMATE_MAP_SOURCE (source),
+                                                -85, -180, 85, 180, 0, 3, NULL);
+  g_assert_cmpuint (n_tiles, ==, 85);
+
+  download_region (SHUMATE_MAP_SOURCE (source), -85, -180, 85, 180, 0, 3, &data);
+
+  g_assert_no_error (data.error);
+  g_assert_true (data.result);
+  g_assert_cmpuint (data.n_progress, ==, n_tiles);
+  g_assert_cmpuint (data.n_failed, ==, 0);
+  g_assert_cmpuint (data.n_tiles, ==, n_tiles);
+  g_assert_cmpuint (g_hash_table_size (source->filled), ==, n_tiles);
+}
+
+static void
+test_map_source_download_region_failed (void)
+{
+  g_autoptr(TestAsyncSource) source = test_async_source_new ();
+  g_autoptr(ShumateErrorTileSource) error_source = g_object_ref_sink (shumate_error_tile_source_new_full ());
+  DownloadData data = { 0 };
+
+  source->fail_odd_columns = TRUE;
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (source), SHUMATE_MAP_SOURCE (error_source));
+
+  /* 1 + 4 + 16 + 64 tiles, 0 + 2 + 8 + 32 in odd columns */
+  download_region (SHUMATE_MAP_SOURCE (source), -85, -180, 85, 180, 0, 3, &data);
+
+  /* The whole region is still gone through */
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_FAILED);
+  g_assert_false (data.result);
+  g_assert_cmpuint (data.n_progress, ==, 85);
+  g_assert_cmpuint (data.n_failed, ==, 42);
+  g_clear_error (&data.error);
+}
+
+static void
+test_map_source_download_region_antimeridian (void)
+{
+  g_autoptr(TestAsyncSource) source = test_async_source_new ();
+  DownloadData data = { 0 };
+  GHashTableIter iter;
+  const char *key;
+  guint64 n_tiles;
+
+  /* From 170° east to 170° west, through 180° */
+  n_tiles = shumate_map_source_estimate_region (SHUMATE_MAP_SOURCE (source),
+                                                -10, 170, 10, -170, 2, 5, NULL);
+  g_assert_cmpuint (n_tiles, >, 0);
+
+  download_region (SHUMATE_MAP_SOURCE (source), -10, 170, 10, -170, 2, 5, &data);
+
+  g_assert_no_error (data.error);
+  g_assert_true (data.result);
+  g_assert_cmpuint (data.n_progress, ==, n_tiles);
+  g_assert_cmpuint (g_hash_table_size (source->filled), ==, n_tiles);
+
+  /* Only the columns next to the antimeridian */
+  g_hash_table_iter_init (&iter, source->filled);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, NULL))
+    {
+      guint zoom, x, y;
+
+      g_assert_cmpint (sscanf (key, "%u/%u/%u", &zoom, &x, &y), ==, 3);
+      g_assert_true (x < (1u << zoom) / 4 || x >= (1u << zoom) * 3 / 4);
+    }
+}
+
+static void
+test_map_source_download_region_cancel (void)
+{
+  g_autoptr(TestAsyncSource) source = test_async_source_new ();
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  DownloadData data = { 0 };
+  guint64 n_progress;
+
+  data.cancellable = cancellable;
+  data.cancel_after = 5;
+
+  download_region (SHUMATE_MAP_SOURCE (source), -85, -180, 85, 180, 0, 3, &data);
+
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_false (data.result);
+  g_assert_cmpuint (data.n_progress, >=, 5);
+  g_assert_cmpuint (data.n_progress, <, 85);
+  g_clear_error (&data.error);
+
+  /* The download is over, the tiles still completing must not use it */
+  n_progress = data.n_progress;
+  g_cancellable_cancel (cancellable);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpuint (data.n_progress, ==, n_progress);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  gtk_init ();
+
+  g_test_add_func ("/map-source/download-region", test_map_source_download_region);
+  g_test_add_func ("/map-source/download-region/antimeridian", test_map_source_download_region_antimeridian);
+  g_test_add_func ("/map-source/download-region/failed", test_map_source_download_region_failed);
+  g_test_add_func ("/map-source/download-region/cancel", test_map_source_download_region_cancel);
+
+  return g_test_run ();
+}
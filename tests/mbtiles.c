@@ -0,0 +1,114 @@
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <shumate/shumate.h>
+#include <sqlite3.h>
+
+#include "benchmark-tile-source.h"
+
+/* A plain 256 pixels PNG tile */
+static GBytes *
+create_tile_data (void)
+{
+  g_autoptr(GdkPixbuf) pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 256, 256);
+  g_autoptr(GError) error = NULL;
+  char *buffer = NULL;
+  gsize size;
+
+  gdk_pixbuf_fill (pixbuf, 0x336699ff);
+  gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, "png", &error, NULL);
+  g_assert_no_error (error);
+
+  return g_bytes_new_take (buffer, size);
+}
+
+/* The row the archive has for the tile at @x and @zoom_level, or -1 */
+static int
+query_tile_row (const char *path,
+                guint       x,
+                guint       zoom_level)
+{
+  g_autofree char *sql = g_strdup_printf ("SELECT tile_row FROM tiles WHERE zoom_level = %u AND tile_column = %u",
+                                          zoom_level, x);
+  sqlite3 *db = NULL;
+  sqlite3_stmt *stmt = NULL;
+  int row = -1;
+
+  g_assert_cmpint (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READONLY, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL), ==, SQLITE_OK);
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    row = sqlite3_column_int (stmt, 0);
+
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+  return row;
+}
+
+static ShumateTile *
+load_tile (ShumateMapSource *source,
+           guint             x,
+           guint             y,
+           guint             zoom_level)
+{
+  ShumateTile *tile = g_object_ref_sink (shumate_tile_new_full (x, y, 256, zoom_level));
+
+  shumate_map_source_fill_tile (source, tile, NULL);
+  while (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
+    g_main_context_iteration (NULL, TRUE);
+
+  return tile;
+}
+
+static void
+test_mbtiles_round_trip (void)
+{
+  g_autofree char *dir = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) bytes = create_tile_data ();
+  g_autoptr(ShumateMapSource) next_source = benchmark_tile_source_new (NULL, NULL);
+  g_autoptr(ShumateMbtilesCache) cache = NULL;
+  g_autoptr(ShumateMbtilesSource) source = NULL;
+  g_autoptr(ShumateTile) stored_tile = NULL;
+  g_autoptr(ShumateTile) tile = NULL;
+  g_autoptr(ShumateTile) flipped_tile = NULL;
+
+  dir = g_dir_make_tmp ("shumate-mbtiles-XXXXXX", &error);
+  g_assert_no_error (error);
+  path = g_build_filename (dir, "tiles.mbtiles", NULL);
+
+  cache = g_object_ref_sink (shumate_mbtiles_cache_new_full (path));
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (cache), next_source);
+
+  stored_tile = g_object_ref_sink (shumate_tile_new_full (1, 0, 256, 2));
+  shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (cache), stored_tile, bytes);
+
+  /* Commits the pending writes */
+  g_clear_object (&cache);
+
+  /* TMS rows start at the bottom of the map */
+  g_assert_cmpint (query_tile_row (path, 1, 2), ==, 3);
+
+  source = g_object_ref_sink (shumate_mbtiles_source_new_full (path));
+
+  tile = load_tile (SHUMATE_MAP_SOURCE (source), 1, 0, 2);
+  g_assert_nonnull (shumate_tile_get_texture (tile));
+
+  /* Nothing was stored at the row of the file */
+  flipped_tile = load_tile (SHUMATE_MAP_SOURCE (source), 1, 3, 2);
+  g_assert_null (shumate_tile_get_texture (flipped_tile));
+
+  g_clear_object (&source);
+  g_assert_cmpint (g_remove (path), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  gtk_init ();
+
+  g_test_add_func ("/mbtiles/round-trip", test_mbtiles_round_trip);
+
+  return g_test_run ();
+}
@@ -0,0 +1,150 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+
+#include "benchmark-tile-source.h"
+
+static ShumateMemoryCache *memory_cache;
+static GBytes *tile_bytes;
+static guint n_misses;
+static guint64 texture_cache_size_limit;
+
+/* Counts the tiles the memory cache didn't have, and gives them to it */
+static void
+on_tile_missed (ShumateTile *tile,
+                gpointer     user_data)
+{
+  n_misses++;
+  shumate_tile_cache_store_tile (SHUMATE_TILE_CACHE (memory_cache), tile, tile_bytes);
+}
+
+static GBytes *
+create_tile_bytes (void)
+{
+  g_autoptr(GdkPixbuf) pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
+  g_autoptr(GError) error = NULL;
+  char *buffer;
+  gsize buffer_size;
+
+  gdk_pixbuf_fill (pixbuf, 0xaad3dfff);
+  g_assert_true (gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, "png", &error, NULL));
+  g_assert_no_error (error);
+
+  return g_bytes_new_take (buffer, buffer_size);
+}
+
+static void
+memory_cache_setup (ShumateMemoryCachePolicy policy)
+{
+  g_autoptr(ShumateMapSource) source = benchmark_tile_source_new (on_tile_missed, NULL);
+
+  /* Every hit has to go through the memory cache */
+  texture_cache_size_limit = shumate_texture_cache_get_size_limit (shumate_texture_cache_get_default ());
+  shumate_texture_cache_set_size_limit (shumate_texture_cache_get_default (), 0);
+
+  memory_cache = g_object_ref_sink (shumate_memory_cache_new_full (8));
+  shumate_memory_cache_set_policy (memory_cache, policy);
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (memory_cache), source);
+  tile_bytes = create_tile_bytes ();
+  n_misses = 0;
+}
+
+static void
+memory_cache_teardown (void)
+{
+  g_clear_object (&memory_cache);
+  g_clear_pointer (&tile_bytes, g_bytes_unref);
+  shumate_texture_cache_set_size_limit (shumate_texture_cache_get_default (), texture_cache_size_limit);
+}
+
+/* Returns whether the memory cache had the tile */
+static gboolean
+request_tile (guint x)
+{
+  g_autoptr(ShumateTile) tile = NULL;
+  guint old_misses = n_misses;
+
+  tile = g_object_ref_sink (shumate_tile_new_full (x, 0, 256, 12));
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (memory_cache), tile, NULL);
+
+  /* Hits are decoded in a thread */
+  while (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
+    g_main_context_iteration (NULL, TRUE);
+
+  return n_misses == old_misses;
+}
+
+/* Tiles seen once stay in their own queue, even when they are used again
+ * right away, and are dropped first */
+static void
+test_memory_cache_two_q_admission (void)
+{
+  ShumateMemoryCachePolicy policies[] = {
+    SHUMATE_MEMORY_CACHE_POLICY_LRU,
+    SHUMATE_MEMORY_CACHE_POLICY_TWO_Q,
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (policies); i++)
+    {
+      memory_cache_setup (policies[i]);
+
+      for (guint x = 0; x < 4; x++)
+        g_assert_false (request_tile (x));
+      g_assert_true (request_tile (0));
+
+      for (guint x = 100; x < 106; x++)
+        g_assert_false (request_tile (x));
+
+      g_assert_cmpuint (n_misses, ==, 10);
+      if (policies[i] == SHUMATE_MEMORY_CACHE_POLICY_TWO_Q)
+        g_assert_false (request_tile (0));
+      else
+        g_assert_true (request_tile (0));
+
+      memory_cache_teardown ();
+    }
+}
+
+/* A tile requested again while 2Q still remembers it is kept over a scan of
+ * tiles only seen once */
+static void
+test_memory_cache_two_q_ghost (void)
+{
+  ShumateMemoryCachePolicy policies[] = {
+    SHUMATE_MEMORY_CACHE_POLICY_LRU,
+    SHUMATE_MEMORY_CACHE_POLICY_TWO_Q,
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (policies); i++)
+    {
+      memory_cache_setup (policies[i]);
+
+      for (guint x = 0; x < 12; x++)
+        g_assert_false (request_tile (x));
+
+      /* Dropped by both, only 2Q remembers it */
+      g_assert_false (request_tile (0));
+
+      for (guint x = 100; x < 132; x++)
+        g_assert_false (request_tile (x));
+
+      g_assert_cmpuint (n_misses, ==, 45);
+      if (policies[i] == SHUMATE_MEMORY_CACHE_POLICY_TWO_Q)
+        g_assert_true (request_tile (0));
+      else
+        g_assert_false (request_tile (0));
+
+      memory_cache_teardown ();
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  gtk_init ();
+
+  g_test_add_func ("/memory-cache/two-q/admission", test_memory_cache_two_q_admission);
+  g_test_add_func ("/memory-cache/two-q/ghost", test_memory_cache_two_q_ghost);
+
+  return g_test_run ();
+}
@@ -0,0 +1,476 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+
+#include "shumate/shumate-network-tile-source-private.h"
+#include "shumate/shumate-tile-private.h"
+#include "benchmark-tile-source.h"
+
+static void
+assert_tile_uri (ShumateNetworkTileSource *source,
+                 const char               *uri_format,
+                 int                       x,
+                 int                       y,
+                 int                       z,
+                 const char               *expected)
+{
+  g_autofree char *uri = NULL;
+
+  shumate_network_tile_source_set_uri_format (source, uri_format);
+  uri = shumate_network_tile_source_get_tile_uri (source, x, y, z);
+  g_assert_cmpstr (uri, ==, expected);
+}
+
+static void
+test_network_tile_uri (void)
+{
+  g_autoptr(ShumateNetworkTileSource) source = NULL;
+
+  source = g_object_ref_sink (shumate_network_tile_source_new_full ("test", "Test", NULL, NULL,
+                                                                    0, 19, 256,
+                                                                    SHUMATE_MAP_PROJECTION_MERCATOR,
+                                                                    NULL));
+
+  assert_tile_uri (source, "https://tile.example.org/#Z#/#X#/#Y#.png", 1, 2, 3,
+                   "https://tile.example.org/3/1/2.png");
+  assert_tile_uri (source, "https://tile.example.org/{z}/{x}/{y}.png", 1, 2, 3,
+                   "https://tile.example.org/3/1/2.png");
+  assert_tile_uri (source, "https://tile.example.org/#Z#/#X#/#TMSY#.png", 1, 2, 3,
+                   "https://tile.example.org/3/1/5.png");
+  assert_tile_uri (source, "https://tile.example.org/{z}/{x}/{-y}.png", 1, 2, 3,
+                   "https://tile.example.org/3/1/5.png");
+
+  /* The subdomain only depends on the tile */
+  assert_tile_uri (source, "https://{s}.tile.example.org/{z}/{x}/{y}.png", 1, 2, 3,
+                   "https://a.tile.example.org/3/1/2.png");
+  assert_tile_uri (source, "https://#S#.tile.example.org/{z}/{x}/{y}.png", 2, 2, 3,
+                   "https://b.tile.example.org/3/2/2.png");
+  assert_tile_uri (source, "https://{s}.tile.example.org/{z}/{x}/{y}.png", 3, 2, 3,
+                   "https://c.tile.example.org/3/3/2.png");
+
+  /* Quadkeys have a digit per zoom level, none for the whole world */
+  assert_tile_uri (source, "https://tile.example.org/{q}.png", 3, 5, 3,
+                   "https://tile.example.org/213.png");
+  assert_tile_uri (source, "https://tile.example.org/#Q#.png", 0, 0, 0,
+                   "https://tile.example.org/.png");
+
+  /* Unknown names are left alone */
+  assert_tile_uri (source, "https://tile.example.org/{z}/{foo}/{x", 1, 2, 3,
+                   "https://tile.example.org/3/{foo}/{x");
+}
+
+static gint64
+parse_expiry_time (const char *cache_control,
+                   const char *age,
+                   const char *expires,
+                   const char *date)
+{
+  SoupMessageHeaders *headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+  gint64 expiry_time;
+
+  if (cache_control)
+    soup_message_headers_append (headers, "Cache-Control", cache_control);
+  if (age)
+    soup_message_headers_append (headers, "Age", age);
+  if (expires)
+    soup_message_headers_append (headers, "Expires", expires);
+  if (date)
+    soup_message_headers_append (headers, "Date", date);
+
+  expiry_time = shumate_network_tile_source_parse_expiry_time (headers);
+  soup_message_headers_free (headers);
+
+  return expiry_time;
+}
+
+static void
+test_network_expiry_time (void)
+{
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  /* Leaves the choice to the cache */
+  g_assert_cmpint (parse_expiry_time (NULL, NULL, NULL, NULL), ==, 0);
+  g_assert_cmpint (parse_expiry_time ("public", NULL, NULL, NULL), ==, 0);
+
+  g_assert_cmpint (parse_expiry_time ("public, max-age=3600", NULL, NULL, NULL) - now, >=, 3600);
+  g_assert_cmpint (parse_expiry_time ("public, max-age=3600", NULL, NULL, NULL) - now, <=, 3601);
+
+  /* The time spent in a proxy cache counts */
+  g_assert_cmpint (parse_expiry_time ("max-age=3600", "600", NULL, NULL) - now, >=, 3000);
+  g_assert_cmpint (parse_expiry_time ("max-age=3600", "600", NULL, NULL) - now, <=, 3001);
+  g_assert_cmpint (parse_expiry_time ("max-age=3600", "7200", NULL, NULL) - now, <=, 1);
+
+  /* Already expired */
+  g_assert_cmpint (parse_expiry_time ("no-cache", NULL, NULL, NULL) - now, <=, 1);
+  g_assert_cmpint (parse_expiry_time ("max-age=3600, no-store", NULL, NULL, NULL) - now, <=, 1);
+  g_assert_cmpint (parse_expiry_time (NULL, NULL, "0", NULL) - now, <=, 1);
+
+  /* max-age wins over Expires, unless it is invalid */
+  g_assert_cmpint (parse_expiry_time ("max-age=60", NULL, "Thu, 01 Dec 1994 16:00:00 GMT", NULL) - now, >=, 60);
+  g_assert_cmpint (parse_expiry_time ("max-age=60s", NULL, "Thu, 01 Dec 1994 16:00:00 GMT", NULL), ==, 786297600);
+  g_assert_cmpint (parse_expiry_time (NULL, NULL, "Thu, 01 Dec 1994 16:00:00 GMT", NULL), ==, 786297600);
+
+  /* Expires counts from the Date of the response, not from the local clock */
+  g_assert_cmpint (parse_expiry_time (NULL, NULL, "Thu, 01 Dec 1994 16:00:00 GMT",
+                                      "Thu, 01 Dec 1994 15:00:00 GMT") - now, >=, 3600);
+  g_assert_cmpint (parse_expiry_time (NULL, NULL, "Thu, 01 Dec 1994 16:00:00 GMT",
+                                      "Thu, 01 Dec 1994 15:00:00 GMT") - now, <=, 3601);
+  g_assert_cmpint (parse_expiry_time (NULL, NULL, "Thu, 01 Dec 1994 16:00:00 GMT",
+                                      "Thu, 01 Dec 1994 17:00:00 GMT") - now, <=, 1);
+}
+
+/* A local HTTP server which answers every request with the same status.
+ * While hold is set, the requests wait for test_server_release(). */
+typedef struct {
+  SoupServer *server;
+  char *uri_format;
+  GPtrArray *paths;
+  guint status;
+  gboolean hold;
+  GPtrArray *held;
+} TestServer;
+
+/* The client went away while its request was held */
+static void
+on_held_message_finished (SoupMessage *msg,
+                          TestServer  *test_server)
+{
+  g_ptr_array_remove (test_server->held, msg);
+}
+
+static void
+test_server_callback (SoupServer        *server,
+                      SoupMessage       *msg,
+                      const char        *path,
+                      GHashTable        *query,
+                      SoupClientContext *client,
+                      gpointer           user_data)
+{
+  TestServer *test_server = user_data;
+
+  g_ptr_array_add (test_server->paths, g_strdup (path));
+  soup_message_set_status (msg, test_server->status);
+
+  if (test_server->hold)
+    {
+      soup_server_pause_message (server, msg);
+      g_ptr_array_add (test_server->held, g_object_ref (msg));
+      g_signal_connect (msg, "finished", G_CALLBACK (on_held_message_finished), test_server);
+    }
+}
+
+static TestServer *
+test_server_new (guint status)
+{
+  TestServer *test_server = g_new0 (TestServer, 1);
+  g_autoptr(GError) error = NULL;
+  GSList *uris;
+
+  test_server->server = g_object_new (SOUP_TYPE_SERVER, NULL);
+  test_server->paths = g_ptr_array_new_with_free_func (g_free);
+  test_server->held = g_ptr_array_new_with_free_func (g_object_unref);
+  test_server->status = status;
+
+  soup_server_add_handler (test_server->server, NULL, test_server_callback, test_server, NULL);
+  soup_server_listen_local (test_server->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (test_server->server);
+  test_server->uri_format = g_strdup_printf ("http://127.0.0.1:%u/{z}/{x}/{y}.png",
+                                             soup_uri_get_port (uris->data));
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  return test_server;
+}
+
+/* Answers the requests held so far */
+static void
+test_server_release (TestServer *test_server)
+{
+  g_autoptr(GPtrArray) held = g_steal_pointer (&test_server->held);
+
+  test_server->held = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < held->len; i++)
+    {
+      SoupMessage *msg = g_ptr_array_index (held, i);
+
+      g_signal_handlers_disconnect_by_func (msg, on_held_message_finished, test_server);
+      soup_server_unpause_message (test_server->server, msg);
+    }
+}
+
+static void
+test_server_free (TestServer *test_server)
+{
+  test_server_release (test_server);
+  soup_server_disconnect (test_server->server);
+  g_object_unref (test_server->server);
+  g_ptr_array_unref (test_server->paths);
+  g_ptr_array_unref (test_server->held);
+  g_free (test_server->uri_format);
+  g_free (test_server);
+}
+
+/* A source downloading from @test_server, which falls back to a source
+ * filling the tiles right away */
+static ShumateNetworkTileSource *
+test_source_new (TestServer *test_server)
+{
+  g_autoptr(ShumateMapSource) next_source = benchmark_tile_source_new (NULL, NULL);
+  ShumateNetworkTileSource *source;
+
+  source = g_object_ref_sink (shumate_network_tile_source_new_full ("test", "Test", NULL, NULL,
+                                                                    0, 19, 256,
+                                                                    SHUMATE_MAP_PROJECTION_MERCATOR,
+                                                                    test_server->uri_format));
+  shumate_map_source_set_next_source (SHUMATE_MAP_SOURCE (source), next_source);
+
+  return source;
+}
+
+static void
+wait_for_tile (ShumateTile *tile)
+{
+  while (shumate_tile_get_state (tile) != SHUMATE_STATE_DONE)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+wait_for_requests (TestServer *test_server,
+                   guint       n_requests)
+{
+  while (test_server->paths->len < n_requests)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_network_center_first (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_NOT_FOUND);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+  g_autoptr(ShumateTile) corner = g_object_ref_sink (shumate_tile_new_full (0, 0, 256, 3));
+  g_autoptr(ShumateTile) edge = g_object_ref_sink (shumate_tile_new_full (1, 0, 256, 3));
+  g_autoptr(ShumateTile) center = g_object_ref_sink (shumate_tile_new_full (1, 1, 256, 3));
+
+  shumate_network_tile_source_set_max_conns (source, 1);
+
+  /* Filled in the order of the layout, columns first */
+  shumate_tile_set_priority (corner, SHUMATE_TILE_PRIORITY_VISIBLE + 2);
+  shumate_tile_set_priority (edge, SHUMATE_TILE_PRIORITY_VISIBLE + 1);
+  shumate_tile_set_priority (center, SHUMATE_TILE_PRIORITY_VISIBLE);
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), corner, NULL);
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), edge, NULL);
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), center, NULL);
+
+  wait_for_tile (corner);
+  wait_for_tile (edge);
+  wait_for_tile (center);
+
+  g_assert_cmpuint (test_server->paths->len, ==, 3);
+  g_assert_cmpstr (g_ptr_array_index (test_server->paths, 0), ==, "/3/1/1.png");
+  g_assert_cmpstr (g_ptr_array_index (test_server->paths, 1), ==, "/3/1/0.png");
+  g_assert_cmpstr (g_ptr_array_index (test_server->paths, 2), ==, "/3/0/0.png");
+
+  test_server_free (test_server);
+}
+
+static void
+test_network_shared_request (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_NOT_FOUND);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+  g_autoptr(ShumateTile) tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+  g_autoptr(ShumateTile) other_tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+
+  test_server->hold = TRUE;
+
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), tile, NULL);
+  wait_for_requests (test_server, 1);
+
+  /* The second tile waits for the request already sent */
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), other_tile, NULL);
+  test_server_release (test_server);
+
+  wait_for_tile (tile);
+  wait_for_tile (other_tile);
+  g_assert_cmpuint (test_server->paths->len, ==, 1);
+
+  test_server_free (test_server);
+}
+
+static void
+test_network_cancel_waiter (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_NOT_FOUND);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+  g_autoptr(ShumateTile) tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+  g_autoptr(ShumateTile) other_tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GCancellable) other_cancellable = g_cancellable_new ();
+
+  test_server->hold = TRUE;
+
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), tile, cancellable);
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), other_tile, other_cancellable);
+  wait_for_requests (test_server, 1);
+
+  /* The other tile still gets the answer of the same request */
+  g_cancellable_cancel (cancellable);
+  while (g_main_context_iteration (NULL, FALSE));
+  test_server_release (test_server);
+
+  wait_for_tile (other_tile);
+  g_assert_cmpuint (test_server->paths->len, ==, 1);
+  g_assert_cmpint (shumate_tile_get_state (tile), !=, SHUMATE_STATE_DONE);
+
+  test_server_free (test_server);
+}
+
+static void
+test_network_cancel_last_waiter (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_NOT_FOUND);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+  g_autoptr(ShumateTile) tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+  g_autoptr(ShumateTile) other_tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+  g_autoptr(ShumateTile) new_tile = g_object_ref_sink (shumate_tile_new_full (1, 2, 256, 3));
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(GCancellable) other_cancellable = g_cancellable_new ();
+
+  test_server->hold = TRUE;
+
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), tile, cancellable);
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), other_tile, other_cancellable);
+  wait_for_requests (test_server, 1);
+
+  /* Nobody waits for the request anymore, a new tile sends another one */
+  g_cancellable_cancel (cancellable);
+  g_cancellable_cancel (other_cancellable);
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), new_tile, NULL);
+  wait_for_requests (test_server, 2);
+
+  test_server->hold = FALSE;
+  test_server_release (test_server);
+
+  wait_for_tile (new_tile);
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpint (shumate_tile_get_state (tile), !=, SHUMATE_STATE_DONE);
+  g_assert_cmpint (shumate_tile_get_state (other_tile), !=, SHUMATE_STATE_DONE);
+
+  test_server_free (test_server);
+}
+
+/* Loads a tile and returns whether a request was sent for it */
+static gboolean
+load_tile (ShumateNetworkTileSource *source,
+           TestServer               *test_server,
+           guint                     x,
+           guint                     y,
+           guint                     zoom)
+{
+  g_autoptr(ShumateTile) tile = g_object_ref_sink (shumate_tile_new_full (x, y, 256, zoom));
+  guint n_requests = test_server->paths->len;
+
+  shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), tile, NULL);
+  wait_for_tile (tile);
+
+  return test_server->paths->len > n_requests;
+}
+
+static void
+test_network_missing_tile (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_NOT_FOUND);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+
+  g_assert_true (load_tile (source, test_server, 1, 2, 3));
+  g_assert_false (load_tile (source, test_server, 1, 2, 3));
+
+  test_server->status = SOUP_STATUS_GONE;
+  g_assert_true (load_tile (source, test_server, 2, 2, 3));
+  g_assert_false (load_tile (source, test_server, 2, 2, 3));
+
+  /* Other errors may not last */
+  test_server->status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+  g_assert_true (load_tile (source, test_server, 3, 2, 3));
+  g_assert_true (load_tile (source, test_server, 3, 2, 3));
+
+  /* Changing the time to live forgets the tiles, 0 remembers none */
+  test_server->status = SOUP_STATUS_NOT_FOUND;
+  shumate_network_tile_source_set_missing_tile_ttl (source, 0);
+  g_assert_true (load_tile (source, test_server, 1, 2, 3));
+  g_assert_true (load_tile (source, test_server, 1, 2, 3));
+
+  test_server_free (test_server);
+}
+
+static void
+test_network_missing_tile_eviction (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_NOT_FOUND);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+  g_autoptr(GPtrArray) tiles = g_ptr_array_new_with_free_func (g_object_unref);
+
+  shumate_network_tile_source_set_max_conns (source, 16);
+
+  /* The oldest one */
+  g_assert_true (load_tile (source, test_server, 0, 0, 12));
+
+  /* Fills the list of missing tiles, then one more */
+  for (guint i = 1; i <= MISSING_TILES_MAX; i++)
+    {
+      ShumateTile *tile = g_object_ref_sink (shumate_tile_new_full (i % 64, i / 64, 256, 12));
+
+      shumate_map_source_fill_tile (SHUMATE_MAP_SOURCE (source), tile, NULL);
+      g_ptr_array_add (tiles, tile);
+    }
+
+  for (guint i = 0; i < tiles->len; i++)
+    wait_for_tile (g_ptr_array_index (tiles, i));
+
+  g_assert_cmpuint (test_server->paths->len, ==, MISSING_TILES_MAX + 1);
+
+  /* Only the oldest tile was forgotten. It is checked last, as remembering
+   * it again forgets another one. */
+  g_assert_false (load_tile (source, test_server, 1, 0, 12));
+  g_assert_false (load_tile (source, test_server, MISSING_TILES_MAX % 64, MISSING_TILES_MAX / 64, 12));
+  g_assert_true (load_tile (source, test_server, 0, 0, 12));
+
+  test_server_free (test_server);
+}
+
+static void
+test_network_host_backoff (void)
+{
+  TestServer *test_server = test_server_new (SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_autoptr(ShumateNetworkTileSource) source = test_source_new (test_server);
+
+  for (guint i = 0; i < HOST_FAILURE_THRESHOLD; i++)
+    g_assert_true (load_tile (source, test_server, i, 0, 3));
+
+  /* The server is given a rest, even for other tiles */
+  g_assert_false (load_tile (source, test_server, 0, 0, 3));
+  g_assert_false (load_tile (source, test_server, 7, 7, 3));
+  g_assert_cmpuint (test_server->paths->len, ==, HOST_FAILURE_THRESHOLD);
+
+  test_server_free (test_server);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  gtk_init ();
+
+  g_test_add_func ("/network-tile-source/tile-uri", test_network_tile_uri);
+  g_test_add_func ("/network-tile-source/expiry-time", test_network_expiry_time);
+  g_test_add_func ("/network-tile-source/center-first", test_network_center_first);
+  g_test_add_func ("/network-tile-source/shared-request", test_network_shared_request);
+  g_test_add_func ("/network-tile-source/cancel-waiter", test_network_cancel_waiter);
+  g_test_add_func ("/network-tile-source/cancel-last-waiter", test_network_cancel_last_waiter);
+  g_test_add_func ("/network-tile-source/missing-tile", test_network_missing_tile);
+  g_test_add_func ("/network-tile-source/missing-tile/eviction", test_network_missing_tile_eviction);
+  g_test_add_func ("/network-tile-source/host-backoff", test_network_host_backoff);
+
+  return g_test_run ();
+}
@@ -0,0 +1,50 @@
+#include <gtk/gtk.h>
+#include <shumate/shumate.h>
+
+#include "shumate/shumate-pmtiles-source-private.h"
+
+static void
+test_pmtiles_tile_id (void)
+{
+  /* From the PMTiles specification */
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (0, 0, 0), ==, 0);
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (1, 0, 0), ==, 1);
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (1, 0, 1), ==, 2);
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (1, 1, 1), ==, 3);
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (1, 1, 0), ==, 4);
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (2, 0, 0), ==, 5);
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (12, 3423, 1763), ==, 19078479);
+
+  /* Beyond 32 bits */
+  g_assert_cmpuint (shumate_pmtiles_zxy_to_tile_id (20, 0, 0), ==, G_GUINT64_CONSTANT (366503875925));
+
+  /* Each zoom level covers its own range of ids */
+  for (guint zoom = 0; zoom < 5; zoom++)
+    {
+      guint n = 1 << zoom;
+      guint64 first = ((guint64) n * n - 1) / 3;
+      g_autofree gboolean *seen = g_new0 (gboolean, n * n);
+
+      for (guint x = 0; x < n; x++)
+        for (guint y = 0; y < n; y++)
+          {
+            guint64 tile_id = shumate_pmtiles_zxy_to_tile_id (zoom, x, y);
+
+            g_assert_cmpuint (tile_id, >=, first);
+            g_assert_cmpuint (tile_id, <, first + n * n);
+            g_assert_false (seen[tile_id - first]);
+            seen[tile_id - first] = TRUE;
+          }
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  gtk_init ();
+
+  g_test_add_func ("/pmtiles-source/tile-id", test_pmtiles_tile_id);
+
+  return g_test_run ();
+}